@@ -0,0 +1,86 @@
+#include "core/xbench.h"
+
+#include "../src/xpipe.h"
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+bench_unit_t bench_dynamic_array = {
+    "bench_dynamic_array",
+    prepare,
+    run,
+    finish
+};
+
+/* an array grows from 4 elements to BENCH_ARRAY_ELTS, then starts over */
+#define BENCH_ARRAY_ELTS    4096
+
+typedef struct {
+    void     *p;
+    uint_t    n;
+} elt_t;
+
+static mem_pool_t   *pool;
+
+
+static int prepare(void)
+{
+    pool = mem_pool_create((u_char *) "bench", REQUEST_POOL_SIZE, NULL);
+    if (pool == NULL) {
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+static void bench_push(uint64_t n, uint_t init)
+{
+    elt_t           *e;
+    uint64_t         i;
+    dynamic_array_t *array;
+
+    array = NULL;
+
+    for (i = 0; i < n; i++) {
+        if (i % BENCH_ARRAY_ELTS == 0) {
+            mem_pool_clear(pool);
+            array = dynamic_array_create(pool, init, sizeof(elt_t));
+        }
+
+        e = dynamic_array_push(array);
+        e->n = i;
+        bench_use(e);
+    }
+
+    mem_pool_clear(pool);
+}
+
+static void bench_push_grow(uint64_t n)
+{
+    bench_push(n, 4);
+}
+
+static void bench_push_presized(uint64_t n)
+{
+    bench_push(n, BENCH_ARRAY_ELTS);
+}
+
+static int run(void) 
+{
+    bench_case("dynamic_array_push grow from 4", bench_push_grow);
+    bench_case("dynamic_array_push presized", bench_push_presized);
+
+    return BENCH_OK;
+}
+
+static int finish(void)
+{
+    mem_pool_destroy(pool);
+
+    return BENCH_OK;
+}
@@ -0,0 +1,87 @@
+#include "core/xbench.h"
+
+#include "../src/xpipe.h"
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+bench_unit_t bench_logger = {
+    "bench_logger",
+    prepare,
+    run,
+    finish
+};
+
+/* the lines go to /dev/null, only formatting and write(2) are measured */
+static file_t       file;
+static logger_t     logger;
+
+
+static int prepare(void)
+{
+    timer_init();
+
+    set_string(&file.name, "/dev/null");
+    file.offset = FL_BEGIN_OFFSET;
+
+    file.fd = open_file_fd(file.name.data, FL_APPEND, 0644);
+    if (file.fd == FL_INVALID_FD) {
+        perror("open file");
+        return BENCH_ERROR;
+    }
+
+    logger.file = &file;
+    logger.level = LOG_LEVEL_INFO;
+
+    return BENCH_OK;
+}
+
+static void bench_log_info(uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        log_info(&logger, 0, "Client(addr:%s, port:%d) has closed.",
+                 "192.168.1.100", (int) i);
+    }
+}
+
+static void bench_log_error_errno(uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        log_error(&logger, ECONNRESET, "Connection(%d) is error.", (int) i);
+    }
+}
+
+/* below the level of the logger, nothing is written */
+static void bench_log_debug_filtered(uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        log_debug(&logger, 0, "Data len: %d", (int) i);
+    }
+}
+
+static int run(void) 
+{
+    bench_case("log_core_writer (log_info)", bench_log_info);
+    bench_case("log_core_writer (log_error, errno)", bench_log_error_errno);
+    bench_case("log_debug filtered", bench_log_debug_filtered);
+
+    return BENCH_OK;
+}
+
+static int finish(void)
+{
+    file_close(file.fd);
+
+    return BENCH_OK;
+}
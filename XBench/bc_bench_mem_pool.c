@@ -0,0 +1,99 @@
+#include "core/xbench.h"
+
+#include "../src/xpipe.h"
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+bench_unit_t bench_mem_pool = {
+    "bench_mem_pool",
+    prepare,
+    run,
+    finish
+};
+
+/* the pool is cleared after so many allocations */
+#define BENCH_POOL_ROUND    256
+
+static mem_pool_t   *pool;
+static size_t        size;
+
+
+static int prepare(void)
+{
+    pool = mem_pool_create((u_char *) "bench", REQUEST_POOL_SIZE, NULL);
+    if (pool == NULL) {
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+static void bench_pmalloc(uint64_t n)
+{
+    void    *p;
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        p = pmalloc(pool, size);
+        bench_use(p);
+
+        if (i % BENCH_POOL_ROUND == BENCH_POOL_ROUND - 1) {
+            mem_pool_clear(pool);
+        }
+    }
+
+    mem_pool_clear(pool);
+}
+
+static void bench_pcalloc(uint64_t n)
+{
+    void    *p;
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        p = pcalloc(pool, size);
+        bench_use(p);
+
+        if (i % BENCH_POOL_ROUND == BENCH_POOL_ROUND - 1) {
+            mem_pool_clear(pool);
+        }
+    }
+
+    mem_pool_clear(pool);
+}
+
+static void bench_pmalloc_16(uint64_t n)   { size = 16; bench_pmalloc(n); }
+static void bench_pmalloc_128(uint64_t n)  { size = 128; bench_pmalloc(n); }
+static void bench_pmalloc_1k(uint64_t n)   { size = 1024; bench_pmalloc(n); }
+static void bench_pmalloc_64k(uint64_t n)  { size = 65536; bench_pmalloc(n); }
+static void bench_pcalloc_16(uint64_t n)   { size = 16; bench_pcalloc(n); }
+static void bench_pcalloc_128(uint64_t n)  { size = 128; bench_pcalloc(n); }
+static void bench_pcalloc_1k(uint64_t n)   { size = 1024; bench_pcalloc(n); }
+static void bench_pcalloc_64k(uint64_t n)  { size = 65536; bench_pcalloc(n); }
+
+static int run(void) 
+{
+    bench_case("pmalloc 16B", bench_pmalloc_16);
+    bench_case("pmalloc 128B", bench_pmalloc_128);
+    bench_case("pmalloc 1KB", bench_pmalloc_1k);
+    bench_case("pmalloc 64KB (large)", bench_pmalloc_64k);
+    bench_case("pcalloc 16B", bench_pcalloc_16);
+    bench_case("pcalloc 128B", bench_pcalloc_128);
+    bench_case("pcalloc 1KB", bench_pcalloc_1k);
+    bench_case("pcalloc 64KB (large)", bench_pcalloc_64k);
+
+    return BENCH_OK;
+}
+
+static int finish(void)
+{
+    mem_pool_destroy(pool);
+
+    return BENCH_OK;
+}
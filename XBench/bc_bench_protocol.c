@@ -0,0 +1,165 @@
+#include "core/xbench.h"
+
+#include "../src/xpipe.h"
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+bench_unit_t bench_protocol = {
+    "bench_protocol",
+    prepare,
+    run,
+    finish
+};
+
+/* every frame is fed in pieces, cut at BENCH_CUTS random offsets */
+#define BENCH_SPLITS    64
+#define BENCH_CUTS      3
+
+typedef struct {
+    u_char  *data;
+    size_t   len;
+    size_t   cuts[BENCH_SPLITS][BENCH_CUTS + 2];
+} frame_t;
+
+static frame_t       frames[4];
+static frame_t      *frame;
+static buffer_t      buf;
+static protocol_t    pro;
+static tcp_request_t req;
+
+
+static int frame_init(frame_t *f, const char *head, size_t data_len)
+{
+    int    i, k;
+    size_t n, t, *cuts;
+
+    n = strlen(head);
+
+    f->len = n + data_len;
+    f->data = malloc(f->len);
+    if (f->data == NULL) {
+        return BENCH_ERROR;
+    }
+
+    memcpy(f->data, head, n);
+    memset(f->data + n, 'x', data_len);
+
+    for (i = 0; i < BENCH_SPLITS; i++) {
+        cuts = f->cuts[i];
+
+        cuts[0] = 0;
+        for (k = 1; k <= BENCH_CUTS; k++) {
+            cuts[k] = 1 + random() % (f->len - 1);
+        }
+        cuts[BENCH_CUTS + 1] = f->len;
+
+        /* insertion sort, there are a few of them */
+        for (k = 2; k <= BENCH_CUTS; k++) {
+            for (n = k; n > 1 && cuts[n - 1] > cuts[n]; n--) {
+                t = cuts[n];
+                cuts[n] = cuts[n - 1];
+                cuts[n - 1] = t;
+            }
+        }
+    }
+
+    return BENCH_OK;
+}
+
+static int prepare(void)
+{
+    srandom(1);
+
+    if (frame_init(&frames[0], "PUT\r\nqueue=orders;priority=1\r\n64\r\n", 64)
+        || frame_init(&frames[1], "PUT\r\nqueue=orders\r\n4096\r\n", 4096)
+        || frame_init(&frames[2], "GET\r\nqueue=orders;group=billing\r\n", 0)
+        || frame_init(&frames[3], "STATS\r\n\r\n", 0))
+    {
+        return BENCH_ERROR;
+    }
+
+    req.protocol = &pro;
+    req.last_buffer = &buf;
+
+    return BENCH_OK;
+}
+
+static void bench_parse(uint64_t n)
+{
+    int       ret, k;
+    size_t   *cuts;
+    uint64_t  i;
+
+    ret = PROTOCOL_OK;
+
+    for (i = 0; i < n; i++) {
+        cuts = frame->cuts[i % BENCH_SPLITS];
+
+        memset(&pro, 0, sizeof(protocol_t));
+
+        for (k = 0; k <= BENCH_CUTS; k++) {
+            if (cuts[k] == cuts[k + 1]) {
+                continue;
+            }
+
+            ret = protocol_parse(&req, frame->data + cuts[k],
+                                 frame->data + cuts[k + 1]);
+        }
+
+        if (ret != PROTOCOL_DONE) {
+            fprintf(stderr, "parse failed: %d\n", ret);
+            exit(1);
+        }
+    }
+}
+
+static void bench_parse_put_64(uint64_t n)
+{
+    frame = &frames[0];
+    bench_parse(n);
+}
+
+static void bench_parse_put_4096(uint64_t n)
+{
+    frame = &frames[1];
+    bench_parse(n);
+}
+
+static void bench_parse_get(uint64_t n)
+{
+    frame = &frames[2];
+    bench_parse(n);
+}
+
+static void bench_parse_stats(uint64_t n)
+{
+    frame = &frames[3];
+    bench_parse(n);
+}
+
+static int run(void) 
+{
+    bench_case("protocol_parse PUT 64B split", bench_parse_put_64);
+    bench_case("protocol_parse PUT 4KB split", bench_parse_put_4096);
+    bench_case("protocol_parse GET split", bench_parse_get);
+    bench_case("protocol_parse STATS split", bench_parse_stats);
+
+    return BENCH_OK;
+}
+
+static int finish(void)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        free(frames[i].data);
+    }
+
+    return BENCH_OK;
+}
@@ -0,0 +1,26 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+
+#include "core/xbench.h"
+
+
+extern bench_unit_t bench_protocol;
+extern bench_unit_t bench_mem_pool;
+extern bench_unit_t bench_dynamic_array;
+extern bench_unit_t bench_logger;
+
+bench_unit_t* bench_units[] = {
+    &bench_protocol,
+    &bench_mem_pool,
+    &bench_dynamic_array,
+    &bench_logger,
+    NULL 
+};
+
+
+#endif /* __CONFIG_H__ */ 
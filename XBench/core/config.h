@@ -0,0 +1,16 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+
+#include "xbench.h"
+
+
+bench_unit_t* bench_units[] = {
+    NULL 
+};
+
+#endif /* __CONFIG_H__ */ 
@@ -0,0 +1,621 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xbench.h"
+
+#ifdef NEW_CONFIG
+#include "../config.h"
+#else
+#include "config.h"
+#endif
+
+#define BENCH_WARMUP_NSECS  (50 * 1000000ULL)
+#define BENCH_REP_NSECS     (20 * 1000000ULL)
+#define BENCH_REPS          15
+
+/**
+ * A regression is slower by more than the threshold and significant. The
+ * samples of one run don't see the drift between runs, so a suspect is
+ * run again BENCH_RUNS_MAX - 1 times, in rounds over all the suspects, and
+ * must be slower in each run and by more than the spread of its runs.
+ */
+#define BENCH_THRESHOLD     5.0     /* percent of the median */
+#define BENCH_ALPHA         0.01
+
+#define c_close     "\e[0m"
+#define c_yellow    "\e[1;33m"
+
+
+static bench_result_t  results[BENCH_CASES_MAX];
+static int             nresults;
+static int             reps = BENCH_REPS;
+static const char     *filter;
+static const char     *current_unit;
+static int             confirming;
+
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    double x, y;
+
+    x = *(const double *) a;
+    y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_median(double *v, int n)
+{
+    double sorted[BENCH_REPS_MAX];
+
+    memcpy(sorted, v, sizeof(double) * n);
+    qsort(sorted, n, sizeof(double), bench_cmp);
+
+    return (n & 1) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+static void bench_summary(bench_result_t *res)
+{
+    int    i;
+    double sum, d, min;
+
+    sum = 0;
+    for (i = 0; i < res->reps; i++) {
+        sum += res->samples[i];
+    }
+
+    res->mean = sum / res->reps;
+
+    sum = 0;
+    for (i = 0; i < res->reps; i++) {
+        d = res->samples[i] - res->mean;
+        sum += d * d;
+    }
+
+    res->stddev = res->reps > 1 ? sqrt(sum / (res->reps - 1)) : 0;
+
+    min = res->samples[0];
+    for (i = 1; i < res->reps; i++) {
+        if (res->samples[i] < min) {
+            min = res->samples[i];
+        }
+    }
+
+    res->min = min;
+    res->median = bench_median(res->samples, res->reps);
+}
+
+static bench_result_t *bench_find(bench_result_t *res, int n,
+    const char *name)
+{
+    int  i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(res[i].name, name) == 0) {
+            return &res[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * The samples of the runs of a case are pooled, up to BENCH_REPS_MAX, a
+ * run again only measures a suspect with the "ops" of its first run.
+ */
+void bench_case(const char *name, bench_fp fn)
+{
+    int             i;
+    uint64_t        n, start, elapsed, warmup;
+    double          run[BENCH_REPS_MAX];
+    bench_result_t *res;
+
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    res = NULL;
+
+    if (confirming) {
+        res = bench_find(results, nresults, name);
+        if (res == NULL || !res->suspect || res->runs == BENCH_RUNS_MAX) {
+            return;
+        }
+
+    } else if (nresults == BENCH_CASES_MAX) {
+        fprintf(stderr, "too many bench cases, max is %d.\n",
+                BENCH_CASES_MAX);
+        return;
+    }
+
+    /* warm up the caches and calibrate "n" at the same time */
+    n = 1;
+    warmup = bench_now();
+
+    for ( ;; ) {
+        start = bench_now();
+        fn(n);
+        elapsed = bench_now() - start;
+
+        if (elapsed >= BENCH_REP_NSECS / 4
+            && bench_now() - warmup >= BENCH_WARMUP_NSECS)
+        {
+            break;
+        }
+
+        if (elapsed < BENCH_REP_NSECS / 4) {
+            n *= 2;
+        }
+    }
+
+    n = n * BENCH_REP_NSECS / (elapsed ? elapsed : 1);
+    if (n == 0) {
+        n = 1;
+    }
+
+    if (res == NULL) {
+        res = &results[nresults++];
+
+        res->unit = current_unit;
+        res->name = name;
+        res->ops = n;
+        res->reps = 0;
+        res->runs = 0;
+        res->suspect = 0;
+    }
+
+    n = res->ops;
+
+    for (i = 0; i < reps; i++) {
+        start = bench_now();
+        fn(n);
+        elapsed = bench_now() - start;
+
+        run[i] = (double) elapsed / n;
+
+        if (res->reps < BENCH_REPS_MAX) {
+            res->samples[res->reps++] = run[i];
+        }
+    }
+
+    res->medians[res->runs++] = bench_median(run, reps);
+
+    bench_summary(res);
+
+    printf("%-40s %12.1f ns/op %14.0f ops/s  +- %5.1f%%  (%llu x %d)\n",
+           name, res->mean, 1e9 / res->mean,
+           res->mean > 0 ? res->stddev * 100 / res->mean : 0,
+           (unsigned long long) n, reps);
+}
+
+static int bench_write_json(const char *path)
+{
+    int             i, k;
+    FILE           *f;
+    bench_result_t *res;
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return BENCH_ERROR;
+    }
+
+    fprintf(f, "{\n  \"benchmarks\": [\n");
+
+    for (i = 0; i < nresults; i++) {
+        res = &results[i];
+
+        fprintf(f, "    {\"unit\": \"%s\", \"name\": \"%s\", "
+                "\"ops\": %llu, \"reps\": %d,\n"
+                "     \"mean_ns\": %.3f, \"stddev_ns\": %.3f, "
+                "\"variance\": %.3f, \"min_ns\": %.3f, \"median_ns\": %.3f, "
+                "\"ops_per_sec\": %.1f,\n"
+                "     \"samples\": [",
+                res->unit, res->name, (unsigned long long) res->ops,
+                res->reps, res->mean, res->stddev, res->stddev * res->stddev,
+                res->min, res->median, 1e9 / res->mean);
+
+        for (k = 0; k < res->reps; k++) {
+            fprintf(f, "%s%.3f", k ? ", " : "", res->samples[k]);
+        }
+
+        fprintf(f, "]}%s\n", i + 1 < nresults ? "," : "");
+    }
+
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+
+    return BENCH_OK;
+}
+
+/**
+ * Read back the "name" and "samples" of each case of a result file, only
+ * the format written by "bench_write_json" is understood.
+ */
+static int bench_read_json(const char *path, bench_result_t *res, int max)
+{
+    int     n;
+    long    len;
+    char   *buf, *p, *q, *end;
+    FILE   *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return BENCH_ERROR;
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = malloc(len + 1);
+    if (buf == NULL || fread(buf, 1, len, f) != (size_t) len) {
+        fclose(f);
+        return BENCH_ERROR;
+    }
+
+    buf[len] = '\0';
+    fclose(f);
+
+    n = 0;
+    p = buf;
+
+    while (n < max && (p = strstr(p, "\"name\": \"")) != NULL) {
+        p += sizeof("\"name\": \"") - 1;
+
+        q = strchr(p, '"');
+        if (q == NULL) {
+            break;
+        }
+
+        *q = '\0';
+        res[n].name = p;
+        res[n].reps = 0;
+
+        p = strstr(q + 1, "\"samples\": [");
+        if (p == NULL) {
+            break;
+        }
+
+        p += sizeof("\"samples\": [") - 1;
+
+        while (*p != ']' && res[n].reps < BENCH_REPS_MAX) {
+            res[n].samples[res[n].reps] = strtod(p, &end);
+            if (end == p) {
+                break;
+            }
+
+            res[n].reps++;
+            p = end;
+
+            while (*p == ',' || *p == ' ') {
+                p++;
+            }
+        }
+
+        if (res[n].reps >= 2) {
+            bench_summary(&res[n]);
+            res[n].runs = 1;
+            res[n].medians[0] = res[n].median;
+            res[n].suspect = 0;
+            n++;
+        }
+    }
+
+    /* "buf" is kept, the names point into it */
+    return n;
+}
+
+/**
+ * Mann-Whitney U test, normal approximation with the tie correction.
+ * Return the one-sided p-value of "b" being greater (slower) than "a".
+ */
+static double bench_mann_whitney(bench_result_t *a, bench_result_t *b)
+{
+    int     i, k, m, n1, n2, n;
+    double  r1, u, mu, sigma, z, ties, t, rank;
+    struct {
+        double  v;
+        int     from_a;
+        double  rank;
+    } all[BENCH_REPS_MAX * 2], tmp;
+
+    n1 = a->reps;
+    n2 = b->reps;
+    n = n1 + n2;
+
+    for (i = 0; i < n1; i++) {
+        all[i].v = a->samples[i];
+        all[i].from_a = 1;
+    }
+
+    for (i = 0; i < n2; i++) {
+        all[n1 + i].v = b->samples[i];
+        all[n1 + i].from_a = 0;
+    }
+
+    for (i = 1; i < n; i++) {
+        for (k = i; k > 0 && all[k - 1].v > all[k].v; k--) {
+            tmp = all[k];
+            all[k] = all[k - 1];
+            all[k - 1] = tmp;
+        }
+    }
+
+    /* the tied values share the mean of their ranks */
+    ties = 0;
+
+    for (i = 0; i < n; i = k) {
+        for (k = i + 1; k < n && all[k].v == all[i].v; k++) {
+            /* void */
+        }
+
+        t = k - i;
+        ties += t * t * t - t;
+
+        /* ranks i + 1 ... k */
+        rank = (i + 1 + k) / 2.0;
+
+        for (m = i; m < k; m++) {
+            all[m].rank = rank;
+        }
+    }
+
+    r1 = 0;
+    for (i = 0; i < n; i++) {
+        if (!all[i].from_a) {
+            r1 += all[i].rank;
+        }
+    }
+
+    u = r1 - n2 * (n2 + 1) / 2.0;
+    mu = n1 * n2 / 2.0;
+    sigma = sqrt(n1 * n2 / 12.0 * ((n + 1) - ties / ((double) n * (n - 1))));
+
+    if (sigma == 0) {
+        return 1;
+    }
+
+    /* continuity correction */
+    z = (u - mu - 0.5) / sigma;
+
+    return 0.5 * erfc(z / sqrt(2));
+}
+
+/**
+ * Mark the cases of "cur" which are slower than "base" in each of their
+ * runs, beyond the threshold and the spread of the runs, and significantly
+ * in the pooled samples. Return the number of them.
+ */
+static int bench_compare(bench_result_t *base, int nbase,
+    bench_result_t *cur, int ncur, double threshold, int report)
+{
+    int             i, k, regressions;
+    double          change, least, spread, lo, hi, p;
+    const char     *verdict;
+    bench_result_t *b;
+
+    if (report) {
+        printf("%-40s %12s %12s %8s %9s\n",
+               "case", "base ns/op", "ns/op", "change", "p-value");
+    }
+
+    regressions = 0;
+
+    for (i = 0; i < ncur; i++) {
+        b = bench_find(base, nbase, cur[i].name);
+
+        if (b == NULL) {
+            if (report) {
+                printf("%-40s %12s %12.1f %8s %9s  new\n",
+                       cur[i].name, "-", cur[i].median, "-", "-");
+            }
+
+            cur[i].suspect = 0;
+            continue;
+        }
+
+        lo = hi = cur[i].medians[0];
+
+        for (k = 1; k < cur[i].runs; k++) {
+            lo = cur[i].medians[k] < lo ? cur[i].medians[k] : lo;
+            hi = cur[i].medians[k] > hi ? cur[i].medians[k] : hi;
+        }
+
+        change = (cur[i].median - b->median) * 100 / b->median;
+        least = (lo - b->median) * 100 / b->median;
+        spread = (hi - lo) * 100 / b->median;
+        p = bench_mann_whitney(b, &cur[i]);
+
+        verdict = "";
+        cur[i].suspect = 0;
+
+        if (least > threshold && least > spread && p < BENCH_ALPHA) {
+            verdict = "REGRESSION";
+            cur[i].suspect = 1;
+            regressions++;
+
+        } else if (change < -threshold
+                   && bench_mann_whitney(&cur[i], b) < BENCH_ALPHA)
+        {
+            verdict = "improved";
+        }
+
+        if (!report) {
+            continue;
+        }
+
+        printf("%-40s %12.1f %12.1f %+7.1f%% %9.4f  %s",
+               cur[i].name, b->median, cur[i].median, change, p, verdict);
+
+        if (cur[i].runs > 1) {
+            printf(" (%d runs, spread %.1f%%)", cur[i].runs, spread);
+        }
+
+        printf("\n");
+    }
+
+    if (report) {
+        printf("%d regressions beyond %.1f%% (p < %.2f).\n",
+               regressions, threshold, BENCH_ALPHA);
+    }
+
+    return regressions;
+}
+
+static void bench_run_units(void)
+{
+    int           i, ret;
+    bench_unit_t *bu;
+
+    for (i = 0; ; i++) {
+        bu = bench_units[i];
+        if (bu == NULL) {
+            break;
+        }
+
+        printf("%s================= %s ===============%s\n",
+               c_yellow, bu->name, c_close);
+
+        current_unit = bu->name;
+
+        ret = bu->prepare();
+        if (ret == BENCH_ERROR) {
+            printf("%s prepare failed.\n", bu->name);
+            continue;
+        }
+
+        ret = bu->run();
+        if (ret == BENCH_ERROR) {
+            printf("%s run failed.\n", bu->name);
+        }
+
+        ret = bu->finish();
+        if (ret == BENCH_ERROR) {
+            printf("%s finish failed.\n", bu->name);
+        }
+    }
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr, "usage: xbench [-o result.json] [-r repetitions] "
+            "[-f filter]\n"
+            "       xbench -c [-t threshold%%] [-o result.json] "
+            "baseline.json\n"
+            "       xbench -c [-t threshold%%] baseline.json result.json\n");
+}
+
+/**
+ * "-c baseline.json" runs the cases and runs the suspects again before a
+ * regression is reported. "-c baseline.json result.json" compares two
+ * files, the runs can't be repeated then.
+ */
+int main(int argc, char *argv[])
+{
+    int             i, opt, compare, nbase, ncur, regressions;
+    double          threshold;
+    const char     *output;
+    bench_result_t *base, *cur;
+
+    output = NULL;
+    compare = 0;
+    threshold = BENCH_THRESHOLD;
+
+    while ((opt = getopt(argc, argv, "o:r:f:ct:h")) != -1) {
+        switch (opt) {
+        case 'o': output = optarg; break;
+        case 'r': reps = atoi(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'c': compare = 1; break;
+        case 't': threshold = atof(optarg); break;
+        default:
+            bench_usage();
+            return 1;
+        }
+    }
+
+    if (compare && argc - optind != 1 && argc - optind != 2) {
+        bench_usage();
+        return 1;
+    }
+
+    base = NULL;
+    nbase = 0;
+
+    if (compare) {
+        base = calloc(BENCH_CASES_MAX * 2, sizeof(bench_result_t));
+        if (base == NULL) {
+            return 1;
+        }
+
+        nbase = bench_read_json(argv[optind], base, BENCH_CASES_MAX);
+        if (nbase == BENCH_ERROR) {
+            return 1;
+        }
+    }
+
+    if (compare && argc - optind == 2) {
+        cur = base + BENCH_CASES_MAX;
+
+        ncur = bench_read_json(argv[optind + 1], cur, BENCH_CASES_MAX);
+        if (ncur == BENCH_ERROR) {
+            return 1;
+        }
+
+        return bench_compare(base, nbase, cur, ncur, threshold, 1) ? 1 : 0;
+    }
+
+    if (reps < 2 || reps > BENCH_REPS_MAX) {
+        fprintf(stderr, "repetitions must be 2 to %d.\n", BENCH_REPS_MAX);
+        return 1;
+    }
+
+    bench_run_units();
+
+    regressions = 0;
+
+    if (compare) {
+        regressions = bench_compare(base, nbase, results, nresults,
+                                    threshold, 0);
+
+        /* each round runs every suspect once more */
+        for (i = 1; i < BENCH_RUNS_MAX && regressions != 0; i++) {
+            printf("%d suspected regressions, run them again (%d/%d).\n",
+                   regressions, i, BENCH_RUNS_MAX - 1);
+
+            confirming = 1;
+            bench_run_units();
+
+            regressions = bench_compare(base, nbase, results, nresults,
+                                        threshold, 0);
+        }
+
+        regressions = bench_compare(base, nbase, results, nresults,
+                                    threshold, 1);
+    }
+
+    if (output != NULL && bench_write_json(output) == BENCH_ERROR) {
+        return 1;
+    }
+
+    return regressions ? 1 : 0;
+}
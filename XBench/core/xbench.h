@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __XBENCH_H__
+#define __XBENCH_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define BENCH_ERROR -1
+#define BENCH_OK 0
+
+#define BENCH_REPS_MAX      64
+#define BENCH_RUNS_MAX      4       /* the first and the confirmations */
+#define BENCH_CASES_MAX     128
+
+/* run the operation "n" times */
+typedef void (*bench_fp) (uint64_t n);
+
+typedef int (*prepare_bench_handler_fp) (void);
+typedef int (*run_bench_handler_fp) (void);
+typedef int (*finish_bench_handler_fp) (void);
+
+
+typedef struct {
+    char  *name;
+
+    prepare_bench_handler_fp  prepare;
+    run_bench_handler_fp      run;
+    finish_bench_handler_fp   finish;
+} bench_unit_t;
+
+/**
+ * A case is warmed up, "n" is calibrated so a repetition takes about
+ * BENCH_REP_NSECS, then every repetition gives one sample of nsecs/op.
+ */
+typedef struct {
+    const char  *unit;
+    const char  *name;
+    uint64_t     ops;       /* ops of a repetition */
+    int          reps;
+    double       samples[BENCH_REPS_MAX];
+    double       mean;
+    double       stddev;
+    double       min;
+    double       median;
+    int          runs;      /* of the case in this process */
+    double       medians[BENCH_RUNS_MAX];
+    int          suspect;
+} bench_result_t;
+
+void bench_case(const char *name, bench_fp fn);
+
+/* keep the compiler from dropping a result or an unused store */
+#define bench_use(p)  __asm__ __volatile__("" : : "r"(p) : "memory")
+
+#endif /* __XBENCH_H__ */
@@ -10,9 +10,31 @@
 
 
 extern unit_cases_t test_mem_pool;
+extern unit_cases_t test_channel;
+extern unit_cases_t test_reload;
+extern unit_cases_t test_queue_memory;
+extern unit_cases_t test_queue_log;
+extern unit_cases_t test_timer_wheel;
+extern unit_cases_t test_queue_lease;
+extern unit_cases_t test_queue_ttl;
+extern unit_cases_t test_queue_delay;
+extern unit_cases_t test_queue_priority;
+extern unit_cases_t test_queue_registry;
+extern unit_cases_t test_protocol;
 
 unit_cases_t* test_units[] = {
     &test_mem_pool,
+    &test_channel,
+    &test_reload,
+    &test_queue_memory,
+    &test_queue_log,
+    &test_timer_wheel,
+    &test_queue_lease,
+    &test_queue_ttl,
+    &test_queue_delay,
+    &test_queue_priority,
+    &test_queue_registry,
+    &test_protocol,
     NULL 
 };
 
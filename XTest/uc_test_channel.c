@@ -0,0 +1,159 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_channel = {
+    "test_channel",
+    prepare,
+    run,
+    finish
+};
+
+#define TEST_CHANNEL_SIZE   4
+
+static file_t       *file;
+static logger_t     *logger;
+static mem_pool_t   *pool;
+static channel_t    *ch;
+
+/* the eventfd of a channel is readable while it's not empty */
+static int channel_readable(channel_t *ch)
+{
+    struct pollfd pfd;
+
+    pfd.fd = ch->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) == 1;
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    pool = mem_pool_create((u_char *) "channel_test", 4096, logger);
+    if (pool == NULL) {
+        fprintf(stderr, "create pool failed\n");
+        return TEST_ERROR;
+    }
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int           i, ret;
+    channel_msg_t msg;
+
+    TEST_CASE("channel_create")
+    {
+        ch = channel_create(pool, TEST_CHANNEL_SIZE, logger);
+
+        ASSERT_NOT_NULL(ch);
+        ret = channel_recv(ch, &msg);
+        ASSERT_EQ(ret, CHANNEL_EMPTY);
+        ret = channel_readable(ch);
+        ASSERT_EQ(ret, 0);
+    }
+
+    TEST_CASE("channel_send until it's full")
+    {
+        for (i = 0; i < TEST_CHANNEL_SIZE; i++) {
+            msg.type = i;
+            msg.data = NULL;
+            msg.from = &sys_queue_module;
+
+            ret = channel_send(ch, &msg);
+            ASSERT_EQ(ret, CHANNEL_OK);
+        }
+
+        ret = channel_send(ch, &msg);
+        ASSERT_EQ(ret, CHANNEL_FULL);
+        ret = channel_readable(ch);
+        ASSERT_EQ(ret, 1);
+    }
+
+    TEST_CASE("channel_recv in order")
+    {
+        for (i = 0; i < TEST_CHANNEL_SIZE; i++) {
+            ret = channel_recv(ch, &msg);
+            ASSERT_EQ(ret, CHANNEL_OK);
+            ASSERT_EQ(msg.type, i);
+            ASSERT_EQ(msg.from, &sys_queue_module);
+        }
+
+        /* drained, the fd is reset */
+        ret = channel_recv(ch, &msg);
+        ASSERT_EQ(ret, CHANNEL_EMPTY);
+        ret = channel_readable(ch);
+        ASSERT_EQ(ret, 0);
+    }
+
+    TEST_CASE("channel wraps around")
+    {
+        for (i = 0; i < TEST_CHANNEL_SIZE * 3; i++) {
+            msg.type = i;
+
+            ret = channel_send(ch, &msg);
+            ASSERT_EQ(ret, CHANNEL_OK);
+            ret = channel_recv(ch, &msg);
+            ASSERT_EQ(ret, CHANNEL_OK);
+            ASSERT_EQ(msg.type, i);
+        }
+
+        ret = channel_recv(ch, &msg);
+        ASSERT_EQ(ret, CHANNEL_EMPTY);
+    }
+
+    TEST_CASE("channel_notify wakes up an empty channel")
+    {
+        channel_notify(ch);
+
+        ret = channel_readable(ch);
+        ASSERT_EQ(ret, 1);
+        ret = channel_recv(ch, &msg);
+        ASSERT_EQ(ret, CHANNEL_EMPTY);
+        ret = channel_readable(ch);
+        ASSERT_EQ(ret, 0);
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    channel_destroy(ch);
+    mem_pool_destroy(pool);
+
+    return TEST_OK;
+}
@@ -22,6 +22,11 @@ static file_t       *file;
 static logger_t     *logger;
 static mem_pool_t   *pool;
 
+static void cleanup_count(void *data)
+{
+    (*(int *) data)++;
+}
+
 static int prepare(void)
 {
     file = malloc(sizeof(file_t));
@@ -111,7 +116,25 @@ static int run(void)
 
     TEST_CASE("pmalloc large")
     {
+        int     ret;
+        u_char *p;
 
+        p = pmalloc(pool, 8192);
+
+        ASSERT_NOT_NULL(p);
+        ASSERT_NOT_NULL(pool->large);
+        ASSERT_EQ(pool->large->data, p);
+        ASSERT_EQ(pool->total, 2048);
+
+        ret = pfree_large(pool, p);
+
+        ASSERT_EQ(ret, XPE_OK);
+        ASSERT_EQ(pool->large->data, NULL);
+
+        p = pmalloc(pool, 8192);
+
+        ASSERT_NOT_NULL(p);
+        ASSERT_EQ(pool->large->data, p);
     }
 
     TEST_CASE("pcalloc")
@@ -119,6 +142,41 @@ static int run(void)
 
     }
 
+    TEST_CASE("cleanup")
+    {
+        int                 n;
+        mem_pool_t         *tmp;
+        mem_pool_cleanup_t *c;
+
+        n = 0;
+
+        tmp = mem_pool_create((u_char *) "test_cleanup", 1024, logger);
+        ASSERT_NOT_NULL(tmp);
+        ASSERT_EQ(tmp->cleanup, NULL);
+
+        c = mem_pool_cleanup_add(tmp, 0);
+        ASSERT_NOT_NULL(c);
+        ASSERT_EQ(tmp->cleanup, c);
+
+        c->handler = cleanup_count;
+        c->data = &n;
+
+        mem_pool_clear(tmp);
+
+        ASSERT_EQ(n, 1);
+        ASSERT_EQ(tmp->cleanup, NULL);
+
+        c = mem_pool_cleanup_add(tmp, 0);
+        ASSERT_NOT_NULL(c);
+
+        c->handler = cleanup_count;
+        c->data = &n;
+
+        mem_pool_destroy(tmp);
+
+        ASSERT_EQ(n, 2);
+    }
+
     return TEST_OK;
 }
 
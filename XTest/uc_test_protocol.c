@@ -0,0 +1,338 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_protocol = {
+    "test_protocol",
+    prepare,
+    run,
+    finish
+};
+
+static file_t       *file;
+static logger_t     *logger;
+static mem_pool_t   *pool;
+
+static tcp_request_t *request_init(size_t size)
+{
+    buffer_t       *b;
+    tcp_request_t  *r;
+
+    r = pcalloc(pool, sizeof(tcp_request_t));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    b = pcalloc(pool, sizeof(buffer_t));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->buffer = pmalloc(pool, size);
+    if (b->buffer == NULL) {
+        return NULL;
+    }
+
+    b->last = b->buffer;
+    b->end = b->buffer + size;
+
+    r->buffers = b;
+    r->last_buffer = b;
+    r->pool = pool;
+    r->logger = logger;
+
+    if (protocol_init(r) != PROTOCOL_OK) {
+        return NULL;
+    }
+
+    return r;
+}
+
+/**
+ * "data" is read as the server does, into buffers of "size" bytes, a new
+ * one is chained once the last is full. return the result of the parser
+ * once it's not PROTOCOL_OK.
+ */
+static int feed(tcp_request_t *r, char *data, size_t len)
+{
+    int        ret;
+    size_t     n, size;
+    buffer_t  *b, *nb;
+
+    ret = PROTOCOL_OK;
+    size = r->buffers->end - r->buffers->buffer;
+
+    while (len > 0) {
+        b = r->last_buffer;
+
+        if (b->last == b->end) {
+            nb = pcalloc(pool, sizeof(buffer_t));
+            if (nb == NULL) {
+                return PROTOCOL_ERROR;
+            }
+
+            nb->buffer = pmalloc(pool, size);
+            if (nb->buffer == NULL) {
+                return PROTOCOL_ERROR;
+            }
+
+            nb->last = nb->buffer;
+            nb->end = nb->buffer + size;
+
+            b->next = nb;
+            r->last_buffer = nb;
+            b = nb;
+        }
+
+        n = b->end - b->last;
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(b->last, data, n);
+
+        ret = r->parser(r, b->last, b->last + n);
+        b->last += n;
+
+        data += n;
+        len -= n;
+
+        if (ret != PROTOCOL_OK) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/* the data of a PUT, which may be in more than one buffer, into "buf" */
+static size_t put_data(tcp_request_t *r, char *buf)
+{
+    u_char      *p;
+    size_t       n;
+    buffer_t    *b;
+    protocol_t  *pro;
+
+    pro = r->protocol;
+    n = 0;
+
+    for (b = pro->data_start_buf, p = pro->data_start; b != NULL;
+         b = b->next, p = b ? b->buffer : NULL)
+    {
+        if (b == r->last_buffer) {
+            memcpy(buf + n, p, pro->data_end - p);
+            n += pro->data_end - p;
+            break;
+        }
+
+        memcpy(buf + n, p, b->last - p);
+        n += b->last - p;
+    }
+
+    buf[n] = '\0';
+
+    return n;
+}
+
+/* the header "name" of the request into "buf", "" if it's not found */
+static char *header(tcp_request_t *r, const char *name, char *buf)
+{
+    string_t value;
+
+    buf[0] = '\0';
+
+    if (protocol_header(r->protocol, name, &value) == PROTOCOL_OK) {
+        memcpy(buf, value.data, value.len);
+        buf[value.len] = '\0';
+    }
+
+    return buf;
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    pool = mem_pool_create((u_char *) "protocol_test", 4096, logger);
+    if (pool == NULL) {
+        return TEST_ERROR;
+    }
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int             ret, ok;
+    char           *req, *v, buf[256];
+    size_t          size, n;
+    u_char         *next;
+    tcp_request_t  *r;
+
+    req = "PUT\r\nqueue=uc_protocol;priority=2\r\n12\r\nhello, world";
+
+    TEST_CASE("parse a request in one buffer")
+    {
+        r = request_init(256);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, req, strlen(req));
+        ASSERT_EQ(ret, PROTOCOL_DONE);
+        ASSERT_EQ(r->protocol->type, PUT_T);
+        ASSERT_EQ((int) r->protocol->data_len, 12);
+        ASSERT_EQ(r->protocol->next, NULL);
+
+        n = put_data(r, buf);
+        ASSERT_EQ((int) n, 12);
+        ASSERT_STR_EQ(buf, "hello, world");
+
+        v = header(r, "queue", buf);
+        ASSERT_STR_EQ(v, "uc_protocol");
+    }
+
+    TEST_CASE("parse a request split across buffers")
+    {
+        /* the type, the headers, the data length and the data are cut */
+        for (ok = 1, size = 1; size < strlen(req); size++) {
+            r = request_init(size);
+            if (r == NULL) {
+                ok = 0;
+                break;
+            }
+
+            ok &= feed(r, req, strlen(req)) == PROTOCOL_DONE;
+            ok &= r->protocol->type == PUT_T;
+            ok &= r->protocol->data_len == 12;
+
+            ok &= put_data(r, buf) == 12;
+            ok &= strcmp(buf, "hello, world") == 0;
+
+            ok &= strcmp(header(r, "queue", buf), "uc_protocol") == 0;
+            ok &= strcmp(header(r, "priority", buf), "2") == 0;
+        }
+
+        ASSERT_EQ(ok, 1);
+    }
+
+    TEST_CASE("parse the requests pipelined after one")
+    {
+        req = "PUT\r\nqueue=a\r\n3\r\nabc"
+              "GET\r\nqueue=a\r\n"
+              "ACK\r\nqueue=a;group=g;id=1\r\n";
+
+        r = request_init(256);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, req, strlen(req));
+        ASSERT_EQ(ret, PROTOCOL_DONE);
+        ASSERT_EQ(r->protocol->type, PUT_T);
+
+        n = put_data(r, buf);
+        ASSERT_EQ((int) n, 3);
+        ASSERT_STR_EQ(buf, "abc");
+
+        /* the rest is carried to the next request as the server does */
+        next = r->protocol->next;
+        ASSERT_NOT_NULL(next);
+
+        n = r->last_buffer->last - next;
+        ASSERT_EQ((int) n, (int) strlen(req) - 20);
+
+        r = request_init(256);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, (char *) next, n);
+        ASSERT_EQ(ret, PROTOCOL_DONE);
+        ASSERT_EQ(r->protocol->type, GET_T);
+
+        v = header(r, "queue", buf);
+        ASSERT_STR_EQ(v, "a");
+
+        next = r->protocol->next;
+        ASSERT_NOT_NULL(next);
+
+        n = r->last_buffer->last - next;
+
+        r = request_init(256);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, (char *) next, n);
+        ASSERT_EQ(ret, PROTOCOL_DONE);
+        ASSERT_EQ(r->protocol->type, ACK_T);
+        ASSERT_EQ(r->protocol->next, NULL);
+
+        v = header(r, "group", buf);
+        ASSERT_STR_EQ(v, "g");
+    }
+
+    TEST_CASE("reject an invalid request")
+    {
+        r = request_init(4);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, "PUSH\r\n", 6);
+        ASSERT_EQ(ret, 3);      /* type not found */
+
+        r = request_init(4);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, "PUT\r\nqueue=a\r\n1x\r\n", 18);
+        ASSERT_EQ(ret, 5);      /* data len is invalid */
+
+        r = request_init(4);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, "PUT\r\nqueue=a\r\n0\r\n", 17);
+        ASSERT_EQ(ret, 5);
+
+        r = request_init(4);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, "GET\r\nqueue=a b\r\n", 16);
+        ASSERT_EQ(ret, 4);      /* headers are invalid */
+
+        r = request_init(4);
+        ASSERT_NOT_NULL(r);
+
+        ret = feed(r, "COMMITS\r\n", 9);
+        ASSERT_EQ(ret, 3);
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    mem_pool_destroy(pool);
+
+    return TEST_OK;
+}
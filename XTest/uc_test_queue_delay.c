@@ -0,0 +1,267 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_queue_delay = {
+    "test_queue_delay",
+    prepare,
+    run,
+    finish
+};
+
+#define TEST_DELAY_DIR  "/tmp/xtest_queue_delay"
+
+static file_t       *file;
+static logger_t     *logger;
+
+/* "settings" is "key=value;..." as the headers of QUEUE */
+static queue_t *create_queue(char *name, char *settings)
+{
+    char          *p, *eq, *semi, buf[256];
+    string_t       key, value;
+    queue_conf_t   qc;
+
+    queue_conf_init(&qc);
+
+    qc.name.data = (u_char *) name;
+    qc.name.len = strlen(name);
+
+    snprintf(buf, sizeof(buf), "%s", settings);
+
+    for (p = buf; *p != '\0'; p = semi + 1) {
+        semi = strchr(p, ';');
+        if (semi == NULL) {
+            semi = p + strlen(p) - 1;
+        } else {
+            *semi = '\0';
+        }
+
+        eq = strchr(p, '=');
+        if (eq == NULL) {
+            return NULL;
+        }
+
+        *eq = '\0';
+
+        key.data = (u_char *) p;
+        key.len = eq - p;
+        value.data = (u_char *) eq + 1;
+        value.len = strlen(eq + 1);
+
+        if (queue_conf_set(&qc, &key, &value) == QUEUE_ERROR) {
+            return NULL;
+        }
+    }
+
+    return queue_create(&qc, logger);
+}
+
+static int put(queue_t *q, char *data, size_t len, uint64_t at)
+{
+    queue_msg_t msg;
+
+    memset(&msg, 0, sizeof(queue_msg_t));
+
+    msg.data = (u_char *) data;
+    msg.len = len;
+    msg.fd = -1;
+
+    return queue_delay_put(q, &msg, at);
+}
+
+/* the oldest message of the engine is taken, its payload is in "buf" */
+static int get(queue_t *q, uint64_t *id, char *buf)
+{
+    queue_msg_t msg;
+
+    if (q->conf.engine->peek_handler(q, &msg) != QUEUE_OK) {
+        return QUEUE_EMPTY;
+    }
+
+    *id = msg.id;
+    memcpy(buf, msg.data, msg.len);
+    buf[msg.len] = '\0';
+
+    q->conf.engine->pop_handler(q);
+    q->depth--;
+    q->bytes -= msg.len;
+
+    return QUEUE_OK;
+}
+
+static off_t file_size(char *name)
+{
+    struct stat st;
+
+    if (stat(name, &st) == -1) {
+        return -1;
+    }
+
+    return st.st_size;
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    if (system("rm -rf " TEST_DELAY_DIR) != 0) {
+        return TEST_ERROR;
+    }
+
+    set_string(&queue_data_dir, TEST_DELAY_DIR);
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int         i, ret, ok;
+    uint_t      left;
+    char        buf[4096], data[4096];
+    uint64_t    id, base;
+    queue_t    *q;
+
+    base = time_current_epoch_msecs;
+
+    TEST_CASE("promote by \"at\" and the order of PUTs")
+    {
+        q = create_queue("uc_delay", "engine=log");
+        ASSERT_NOT_NULL(q);
+
+        ok = put(q, "a", 1, base + 30) == QUEUE_OK;
+        ok &= put(q, "b", 1, base + 10) == QUEUE_OK;
+        ok &= put(q, "c", 1, base + 20) == QUEUE_OK;
+        ok &= put(q, "d", 1, base + 10) == QUEUE_OK;
+        ok &= put(q, "e", 1, base + 40) == QUEUE_OK;
+        ASSERT_EQ(ok, 1);
+        ASSERT_EQ((int) q->delayed, 5);
+
+        time_current_epoch_msecs = base + 20;
+
+        left = queue_delay_promote(q);
+        ASSERT_EQ((int) left, 2);
+        ASSERT_EQ((int) q->depth, 3);
+
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) id, 1);
+        ASSERT_STR_EQ(buf, "b");
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_STR_EQ(buf, "d");
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_STR_EQ(buf, "c");
+    }
+
+    TEST_CASE("replay the delayed messages after the mark")
+    {
+        /* the engine and the mark are synced when it's done */
+        queue_destroy_all();
+
+        q = create_queue("uc_delay", "engine=log");
+        ASSERT_NOT_NULL(q);
+
+        ASSERT_EQ((int) q->delayed, 2);
+        ASSERT_EQ((int) q->next_id, 4);
+        ASSERT_EQ((int) q->depth, 0);
+
+        time_current_epoch_msecs = base + 40;
+
+        left = queue_delay_promote(q);
+        ASSERT_EQ((int) left, 0);
+
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) id, 4);
+        ASSERT_STR_EQ(buf, "a");
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) id, 5);
+        ASSERT_STR_EQ(buf, "e");
+    }
+
+    TEST_CASE("write the file again when most of it is promoted")
+    {
+        memset(data, 'x', sizeof(data));
+
+        for (ok = 1, i = 0; i < 300; i++) {
+            ok &= put(q, data, sizeof(data), base + 50) == QUEUE_OK;
+        }
+
+        ok &= put(q, "f", 1, base + 600000) == QUEUE_OK;
+        ASSERT_EQ(ok, 1);
+
+        time_current_epoch_msecs = base + 50;
+
+        left = queue_delay_promote(q);
+        ASSERT_EQ((int) left, 1);
+
+        q->conf.engine->sync_handler(q);
+        queue_delay_sync(q);
+
+        /* the mark and "f" */
+        ASSERT_EQ((int) file_size(TEST_DELAY_DIR "/uc_delay/delayed"),
+                  16 + 32 + 1);
+        ASSERT_EQ((int) file_size(TEST_DELAY_DIR "/uc_delay/delayed.new"),
+                  -1);
+
+        /* appended to the new file */
+        ret = put(q, "g", 1, base + 600000);
+        ASSERT_EQ(ret, QUEUE_OK);
+
+        queue_destroy_all();
+
+        q = create_queue("uc_delay", "engine=log");
+        ASSERT_NOT_NULL(q);
+
+        ASSERT_EQ((int) q->delayed, 2);
+        ASSERT_EQ((int) q->depth, 300);
+    }
+
+    timer_update();
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    queue_destroy_all();
+
+    if (system("rm -rf " TEST_DELAY_DIR) != 0) {
+        return TEST_ERROR;
+    }
+
+    return TEST_OK;
+}
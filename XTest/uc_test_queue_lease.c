@@ -0,0 +1,236 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_queue_lease = {
+    "test_queue_lease",
+    prepare,
+    run,
+    finish
+};
+
+#define TEST_LEASES     3000
+
+static file_t       *file;
+static logger_t     *logger;
+
+/* "settings" is "key=value;..." as the headers of QUEUE */
+static queue_t *create_queue(char *name, char *settings)
+{
+    char          *p, *eq, *semi, buf[256];
+    string_t       key, value;
+    queue_conf_t   qc;
+
+    queue_conf_init(&qc);
+
+    qc.name.data = (u_char *) name;
+    qc.name.len = strlen(name);
+
+    snprintf(buf, sizeof(buf), "%s", settings);
+
+    for (p = buf; *p != '\0'; p = semi + 1) {
+        semi = strchr(p, ';');
+        if (semi == NULL) {
+            semi = p + strlen(p) - 1;
+        } else {
+            *semi = '\0';
+        }
+
+        eq = strchr(p, '=');
+        if (eq == NULL) {
+            return NULL;
+        }
+
+        *eq = '\0';
+
+        key.data = (u_char *) p;
+        key.len = eq - p;
+        value.data = (u_char *) eq + 1;
+        value.len = strlen(eq + 1);
+
+        if (queue_conf_set(&qc, &key, &value) == QUEUE_ERROR) {
+            return NULL;
+        }
+    }
+
+    return queue_create(&qc, logger);
+}
+
+static int put(queue_t *q, char *data, size_t len)
+{
+    queue_msg_t msg;
+
+    memset(&msg, 0, sizeof(queue_msg_t));
+
+    msg.data = (u_char *) data;
+    msg.len = len;
+    msg.fd = -1;
+
+    return queue_put(q, &msg);
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int          ret;
+    uint_t       i, j, ok, start;
+    uint64_t     id, ids[TEST_LEASES];
+    queue_t     *q;
+    queue_msg_t  msg;
+
+    start = time_current_msecs;
+
+    TEST_CASE("lease the messages")
+    {
+        q = create_queue("uc_lease", "slots=4096;bytes=65536;"
+                         "visibility_ms=1000");
+        ASSERT_NOT_NULL(q);
+
+        for (ok = 1, i = 0; i < TEST_LEASES; i++) {
+            ok &= put(q, "abcd", 4) == QUEUE_OK;
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        for (ok = 1, i = 0; i < TEST_LEASES; i++) {
+            ret = queue_lease_next(q, &msg, 1000);
+            ok &= ret == QUEUE_OK && msg.id == i + 1;
+        }
+
+        ASSERT_EQ(ok, 1);
+        ret = queue_lease_next(q, &msg, 1000);
+        ASSERT_EQ(ret, QUEUE_EMPTY);
+
+        /* the table is grown past 3/4 of 1024 slots twice */
+        ASSERT_EQ((int) q->leases->n, TEST_LEASES);
+        ASSERT_EQ((int) q->leases->bits, 12);
+        ASSERT_EQ((int) q->inflight, TEST_LEASES);
+    }
+
+    TEST_CASE("ACK shifts the leases after it back")
+    {
+        /* two of three in a shuffled order */
+        for (i = 0; i < TEST_LEASES; i++) {
+            ids[i] = i + 1;
+        }
+
+        for (i = TEST_LEASES - 1; i > 0; i--) {
+            j = (i * 2654435761U) % (i + 1);
+            id = ids[i];
+            ids[i] = ids[j];
+            ids[j] = id;
+        }
+
+        for (ok = 1, i = 0; i < TEST_LEASES; i++) {
+            if (ids[i] % 3 != 0) {
+                ok &= queue_lease_ack(q, ids[i]) == QUEUE_OK;
+            }
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        /* every lease left is found, no slot is left empty on its probe */
+        for (ok = 1, id = 1; id <= TEST_LEASES; id++) {
+            ok &= queue_lease_held(q, id) == (id % 3 == 0);
+        }
+
+        ASSERT_EQ(ok, 1);
+        ASSERT_EQ((int) q->leases->n, TEST_LEASES / 3);
+        ASSERT_EQ((int) q->inflight, TEST_LEASES / 3);
+
+        ret = queue_lease_ack(q, 1);
+        ASSERT_EQ(ret, QUEUE_ERROR);
+        ret = queue_lease_ack(q, TEST_LEASES + 1);
+        ASSERT_EQ(ret, QUEUE_ERROR);
+
+        /* a leased message keeps the ones after it */
+        queue_trim(q);
+        ASSERT_EQ((int) q->depth, TEST_LEASES - 2);
+    }
+
+    TEST_CASE("redeliver the expired leases")
+    {
+        time_current_msecs = start + 999;
+        queue_lease_expire(q);
+        ASSERT_EQ((int) q->inflight, TEST_LEASES / 3);
+
+        time_current_msecs = start + 1010;
+        queue_lease_expire(q);
+        ASSERT_EQ((int) q->inflight, 0);
+
+        /* in the order they expire */
+        ret = queue_lease_next(q, &msg, 1000);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) msg.id, 3);
+        ASSERT_EQ((int) q->redelivered, 1);
+
+        ret = queue_lease_held(q, 3);
+        ASSERT_EQ(ret, 1);
+
+        for (ok = 1, id = 6; id <= TEST_LEASES; id += 3) {
+            ret = queue_lease_next(q, &msg, 1000);
+            ok &= ret == QUEUE_OK && msg.id == id;
+        }
+
+        ASSERT_EQ(ok, 1);
+        ASSERT_EQ((int) q->inflight, TEST_LEASES / 3);
+
+        for (ok = 1, id = 3; id <= TEST_LEASES; id += 3) {
+            ok &= queue_lease_ack(q, id) == QUEUE_OK;
+        }
+
+        ASSERT_EQ(ok, 1);
+        ASSERT_EQ((int) q->leases->n, 0);
+
+        queue_trim(q);
+        ASSERT_EQ((int) q->depth, 0);
+    }
+
+    timer_update();
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    queue_destroy_all();
+
+    return TEST_OK;
+}
@@ -0,0 +1,322 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_queue_log = {
+    "test_queue_log",
+    prepare,
+    run,
+    finish
+};
+
+#define TEST_LOG_DIR    "/tmp/xtest_queue_log"
+
+static file_t       *file;
+static logger_t     *logger;
+
+/* "settings" is "key=value;..." as the headers of QUEUE */
+static queue_t *create_queue(char *name, char *settings)
+{
+    char          *p, *eq, *semi, buf[256];
+    string_t       key, value;
+    queue_conf_t   qc;
+
+    queue_conf_init(&qc);
+
+    qc.name.data = (u_char *) name;
+    qc.name.len = strlen(name);
+
+    snprintf(buf, sizeof(buf), "%s", settings);
+
+    for (p = buf; *p != '\0'; p = semi + 1) {
+        semi = strchr(p, ';');
+        if (semi == NULL) {
+            semi = p + strlen(p) - 1;
+        } else {
+            *semi = '\0';
+        }
+
+        eq = strchr(p, '=');
+        if (eq == NULL) {
+            return NULL;
+        }
+
+        *eq = '\0';
+
+        key.data = (u_char *) p;
+        key.len = eq - p;
+        value.data = (u_char *) eq + 1;
+        value.len = strlen(eq + 1);
+
+        if (queue_conf_set(&qc, &key, &value) == QUEUE_ERROR) {
+            return NULL;
+        }
+    }
+
+    return queue_create(&qc, logger);
+}
+
+/* the payload of message "id" is "len" bytes of "id" and a letter */
+static void payload(uint64_t id, size_t len, char *buf)
+{
+    memset(buf, 'a' + (int) (id % 26), len);
+    memcpy(buf, &id, len < sizeof(id) ? len : sizeof(id));
+}
+
+static int put(queue_t *q, size_t len)
+{
+    char         buf[256];
+    queue_msg_t  msg;
+
+    memset(&msg, 0, sizeof(queue_msg_t));
+
+    payload(q->next_id, len, buf);
+
+    msg.data = (u_char *) buf;
+    msg.len = len;
+    msg.fd = -1;
+
+    return queue_put(q, &msg);
+}
+
+/**
+ * message "id" is read by the index like a consumer group without a hint,
+ * 1 if it's there with its payload of "len" bytes.
+ */
+static int check(queue_t *q, uint64_t id, size_t len)
+{
+    char            buf[256];
+    queue_msg_t     msg;
+    queue_cursor_t  c;
+
+    c.id = id;
+    c.hint_base = 0;
+    c.hint_off = 0;
+
+    if (q->conf.engine->read_handler(q, &c, &msg) != QUEUE_OK
+        || msg.id != id || msg.len != len)
+    {
+        return 0;
+    }
+
+    payload(id, len, buf);
+
+    return memcmp(msg.data, buf, len) == 0;
+}
+
+static off_t file_size(char *name)
+{
+    struct stat st;
+
+    if (stat(name, &st) == -1) {
+        return -1;
+    }
+
+    return st.st_size;
+}
+
+/* flip a byte at "off" of a file */
+static int corrupt(char *name, off_t off)
+{
+    int     fd;
+    u_char  c;
+
+    fd = open(name, O_RDWR);
+    if (fd == -1) {
+        return TEST_ERROR;
+    }
+
+    if (pread(fd, &c, 1, off) != 1) {
+        close(fd);
+        return TEST_ERROR;
+    }
+
+    c ^= 0xff;
+
+    if (pwrite(fd, &c, 1, off) != 1) {
+        close(fd);
+        return TEST_ERROR;
+    }
+
+    close(fd);
+
+    return TEST_OK;
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    if (system("rm -rf " TEST_LOG_DIR) != 0) {
+        return TEST_ERROR;
+    }
+
+    set_string(&queue_data_dir, TEST_LOG_DIR);
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int          i, ret, ok;
+    uint64_t     id;
+    queue_t     *q;
+    queue_msg_t  msg;
+
+    TEST_CASE("crc32c")
+    {
+        ret = crc32c(0, (u_char *) "123456789", 9) == 0xe3069283;
+        ASSERT_EQ(ret, 1);
+
+        /* in pieces, from an odd address */
+        ret = crc32c(crc32c(0, (u_char *) "123", 3), (u_char *) "456789", 6)
+              == 0xe3069283;
+        ASSERT_EQ(ret, 1);
+
+        ret = crc32c(0, (u_char *) "", 0);
+        ASSERT_EQ(ret, 0);
+    }
+
+    TEST_CASE("recover the segments")
+    {
+        q = create_queue("uc_log", "engine=log;segment_bytes=4096");
+        ASSERT_NOT_NULL(q);
+
+        for (i = 0; i < 300; i++) {
+            ret = put(q, 30);
+            ASSERT_EQ(ret, QUEUE_OK);
+        }
+
+        for (i = 0; i < 10; i++) {
+            ret = q->conf.engine->peek_handler(q, &msg);
+            ASSERT_EQ(ret, QUEUE_OK);
+            q->conf.engine->pop_handler(q);
+            q->depth--;
+            q->bytes -= msg.len;
+        }
+
+        /* the engine is synced when it's done */
+        queue_destroy_all();
+
+        q = create_queue("uc_log", "engine=log;segment_bytes=4096");
+        ASSERT_NOT_NULL(q);
+
+        ASSERT_EQ((int) q->next_id, 301);
+        ASSERT_EQ((int) q->depth, 290);
+        ASSERT_EQ((int) q->bytes, 290 * 30);
+
+        ret = q->conf.engine->peek_handler(q, &msg);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) msg.id, 11);
+
+        for (ok = 1, id = 11; id <= 300; id++) {
+            ok &= check(q, id, 30);
+        }
+
+        ASSERT_EQ(ok, 1);
+    }
+
+    TEST_CASE("cut a torn tail")
+    {
+        q = create_queue("uc_torn", "engine=log");
+        ASSERT_NOT_NULL(q);
+
+        /* records of 64 bytes, an index entry for every 64 of them */
+        for (i = 0; i < 200; i++) {
+            ret = put(q, 40);
+            ASSERT_EQ(ret, QUEUE_OK);
+        }
+
+        queue_destroy_all();
+
+        ASSERT_EQ((int) file_size(TEST_LOG_DIR "/uc_torn/"
+                                  "00000000000000000001.idx"), 4 * 16);
+
+        /* the payload of message 100 */
+        ret = corrupt(TEST_LOG_DIR "/uc_torn/00000000000000000001.log",
+                      99 * 64 + 24 + 7);
+        ASSERT_EQ(ret, TEST_OK);
+
+        q = create_queue("uc_torn", "engine=log");
+        ASSERT_NOT_NULL(q);
+
+        ASSERT_EQ((int) q->next_id, 100);
+        ASSERT_EQ((int) q->depth, 99);
+
+        /* the entries of messages 129 and 193 are dropped */
+        ASSERT_EQ((int) file_size(TEST_LOG_DIR "/uc_torn/"
+                                  "00000000000000000001.idx"), 2 * 16);
+
+        ret = check(q, 99, 40);
+        ASSERT_EQ(ret, 1);
+        ret = check(q, 100, 40);
+        ASSERT_EQ(ret, 0);
+
+        /* the records written over the torn ones have other offsets */
+        for (i = 0; i < 150; i++) {
+            ret = put(q, 20);
+            ASSERT_EQ(ret, QUEUE_OK);
+        }
+
+        queue_destroy_all();
+
+        q = create_queue("uc_torn", "engine=log");
+        ASSERT_NOT_NULL(q);
+
+        ASSERT_EQ((int) q->next_id, 250);
+
+        for (ok = 1, id = 1; id < 100; id++) {
+            ok &= check(q, id, 40);
+        }
+
+        for (id = 100; id < 250; id++) {
+            ok &= check(q, id, 20);
+        }
+
+        ASSERT_EQ(ok, 1);
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    queue_destroy_all();
+
+    if (system("rm -rf " TEST_LOG_DIR) != 0) {
+        return TEST_ERROR;
+    }
+
+    return TEST_OK;
+}
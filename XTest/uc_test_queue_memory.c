@@ -0,0 +1,250 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_queue_memory = {
+    "test_queue_memory",
+    prepare,
+    run,
+    finish
+};
+
+static file_t       *file;
+static logger_t     *logger;
+
+/* "settings" is "key=value;..." as the headers of QUEUE */
+static queue_t *create_queue(char *name, char *settings)
+{
+    char          *p, *eq, *semi, buf[256];
+    string_t       key, value;
+    queue_conf_t   qc;
+
+    queue_conf_init(&qc);
+
+    qc.name.data = (u_char *) name;
+    qc.name.len = strlen(name);
+
+    snprintf(buf, sizeof(buf), "%s", settings);
+
+    for (p = buf; *p != '\0'; p = semi + 1) {
+        semi = strchr(p, ';');
+        if (semi == NULL) {
+            semi = p + strlen(p) - 1;
+        } else {
+            *semi = '\0';
+        }
+
+        eq = strchr(p, '=');
+        if (eq == NULL) {
+            return NULL;
+        }
+
+        *eq = '\0';
+
+        key.data = (u_char *) p;
+        key.len = eq - p;
+        value.data = (u_char *) eq + 1;
+        value.len = strlen(eq + 1);
+
+        if (queue_conf_set(&qc, &key, &value) == QUEUE_ERROR) {
+            return NULL;
+        }
+    }
+
+    return queue_create(&qc, logger);
+}
+
+static int put(queue_t *q, char *data, size_t len)
+{
+    queue_msg_t msg;
+
+    memset(&msg, 0, sizeof(queue_msg_t));
+
+    msg.data = (u_char *) data;
+    msg.len = len;
+    msg.fd = -1;
+
+    return queue_put(q, &msg);
+}
+
+/* the oldest message is taken, its payload is copied to "buf" */
+static int get(queue_t *q, uint64_t *id, char *buf)
+{
+    queue_msg_t msg;
+
+    if (q->conf.engine->peek_handler(q, &msg) != QUEUE_OK) {
+        return QUEUE_EMPTY;
+    }
+
+    *id = msg.id;
+    memcpy(buf, msg.data, msg.len);
+    buf[msg.len] = '\0';
+
+    q->conf.engine->pop_handler(q);
+    q->depth--;
+    q->bytes -= msg.len;
+
+    return QUEUE_OK;
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int        i, ret;
+    char       data[64], buf[64];
+    uint64_t   id;
+    queue_t   *q;
+
+    TEST_CASE("reject when the slots are full")
+    {
+        q = create_queue("uc_ring_slots", "slots=4;bytes=4096");
+        ASSERT_NOT_NULL(q);
+
+        for (i = 0; i < 4; i++) {
+            ret = put(q, "abc", 3);
+            ASSERT_EQ(ret, QUEUE_OK);
+        }
+
+        ret = put(q, "abc", 3);
+        ASSERT_EQ(ret, QUEUE_FULL);
+        ASSERT_EQ((int) q->rejected, 1);
+        ASSERT_EQ((int) q->depth, 4);
+
+        /* a slot is free again once the oldest is taken */
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) id, 1);
+
+        ret = put(q, "abc", 3);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) q->next_id, 6);
+    }
+
+    TEST_CASE("reject when the bytes are full")
+    {
+        q = create_queue("uc_ring_bytes", "slots=16;bytes=64");
+        ASSERT_NOT_NULL(q);
+
+        memset(data, 'x', 20);
+
+        for (i = 0; i < 3; i++) {
+            ret = put(q, data, 20);
+            ASSERT_EQ(ret, QUEUE_OK);
+        }
+
+        /* 4 bytes are left at the end and the oldest is at the start */
+        ret = put(q, data, 20);
+        ASSERT_EQ(ret, QUEUE_FULL);
+        ret = put(q, data, 4);
+        ASSERT_EQ(ret, QUEUE_OK);
+
+        /* larger than the arena */
+        ret = put(q, data, 65);
+        ASSERT_EQ(ret, QUEUE_ERROR);
+        ASSERT_EQ((int) q->depth, 4);
+    }
+
+    TEST_CASE("drop_oldest when the slots are full")
+    {
+        q = create_queue("uc_ring_drop", "slots=4;bytes=4096;"
+                         "full=drop_oldest");
+        ASSERT_NOT_NULL(q);
+
+        for (i = 1; i <= 6; i++) {
+            snprintf(data, sizeof(data), "m%d", i);
+            ret = put(q, data, strlen(data));
+            ASSERT_EQ(ret, QUEUE_OK);
+        }
+
+        ASSERT_EQ((int) q->depth, 4);
+        ASSERT_EQ((int) q->dropped, 2);
+        ASSERT_EQ((int) q->rejected, 0);
+
+        for (i = 3; i <= 6; i++) {
+            snprintf(data, sizeof(data), "m%d", i);
+            ret = get(q, &id, buf);
+            ASSERT_EQ(ret, QUEUE_OK);
+            ASSERT_EQ((int) id, i);
+            ASSERT_STR_EQ(buf, data);
+        }
+
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_EMPTY);
+    }
+
+    TEST_CASE("drop_oldest when the bytes wrap around")
+    {
+        q = create_queue("uc_ring_wrap", "slots=16;bytes=64;"
+                         "full=drop_oldest");
+        ASSERT_NOT_NULL(q);
+
+        for (i = 1; i <= 10; i++) {
+            memset(data, 'a' + i, 20);
+            ret = put(q, data, 20);
+            ASSERT_EQ(ret, QUEUE_OK);
+            ASSERT_LE((int) q->bytes, 64);
+        }
+
+        ASSERT_EQ((int) (q->depth + q->dropped), 10);
+
+        /* the newest ones are left in order with their payloads */
+        for (i = 11 - (int) q->depth; i <= 10; i++) {
+            memset(data, 'a' + i, 20);
+            data[20] = '\0';
+
+            ret = get(q, &id, buf);
+            ASSERT_EQ(ret, QUEUE_OK);
+            ASSERT_EQ((int) id, i);
+            ASSERT_STR_EQ(buf, data);
+        }
+
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_EMPTY);
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    queue_destroy_all();
+
+    return TEST_OK;
+}
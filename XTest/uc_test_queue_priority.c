@@ -0,0 +1,263 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_queue_priority = {
+    "test_queue_priority",
+    prepare,
+    run,
+    finish
+};
+
+#define TEST_PRIORITY_DIR  "/tmp/xtest_queue_priority"
+
+static file_t       *file;
+static logger_t     *logger;
+
+/* "settings" is "key=value;..." as the headers of QUEUE */
+static queue_t *create_queue(char *name, char *settings)
+{
+    char          *p, *eq, *semi, buf[256];
+    string_t       key, value;
+    queue_conf_t   qc;
+
+    queue_conf_init(&qc);
+
+    qc.name.data = (u_char *) name;
+    qc.name.len = strlen(name);
+
+    snprintf(buf, sizeof(buf), "%s", settings);
+
+    for (p = buf; *p != '\0'; p = semi + 1) {
+        semi = strchr(p, ';');
+        if (semi == NULL) {
+            semi = p + strlen(p) - 1;
+        } else {
+            *semi = '\0';
+        }
+
+        eq = strchr(p, '=');
+        if (eq == NULL) {
+            return NULL;
+        }
+
+        *eq = '\0';
+
+        key.data = (u_char *) p;
+        key.len = eq - p;
+        value.data = (u_char *) eq + 1;
+        value.len = strlen(eq + 1);
+
+        if (queue_conf_set(&qc, &key, &value) == QUEUE_ERROR) {
+            return NULL;
+        }
+    }
+
+    return queue_create(&qc, logger);
+}
+
+/* the payload is "<priority>.<n>" */
+static int put(queue_t *q, uint_t priority, int n)
+{
+    char         buf[32];
+    queue_msg_t  msg;
+
+    memset(&msg, 0, sizeof(queue_msg_t));
+
+    msg.len = snprintf(buf, sizeof(buf), "%u.%d", priority, n);
+    msg.data = (u_char *) buf;
+    msg.fd = -1;
+    msg.priority = priority;
+
+    return queue_put(q, &msg);
+}
+
+/* the oldest message of the highest priority, its payload is in "buf" */
+static int get(queue_t *q, uint64_t *id, char *buf)
+{
+    queue_msg_t msg;
+
+    if (q->conf.engine->peek_handler(q, &msg) != QUEUE_OK) {
+        return QUEUE_EMPTY;
+    }
+
+    *id = msg.id;
+    memcpy(buf, msg.data, msg.len);
+    buf[msg.len] = '\0';
+
+    q->conf.engine->pop_handler(q);
+    q->depth--;
+    q->bytes -= msg.len;
+
+    return QUEUE_OK;
+}
+
+/* the payloads of the messages taken until it's empty */
+static char *get_all(queue_t *q)
+{
+    size_t         n;
+    uint64_t       id;
+    char           buf[32];
+    static char    all[256];
+
+    all[0] = '\0';
+
+    for (n = 0; get(q, &id, buf) == QUEUE_OK; ) {
+        n += snprintf(all + n, sizeof(all) - n, "%s%s", n ? " " : "", buf);
+    }
+
+    return all;
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    if (system("rm -rf " TEST_PRIORITY_DIR) != 0) {
+        return TEST_ERROR;
+    }
+
+    set_string(&queue_data_dir, TEST_PRIORITY_DIR);
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int         ret, ok;
+    char        buf[32], *all;
+    uint64_t    id;
+    queue_t    *q;
+
+    TEST_CASE("the highest priority first, in order within a level")
+    {
+        q = create_queue("uc_prio", "priority=on");
+        ASSERT_NOT_NULL(q);
+
+        ok = put(q, 0, 1) == QUEUE_OK;
+        ok &= put(q, 3, 2) == QUEUE_OK;
+        ok &= put(q, 7, 3) == QUEUE_OK;
+        ok &= put(q, 3, 4) == QUEUE_OK;
+        ok &= put(q, 0, 5) == QUEUE_OK;
+        ok &= put(q, 7, 6) == QUEUE_OK;
+        ok &= put(q, 5, 7) == QUEUE_OK;
+        ASSERT_EQ(ok, 1);
+        ASSERT_EQ((int) q->depth, 7);
+
+        /* the id is of the level and has the priority in its low bits */
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) id, (1 << 3) | 7);
+        ASSERT_STR_EQ(buf, "7.3");
+
+        all = get_all(q);
+        ASSERT_STR_EQ(all, "7.6 5.7 3.2 3.4 0.1 0.5");
+        ASSERT_EQ((int) q->depth, 0);
+    }
+
+    TEST_CASE("a higher priority put later goes first")
+    {
+        ok = put(q, 1, 1) == QUEUE_OK;
+        ok &= put(q, 1, 2) == QUEUE_OK;
+        ASSERT_EQ(ok, 1);
+
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_STR_EQ(buf, "1.1");
+
+        ok = put(q, 6, 3) == QUEUE_OK;
+        ok &= put(q, 0, 4) == QUEUE_OK;
+        ok &= put(q, 2, 5) == QUEUE_OK;
+        ASSERT_EQ(ok, 1);
+
+        all = get_all(q);
+        ASSERT_STR_EQ(all, "6.3 2.5 1.2 0.4");
+    }
+
+    TEST_CASE("a level drops its own oldest")
+    {
+        q = create_queue("uc_prio_drop", "priority=on;slots=2;"
+                         "full=drop_oldest");
+        ASSERT_NOT_NULL(q);
+
+        ok = put(q, 1, 1) == QUEUE_OK;
+        ok &= put(q, 4, 2) == QUEUE_OK;
+        ok &= put(q, 1, 3) == QUEUE_OK;
+        ok &= put(q, 1, 4) == QUEUE_OK;
+        ASSERT_EQ(ok, 1);
+
+        ASSERT_EQ((int) q->dropped, 1);
+        ASSERT_EQ((int) q->depth, 3);
+        all = get_all(q);
+        ASSERT_STR_EQ(all, "4.2 1.3 1.4");
+    }
+
+    TEST_CASE("the levels of the log engine are recovered")
+    {
+        q = create_queue("uc_prio_log", "priority=on;engine=log");
+        ASSERT_NOT_NULL(q);
+
+        ok = put(q, 2, 1) == QUEUE_OK;
+        ok &= put(q, 6, 2) == QUEUE_OK;
+        ok &= put(q, 2, 3) == QUEUE_OK;
+        ok &= put(q, 4, 4) == QUEUE_OK;
+        ASSERT_EQ(ok, 1);
+
+        ret = get(q, &id, buf);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_STR_EQ(buf, "6.2");
+
+        queue_destroy_all();
+
+        q = create_queue("uc_prio_log", "priority=on;engine=log");
+        ASSERT_NOT_NULL(q);
+
+        ASSERT_EQ((int) q->depth, 3);
+        all = get_all(q);
+        ASSERT_STR_EQ(all, "4.4 2.1 2.3");
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    queue_destroy_all();
+
+    if (system("rm -rf " TEST_PRIORITY_DIR) != 0) {
+        return TEST_ERROR;
+    }
+
+    return TEST_OK;
+}
@@ -0,0 +1,228 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_queue_registry = {
+    "test_queue_registry",
+    prepare,
+    run,
+    finish
+};
+
+#define TEST_QUEUES     1000
+
+static file_t       *file;
+static logger_t     *logger;
+
+/* "settings" is "key=value;..." as the headers of QUEUE */
+static queue_t *create_queue(char *name, char *settings)
+{
+    char          *p, *eq, *semi, buf[256];
+    string_t       key, value;
+    queue_conf_t   qc;
+
+    queue_conf_init(&qc);
+
+    qc.name.data = (u_char *) name;
+    qc.name.len = strlen(name);
+
+    snprintf(buf, sizeof(buf), "%s", settings);
+
+    for (p = buf; *p != '\0'; p = semi + 1) {
+        semi = strchr(p, ';');
+        if (semi == NULL) {
+            semi = p + strlen(p) - 1;
+        } else {
+            *semi = '\0';
+        }
+
+        eq = strchr(p, '=');
+        if (eq == NULL) {
+            return NULL;
+        }
+
+        *eq = '\0';
+
+        key.data = (u_char *) p;
+        key.len = eq - p;
+        value.data = (u_char *) eq + 1;
+        value.len = strlen(eq + 1);
+
+        if (queue_conf_set(&qc, &key, &value) == QUEUE_ERROR) {
+            return NULL;
+        }
+    }
+
+    return queue_create(&qc, logger);
+}
+
+/* names longer than the key of a slot share its first bytes */
+static void queue_name(int i, char *name)
+{
+    if (i % 2) {
+        sprintf(name, "q%d", i);
+    } else {
+        sprintf(name, "uc_registry_long_name_%d", i);
+    }
+}
+
+/* 1 if queue "i" is found under its name */
+static int found(int i)
+{
+    int        ret;
+    char       name[64];
+    queue_t   *q;
+    string_t   s;
+
+    queue_name(i, name);
+
+    s.data = (u_char *) name;
+    s.len = strlen(name);
+
+    q = queue_acquire(&s);
+    if (q == NULL) {
+        return 0;
+    }
+
+    ret = strcmp((char *) q->name, name) == 0;
+
+    queue_release(q);
+
+    return ret;
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int                i, ret, ok;
+    uint_t             n;
+    char               name[64];
+    string_t           s;
+    queue_t           *q;
+    queue_snapshot_t  *snaps;
+
+    TEST_CASE("queue_create grows the registry")
+    {
+        for (ok = 1, i = 0; i < TEST_QUEUES; i++) {
+            queue_name(i, name);
+            ok &= create_queue(name, "slots=1;bytes=16") != NULL;
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        for (ok = 1, i = 0; i < TEST_QUEUES; i++) {
+            ok &= found(i);
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        /* a name which differs after the key of the slot */
+        s.data = (u_char *) "uc_registry_long_name_x";
+        s.len = strlen((char *) s.data);
+
+        q = queue_acquire(&s);
+        ASSERT_EQ(q, NULL);
+
+        q = create_queue("q1", "slots=1;bytes=16");
+        ASSERT_EQ(q, NULL);
+
+        snaps = queue_snapshot(&n);
+        ASSERT_NOT_NULL(snaps);
+        ASSERT_EQ((int) n, TEST_QUEUES);
+        free(snaps);
+    }
+
+    TEST_CASE("queue_delete shifts the queues after it back")
+    {
+        for (ok = 1, i = 0; i < TEST_QUEUES; i += 3) {
+            queue_name(i, name);
+
+            s.data = (u_char *) name;
+            s.len = strlen(name);
+
+            ok &= queue_delete(&s, logger) == QUEUE_OK;
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        /* every queue left is found, no slot is left empty on its probe */
+        for (ok = 1, i = 0; i < TEST_QUEUES; i++) {
+            ok &= found(i) == (i % 3 != 0);
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        snaps = queue_snapshot(&n);
+        ASSERT_NOT_NULL(snaps);
+        ASSERT_EQ((int) n, TEST_QUEUES - (TEST_QUEUES + 2) / 3);
+        free(snaps);
+
+        s.data = (u_char *) "q0";
+        s.len = 2;
+
+        ret = queue_delete(&s, logger);
+        ASSERT_EQ(ret, QUEUE_ERROR);
+    }
+
+    TEST_CASE("queue_create takes a deleted name again")
+    {
+        for (ok = 1, i = 0; i < TEST_QUEUES; i += 3) {
+            queue_name(i, name);
+            ok &= create_queue(name, "slots=1;bytes=16") != NULL;
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        for (ok = 1, i = 0; i < TEST_QUEUES; i++) {
+            ok &= found(i);
+        }
+
+        ASSERT_EQ(ok, 1);
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    queue_destroy_all();
+
+    return TEST_OK;
+}
@@ -0,0 +1,205 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_queue_ttl = {
+    "test_queue_ttl",
+    prepare,
+    run,
+    finish
+};
+
+static file_t       *file;
+static logger_t     *logger;
+
+/* "settings" is "key=value;..." as the headers of QUEUE */
+static queue_t *create_queue(char *name, char *settings)
+{
+    char          *p, *eq, *semi, buf[256];
+    string_t       key, value;
+    queue_conf_t   qc;
+
+    queue_conf_init(&qc);
+
+    qc.name.data = (u_char *) name;
+    qc.name.len = strlen(name);
+
+    snprintf(buf, sizeof(buf), "%s", settings);
+
+    for (p = buf; *p != '\0'; p = semi + 1) {
+        semi = strchr(p, ';');
+        if (semi == NULL) {
+            semi = p + strlen(p) - 1;
+        } else {
+            *semi = '\0';
+        }
+
+        eq = strchr(p, '=');
+        if (eq == NULL) {
+            return NULL;
+        }
+
+        *eq = '\0';
+
+        key.data = (u_char *) p;
+        key.len = eq - p;
+        value.data = (u_char *) eq + 1;
+        value.len = strlen(eq + 1);
+
+        if (queue_conf_set(&qc, &key, &value) == QUEUE_ERROR) {
+            return NULL;
+        }
+    }
+
+    return queue_create(&qc, logger);
+}
+
+/* "ttl" msecs from now, 0 is expired already */
+static int put(queue_t *q, uint64_t ttl)
+{
+    queue_msg_t msg;
+
+    memset(&msg, 0, sizeof(queue_msg_t));
+
+    msg.data = (u_char *) "x";
+    msg.len = 1;
+    msg.fd = -1;
+    msg.expire = ttl ? time_current_epoch_msecs + ttl
+                     : time_current_epoch_msecs - 1;
+
+    return queue_put(q, &msg);
+}
+
+static int prepare(void)
+{
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int          i, ret, ok;
+    queue_t     *q;
+    queue_msg_t  msg;
+
+    TEST_CASE("queue_sweep stops at a message which is not expired")
+    {
+        q = create_queue("uc_ttl", "slots=8192;bytes=65536");
+        ASSERT_NOT_NULL(q);
+
+        for (ok = 1, i = 0; i < 5; i++) {
+            ok &= put(q, 0) == QUEUE_OK;
+        }
+
+        ok &= put(q, 60000) == QUEUE_OK;
+
+        for (i = 0; i < 3; i++) {
+            ok &= put(q, 0) == QUEUE_OK;
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        queue_sweep(q);
+
+        ASSERT_EQ((int) q->expired, 5);
+        ASSERT_EQ((int) q->depth, 4);
+
+        ret = q->conf.engine->peek_handler(q, &msg);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) msg.id, 6);
+
+        q->conf.engine->pop_handler(q);
+        q->depth--;
+        q->bytes -= msg.len;
+
+        queue_sweep(q);
+
+        ASSERT_EQ((int) q->expired, 8);
+        ASSERT_EQ((int) q->depth, 0);
+    }
+
+    TEST_CASE("queue_sweep removes QUEUE_SWEEP_MAX at most a call")
+    {
+        for (ok = 1, i = 0; i < QUEUE_SWEEP_MAX + 100; i++) {
+            ok &= put(q, 0) == QUEUE_OK;
+        }
+
+        ASSERT_EQ(ok, 1);
+
+        queue_sweep(q);
+
+        ASSERT_EQ((int) q->expired, 8 + QUEUE_SWEEP_MAX);
+        ASSERT_EQ((int) q->depth, 100);
+
+        queue_sweep(q);
+
+        ASSERT_EQ((int) q->expired, 8 + QUEUE_SWEEP_MAX + 100);
+        ASSERT_EQ((int) q->depth, 0);
+    }
+
+    TEST_CASE("a lease skips QUEUE_SWEEP_BATCH expired at most")
+    {
+        q = create_queue("uc_ttl_lease", "slots=4096;bytes=65536;"
+                         "visibility_ms=1000");
+        ASSERT_NOT_NULL(q);
+
+        for (ok = 1, i = 0; i < QUEUE_SWEEP_BATCH + 10; i++) {
+            ok &= put(q, 0) == QUEUE_OK;
+        }
+
+        ok &= put(q, 60000) == QUEUE_OK;
+
+        ASSERT_EQ(ok, 1);
+
+        /* the queue lock is not held for all of them */
+        ret = queue_lease_next(q, &msg, 1000);
+        ASSERT_EQ(ret, QUEUE_EMPTY);
+        ASSERT_EQ((int) q->leases->cursor.id, QUEUE_SWEEP_BATCH + 1);
+
+        ret = queue_lease_next(q, &msg, 1000);
+        ASSERT_EQ(ret, QUEUE_OK);
+        ASSERT_EQ((int) msg.id, QUEUE_SWEEP_BATCH + 11);
+        ASSERT_EQ((int) q->inflight, 1);
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    queue_destroy_all();
+
+    return TEST_OK;
+}
@@ -0,0 +1,222 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_reload = {
+    "test_reload",
+    prepare,
+    run,
+    finish
+};
+
+#define TEST_RELOAD_DIR     "/tmp/xtest_reload"
+
+static char          cwd[1024];
+static file_t       *file;
+static logger_t     *logger;
+static conf_file_t   conf;
+
+static xpipe_resource_t  resource;
+
+static int write_conf(const char *text)
+{
+    FILE *fp;
+
+    fp = fopen(xpipe_conf_file_path, "w");
+    if (fp == NULL) {
+        perror("open config");
+        return TEST_ERROR;
+    }
+
+    fputs(text, fp);
+    fclose(fp);
+
+    return TEST_OK;
+}
+
+static int prepare(void)
+{
+    int              i;
+    system_module_t *mod;
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd");
+        return TEST_ERROR;
+    }
+
+    /* the config is "conf/xpipe.conf" of the working directory */
+    mkdir(TEST_RELOAD_DIR, 0755);
+    mkdir(TEST_RELOAD_DIR "/conf", 0755);
+
+    if (chdir(TEST_RELOAD_DIR) == -1) {
+        perror("chdir");
+        return TEST_ERROR;
+    }
+
+    file = malloc(sizeof(file_t));
+    if (file == NULL) {
+        fprintf(stderr, "malloc \"file_t\"\n");
+        return TEST_ERROR;
+    }
+
+    set_string(&file->name, "/tmp/test.log");
+    file->offset = FL_BEGIN_OFFSET;
+
+    file->fd = open_file_fd(file->name.data, FL_APPEND|FL_CREATE, 0644);
+    if (file->fd == FL_INVALID_FD) {
+        perror("open file");
+        return TEST_ERROR;
+    }
+
+    logger = malloc(sizeof(logger_t));
+    if (logger == NULL) {
+        fprintf(stderr, "malloc \"logger_t\"\n");
+        return TEST_ERROR;
+    }
+
+    logger->file = file;
+    logger->level = LOG_LEVEL_DEBUG;
+
+    timer_init();
+
+    for (i = 0; ; i++) {
+        mod = *(sys_modules + i);
+        if (mod == NULL) {
+            break;
+        }
+
+        mod->index = i;
+    }
+
+    resource.sys_mod_num = i;
+    resource.log_stdout = logger;
+    resource.default_logger = logger;
+
+    if (write_conf("net {\n"
+                   "    listen 18090;\n"
+                   "    connections 64;\n"
+                   "}\n") == TEST_ERROR)
+    {
+        return TEST_ERROR;
+    }
+
+    if (conf_file_parser(&resource, &conf, logger) == CONF_ERROR
+        || sys_modules_prepare(&resource) == MOD_ERROR
+        || sys_net_module.init_mod(&sys_net_module) == MOD_ERROR)
+    {
+        fprintf(stderr, "init the \"net\" module failed.\n");
+        return TEST_ERROR;
+    }
+
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int                   ret;
+    tcp_server_t         *server;
+    xpipe_net_mod_conf_t *cf;
+
+    cf = (xpipe_net_mod_conf_t *) sys_net_module.mod_conf;
+    server = cf->netwk->server;
+
+    TEST_CASE("reload net")
+    {
+        ASSERT_EQ(server->conn_limit, 64);
+        ASSERT_EQ(server->nodelay, 0);
+
+        write_conf("net {\n"
+                   "    listen 18091;\n"
+                   "    connections 32;\n"
+                   "    nodelay;\n"
+                   "    shutdown_timeout 500;\n"
+                   "}\n");
+
+        ret = sys_modules_reload(&resource);
+        ASSERT_EQ(ret, MOD_OK);
+
+        ASSERT_EQ(server->conn_limit, 32);
+        ASSERT_EQ(server->nodelay, 1);
+        ASSERT_EQ(cf->shutdown_timeout, 500);
+
+        /* the listening socket can't be changed */
+        ASSERT_EQ(server->port, 18090);
+        ASSERT_EQ(cf->port, 18090);
+    }
+
+    TEST_CASE("reload beyond connections")
+    {
+        write_conf("net {\n"
+                   "    listen 18090;\n"
+                   "    connections 128;\n"
+                   "}\n");
+
+        ret = sys_modules_reload(&resource);
+        ASSERT_EQ(ret, MOD_OK);
+
+        /* the connection pool is allocated at startup */
+        ASSERT_EQ(server->conn_limit, 64);
+        ASSERT_EQ(server->nodelay, 0);
+    }
+
+    TEST_CASE("reload invalid config")
+    {
+        write_conf("net {\n"
+                   "    connections 16;\n"
+                   "    nodelay\n");
+
+        ret = sys_modules_reload(&resource);
+        ASSERT_EQ(ret, MOD_ERROR);
+
+        ASSERT_EQ(server->conn_limit, 64);
+    }
+
+    TEST_CASE("reload net in its own thread")
+    {
+        sys_net_module.thread = 1;
+
+        /* ASSERT_EQ evaluates its arguments twice */
+        ret = sys_modules_start_threads(&resource);
+        ASSERT_EQ(ret, MOD_OK);
+
+        write_conf("net {\n"
+                   "    listen 18090;\n"
+                   "    connections 16;\n"
+                   "    nodelay;\n"
+                   "}\n");
+
+        /* it's answered by the thread of "net" through the channels */
+        ret = sys_modules_reload(&resource);
+        ASSERT_EQ(ret, MOD_OK);
+
+        sys_modules_stop_threads(&resource);
+
+        ASSERT_EQ(server->conn_limit, 16);
+        ASSERT_EQ(server->nodelay, 1);
+    }
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    sys_net_module.finish_mod(&sys_net_module);
+
+    unlink(TEST_RELOAD_DIR "/conf/xpipe.conf");
+    rmdir(TEST_RELOAD_DIR "/conf");
+    rmdir(TEST_RELOAD_DIR);
+
+    if (chdir(cwd) == -1) {
+        perror("chdir");
+        return TEST_ERROR;
+    }
+
+    return TEST_OK;
+}
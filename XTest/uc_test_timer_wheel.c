@@ -0,0 +1,162 @@
+#include "core/xtest.h"
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+
+static int prepare(void);
+static int run(void);
+static int finish(void);
+
+
+unit_cases_t test_timer_wheel = {
+    "test_timer_wheel",
+    prepare,
+    run,
+    finish
+};
+
+typedef struct {
+    timer_node_t   node;
+    uint64_t       due;         /* msecs from the start */
+    uint64_t       fired;       /* msecs it's fired at, 0 never */
+    uint_t         times;
+} test_timer_t;
+
+#define TEST_TIMERS     (int) (sizeof(dues) / sizeof(dues[0]))
+
+/**
+ * Around the boundaries of the levels: 2^8 ticks of level 0, then 2^6
+ * slots of each level above, a timer of 2^20 ticks starts on the last one.
+ */
+static uint64_t dues[] = {
+    1, 2, 255, 256, 257, 1000, 16383, 16384, 16385, 65536, 100000,
+    262143, 262144, 1048575, 1048576, 1048577
+};
+
+static test_timer_t   timers[16];
+static uint64_t       now;
+
+static void fire(timer_node_t *node, void *data)
+{
+    test_timer_t *t;
+
+    t = (test_timer_t *) node;
+
+    t->fired = now;
+    t->times++;
+    (*(uint_t *) data)++;
+}
+
+static int prepare(void)
+{
+    return TEST_OK;
+}
+
+static int run(void)
+{
+    int             i;
+    uint_t          n, ok;
+    timer_wheel_t  *tw;
+
+    tw = malloc(sizeof(timer_wheel_t));
+    ASSERT_NOT_NULL(tw);
+
+    TEST_CASE("timer_wheel_add")
+    {
+        /* the msecs of the wheel may wrap */
+        timer_wheel_init(tw, (uint_t) -5000, 1);
+
+        memset(timers, 0, sizeof(timers));
+
+        for (i = 0; i < TEST_TIMERS; i++) {
+            timers[i].due = dues[i];
+            timer_wheel_add(tw, &timers[i].node, dues[i]);
+        }
+
+        ASSERT_EQ((int) tw->count, TEST_TIMERS);
+    }
+
+    TEST_CASE("timer_wheel_del")
+    {
+        timer_wheel_del(tw, &timers[5].node);
+        timer_wheel_del(tw, &timers[5].node);
+
+        ASSERT_EQ((int) tw->count, TEST_TIMERS - 1);
+        ASSERT_EQ(timers[5].node.next, NULL);
+    }
+
+    TEST_CASE("timer_wheel_advance cascades to the tick")
+    {
+        n = 0;
+
+        for (now = 1; now <= 1048600; now++) {
+            timer_wheel_advance(tw, (uint_t) (now - 5000), fire, &n);
+        }
+
+        ASSERT_EQ((int) n, TEST_TIMERS - 1);
+        ASSERT_EQ((int) tw->count, 0);
+
+        for (ok = 1, i = 0; i < TEST_TIMERS; i++) {
+            if (i == 5) {
+                ok &= timers[i].times == 0;
+                continue;
+            }
+
+            ok &= timers[i].times == 1 && timers[i].fired == timers[i].due;
+        }
+
+        ASSERT_EQ(ok, 1);
+    }
+
+    TEST_CASE("timer_wheel_advance by a jump")
+    {
+        timer_wheel_init(tw, 0, 10);
+
+        memset(timers, 0, sizeof(timers));
+
+        for (i = 0; i < TEST_TIMERS; i++) {
+            timers[i].due = dues[i] * 10;
+            timer_wheel_add(tw, &timers[i].node, dues[i] * 10);
+        }
+
+        n = 0;
+
+        /* a tick is due once all of its msecs are passed */
+        now = 2559;
+        timer_wheel_advance(tw, (uint_t) now, fire, &n);
+        ASSERT_EQ((int) n, 3);
+
+        now = 2560;
+        timer_wheel_advance(tw, (uint_t) now, fire, &n);
+        ASSERT_EQ((int) n, 4);
+
+        now = 10485760;
+        timer_wheel_advance(tw, (uint_t) now, fire, &n);
+        ASSERT_EQ((int) n, TEST_TIMERS - 1);
+
+        now = 10485770;
+        timer_wheel_advance(tw, (uint_t) now, fire, &n);
+        ASSERT_EQ((int) n, TEST_TIMERS);
+        ASSERT_EQ((int) tw->count, 0);
+    }
+
+    TEST_CASE("timer_wheel_add beyond the last level")
+    {
+        timer_wheel_init(tw, 0, 1);
+
+        memset(timers, 0, sizeof(timers));
+        timer_wheel_add(tw, &timers[0].node, TIMER_WHEEL_MAX * 2);
+
+        ASSERT_EQ(timers[0].node.expire == TIMER_WHEEL_MAX, 1);
+    }
+
+    free(tw);
+
+    return TEST_OK;
+}
+
+static int finish(void)
+{
+    return TEST_OK;
+}
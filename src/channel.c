@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+
+channel_t *channel_create(mem_pool_t *pool, uint_t size, logger_t *logger)
+{
+    channel_t *ch;
+
+    ch = pmalloc(pool, sizeof(channel_t));
+    if (ch == NULL) {
+        log_error(logger, 0, "pmalloc channel failed.");
+        return NULL;
+    }
+
+    ch->msgs = pmalloc(pool, sizeof(channel_msg_t) * size);
+    if (ch->msgs == NULL) {
+        log_error(logger, 0, "pmalloc channel's messages failed.");
+        return NULL;
+    }
+
+    ch->fd = eventfd(0, EFD_NONBLOCK);
+    if (ch->fd == -1) {
+        log_error(logger, errno, "create channel's eventfd failed.");
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&ch->lock, NULL) != 0) {
+        log_error(logger, 0, "init channel's lock failed.");
+        close(ch->fd);
+        return NULL;
+    }
+
+    ch->size = size;
+    ch->head = 0;
+    ch->tail = 0;
+    ch->logger = logger;
+
+    return ch;
+}
+
+void channel_destroy(channel_t *ch)
+{
+    close(ch->fd);
+    pthread_mutex_destroy(&ch->lock);
+}
+
+int channel_send(channel_t *ch, channel_msg_t *msg)
+{
+    pthread_mutex_lock(&ch->lock);
+
+    if (ch->tail - ch->head == ch->size) {
+        pthread_mutex_unlock(&ch->lock);
+        return CHANNEL_FULL;
+    }
+
+    ch->msgs[ch->tail++ & (ch->size - 1)] = *msg;
+
+    channel_notify(ch);
+
+    pthread_mutex_unlock(&ch->lock);
+
+    return CHANNEL_OK;
+}
+
+int channel_recv(channel_t *ch, channel_msg_t *msg)
+{
+    uint64_t n;
+
+    pthread_mutex_lock(&ch->lock);
+
+    if (ch->head == ch->tail) {
+        /* drained, the fd must not be readable any more */
+        (void) read(ch->fd, &n, sizeof(uint64_t));
+        pthread_mutex_unlock(&ch->lock);
+        return CHANNEL_EMPTY;
+    }
+
+    *msg = ch->msgs[ch->head++ & (ch->size - 1)];
+
+    pthread_mutex_unlock(&ch->lock);
+
+    return CHANNEL_OK;
+}
+
+/**
+ * wake up the thread which polls the channel, even if it is empty.
+ */
+void channel_notify(channel_t *ch)
+{
+    uint64_t n = 1;
+
+    if (write(ch->fd, &n, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+        log_error(ch->logger, errno, "notify channel failed.");
+    }
+}
@@ -0,0 +1,46 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __CHANNEL_H__
+#define __CHANNEL_H__
+
+#include "config.h"
+#include "system.h"
+
+#define CHANNEL_OK      0
+#define CHANNEL_ERROR  -1
+#define CHANNEL_EMPTY  -2
+#define CHANNEL_FULL   -3
+
+#define CHANNEL_SIZE    1024     /* must be a power of 2 */
+
+typedef struct {
+    int                  type;
+    void                *data;
+    system_module_t     *from;
+} channel_msg_t;
+
+/**
+ * A bounded multi-producer queue of messages. "fd" is an eventfd which is
+ * readable while the channel is not empty, so the module scheduler can
+ * poll it together with the module's own fd.
+ */
+typedef struct {
+    int                  fd;
+    uint_t               size;
+    uint_t               head;
+    uint_t               tail;
+    channel_msg_t       *msgs;
+    pthread_mutex_t      lock;
+    logger_t            *logger;
+} channel_t;
+
+
+channel_t *channel_create(mem_pool_t *pool, uint_t size, logger_t *logger);
+void channel_destroy(channel_t *ch);
+int channel_send(channel_t *ch, channel_msg_t *msg);
+int channel_recv(channel_t *ch, channel_msg_t *msg);
+void channel_notify(channel_t *ch);
+
+#endif /* __CHANNEL_H__ */
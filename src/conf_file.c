@@ -88,6 +88,8 @@ static int conf_file_init(xpipe_resource_t *res, conf_file_t *conf,
         return CONF_ERROR;
     }
 
+    conf->pool = conf_pool;
+
     conf_file = file_open(conf_pool, xpipe_conf_file_path);
     if (conf_file == NULL) {
         log_stderr(errno, "open configure file \"%s\" error.", 
@@ -97,7 +99,6 @@ static int conf_file_init(xpipe_resource_t *res, conf_file_t *conf,
 
     conf->file = conf_file;
     conf->blocks = 0;
-    conf->pool = conf_pool;
 
     if (dynamic_array_init(conf_pool, &conf->mod_cmds, 10,
                            sizeof(conf_command_t *)) == NULL)
@@ -113,6 +114,15 @@ static int conf_file_init(xpipe_resource_t *res, conf_file_t *conf,
         return CONF_ERROR;
     }
 
+    if (dynamic_array_init(conf_pool, &conf->mod_shadows, sys_mod_num, 
+                           sizeof(system_module_t *)) == NULL) 
+    {
+        log_stderr(0, "init the array of module shadows failed.");
+        return CONF_ERROR;
+    }
+
+    memset(conf->mod_shadows.elts, 0, sizeof(system_module_t *) * sys_mod_num);
+
     /* build index of module's commands */
     for (i = 0; ; i++) {
         cmd = sys_main_module.commands + i;
@@ -131,7 +141,9 @@ static int conf_file_init(xpipe_resource_t *res, conf_file_t *conf,
         }
     }
 
-    res->conf_pool = conf_pool;
+    if (!conf->reload) {
+        res->conf_pool = conf_pool;
+    }
 
     return CONF_OK;
 }
@@ -147,7 +159,7 @@ int conf_file_parser(xpipe_resource_t *resource, conf_file_t *conf,
     string_t         *arg, *cmd_name;
     conf_command_t   *cmd;
     dynamic_array_t  *cmd_args;
-    system_module_t  *mod;
+    system_module_t  *mod, *shadow;
 
     enum {
         sw_out = 0,
@@ -182,6 +194,7 @@ READ_CONF_FILE:
     
     if (n == 0) {
         if (state == sw_out || state == sw_mod_block_end) {
+            file_close(conf->file->fd);
             return CONF_OK;
         } 
 
@@ -242,6 +255,22 @@ READ_CONF_FILE:
                 return CONF_ERROR;
             }
 
+            if (conf->reload) {
+                shadow = pmalloc(conf->pool, sizeof(system_module_t));
+                if (shadow == NULL) {
+                    log_stderr(0, "pmalloc failed, (%s,%d)", 
+                               __FILE__, __LINE__);
+                    return CONF_ERROR;
+                }
+
+                *shadow = *mod;
+                shadow->logger = NULL;
+                conf_file_shadow(conf, mod->index) = shadow;
+
+                /* the commands of this block set the shadow */
+                mod = shadow;
+            }
+
             if ((mod->mod_conf = mod->create_conf(conf->pool)) == NULL) {
                 log_stderr(0, "\"%s\" module create conf failed.(%d line).", 
                            key, line);
@@ -23,14 +23,24 @@ typedef struct {
 
 #define conf_command_null  {0, {0, NULL}, NULL}
 
+/**
+ * When "reload" is set the parsed configs are not installed into the
+ * modules, they are set to copies of the modules in "mod_shadows" and each
+ * module's "reload_mod" picks the settings which are safe to change.
+ */
 struct conf_file_s {
     file_t          *file;
     uint_t           blocks;
+    int              reload;
     dynamic_array_t  mod_cmds;   /* element is 'conf_command_t *' */
     dynamic_array_t  mod_cfs;       /* element is 'void *' */
+    dynamic_array_t  mod_shadows;   /* element is 'system_module_t *' */
     mem_pool_t      *pool;
 };
 
+#define conf_file_shadow(conf, i)  \
+    (((system_module_t **) (conf)->mod_shadows.elts)[i])
+
 
 int conf_file_parser(xpipe_resource_t *resource, conf_file_t *conf,
         logger_t *logger);
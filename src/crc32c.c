@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+#define CRC32C_POLY  0x82f63b78     /* reflected 0x1edc6f41 */
+
+static uint32_t        crc32c_table[8][256];
+static pthread_once_t  crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * "table[k][n]" is the CRC of byte "n" followed by "k" zero bytes, so 8
+ * bytes are folded in a round.
+ */
+static void crc32c_init(void)
+{
+    int       i, k;
+    uint32_t  crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+
+        crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][i] = crc;
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const u_char *p, size_t len)
+{
+    uint32_t  lo, hi;
+
+    pthread_once(&crc32c_once, crc32c_init);
+
+    crc = ~crc;
+
+    for ( /* void */ ; len > 0 && ((uintptr_t) p & 7) != 0; len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    /* little endian */
+    for ( /* void */ ; len >= 8; len -= 8, p += 8) {
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+
+        lo ^= crc;
+
+        crc = crc32c_table[7][lo & 0xff]
+              ^ crc32c_table[6][(lo >> 8) & 0xff]
+              ^ crc32c_table[5][(lo >> 16) & 0xff]
+              ^ crc32c_table[4][lo >> 24]
+              ^ crc32c_table[3][hi & 0xff]
+              ^ crc32c_table[2][(hi >> 8) & 0xff]
+              ^ crc32c_table[1][(hi >> 16) & 0xff]
+              ^ crc32c_table[0][hi >> 24];
+    }
+
+    for ( /* void */ ; len > 0; len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
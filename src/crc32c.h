@@ -0,0 +1,18 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * CRC-32C (Castagnoli), the checksum of iSCSI and ext4, of "len" bytes at
+ * "p". "crc" is 0 for the first block, or the result of the block before
+ * to go on with a checksum in pieces.
+ */
+uint32_t crc32c(uint32_t crc, const u_char *p, size_t len);
+
+#endif /* __CRC32C_H__ */
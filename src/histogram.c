@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+
+static inline uint_t histogram_index(uint64_t value)
+{
+    uint_t msb, e;
+
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return (uint_t) value;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    e = msb - (HISTOGRAM_SUB_BITS - 1);
+
+    return e * HISTOGRAM_HALF + (uint_t) (value >> e);
+}
+
+/**
+ * the highest value counted by the bucket.
+ */
+uint64_t histogram_bucket_value(uint_t index)
+{
+    uint_t e;
+
+    if (index < (1 << HISTOGRAM_SUB_BITS)) {
+        return index;
+    }
+
+    e = index / HISTOGRAM_HALF - 1;
+
+    return (((uint64_t) (index - e * HISTOGRAM_HALF) + 1) << e) - 1;
+}
+
+void histogram_record(histogram_t *h, uint64_t value)
+{
+    if (value > HISTOGRAM_MAX_VALUE) {
+        value = HISTOGRAM_MAX_VALUE;
+    }
+
+    h->counts[histogram_index(value)]++;
+    h->total++;
+    h->sum += value;
+
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void histogram_merge(histogram_t *dst, histogram_t *src)
+{
+    uint_t i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+
+    dst->total += src->total;
+    dst->sum += src->sum;
+
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/**
+ * percentile is in (0, 100], e.g. 99.9
+ */
+uint64_t histogram_percentile(histogram_t *h, double percentile)
+{
+    uint_t   i;
+    uint64_t rank, n, total;
+
+    total = 0;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += h->counts[i];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t) (percentile / 100.0 * total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0, n = 0; i < HISTOGRAM_BUCKETS; i++) {
+        n += h->counts[i];
+
+        if (n >= rank) {
+            break;
+        }
+    }
+
+    n = histogram_bucket_value(i);
+
+    return n < h->max ? n : h->max;
+}
@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * Log-linear buckets: values below 2^HISTOGRAM_SUB_BITS have a bucket each,
+ * above that every power of 2 is split into 2^(HISTOGRAM_SUB_BITS - 1)
+ * linear buckets, so the error of a recorded value is less than 1/16.
+ * Values beyond HISTOGRAM_MAX_VALUE are counted as it.
+ */
+#define HISTOGRAM_SUB_BITS   5
+#define HISTOGRAM_HALF       (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_MAX_BITS   48
+#define HISTOGRAM_MAX_VALUE  ((1ULL << HISTOGRAM_MAX_BITS) - 1)
+#define HISTOGRAM_BUCKETS    \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_HALF)
+
+/**
+ * There is no lock, a histogram has a single writer. Readers merge the
+ * histograms of all writers, a count may be one record behind.
+ */
+typedef struct {
+    uint64_t    total;
+    uint64_t    sum;
+    uint64_t    max;
+    uint64_t    counts[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+
+void histogram_record(histogram_t *h, uint64_t value);
+void histogram_merge(histogram_t *dst, histogram_t *src);
+uint64_t histogram_percentile(histogram_t *h, double percentile);
+uint64_t histogram_bucket_value(uint_t index);
+
+#define histogram_mean(h)  ((h)->total ? (h)->sum / (h)->total : 0)
+
+#endif /* __HISTOGRAM_H__ */
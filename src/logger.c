@@ -26,7 +26,7 @@ static void log_core_writer(file_t *f, int err, int level, const char *fmt,
 
     p = info_str;
 
-    p = x_memcpy_n(p, cache_log_time.data, cache_log_time.len);
+    p = x_memcpy_n(p, timer_log_time(), TIMER_LOG_TIME_LEN);
     
     p = x_memcpy_n(p, level_str[level].data, level_str[level].len);  
     
@@ -36,7 +36,7 @@ static void log_core_writer(file_t *f, int err, int level, const char *fmt,
         p = x_memcpy_n(p, " - ", 3);
     }
 
-    max_len = LOG_CONTENT_MAX_LEN - level_str[level].len - 1; /* -1 for '\n'*/
+    max_len = LOG_CONTENT_MAX_LEN - (p - info_str) - 1; /* -1 for '\n'*/
 
     n = vsnprintf((char *) p, max_len, fmt, args);
     p += (n < max_len ? n : max_len - 1);
@@ -5,6 +5,56 @@
 #include "config.h"
 #include "system.h"
 
+#ifdef POOL_STATS
+
+static mem_pool_t      *mem_pool_registry;
+static pthread_mutex_t  mem_pool_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void mem_pool_register(mem_pool_t *pool)
+{
+    pool->stats.prev = NULL;
+
+    pthread_mutex_lock(&mem_pool_registry_lock);
+
+    pool->stats.next = mem_pool_registry;
+    if (mem_pool_registry != NULL) {
+        mem_pool_registry->stats.prev = pool;
+    }
+    mem_pool_registry = pool;
+
+    pthread_mutex_unlock(&mem_pool_registry_lock);
+}
+
+static void mem_pool_unregister(mem_pool_t *pool)
+{
+    pthread_mutex_lock(&mem_pool_registry_lock);
+
+    if (pool->stats.prev != NULL) {
+        pool->stats.prev->stats.next = pool->stats.next;
+    } else {
+        mem_pool_registry = pool->stats.next;
+    }
+
+    if (pool->stats.next != NULL) {
+        pool->stats.next->stats.prev = pool->stats.prev;
+    }
+
+    pthread_mutex_unlock(&mem_pool_registry_lock);
+}
+
+static void mem_pool_high_water(mem_pool_t *pool)
+{
+    size_t footprint;
+
+    footprint = pool->total + pool->stats.large_bytes;
+
+    if (footprint > pool->stats.high_water) {
+        pool->stats.high_water = footprint;
+    }
+}
+
+#endif
+
 
 static void *alloc_large_mem(mem_pool_t *pool, size_t size)
 {
@@ -18,9 +68,19 @@ static void *alloc_large_mem(mem_pool_t *pool, size_t size)
         return NULL;
     }
 
+    stats_add(STAT_POOL_BYTES, size);
+
+    mem_pool_stat_add(pool, large, 1);
+    mem_pool_stat_add(pool, large_bytes, size);
+
+#ifdef POOL_STATS
+    mem_pool_high_water(pool);
+#endif
+
     for (n = 0, large = pool->large; large ; large = large->next) {
         if (large->data == NULL) {
             large->data = p;
+            large->size = size;
             return p;
         }
 
@@ -32,11 +92,14 @@ static void *alloc_large_mem(mem_pool_t *pool, size_t size)
     large = (mem_pool_large_t *) pmalloc(pool, sizeof(mem_pool_large_t));
     if (large == NULL) {
         log_error(pool->logger, 0, "\"alloc_large_mem - header\" failed.");
+        stats_sub(STAT_POOL_BYTES, size);
+        mem_pool_stat_add(pool, large_bytes, -size);
         free(p);
         return NULL;
     }
 
     large->data = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -62,10 +125,20 @@ static void *add_mem_chunk(mem_pool_t *pool, size_t size)
     new_chunk->next = NULL;
 
     pool->total += alloc_size;
+    stats_add(STAT_POOL_BYTES, alloc_size);
+
+    mem_pool_stat_add(pool, chunks, 1);
+
+#ifdef POOL_STATS
+    mem_pool_high_water(pool);
+#endif
 
     for (p = pool->current; p->next ; p = p->next) {
         if (p->fail++ > 4) {
             pool->current = p->next;
+
+            /* "p" is not looked at again until the pool is cleared */
+            mem_pool_stat_add(pool, wasted, p->end - p->last);
         }
     }
 
@@ -98,22 +171,51 @@ mem_pool_t *mem_pool_create(u_char *name, size_t size, logger_t *logger)
     pool->max = size < MAX_SIZE_OF_CHUNK ? size : MAX_SIZE_OF_CHUNK;
     pool->current = &pool->chunk;
     pool->large = NULL;
+    pool->cleanup = NULL;
     pool->logger = logger;
 
+    stats_add(STAT_POOL_BYTES, size);
+
+#ifdef POOL_STATS
+    memset(&pool->stats, 0, sizeof(mem_pool_stats_t));
+    pool->stats.chunks = 1;
+    pool->stats.high_water = size;
+
+    mem_pool_register(pool);
+#endif
+
     return pool;
 }
 
 void mem_pool_destroy(mem_pool_t *pool)
 {
-    mem_pool_chunk_t *p;
-    mem_pool_large_t *l;
+    mem_pool_chunk_t   *p;
+    mem_pool_large_t   *l;
+    mem_pool_cleanup_t *c;
+
+    for (c = pool->cleanup; c; c = c->next) {
+        if (c->handler != NULL) {
+            c->handler(c->data);
+        }
+    }
+
+#ifdef POOL_STATS
+    mem_pool_unregister(pool);
+#endif
 
     /* release large memory at first */
     for (l = pool->large; l; l = pool->large) {
         pool->large = l->next;
-        free((void *) l);
+
+        /* the header "l" itself lives in the pool's chunks */
+        if (l->data != NULL) {
+            stats_sub(STAT_POOL_BYTES, l->size);
+            free((void *) l->data);
+        }
     }
 
+    stats_sub(STAT_POOL_BYTES, pool->total);
+
     for (p = pool->chunk.next; p; p = pool->chunk.next) {
         pool->chunk.next = p->next;
         free((void *) p);
@@ -124,15 +226,32 @@ void mem_pool_destroy(mem_pool_t *pool)
 
 void mem_pool_clear(mem_pool_t *pool)
 {
-    mem_pool_chunk_t *p;
-    mem_pool_large_t *l;
+    mem_pool_chunk_t   *p;
+    mem_pool_large_t   *l;
+    mem_pool_cleanup_t *c;
+
+    /* the cleanups live in the chunks which are reused */
+    for (c = pool->cleanup; c; c = c->next) {
+        if (c->handler != NULL) {
+            c->handler(c->data);
+        }
+    }
+
+    pool->cleanup = NULL;
 
     /* release large memory at first */
     for (l = pool->large; l; l = pool->large) {
         pool->large = l->next;
-        free((void *) l);
+
+        /* the header "l" itself lives in the pool's chunks */
+        if (l->data != NULL) {
+            stats_sub(STAT_POOL_BYTES, l->size);
+            free((void *) l->data);
+        }
     }
 
+    mem_pool_stat_add(pool, large_bytes, -pool->stats.large_bytes);
+
     pool->current = &pool->chunk;
 
     for (p = pool->current; p; p = p->next) {
@@ -146,6 +265,8 @@ void *pmalloc(mem_pool_t *pool, size_t size)
     u_char           *p;
     mem_pool_chunk_t *chunk;
 
+    mem_pool_stat_add(pool, requested, size);
+
     if (size <= pool->max) {
         chunk = pool->current;
 
@@ -183,6 +304,8 @@ int pfree_large(mem_pool_t *pool, void *p)
 
     for (l = pool->large; l ; l = l->next) {
         if (l->data == p) {
+            stats_sub(STAT_POOL_BYTES, l->size);
+            mem_pool_stat_add(pool, large_bytes, -l->size);
             free((void *) p);
             l->data = NULL;
             return XPE_OK;
@@ -191,3 +314,106 @@ int pfree_large(mem_pool_t *pool, void *p)
 
     return XPE_ERROR;
 }
+
+#ifdef POOL_STATS
+
+/**
+ * Sum the live pools by name into "usage", return the number of names.
+ * The counters of a pool are read while its thread may be updating them.
+ */
+int mem_pool_usage(mem_pool_usage_t *usage, int n)
+{
+    int               i, used;
+    mem_pool_t       *pool;
+    mem_pool_usage_t *u;
+
+    used = 0;
+
+    pthread_mutex_lock(&mem_pool_registry_lock);
+
+    for (pool = mem_pool_registry; pool; pool = pool->stats.next) {
+        for (i = 0; i < used; i++) {
+            if (x_strcmp(usage[i].name, pool->name.data) == 0) {
+                break;
+            }
+        }
+
+        if (i == used) {
+            if (used == n) {
+                continue;
+            }
+
+            memset(&usage[used], 0, sizeof(mem_pool_usage_t));
+            usage[used++].name = pool->name.data;
+        }
+
+        u = &usage[i];
+
+        u->pools++;
+        u->total += pool->total;
+        u->requested += pool->stats.requested;
+        u->wasted += pool->stats.wasted;
+        u->large += pool->stats.large;
+        u->large_bytes += pool->stats.large_bytes;
+        u->chunks += pool->stats.chunks;
+
+        if (pool->stats.high_water > u->high_water) {
+            u->high_water = pool->stats.high_water;
+        }
+    }
+
+    pthread_mutex_unlock(&mem_pool_registry_lock);
+
+    return used;
+}
+
+/* the pools which are alive on exit, the ones of requests are leaks */
+void mem_pool_log_usage(logger_t *logger)
+{
+    int              i, n;
+    mem_pool_usage_t usage[MEM_POOL_NAMES_MAX];
+
+    n = mem_pool_usage(usage, MEM_POOL_NAMES_MAX);
+
+    for (i = 0; i < n; i++) {
+        log_info(logger, 0, "pool \"%s\" alive: %d pools, %lu bytes, "
+                 "requested %lu, wasted %lu, large %d(%lu bytes), "
+                 "chunks %d, high water %lu",
+                 usage[i].name, usage[i].pools, (u_long) usage[i].total,
+                 (u_long) usage[i].requested, (u_long) usage[i].wasted,
+                 usage[i].large, (u_long) usage[i].large_bytes,
+                 usage[i].chunks, (u_long) usage[i].high_water);
+    }
+}
+
+#endif
+
+/**
+ * "size" bytes of "data" are allocated in the pool for the handler, the
+ * caller sets "handler" and fills "data".
+ */
+mem_pool_cleanup_t *mem_pool_cleanup_add(mem_pool_t *pool, size_t size)
+{
+    mem_pool_cleanup_t *c;
+
+    c = pmalloc(pool, sizeof(mem_pool_cleanup_t));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    if (size != 0) {
+        c->data = pmalloc(pool, size);
+        if (c->data == NULL) {
+            return NULL;
+        }
+    } else {
+        c->data = NULL;
+    }
+
+    c->handler = NULL;
+    c->next = pool->cleanup;
+
+    pool->cleanup = c;
+
+    return c;
+}
@@ -19,11 +19,23 @@ typedef struct mem_pool_large_s mem_pool_large_t;
 
 struct mem_pool_large_s {
     u_char           *data;
+    size_t            size;
     mem_pool_large_t *next;
 };
 
 typedef struct mem_pool_chunk_s mem_pool_chunk_t;
 
+typedef void (*mem_pool_cleanup_fp) (void *data);
+
+typedef struct mem_pool_cleanup_s mem_pool_cleanup_t;
+
+/* run when the pool is destroyed, the last added runs first */
+struct mem_pool_cleanup_s {
+    mem_pool_cleanup_fp  handler;
+    void                *data;
+    mem_pool_cleanup_t  *next;
+};
+
 struct mem_pool_chunk_s {
     int               fail;
     u_char           *last;
@@ -31,15 +43,62 @@ struct mem_pool_chunk_s {
     mem_pool_chunk_t *next;
 };
 
-struct mem_pool_s {
-    string_t          name;
+#ifdef POOL_STATS
+
+#define MEM_POOL_NAMES_MAX  32
+
+/**
+ * Built with "--with-pool-stats", every pool is linked in a registry.
+ * requested: bytes asked for, large ones included.
+ * wasted: tails of the chunks which "current" has moved past.
+ * large_bytes: large memory held now, "total" + it is the footprint,
+ *     "high_water" is the highest footprint.
+ */
+typedef struct {
+    size_t            requested;
+    size_t            wasted;
+    uint_t            large;
+    size_t            large_bytes;
+    uint_t            chunks;
+    size_t            high_water;
+    mem_pool_t       *prev;
+    mem_pool_t       *next;
+} mem_pool_stats_t;
+
+/* the live pools of a name */
+typedef struct {
+    u_char           *name;
+    uint_t            pools;
     size_t            total;
-    size_t            max;
-    mem_pool_chunk_t *current;
-    mem_pool_large_t *large;
-    logger_t         *logger;
+    size_t            requested;
+    size_t            wasted;
+    uint_t            large;
+    size_t            large_bytes;
+    uint_t            chunks;
+    size_t            high_water;   /* the highest of a pool */
+} mem_pool_usage_t;
+
+#define mem_pool_stat_add(pool, field, n)  ((pool)->stats.field += (n))
+
+#else
+
+#define mem_pool_stat_add(pool, field, n)
 
-    mem_pool_chunk_t  chunk; 
+#endif
+
+struct mem_pool_s {
+    string_t            name;
+    size_t              total;
+    size_t              max;
+    mem_pool_chunk_t   *current;
+    mem_pool_large_t   *large;
+    mem_pool_cleanup_t *cleanup;
+    logger_t           *logger;
+#ifdef POOL_STATS
+    mem_pool_stats_t    stats;
+#endif
+
+    mem_pool_chunk_t    chunk;    /* must be the last */
 };
 
 
@@ -50,5 +109,11 @@ void mem_pool_clear(mem_pool_t *pool);
 void *pmalloc(mem_pool_t *pool, size_t size);
 void *pcalloc(mem_pool_t *pool, size_t size);
 int pfree_large(mem_pool_t *pool, void *p);
+mem_pool_cleanup_t *mem_pool_cleanup_add(mem_pool_t *pool, size_t size);
+
+#ifdef POOL_STATS
+int mem_pool_usage(mem_pool_usage_t *usage, int n);
+void mem_pool_log_usage(logger_t *logger);
+#endif
 
 #endif /* __MEM_POOL_H__ */
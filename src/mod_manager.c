@@ -5,9 +5,14 @@
 #include "config.h"
 #include "system.h"
 
+static int sys_modules_reload_wait(xpipe_resource_t *resource,
+        uint_t pending);
+
 system_module_t *sys_modules[] = {
     &sys_main_module,
+    &sys_queue_module,
     &sys_net_module,
+    &sys_admin_module,
     NULL
 };
 
@@ -26,6 +31,12 @@ int sys_modules_prepare(xpipe_resource_t *resource)
             break;
         }
 
+        if (i == MOD_MAX_NUM) {
+            log_error(resource->default_logger, 0,
+                      "too many system modules, max is %d.", MOD_MAX_NUM);
+            return MOD_ERROR;
+        }
+
         if (mod->logger == NULL) {
             mod->logger = resource->default_logger;
         }
@@ -40,12 +51,411 @@ int sys_modules_prepare(xpipe_resource_t *resource)
         }
 
         mod->pool = pool;
+        mod->resource = resource;
+
+        mod->channel = channel_create(pool, CHANNEL_SIZE, mod->logger);
+        if (mod->channel == NULL) {
+            log_error(resource->default_logger, 0,
+                      "create module \"%s\"'s channel failed.",
+                      mod->mod_name.data);
+            return MOD_ERROR;
+        }
     }
 
     return MOD_OK;
 }
 
+/**
+ * modules are finished in the reverse order of "sys_modules", the ones
+ * which depend on others go first.
+ */
 int sys_modules_finish(xpipe_resource_t *resource)
 {
-    return MOD_ERROR;
+    int              i, ret;
+    system_module_t *mod;
+
+    ret = MOD_OK;
+
+    for (i = resource->sys_mod_num - 1; i >= 0; i--) {
+        mod = *(sys_modules + i);
+
+        if (mod->finish_mod && mod->finish_mod(mod) == MOD_ERROR) {
+            log_error(resource->default_logger, 0,
+                      "finish module \"%s\" failed.", mod->mod_name.data);
+            ret = MOD_ERROR;
+        }
+
+        if (mod->channel != NULL) {
+            channel_destroy(mod->channel);
+            mod->channel = NULL;
+        }
+
+        log_info(resource->default_logger, 0,
+                 "module \"%s\" finished.", mod->mod_name.data);
+    }
+
+    return ret;
+}
+
+/**
+ * Parse the config file into a fresh pool, the running config is kept if
+ * it's invalid. Otherwise every module takes the settings which are safe
+ * to change from its new config, and the pool is released. A module which
+ * has its own thread is sent MOD_MSG_RELOAD and reloads in that thread,
+ * the pool is released once all of them have answered.
+ */
+int sys_modules_reload(xpipe_resource_t *resource)
+{
+    int              i, ret;
+    uint_t           pending;
+    conf_file_t      conf;
+    system_module_t *mod, *new_mod;
+
+    ret = MOD_ERROR;
+    pending = 0;
+
+    memset(&conf, 0, sizeof(conf_file_t));
+    conf.reload = 1;
+
+    if (conf_file_parser(resource, &conf, resource->default_logger) 
+            == CONF_ERROR)
+    {
+        log_error(resource->default_logger, 0, 
+                  "reload \"%s\" failed, keep the running config.",
+                  xpipe_conf_file_path);
+        goto done;
+    }
+
+    ret = MOD_OK;
+
+    for (i = 0; i < resource->sys_mod_num; i++) {
+        mod = *(sys_modules + i);
+        new_mod = conf_file_shadow(&conf, i);
+
+        if (new_mod == NULL) {
+            continue;
+        }
+
+        /* "log" command: only its level can be changed */
+        if (new_mod->logger != NULL) {
+            if (mod->logger != NULL) {
+                mod->logger->level = new_mod->logger->level;
+            }
+
+            file_close(new_mod->logger->file->fd);
+        }
+
+        if (mod->reload_mod == NULL) {
+            continue;
+        }
+
+        if (mod->thread) {
+            if (sys_module_send(&sys_main_module, mod, MOD_MSG_RELOAD,
+                                new_mod) == MOD_OK)
+            {
+                pending++;
+                continue;
+            }
+
+            ret = MOD_ERROR;
+            continue;
+        }
+
+        if (mod->reload_mod(mod, new_mod) == MOD_ERROR) {
+            log_error(resource->default_logger, 0,
+                      "reload module \"%s\" failed.", mod->mod_name.data);
+            ret = MOD_ERROR;
+        }
+    }
+
+    if (sys_modules_reload_wait(resource, pending) == MOD_ERROR) {
+        ret = MOD_ERROR;
+    }
+
+    log_info(resource->default_logger, 0, "config has been reloaded.");
+
+done:
+    if (conf.pool != NULL) {
+        mem_pool_destroy(conf.pool);
+    }
+
+    return ret;
+}
+
+/**
+ * Wait for the answers of the modules sent MOD_MSG_RELOAD, they come to
+ * the channel of "main". The threads always answer, they are stopped by
+ * the main thread only.
+ */
+static int sys_modules_reload_wait(xpipe_resource_t *resource,
+        uint_t pending)
+{
+    int            ret;
+    channel_msg_t  msg;
+    struct pollfd  pfd;
+
+    ret = MOD_OK;
+
+    while (pending > 0) {
+        pfd.fd = sys_main_module.channel->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            log_error(resource->default_logger, errno,
+                      "wait for the reloaded modules failed.");
+            return MOD_ERROR;
+        }
+
+        while (channel_recv(sys_main_module.channel, &msg) == CHANNEL_OK) {
+            switch (msg.type) {
+            case MOD_MSG_RELOAD_FAILED:
+                log_error(resource->default_logger, 0,
+                          "reload module \"%s\" failed.",
+                          msg.from->mod_name.data);
+                ret = MOD_ERROR;
+
+                /* fall through */
+            case MOD_MSG_RELOADED:
+                pending--;
+                break;
+            default:
+                log_warn(resource->default_logger, 0,
+                         "module \"main\" drops message(%d).", msg.type);
+            }
+        }
+    }
+
+    return ret;
+}
+
+int sys_modules_wait(system_module_t **mods, uint_t n, const sigset_t *mask)
+{
+    int              timeout, t, nfds, ret;
+    uint_t           i, k;
+    struct pollfd    pfds[2 * MOD_MAX_NUM];     /* channel and fd */
+    struct timespec  ts, *tsp;
+    system_module_t *mod;
+
+    timeout = -1;
+    nfds = 0;
+
+    for (i = 0; i < n; i++) {
+        mod = mods[i];
+        mod->ready = 0;
+        mod->inbox = 0;
+
+        pfds[nfds].fd = mod->channel->fd;
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        nfds++;
+
+        if (mod->process_mod == NULL) {
+            continue;
+        }
+
+        if (mod->fd == -1 && mod->timer == 0) {
+            /* the module can't tell when it has work, run it every round */
+            mod->ready = 1;
+            timeout = 0;
+            continue;
+        }
+
+        if (mod->fd != -1) {
+            pfds[nfds].fd = mod->fd;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            nfds++;
+        }
+
+        if (mod->timer != 0) {
+            t = (int) (mod->timer - time_current_msecs);
+            if (t < 0) {
+                t = 0;
+            }
+
+            if (timeout == -1 || t < timeout) {
+                timeout = t;
+            }
+        }
+    }
+
+    tsp = NULL;
+
+    if (timeout != -1) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+
+    ret = ppoll(pfds, nfds, tsp, mask);
+    if (ret == -1 && errno != EINTR) {
+        return MOD_ERROR;
+    }
+
+    timer_update();
+
+    for (i = 0, k = 0; i < n; i++) {
+        mod = mods[i];
+
+        /* also woken up to exit, the loop of the thread checks "stop" */
+        if (pfds[k++].revents) {
+            mod->inbox = 1;
+        }
+
+        if (mod->process_mod == NULL || (mod->fd == -1 && mod->timer == 0)) {
+            continue;
+        }
+
+        if (mod->fd != -1 && pfds[k++].revents) {
+            mod->ready = 1;
+        }
+
+        if (mod->timer != 0 && (int) (mod->timer - time_current_msecs) <= 0) {
+            mod->timer = 0;
+            mod->ready = 1;
+        }
+    }
+
+    return MOD_OK;
+}
+
+/**
+ * The messages are handled first, "process_mod" is run only if the module
+ * is ready by its fd or timer.
+ */
+int sys_module_process(system_module_t *mod)
+{
+    int           type;
+    channel_msg_t msg;
+
+    while (mod->inbox && channel_recv(mod->channel, &msg) == CHANNEL_OK) {
+        if (msg.type == MOD_MSG_RELOAD) {
+            type = MOD_MSG_RELOADED;
+
+            if (mod->reload_mod(mod, (system_module_t *) msg.data)
+                    == MOD_ERROR)
+            {
+                type = MOD_MSG_RELOAD_FAILED;
+            }
+
+            (void) sys_module_send(mod, msg.from, type, NULL);
+            continue;
+        }
+
+        if (mod->msg_handler == NULL) {
+            log_warn(mod->logger, 0, "module \"%s\" drops message(%d).",
+                     mod->mod_name.data, msg.type);
+            continue;
+        }
+
+        if (mod->msg_handler(mod, &msg) == MOD_ERROR) {
+            log_error(mod->logger, 0, "module \"%s\" handle message(%d) "
+                      "failed.", mod->mod_name.data, msg.type);
+        }
+    }
+
+    mod->inbox = 0;
+
+    if (mod->ready && mod->process_mod != NULL) {
+        return mod->process_mod(mod);
+    }
+
+    return MOD_OK;
+}
+
+int sys_module_send(system_module_t *from, system_module_t *to, int type,
+        void *data)
+{
+    channel_msg_t msg;
+
+    msg.type = type;
+    msg.data = data;
+    msg.from = from;
+
+    if (channel_send(to->channel, &msg) != CHANNEL_OK) {
+        log_error(from->logger, 0, "channel of module \"%s\" is full.",
+                  to->mod_name.data);
+        return MOD_ERROR;
+    }
+
+    return MOD_OK;
+}
+
+static void *sys_module_thread(void *arg)
+{
+    system_module_t *mod;
+
+    mod = (system_module_t *) arg;
+
+    log_info(mod->logger, 0, "module \"%s\" is working in its own thread.",
+             mod->mod_name.data);
+
+    /* signals stay blocked, they are handled by the main thread */
+    while (!mod->resource->stop) {
+        if (sys_modules_wait(&mod, 1, NULL) == MOD_ERROR) {
+            log_error(mod->logger, errno, "wait for module \"%s\" failed.",
+                      mod->mod_name.data);
+            continue;
+        }
+
+        if ((mod->ready || mod->inbox)
+            && sys_module_process(mod) == MOD_ERROR)
+        {
+            log_error(mod->logger, 0, "process module \"%s\" failed.",
+                      mod->mod_name.data);
+        }
+    }
+
+    return NULL;
+}
+
+int sys_modules_start_threads(xpipe_resource_t *resource)
+{
+    uint_t           i;
+    system_module_t *mod;
+
+    for (i = 0; ; i++) {
+        mod = *(sys_modules + i);
+        if (mod == NULL) {
+            break;
+        }
+
+        if (!mod->thread) {
+            continue;
+        }
+
+        if (pthread_create(&mod->tid, NULL, sys_module_thread, mod) != 0) {
+            log_error(resource->default_logger, 0,
+                      "create thread of module \"%s\" failed.",
+                      mod->mod_name.data);
+            mod->thread = 0;
+            return MOD_ERROR;
+        }
+    }
+
+    return MOD_OK;
+}
+
+void sys_modules_stop_threads(xpipe_resource_t *resource)
+{
+    uint_t           i;
+    system_module_t *mod;
+
+    resource->stop = 1;
+
+    for (i = 0; ; i++) {
+        mod = *(sys_modules + i);
+        if (mod == NULL) {
+            break;
+        }
+
+        if (!mod->thread) {
+            continue;
+        }
+
+        channel_notify(mod->channel);
+        pthread_join(mod->tid, NULL);
+        mod->thread = 0;
+    }
 }
@@ -11,10 +11,23 @@
 #define MOD_OK      0
 #define MOD_ERROR   -1
 
+#define MOD_MAX_NUM 32
+
+/**
+ * The messages handled by the module manager, see "sys_module_process".
+ * MOD_MSG_RELOAD: data is the module of the new config, the module is
+ *     reloaded in its own thread and answers the sender.
+ */
+#define MOD_MSG_RELOAD          1
+#define MOD_MSG_RELOADED        2
+#define MOD_MSG_RELOAD_FAILED   3
+
 typedef void* (*create_mod_conf_fp) (mem_pool_t *pool);
 typedef int (*init_mod_fp) (system_module_t *mod);
 typedef int (*process_mod_fp) (system_module_t *mod);
 typedef int (*finish_mod_fp) (system_module_t *mod);
+typedef int (*reload_mod_fp) (system_module_t *mod, system_module_t *new_mod);
+typedef int (*mod_msg_handler_fp) (system_module_t *mod, channel_msg_t *msg);
 
 
 struct system_module_s {
@@ -24,18 +37,45 @@ struct system_module_s {
     init_mod_fp         init_mod;
     process_mod_fp      process_mod;
     finish_mod_fp       finish_mod;
+    reload_mod_fp       reload_mod;
     int                 index;
     void               *mod_conf;
     mem_pool_t         *pool;
     logger_t           *logger;
+
+    /**
+     * fd: the scheduler polls it and runs "process_mod" when it's readable,
+     *     -1 if the module has no fd.
+     * timer: next deadline in msecs (time_current_msecs), 0 if none. It is
+     *     one-shot, the scheduler clears it before running "process_mod".
+     * A module with neither of them is run on every round of the loop.
+     */
+    int                 fd;
+    uint_t              timer;
+    int                 ready;
+
+    /**
+     * thread: run the module's loop in its own thread ("thread on;").
+     * channel: inbox of messages from other modules, they are handled
+     *     before "process_mod" is run. "inbox" is set when it's readable.
+     * msg_handler: the messages which are not the manager's go to it.
+     */
+    int                 thread;
+    pthread_t           tid;
+    channel_t          *channel;
+    int                 inbox;
+    mod_msg_handler_fp  msg_handler;
+    xpipe_resource_t   *resource;
 };
 
-#define sys_mod_padding -1,NULL,NULL,NULL
+#define sys_mod_padding -1,NULL,NULL,NULL,-1,0,0,0,0,NULL,0,NULL,NULL
 #define sys_null_module { {0, NULL}, NULL, NULL, -1, NULL,NULL }
 
 
 extern system_module_t sys_main_module;
+extern system_module_t sys_queue_module;
 extern system_module_t sys_net_module;
+extern system_module_t sys_admin_module;
 
 extern system_module_t *sys_modules[];
 
@@ -44,5 +84,12 @@ extern system_module_t *sys_modules[];
 
 int sys_modules_prepare(xpipe_resource_t *resource);
 int sys_modules_finish(xpipe_resource_t *resource);
+int sys_modules_reload(xpipe_resource_t *resource);
+int sys_modules_wait(system_module_t **mods, uint_t n, const sigset_t *mask);
+int sys_module_process(system_module_t *mod);
+int sys_module_send(system_module_t *from, system_module_t *to, int type,
+        void *data);
+int sys_modules_start_threads(xpipe_resource_t *resource);
+void sys_modules_stop_threads(xpipe_resource_t *resource);
 
 #endif /* __MOD_MANAGER_H__ */
@@ -0,0 +1,673 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+#define ADMIN_CONNECTIONS   16
+
+#define METRICS_URI         "GET /metrics"
+#define METRICS_HEADERS_MAX (MAX_HEADERS_LEN * 8)
+
+static void *create_admin_mod_conf(mem_pool_t *pool);
+static int init_admin_mod(system_module_t *mod);
+static int process_admin_mod(system_module_t *mod);
+static int finish_admin_mod(system_module_t *mod);
+
+static int cmd_admin_listen_set(dynamic_array_t *args, void *mod_conf);
+static int cmd_admin_connections_set(dynamic_array_t *args, void *mod_conf);
+
+static int metrics_protocol_init(tcp_request_t *r);
+static int metrics_parse(tcp_request_t *r, u_char *start, u_char *end);
+static void metrics_respone_generate(tcp_request_t *r);
+static void metrics_render(tcp_request_t *r);
+static void metrics_render_queues(tcp_request_t *r);
+#ifdef LOOP_STATS
+static void metrics_render_loop(tcp_request_t *r);
+#endif
+#ifdef POOL_STATS
+static void metrics_render_pools(tcp_request_t *r);
+#endif
+
+
+typedef struct {
+    uint_t               port;
+    uint_t               conns;
+    tcp_server_t        *server;
+    net_event_driver_t  *event_driver;
+} xpipe_admin_mod_conf_t;
+
+typedef struct {
+    int          id;
+    const char  *name;
+    const char  *type;
+    const char  *help;
+} admin_metric_t;
+
+static conf_command_t commands[] = {
+    { 0, xstring("listen"), cmd_admin_listen_set },
+    { 0, xstring("connections"), cmd_admin_connections_set },
+    conf_command_null
+};
+
+system_module_t sys_admin_module = {
+    xstring("admin"),
+    commands,
+    create_admin_mod_conf,
+    init_admin_mod,
+    process_admin_mod,
+    finish_admin_mod,
+    NULL,
+    sys_mod_padding
+};
+
+/* the counters in stats.h which are exposed one by one */
+static admin_metric_t admin_metrics[] = {
+    { STAT_ACCEPTS, "xpipe_accepts_total", "counter",
+      "Connections accepted." },
+    { STAT_CONNECTIONS, "xpipe_connections", "gauge",
+      "Connections opened now." },
+    { STAT_BYTES_IN, "xpipe_received_bytes_total", "counter",
+      "Bytes read from clients." },
+    { STAT_BYTES_OUT, "xpipe_sent_bytes_total", "counter",
+      "Bytes written to clients." },
+    { STAT_POOL_BYTES, "xpipe_pool_bytes", "gauge",
+      "Bytes held by memory pools." },
+    { STAT_ZEROCOPY_SENDS, "xpipe_zerocopy_sends_total", "counter",
+      "Sends with MSG_ZEROCOPY." },
+    { STAT_ZEROCOPY_COPIED, "xpipe_zerocopy_copied_total", "counter",
+      "MSG_ZEROCOPY sends which the kernel copied." },
+    { -1, NULL, NULL, NULL }
+};
+
+/* the fields of queue_t, one series of each for every queue */
+enum {
+    ADMIN_QUEUE_DEPTH = 0,
+    ADMIN_QUEUE_BYTES,
+    ADMIN_QUEUE_DROPPED,
+    ADMIN_QUEUE_REJECTED,
+    ADMIN_QUEUE_EXPIRED,
+    ADMIN_QUEUE_DELAYED,
+    ADMIN_QUEUE_INFLIGHT,
+    ADMIN_QUEUE_REDELIVERED
+};
+
+static admin_metric_t admin_queue_metrics[] = {
+    { ADMIN_QUEUE_DEPTH, "xpipe_queue_depth", "gauge",
+      "Messages in the queue." },
+    { ADMIN_QUEUE_BYTES, "xpipe_queue_bytes", "gauge",
+      "Payload bytes in the queue." },
+    { ADMIN_QUEUE_DROPPED, "xpipe_queue_dropped_total", "counter",
+      "Oldest messages dropped for new ones." },
+    { ADMIN_QUEUE_REJECTED, "xpipe_queue_rejected_total", "counter",
+      "PUTs rejected as the queue is full." },
+    { ADMIN_QUEUE_EXPIRED, "xpipe_queue_expired_total", "counter",
+      "Messages removed as their TTLs passed." },
+    { ADMIN_QUEUE_DELAYED, "xpipe_queue_delayed", "gauge",
+      "Messages put with a delay which are not due yet." },
+    { ADMIN_QUEUE_INFLIGHT, "xpipe_queue_inflight", "gauge",
+      "Messages leased and not acked." },
+    { ADMIN_QUEUE_REDELIVERED, "xpipe_queue_redelivered_total", "counter",
+      "Messages given again as their leases expired." },
+    { -1, NULL, NULL, NULL }
+};
+
+
+static void *create_admin_mod_conf(mem_pool_t *pool)
+{
+    xpipe_admin_mod_conf_t *cf;
+
+    cf = pcalloc(pool, sizeof(xpipe_admin_mod_conf_t));
+    if (cf == NULL) {
+        log_error(pool->logger, 0, "create \"admin\" module config error.");
+        return NULL;
+    }
+
+    cf->conns = ADMIN_CONNECTIONS;
+
+    return cf;
+}
+
+/**
+ * The admin server has its own event driver, so it can be run in its own
+ * thread ("thread on;") and a scrape never stalls the "net" module.
+ */
+static int init_admin_mod(system_module_t *mod)
+{
+    tcp_server_t           *server;
+    tcp_connection_t       *conn;
+    net_event_driver_t     *event_driver;
+    xpipe_admin_mod_conf_t *cf;
+
+    cf = (xpipe_admin_mod_conf_t *) mod->mod_conf;
+
+    if (cf == NULL || cf->port == 0) {
+        /* nothing to poll, the scheduler skips the module */
+        mod->process_mod = NULL;
+        log_info(mod->logger, 0, "admin server is disabled.");
+        return MOD_OK;
+    }
+
+    event_driver = pmalloc(mod->pool, sizeof(net_event_driver_t));
+    if (event_driver == NULL) {
+        log_error(mod->logger, 0, "\"pmalloc\" memory failed.");
+        return MOD_ERROR;
+    }
+
+    event_driver->size = cf->conns;
+    event_driver->pool = mod->pool;
+    event_driver->logger = mod->logger;
+
+    cf->event_driver = event_driver;
+
+    if (net_event_init(event_driver) == EVENT_ERROR) {
+        return MOD_ERROR;
+    }
+
+    mod->fd = event_driver->fd;
+    event_driver->timeout = 0;
+
+    server = pcalloc(mod->pool, sizeof(tcp_server_t));
+    if (server == NULL) {
+        log_error(mod->logger, 0, "\"pmalloc\" memory failed.");
+        return MOD_ERROR;
+    }
+
+    server->port = cf->port;
+    server->connections = cf->conns;
+    server->event_driver = event_driver;
+    server->protocol_init = metrics_protocol_init;
+    server->respone_generate = metrics_respone_generate;
+    server->close_on_reply = 1;
+    server->pool = mod->pool;
+    server->logger = mod->logger;
+
+    cf->server = server;
+
+    if (tcp_server_init(server) == TCP_SRV_ERROR) {
+        return MOD_ERROR;
+    }
+
+    if (mod->resource->listen_n < XPIPE_LISTEN_FD_MAX) {
+        mod->resource->listen_fds[mod->resource->listen_n++] = server->sock_fd;
+    }
+
+    conn = tcp_get_connection(server, server->sock_fd);
+    if (conn == NULL) {
+        log_error(mod->logger, 0,
+                  "get connection from pool failed, pool may be full.");
+        return MOD_ERROR;
+    }
+
+    conn->is_listen = 1;
+    server->listen_conn = conn;
+
+    if (add_event(event_driver, conn, EV_READ_EVENT, tcp_server_accept)
+            == EVENT_ERROR)
+    {
+        log_error(mod->logger, 0,
+                  "add the read event of listen %d to event driver failed.",
+                  conn->conn_fd);
+        close(conn->conn_fd);
+        tcp_free_connection(server, conn);
+        server->listen_conn = NULL;
+        return MOD_ERROR;
+    }
+
+    log_info(mod->logger, 0, "admin server is listening, port: %d",
+             server->port);
+
+    return MOD_OK;
+}
+
+static int process_admin_mod(system_module_t *mod)
+{
+    xpipe_admin_mod_conf_t *cf;
+
+    cf = (xpipe_admin_mod_conf_t *) mod->mod_conf;
+
+    if (process_events(cf->event_driver) == EVENT_ERROR) {
+        return MOD_ERROR;
+    }
+
+    return MOD_OK;
+}
+
+/* scrapes are not drained, they are retried by the scraper */
+static int finish_admin_mod(system_module_t *mod)
+{
+    xpipe_admin_mod_conf_t *cf;
+
+    cf = (xpipe_admin_mod_conf_t *) mod->mod_conf;
+
+    if (cf == NULL || cf->server == NULL) {
+        return MOD_OK;
+    }
+
+    tcp_server_shutdown(cf->server);
+    tcp_server_close_connections(cf->server);
+
+    cf->event_driver->actions->destroy_handler(cf->event_driver);
+
+    return MOD_OK;
+}
+
+static int metrics_protocol_init(tcp_request_t *r)
+{
+    protocol_t *pro;
+
+    pro = pcalloc(r->pool, sizeof(protocol_t));
+    if (pro == NULL) {
+        return PROTOCOL_ERROR;
+    }
+
+    r->protocol = pro;
+    r->parser = metrics_parse;
+
+    return PROTOCOL_OK;
+}
+
+/**
+ * Only the end of the http headers is looked for, "state" counts the
+ * chars of "\r\n\r\n" matched. The body of a request is not supported.
+ */
+static int metrics_parse(tcp_request_t *r, u_char *start, u_char *end)
+{
+    u_char     *p, *line;
+    protocol_t *pro;
+
+    pro = r->protocol;
+
+    for (p = start; p != end; p++) {
+        if (*p == ((pro->state & 1) ? LF : CR)) {
+            pro->state++;
+        } else {
+            pro->state = (*p == CR) ? 1 : 0;
+        }
+
+        if (pro->state == 4) {
+            break;
+        }
+    }
+
+    pro->tmp_data_len += p - start;
+
+    if (pro->state != 4) {
+        return pro->tmp_data_len > METRICS_HEADERS_MAX ? PROTOCOL_ERROR
+                                                      : PROTOCOL_OK;
+    }
+
+    /* the request line is in the first buffer */
+    line = r->buffers->buffer;
+
+    if (x_strncmp(line, METRICS_URI, sizeof(METRICS_URI) - 1) == 0) {
+        p = line + sizeof(METRICS_URI) - 1;
+
+        if (*p == ' ' || *p == '?' || *p == CR) {
+            pro->type = METRICS_T;
+        }
+    }
+
+    return PROTOCOL_DONE;
+}
+
+static void metrics_respone_generate(tcp_request_t *r)
+{
+    int       n;
+    size_t    len;
+    u_char   *p;
+    buffer_t *buf, *header;
+
+    if (r->error) {
+        tcp_response_printf(r, "HTTP/1.1 400 Bad Request\r\n"
+                            "Content-Length: 0\r\n"
+                            "Connection: close\r\n\r\n");
+        return;
+    }
+
+    if (r->protocol->type != METRICS_T) {
+        tcp_response_printf(r, "HTTP/1.1 404 Not Found\r\n"
+                            "Content-Length: 0\r\n"
+                            "Connection: close\r\n\r\n");
+        return;
+    }
+
+    metrics_render(r);
+
+    len = 0;
+    for (buf = r->response; buf != NULL; buf = buf->next) {
+        len += buf->last - buf->buffer;
+    }
+
+    /* the length is known after the body is rendered, prepend the header */
+    p = pmalloc(r->pool, sizeof(buffer_t) + 256);
+    if (p == NULL) {
+        log_error(r->logger, 0, "alloc response buffer failed.");
+        return;
+    }
+
+    header = (buffer_t *) p;
+
+    header->buffer = p + sizeof(buffer_t);
+    header->end = header->buffer + 256;
+    header->in_file = 0;
+
+    n = snprintf((char *) header->buffer, 256,
+                 "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %lu\r\n"
+                 "Connection: close\r\n\r\n", (u_long) len);
+
+    header->last = header->buffer + n;
+    header->next = r->response;
+
+    r->response = header;
+}
+
+/**
+ * Prometheus text format, the per thread slots of stats are merged here,
+ * the data plane threads are never locked.
+ */
+static void metrics_render(tcp_request_t *r)
+{
+    uint_t          i;
+    double          sec;
+    const char     *name;
+    uint64_t        counters[STAT_MAX];
+    histogram_t     h;
+    admin_metric_t *m;
+
+    stats_merge(counters);
+
+    tcp_response_printf(r, "# HELP xpipe_uptime_seconds Seconds since "
+                        "the server started.\n"
+                        "# TYPE xpipe_uptime_seconds gauge\n"
+                        "xpipe_uptime_seconds %lu\n",
+                        (u_long) stats_uptime());
+
+    for (m = admin_metrics; m->name != NULL; m++) {
+        tcp_response_printf(r, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                            m->name, m->help, m->name, m->type, m->name,
+                            (unsigned long long) counters[m->id]);
+    }
+
+    tcp_response_printf(r, "# HELP xpipe_requests_total Requests parsed, "
+                        "by type.\n"
+                        "# TYPE xpipe_requests_total counter\n");
+
+    for (i = 0; i < PROTOCOL_TYPE_NUM; i++) {
+        tcp_response_printf(r, "xpipe_requests_total{type=\"%s\"} %llu\n",
+                            protocol_type_names[i],
+                            (unsigned long long) counters[STAT_REQUESTS + i]);
+    }
+
+    tcp_response_printf(r, "# HELP xpipe_parse_errors_total Requests "
+                        "rejected by the parser, by error.\n"
+                        "# TYPE xpipe_parse_errors_total counter\n");
+
+    for (i = 0; i < PROTOCOL_ERR_NUM; i++) {
+        name = stats_names[STAT_PARSE_ERRORS + i]
+               + sizeof("parse_errors_") - 1;
+
+        tcp_response_printf(r,
+                            "xpipe_parse_errors_total{error=\"%s\"} %llu\n",
+                            name,
+                            (unsigned long long) counters[STAT_PARSE_ERRORS
+                                                          + i]);
+    }
+
+    tcp_response_printf(r, "# HELP xpipe_request_duration_seconds From the "
+                        "first byte read to the reply written.\n"
+                        "# TYPE xpipe_request_duration_seconds summary\n");
+
+    for (i = 0; i < PROTOCOL_TYPE_NUM; i++) {
+        stats_merge_latency(i, &h);
+
+        if (h.total == 0) {
+            continue;
+        }
+
+        name = protocol_type_names[i];
+
+        sec = histogram_percentile(&h, 50) / 1e9;
+        tcp_response_printf(r, "xpipe_request_duration_seconds"
+                            "{type=\"%s\",quantile=\"0.5\"} %.9f\n",
+                            name, sec);
+
+        sec = histogram_percentile(&h, 99) / 1e9;
+        tcp_response_printf(r, "xpipe_request_duration_seconds"
+                            "{type=\"%s\",quantile=\"0.99\"} %.9f\n",
+                            name, sec);
+
+        sec = histogram_percentile(&h, 99.9) / 1e9;
+        tcp_response_printf(r, "xpipe_request_duration_seconds"
+                            "{type=\"%s\",quantile=\"0.999\"} %.9f\n",
+                            name, sec);
+
+        tcp_response_printf(r, "xpipe_request_duration_seconds_sum"
+                            "{type=\"%s\"} %.9f\n"
+                            "xpipe_request_duration_seconds_count"
+                            "{type=\"%s\"} %llu\n",
+                            name, h.sum / 1e9,
+                            name, (unsigned long long) h.total);
+    }
+
+    metrics_render_queues(r);
+
+#ifdef LOOP_STATS
+    metrics_render_loop(r);
+#endif
+
+#ifdef POOL_STATS
+    metrics_render_pools(r);
+#endif
+}
+
+/* one snapshot of the queues for all of their metrics */
+static void metrics_render_queues(tcp_request_t *r)
+{
+    uint_t            i, n;
+    uint64_t          v;
+    admin_metric_t   *m;
+    queue_snapshot_t *snaps, *sn;
+
+    snaps = queue_snapshot(&n);
+
+    for (m = admin_queue_metrics; m->name != NULL; m++) {
+        tcp_response_printf(r, "# HELP %s %s\n# TYPE %s %s\n",
+                            m->name, m->help, m->name, m->type);
+
+        for (i = 0; i < n; i++) {
+            sn = &snaps[i];
+
+            switch (m->id) {
+            case ADMIN_QUEUE_DEPTH:
+                v = sn->depth;
+                break;
+            case ADMIN_QUEUE_BYTES:
+                v = sn->bytes;
+                break;
+            case ADMIN_QUEUE_DROPPED:
+                v = sn->dropped;
+                break;
+            case ADMIN_QUEUE_EXPIRED:
+                v = sn->expired;
+                break;
+            case ADMIN_QUEUE_DELAYED:
+                v = sn->delayed;
+                break;
+            case ADMIN_QUEUE_INFLIGHT:
+                v = sn->inflight;
+                break;
+            case ADMIN_QUEUE_REDELIVERED:
+                v = sn->redelivered;
+                break;
+            default:
+                v = sn->rejected;
+                break;
+            }
+
+            tcp_response_printf(r, "%s{queue=\"%s\"} %llu\n", m->name,
+                                sn->name, (unsigned long long) v);
+        }
+    }
+
+    free(snaps);
+}
+
+#ifdef LOOP_STATS
+
+static void metrics_render_loop(tcp_request_t *r)
+{
+    loop_stats_t ls;
+
+    stats_merge_loop(&ls);
+
+    tcp_response_printf(r, 
+            "# HELP xpipe_loop_iterations_total Rounds of the event loops.\n"
+            "# TYPE xpipe_loop_iterations_total counter\n"
+            "xpipe_loop_iterations_total %llu\n"
+            "# HELP xpipe_loop_events_total Events returned by the polls.\n"
+            "# TYPE xpipe_loop_events_total counter\n"
+            "xpipe_loop_events_total %llu\n"
+            "# HELP xpipe_loop_events_max Most events of a poll.\n"
+            "# TYPE xpipe_loop_events_max gauge\n"
+            "xpipe_loop_events_max %llu\n"
+            "# HELP xpipe_loop_blocked_seconds_total Time waiting for "
+            "events.\n"
+            "# TYPE xpipe_loop_blocked_seconds_total counter\n"
+            "xpipe_loop_blocked_seconds_total %.9f\n"
+            "# HELP xpipe_loop_busy_seconds_total Time in the event "
+            "handlers.\n"
+            "# TYPE xpipe_loop_busy_seconds_total counter\n"
+            "xpipe_loop_busy_seconds_total %.9f\n"
+            "# HELP xpipe_loop_slowest_handler_seconds The slowest handler "
+            "of the last interval.\n"
+            "# TYPE xpipe_loop_slowest_handler_seconds gauge\n"
+            "xpipe_loop_slowest_handler_seconds{handler=\"%s\"} %.9f\n",
+            (unsigned long long) ls.iterations,
+            (unsigned long long) ls.events,
+            (unsigned long long) ls.max_events,
+            ls.blocked / 1e9, ls.busy / 1e9,
+            event_handler_name(ls.last_slowest_handler),
+            ls.last_slowest / 1e9);
+
+    tcp_response_printf(r, 
+            "# HELP xpipe_loop_lag_seconds Busy time of a round.\n"
+            "# TYPE xpipe_loop_lag_seconds summary\n"
+            "xpipe_loop_lag_seconds{quantile=\"0.5\"} %.9f\n"
+            "xpipe_loop_lag_seconds{quantile=\"0.99\"} %.9f\n"
+            "xpipe_loop_lag_seconds{quantile=\"0.999\"} %.9f\n"
+            "xpipe_loop_lag_seconds_sum %.9f\n"
+            "xpipe_loop_lag_seconds_count %llu\n",
+            histogram_percentile(&ls.lag, 50) / 1e9,
+            histogram_percentile(&ls.lag, 99) / 1e9,
+            histogram_percentile(&ls.lag, 99.9) / 1e9,
+            ls.lag.sum / 1e9, (unsigned long long) ls.lag.total);
+}
+
+#endif
+
+#ifdef POOL_STATS
+
+/* one series of each gauge for every name of the live pools */
+static void metrics_render_pools(tcp_request_t *r)
+{
+    int              i, k, n;
+    mem_pool_usage_t usage[MEM_POOL_NAMES_MAX], *u;
+
+    static struct {
+        const char  *name;
+        const char  *help;
+    } gauges[] = {
+        { "xpipe_pool_live", "Live pools." },
+        { "xpipe_pool_allocated_bytes", "Bytes of the chunks of live pools." },
+        { "xpipe_pool_requested_bytes", "Bytes asked from live pools." },
+        { "xpipe_pool_wasted_bytes", "Tails of chunks which are skipped." },
+        { "xpipe_pool_large_allocations", "Allocations beyond a chunk." },
+        { "xpipe_pool_large_bytes", "Bytes of large allocations held." },
+        { "xpipe_pool_chunks", "Chunks of live pools." },
+        { "xpipe_pool_high_water_bytes", "The highest footprint of a pool." }
+    };
+
+    n = mem_pool_usage(usage, MEM_POOL_NAMES_MAX);
+
+    for (k = 0; k < (int) (sizeof(gauges) / sizeof(gauges[0])); k++) {
+        tcp_response_printf(r, "# HELP %s %s\n# TYPE %s gauge\n",
+                            gauges[k].name, gauges[k].help, gauges[k].name);
+
+        for (i = 0; i < n; i++) {
+            u = &usage[i];
+
+            tcp_response_printf(r, "%s{name=\"%s\"} %lu\n",
+                                gauges[k].name, u->name,
+                                k == 0 ? (u_long) u->pools :
+                                k == 1 ? (u_long) u->total :
+                                k == 2 ? (u_long) u->requested :
+                                k == 3 ? (u_long) u->wasted :
+                                k == 4 ? (u_long) u->large :
+                                k == 5 ? (u_long) u->large_bytes :
+                                k == 6 ? (u_long) u->chunks :
+                                         (u_long) u->high_water);
+        }
+    }
+}
+
+#endif
+
+static int cmd_admin_listen_set(dynamic_array_t *args, void *mod_conf)
+{
+    string_t               *arg;
+    xpipe_admin_mod_conf_t *cf;
+
+    cf = (xpipe_admin_mod_conf_t *) mod_conf;
+
+    if (args->nelts != 2) {
+        log_error(args->pool->logger, 0, "the args of \"listen\" is error.");
+        return CONF_ERROR;
+    }
+
+    arg = dynamic_array_get_ix(args, 1);
+    if (arg == NULL) {
+        return CONF_ERROR;
+    }
+
+    if (!is_positive_integer(arg)) {
+        log_error(args->pool->logger, 0,
+                  "\"%s\" is a invalid port.", arg->data);
+        return CONF_ERROR;
+    }
+
+    cf->port = x_atoi(arg->data);
+
+    return CONF_OK;
+}
+
+static int cmd_admin_connections_set(dynamic_array_t *args, void *mod_conf)
+{
+    string_t               *arg;
+    xpipe_admin_mod_conf_t *cf;
+
+    cf = (xpipe_admin_mod_conf_t *) mod_conf;
+
+    if (args->nelts != 2) {
+        log_error(args->pool->logger, 0,
+                  "the args of \"connections\" is error.");
+        return CONF_ERROR;
+    }
+
+    arg = dynamic_array_get_ix(args, 1);
+    if (arg == NULL) {
+        return CONF_ERROR;
+    }
+
+    if (!is_positive_integer(arg)) {
+        log_error(args->pool->logger, 0, "\"%s\" is not a integer.", arg->data);
+        return CONF_ERROR;
+    }
+
+    cf->conns = x_atoi(arg->data);
+
+    return CONF_OK;
+}
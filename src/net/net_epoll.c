@@ -36,6 +36,7 @@ int epoll_build(net_event_driver_t *event_driver)
     ctx->events = ev;
 
     event_driver->io_ctx = ctx;
+    event_driver->fd = e_fd;
 
     return EVENT_OK;
 }
@@ -132,7 +133,7 @@ int epoll_polling(net_event_driver_t *event_driver)
     ctx = event_driver->io_ctx;
 
     event_num = epoll_wait(ctx->epoll_fd, ctx->events, event_driver->size, 
-                           1000);
+                           event_driver->timeout);
 
     if (event_num > 0) {
         for (i = 0; i < event_num; i++) {
@@ -148,6 +149,10 @@ int epoll_polling(net_event_driver_t *event_driver)
                 active_events |= EV_WRITE_EVENT;
             }
 
+            if (ee->events & EPOLLERR) {
+                active_events |= EV_ERROR_EVENT;
+            }
+
             conn = (tcp_connection_t *) ee->data.ptr;
             conn->active_events = active_events;
 
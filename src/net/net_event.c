@@ -21,6 +21,8 @@ int net_event_init(net_event_driver_t *event_driver)
     actions = &event_actions;
     event_driver->actions = actions;
     event_driver->active_conns = NULL;
+    event_driver->fd = -1;
+    event_driver->timeout = EVENT_POLL_TIMEOUT;
 
     if (actions->create_handler(event_driver) == EVENT_ERROR) {
         return EVENT_ERROR;
@@ -33,14 +35,36 @@ int process_events(net_event_driver_t *event_driver)
 {
     event_actions_t *actions;
     tcp_connection_t *active_conn, *free_conn;
+#ifdef LOOP_STATS
+    uint_t            events;
+    uint64_t          start, polled, t, now;
+    event_handler_fp  handler;
+    loop_stats_t     *ls;
+
+    ls = &stats_slot()->loop;
+    events = 0;
+    start = time_monotonic_nsecs();
+#endif
 
     actions = event_driver->actions;
     
     actions->poll_handler(event_driver);
 
+#ifdef LOOP_STATS
+    polled = time_monotonic_nsecs();
+    t = polled;
+#endif
+
     active_conn = event_driver->active_conns;
 
     while (active_conn) {
+#ifdef LOOP_STATS
+        handler = (active_conn->active_events & EV_READ_EVENT)
+                  ? active_conn->read_event_handler
+                  : active_conn->write_event_handler;
+        events++;
+#endif
+
         if (active_conn->active_events & EV_READ_EVENT) {
             active_conn->read_event_handler(active_conn);
         }
@@ -49,6 +73,24 @@ int process_events(net_event_driver_t *event_driver)
             active_conn->write_event_handler(active_conn);
         }
 
+        if ((active_conn->active_events & EV_ERROR_EVENT)
+            && active_conn->error_event_handler != NULL
+            && !active_conn->close)
+        {
+            active_conn->error_event_handler(active_conn);
+        }
+
+#ifdef LOOP_STATS
+        now = time_monotonic_nsecs();
+
+        if (now - t > ls->slowest) {
+            ls->slowest = now - t;
+            ls->slowest_handler = handler;
+        }
+
+        t = now;
+#endif
+
 
         if (active_conn->dead_events) {
 #ifdef DEBUG
@@ -75,12 +117,11 @@ int process_events(net_event_driver_t *event_driver)
                       active_conn->client_port);
 #endif
 
-            close(active_conn->conn_fd);
-
             free_conn = active_conn;
             active_conn = active_conn->next;
 
-            tcp_free_connection(free_conn->server, free_conn);
+            /* it may be parked until its MSG_ZEROCOPY sends are done */
+            tcp_close_connection(free_conn->server, free_conn);
             continue;
         }
 
@@ -96,6 +137,34 @@ int process_events(net_event_driver_t *event_driver)
 
     event_driver->active_conns = NULL;
 
+#ifdef LOOP_STATS
+    now = time_monotonic_nsecs();
+
+    ls->iterations++;
+    ls->events += events;
+    if (events > ls->max_events) {
+        ls->max_events = events;
+    }
+
+    ls->blocked += polled - start;
+    if (ls->loop_end != 0) {
+        ls->blocked += start - ls->loop_end;
+    }
+
+    ls->busy += now - polled;
+    histogram_record(&ls->lag, now - polled);
+
+    if (now - ls->interval_start >= LOOP_STATS_INTERVAL) {
+        ls->last_slowest = ls->slowest;
+        ls->last_slowest_handler = ls->slowest_handler;
+        ls->slowest = 0;
+        ls->slowest_handler = NULL;
+        ls->interval_start = now;
+    }
+
+    ls->loop_end = now;
+#endif
+
     return EVENT_OK;
 }
 
@@ -140,3 +209,24 @@ int del_event(net_event_driver_t *event_driver, tcp_connection_t *conn,
 }
 
 
+
+#ifdef LOOP_STATS
+
+const char *event_handler_name(event_handler_fp handler)
+{
+    if (handler == tcp_server_accept) {
+        return "accept";
+    }
+
+    if (handler == tcp_server_recv) {
+        return "recv";
+    }
+
+    if (handler == tcp_server_send) {
+        return "send";
+    }
+
+    return "none";
+}
+
+#endif
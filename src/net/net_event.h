@@ -14,6 +14,9 @@
 #define EV_NONE_EVENT  0
 #define EV_READ_EVENT  1
 #define EV_WRITE_EVENT 2
+#define EV_ERROR_EVENT 4    /* always polled, e.g. the socket error queue */
+
+#define EVENT_POLL_TIMEOUT 1000
 
 
 typedef int (*ev_create_fp) (net_event_driver_t *event_driver);
@@ -34,7 +37,9 @@ typedef struct {
 
 struct net_event_driver_s {
     void               *io_ctx;
+    int                 fd;         /* pollable fd of the io backend */
     int                 size;
+    int                 timeout;    /* msecs the poll handler may block */
     event_actions_t    *actions;
     tcp_connection_t   *active_conns;
     mem_pool_t         *pool;
@@ -50,4 +55,8 @@ int add_event(net_event_driver_t *event_driver, tcp_connection_t *conn,
 int del_event(net_event_driver_t *event_driver, tcp_connection_t *conn, 
         int events);
 
+#ifdef LOOP_STATS
+const char *event_handler_name(event_handler_fp handler);
+#endif
+
 #endif  /* __NET_EVENT_H__ */
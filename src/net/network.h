@@ -0,0 +1,26 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __NETWORK_H__
+#define __NETWORK_H__
+
+#include "config.h"
+#include "system.h"
+
+typedef struct {
+    tcp_server_t        *server;
+    net_event_driver_t  *event_driver;
+} network_t;
+
+typedef struct {
+    uint_t      port;
+    uint_t      conns;
+    int         nodelay;
+    uint_t      request_buffer_size;
+    uint_t      shutdown_timeout;
+    size_t      zerocopy_min;
+    network_t  *netwk;
+} xpipe_net_mod_conf_t;
+
+#endif  /* __NETWORK_H__ */
@@ -12,6 +12,7 @@
 #define err_data_len_invalid    5
 #define err_needless_data       6
 
+static int protocol_headers_join(tcp_request_t *r);
 
 string_t protocol_err_info[] = {
     string_null,
@@ -23,6 +24,19 @@ string_t protocol_err_info[] = {
     xstring("Data is needless.")
 };
 
+/* indexed by the type of request */
+const char *protocol_type_names[] = {
+    "unknow",
+    "put",
+    "get",
+    "queue",
+    "list",
+    "stats",
+    "metrics",
+    "commit",
+    "ack"
+};
+
 int protocol_init(tcp_request_t *r)
 {
     protocol_t *pro;
@@ -76,13 +90,14 @@ int protocol_parse(tcp_request_t *r, u_char *start, u_char *end)
                 return err_type_invalid;
             }
 
-            pro->start = p;
+            /* the type may be in two buffers, so it's copied */
+            pro->type_name[0] = c;
+            pro->type_len = 1;
             state = sw_type;
 
             break;
         case sw_type:
             if (c == CR) {
-                pro->end = p;
                 state = sw_type_cr;
                 break;
             }
@@ -91,38 +106,60 @@ int protocol_parse(tcp_request_t *r, u_char *start, u_char *end)
                 return err_type_invalid;
             }
 
+            if (pro->type_len == PROTOCOL_TYPE_MAX_LEN) {
+                return err_type_not_found;
+            }
+
+            pro->type_name[pro->type_len++] = c;
             break;
         case sw_type_cr:
             if (c != LF) {
                 return err_only_cr;
             }
 
-            switch (pro->end - pro->start) {
+            switch (pro->type_len) {
             case 3:
-                if (x_strncmp(pro->start, PUT, 3) == 0) {
+                if (x_strncmp(pro->type_name, PUT, 3) == 0) {
                     pro->type = PUT_T;
                     break;
                 }
 
-                if (x_strncmp(pro->start, GET, 3) == 0) {
+                if (x_strncmp(pro->type_name, GET, 3) == 0) {
                     pro->type = GET_T;
                     break;
                 }
 
+                if (x_strncmp(pro->type_name, ACK, 3) == 0) {
+                    pro->type = ACK_T;
+                    break;
+                }
+
                 return err_type_not_found;
             case 4:
-                if (x_strncmp(pro->start, LIST, 4) == 0) {
+                if (x_strncmp(pro->type_name, LIST, 4) == 0) {
                     pro->type = LIST_T;
                     break;
                 }
 
                 return err_type_not_found;
             case 5:
-                if (x_strncmp(pro->start, QUEUE, 5) == 0) {
+                if (x_strncmp(pro->type_name, QUEUE, 5) == 0) {
                     pro->type = QUEUE_T;
                     break;
                 }
 
+                if (x_strncmp(pro->type_name, STATS, 5) == 0) {
+                    pro->type = STATS_T;
+                    break;
+                }
+
+                return err_type_not_found;
+            case 6:
+                if (x_strncmp(pro->type_name, COMMIT, 6) == 0) {
+                    pro->type = COMMIT_T;
+                    break;
+                }
+
                 return err_type_not_found;
             default:
                 return err_type_not_found;
@@ -142,12 +179,20 @@ int protocol_parse(tcp_request_t *r, u_char *start, u_char *end)
                 return err_headers_invalid;
             }
 
+            pro->headers_start_buf = r->last_buffer;
             pro->headers_start = p;
             state = sw_headers;
             break;
         case sw_headers:
             if (c == CR) {
                 pro->headers_end = p;
+
+                if (pro->headers_start_buf != r->last_buffer
+                    && protocol_headers_join(r) == PROTOCOL_ERROR)
+                {
+                    return PROTOCOL_ERROR;
+                }
+
                 state = sw_headers_cr;
                 break;
             }
@@ -168,40 +213,36 @@ int protocol_parse(tcp_request_t *r, u_char *start, u_char *end)
             break;
         case sw_headers_lf:
             if (pro->type != PUT_T) {
-                return err_needless_data;            
+                goto done;
             } else {
                 if (!is_digit(c)) {
                     return err_data_len_invalid;
                 }
 
-                pro->start = p;
+                data_len = c - '0';
                 state = sw_data_len;
                 break;
             }
         case sw_data_len:
             if (c == CR) {
-                pro->end = p;
                 state = sw_data_len_cr;
                 break;
             }
 
-            if (!is_digit(c)) {
+            /* the digits may be in two buffers, so they are summed up */
+            if (!is_digit(c) || data_len > INT_MAX / 10) {
                 return err_data_len_invalid;
             }
 
+            data_len = data_len * 10 + c - '0';
             break;
         case sw_data_len_cr:
             if (c != LF) {
                 return err_only_cr; 
             }
-            
-            *(p - 1) = '\0';
 
-            data_len = x_atoi(pro->start);
             pro->data_len = data_len;
 
-            *(p - 1) = '\0';
-
             if (data_len <= 0) {
                 return err_data_len_invalid;
             }
@@ -216,14 +257,20 @@ int protocol_parse(tcp_request_t *r, u_char *start, u_char *end)
             state = sw_data;
             break;
         case sw_data:
-            if (data_len-- == 0) {
-                return err_needless_data;
+            if (data_len == 0) {
+                goto done;
             }
 
+            data_len--;
             break;
         } 
     }
 
+done:
+
+    /* the rest is the next request, it's pipelined */
+    pro->next = (p != end) ? p : NULL;
+
     if (pro->type != UNKNOW && pro->type != PUT_T && state == sw_headers_lf) {
         return PROTOCOL_DONE;
     }
@@ -238,3 +285,119 @@ int protocol_parse(tcp_request_t *r, u_char *start, u_char *end)
 
     return PROTOCOL_OK;
 }
+
+/**
+ * Headers are "k1=v1;k2=v2", pass NULL as "p" for the first one. The key
+ * and value point into the request and are not ended by '\0', a header
+ * without '=' has an empty value. return NULL after the last one.
+ */
+u_char *protocol_header_next(protocol_t *pro, u_char *p, string_t *key,
+        string_t *value)
+{
+    u_char *end;
+
+    if (pro->headers_start == NULL || pro->headers_end == NULL) {
+        return NULL;
+    }
+
+    if (p == NULL) {
+        p = pro->headers_start;
+    }
+
+    end = pro->headers_end;
+
+    /* skip the empty ones, e.g. "k1=v1;;k2=v2" */
+    while (p < end && *p == ';') {
+        p++;
+    }
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    key->data = p;
+
+    while (p < end && *p != '=' && *p != ';') {
+        p++;
+    }
+
+    key->len = p - key->data;
+
+    if (p < end && *p == '=') {
+        p++;
+    }
+
+    value->data = p;
+
+    while (p < end && *p != ';') {
+        p++;
+    }
+
+    value->len = p - value->data;
+
+    return p;
+}
+
+/**
+ * The headers are read into more than one buffer, they are copied into one
+ * as they are scanned as a string. The buffers before the last one are
+ * full, "headers_end" is in the last one.
+ */
+static int protocol_headers_join(tcp_request_t *r)
+{
+    size_t      len;
+    u_char     *p, *start;
+    buffer_t   *b, *last;
+    protocol_t *pro;
+
+    pro = r->protocol;
+    last = r->last_buffer;
+
+    b = pro->headers_start_buf;
+    len = b->last - pro->headers_start;
+
+    for (b = b->next; b != last; b = b->next) {
+        len += b->last - b->buffer;
+    }
+
+    len += pro->headers_end - last->buffer;
+
+    start = pmalloc(r->pool, len + 1);
+    if (start == NULL) {
+        return PROTOCOL_ERROR;
+    }
+
+    b = pro->headers_start_buf;
+    p = x_memcpy_n(start, pro->headers_start, b->last - pro->headers_start);
+
+    for (b = b->next; b != last; b = b->next) {
+        p = x_memcpy_n(p, b->buffer, b->last - b->buffer);
+    }
+
+    p = x_memcpy_n(p, last->buffer, pro->headers_end - last->buffer);
+    *p = CR;
+
+    pro->headers_start_buf = NULL;
+    pro->headers_start = start;
+    pro->headers_end = p;
+
+    return PROTOCOL_OK;
+}
+
+int protocol_header(protocol_t *pro, const char *name, string_t *value)
+{
+    size_t    len;
+    u_char   *p;
+    string_t  key;
+
+    len = x_strlen(name);
+
+    for (p = NULL; (p = protocol_header_next(pro, p, &key, value)) != NULL; )
+    {
+        if (key.len == len && x_strncmp(key.data, name, len) == 0) {
+            return PROTOCOL_OK;
+        }
+    }
+
+    return PROTOCOL_ERROR;
+}
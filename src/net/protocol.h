@@ -17,16 +17,29 @@
 #define GET     "GET"
 #define QUEUE   "QUEUE"
 #define LIST    "LIST"
+#define STATS   "STATS"
+#define COMMIT  "COMMIT"
+#define ACK     "ACK"
 
 #define UNKNOW  0
 #define PUT_T   1
 #define GET_T   2
 #define QUEUE_T 3
 #define LIST_T  4
+#define STATS_T 5
+#define METRICS_T 6     /* "GET /metrics" of the admin server */
+#define COMMIT_T  7
+#define ACK_T     8
+
+#define PROTOCOL_TYPE_NUM  9
+#define PROTOCOL_ERR_NUM   7    /* size of "protocol_err_info" */
 
 #define MAX_HEADERS_LEN  1024
 
+#define PROTOCOL_TYPE_MAX_LEN  6    /* "COMMIT" */
+
 extern string_t protocol_err_info[];
+extern const char *protocol_type_names[];
 
 typedef int (*protocol_parse_fp) (tcp_request_t *r, u_char *start,
         u_char *end);
@@ -35,9 +48,10 @@ struct protocol_s {
     int     type;
     int     state;
 
-    u_char *start;
-    u_char *end;
+    u_char  type_name[PROTOCOL_TYPE_MAX_LEN];
+    size_t  type_len;
 
+    void   *headers_start_buf;
     u_char *headers_start;
     u_char *headers_end;
 
@@ -46,10 +60,15 @@ struct protocol_s {
     void   *data_start_buf;
     u_char *data_start;
     u_char *data_end;
+
+    u_char *next;       /* the first byte after the request, or NULL */
 };
 
 int protocol_init(tcp_request_t *r);
 int protocol_parse(tcp_request_t *r, u_char *start, u_char *end);
+u_char *protocol_header_next(protocol_t *pro, u_char *p, string_t *key,
+        string_t *value);
+int protocol_header(protocol_t *pro, const char *name, string_t *value);
 
 #define protocol_err_str(e)  protocol_err_info[e].data
 
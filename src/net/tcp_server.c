@@ -5,16 +5,46 @@
 #include "config.h"
 #include "system.h"
 
+static int tcp_server_splice(tcp_connection_t *conn);
+static ssize_t tcp_server_write(tcp_connection_t *conn, tcp_request_t *r,
+        buffer_t *buf);
+static void tcp_request_release(tcp_connection_t *conn, tcp_request_t *r);
+static void tcp_server_zerocopy_read(tcp_connection_t *conn);
+static void tcp_server_zerocopy_park(tcp_server_t *server,
+        tcp_connection_t *c);
+static void tcp_server_parse(tcp_connection_t *conn);
+static tcp_request_t *tcp_request_pipeline(tcp_connection_t *conn,
+        tcp_request_t *r);
+static void tcp_respone_stats(tcp_request_t *r);
+static void tcp_respone_queue_stats(tcp_request_t *r);
+static void tcp_respone_list(tcp_request_t *r);
+#ifdef LOOP_STATS
+static void tcp_respone_loop_stats(tcp_request_t *r);
+#endif
+#ifdef POOL_STATS
+static void tcp_respone_pool_stats(tcp_request_t *r);
+#endif
+
 int tcp_server_init(tcp_server_t *server)
 {
     int s_fd;
 
-    if ((s_fd = tcp_server_create_socket(server)) == TCP_SRV_ERROR) {
-        return TCP_SRV_ERROR;
-    }
+    server->listen_conn = NULL;
+    server->draining = 0;
+    server->zc_parked = NULL;
+    server->conn_limit = server->connections;
+    server->conn_used = 0;
 
-    if (tcp_server_listen(server, s_fd) == TCP_SRV_ERROR) {
-        goto fail;
+    /* reuse the socket listened by the old process on a binary upgrade */
+    if ((s_fd = tcp_server_inherit_socket(server)) == TCP_SRV_ERROR) {
+
+        if ((s_fd = tcp_server_create_socket(server)) == TCP_SRV_ERROR) {
+            return TCP_SRV_ERROR;
+        }
+
+        if (tcp_server_listen(server, s_fd) == TCP_SRV_ERROR) {
+            goto fail;
+        }
     }
 
     /* create connection pool */
@@ -30,6 +60,46 @@ fail:
     return TCP_SRV_ERROR;
 }
 
+/**
+ * Look for the socket which listens on "server->port" in XPIPE_LISTEN_FD,
+ * it's set by the old process which execs this binary.
+ */
+int tcp_server_inherit_socket(tcp_server_t *server)
+{
+    int              s_fd;
+    char            *env, *p;
+    socklen_t        len;
+    xpe_sockaddr_in  sa;
+
+    env = getenv(XPIPE_LISTEN_FD_ENV);
+    if (env == NULL) {
+        return TCP_SRV_ERROR;
+    }
+
+    for (p = env; *p != '\0'; p++) {
+        s_fd = atoi(p);
+        len = sizeof(xpe_sockaddr_in);
+
+        if (getsockname(s_fd, (xpe_sockaddr *) &sa, &len) == 0
+            && sa.sin_family == AF_INET && ntohs(sa.sin_port) == server->port)
+        {
+            log_info(server->logger, 0, 
+                     "inherit listening socket(%d) of port %d.", 
+                     s_fd, server->port);
+
+            server->sa = sa;
+            return server->sock_fd = s_fd;
+        }
+
+        p = strchr(p, ';');
+        if (p == NULL) {
+            break;
+        }
+    }
+
+    return TCP_SRV_ERROR;
+}
+
 int tcp_server_create_socket(tcp_server_t *server)
 {
     int s_fd, reuse;
@@ -127,6 +197,16 @@ int tcp_server_accept(tcp_connection_t *conn)
         return TCP_SRV_ERROR;
     }
 
+    if (conn->server->zerocopy_min != 0) {
+        if (set_zerocopy(c_fd) != 0) {
+            log_warn(conn->logger, errno,
+                     "Set SO_ZEROCOPY to connection %d failed.", c_fd);
+        } else {
+            new_conn->zerocopy = 1;
+            new_conn->error_event_handler = tcp_server_zerocopy_done;
+        }
+    }
+
     /**
      * add the read event of new tcp connection into event driver 
      */
@@ -151,6 +231,9 @@ int tcp_server_accept(tcp_connection_t *conn)
     new_conn->client_addr.len = x_strlen(addr);
     new_conn->client_port = ntohs(sa.sin_port);
 
+    stats_inc(STAT_ACCEPTS);
+    stats_inc(STAT_CONNECTIONS);
+
 #ifdef DEBUG
     log_debug(conn->logger, 0, 
               "Accept a new connection(%d) from (addr:%s, port:%d), "
@@ -165,12 +248,25 @@ int tcp_server_accept(tcp_connection_t *conn)
 
 int tcp_server_recv(tcp_connection_t *conn)
 {
-    int              n, ret;
+    int              n;
     buffer_t        *b;
     tcp_request_t   *r;
 
     r = conn->request; 
 
+    if (r != NULL && r->ingest != NULL) {
+        return tcp_server_splice(conn);
+    }
+
+    /**
+     * The response of the request is not sent yet, the requests pipelined
+     * after it are read once it's sent, see "tcp_server_send".
+     */
+    if (r != NULL && (r->done || r->error)) {
+        conn->dead_events = EV_READ_EVENT;
+        return TCP_SRV_OK;
+    }
+
     if (r == NULL && (r = tcp_request_init(conn)) == NULL) {
         log_error(conn->logger, 0,
                   "Request from client(addr:%s, port:%d) init failed.",
@@ -205,10 +301,114 @@ int tcp_server_recv(tcp_connection_t *conn)
     }
 
 
-    ret = r->parser(r, b->last, b->last + n);
-    b->last += n;
+    stats_add(STAT_BYTES_IN, n);
+
+    r->unparsed = n;
+
+    tcp_server_parse(conn);
+
+    return TCP_SRV_OK;
+}
+
+/**
+ * Parse the bytes read into the last buffer of the request, then those of
+ * the requests pipelined after it, which are carried to the next request
+ * when the response is sent.
+ */
+static void tcp_server_parse(tcp_connection_t *conn)
+{
+    int            ret;
+    size_t         n;
+    buffer_t      *b;
+    tcp_request_t *r;
+
+    conn->receiving = 1;
+
+    while ((r = conn->request) != NULL && r->unparsed != 0) {
+        b = r->last_buffer;
+        n = r->unparsed;
+        r->unparsed = 0;
+
+        if (r->start_time == 0) {
+            r->start_time = time_monotonic_nsecs();
+        }
+
+        ret = r->parser(r, b->last, b->last + n);
+        b->last += n;
+
+        tcp_request_process(r, ret);
+    }
+
+    conn->receiving = 0;
+}
+
+/**
+ * Move the rest of a large PUT from the socket to the queue's file through
+ * a pipe, the payload is not copied to the user space.
+ */
+static int tcp_server_splice(tcp_connection_t *conn)
+{
+    ssize_t         n, m;
+    tcp_request_t  *r;
+    queue_ingest_t *in;
+
+    r = conn->request;
+    in = r->ingest;
+
+    while (in->left > 0) {
+        n = splice(conn->conn_fd, NULL, in->pipe[1], NULL, in->left,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n == 0) {
+            log_warn(conn->logger, 0, "Client(addr:%s, port:%d) has closed.",
+                     conn->client_addr.data, conn->client_port);
+
+            conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+            conn->close = 1;
+            return TCP_SRV_OK; 
+        }
+
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                return TCP_SRV_OK;
+            }
+
+            log_error(conn->logger, errno, 
+                      "Connection(%d) is error, will close it.", conn->conn_fd);
+
+            conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+            conn->close = 1;
+            return TCP_SRV_ERROR;
+        }
+
+        stats_add(STAT_BYTES_IN, n);
+        in->left -= n;
+
+        for ( /* void */ ; n > 0; n -= m) {
+            m = splice(in->pipe[0], NULL, in->fd, &in->offset, n,
+                       SPLICE_F_MOVE);
+
+            if (m <= 0) {
+                log_error(conn->logger, errno,
+                          "splice the payload to the queue failed.");
+                goto failed;
+            }
+        }
+    }
+
+    queue_ingest_finish(r, 1);
+    tcp_request_process(r, PROTOCOL_DONE);
+
+    return TCP_SRV_OK;
+
+failed:
 
-    tcp_request_process(r, ret);
+    /* the rest of the payload is still in the socket */
+    queue_ingest_finish(r, 0);
+    tcp_request_process(r, PROTOCOL_DONE);
+
+    conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+    conn->close = 1;
 
     return TCP_SRV_OK;
 }
@@ -216,52 +416,463 @@ int tcp_server_recv(tcp_connection_t *conn)
 int tcp_server_send(tcp_connection_t *conn)
 {
     int            n;
+    size_t         size;
     buffer_t      *buf;
-    tcp_request_t *r;
+    tcp_request_t *r, *next;
     
     r = conn->request;
     if (r == NULL) {
         return TCP_SRV_OK;
     }
 
-    buf = r->response;
+    if (r->zerocopy == -1) {
+        r->zerocopy = 0;
 
-    for (;;) {
-        n = write(conn->conn_fd, (char *) buf->buffer,
-                  buf->last - buf->buffer);
+        if (conn->zerocopy) {
+            for (size = 0, buf = r->response; buf != NULL; buf = buf->next) {
+                if (!buf->in_file) {
+                    size += buf->last - buf->buffer;
+                }
+            }
 
-        if (n == -1) {
-            if (errno == EAGAIN) {
-                conn->add_events = EV_WRITE_EVENT;                
-                return TCP_SRV_OK;
-            } else {
-                log_error(conn->logger, 0,
-                          "Connection(%s, %d) is error, will close it.",
-                          conn->client_addr.data, conn->client_port);
+            r->zerocopy = size >= conn->server->zerocopy_min;
+        }
+    }
 
-                conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
-                conn->close = 1;
-                r->finish = 1;
-                return TCP_SRV_OK;
+    /* "buffer" of a response buffer is moved forward as it's sent */
+    for (buf = r->response; buf != NULL; buf = r->response) {
+
+        while (buf->in_file && buf->file_pos < buf->file_last) {
+            n = sendfile(conn->conn_fd, buf->fd, &buf->file_pos,
+                         buf->file_last - buf->file_pos);
+
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    conn->add_events = EV_WRITE_EVENT;                
+                    return TCP_SRV_OK;
+                } else {
+                    log_error(conn->logger, errno,
+                              "Connection(%s, %d) is error, will close it.",
+                              conn->client_addr.data, conn->client_port);
+
+                    conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+                    conn->close = 1;
+                    r->finish = 1;
+                    return TCP_SRV_OK;
+                }
             }
-        }
 
-        buf->buffer += n;
+            stats_add(STAT_BYTES_OUT, n);
+        }
 
-        if (buf->buffer == buf->last) {
-            if (conn->events & EV_WRITE_EVENT) {
-                conn->dead_events = EV_WRITE_EVENT;                
-                conn->write_event_handler = NULL;
+        while (buf->buffer != buf->last) {
+            n = tcp_server_write(conn, r, buf);
+
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    conn->add_events = EV_WRITE_EVENT;                
+                    return TCP_SRV_OK;
+                } else {
+                    log_error(conn->logger, 0,
+                              "Connection(%s, %d) is error, will close it.",
+                              conn->client_addr.data, conn->client_port);
+
+                    conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+                    conn->close = 1;
+                    r->finish = 1;
+                    return TCP_SRV_OK;
+                }
             }
 
-            r->finish = 1;
-            break;
+            stats_add(STAT_BYTES_OUT, n);
+            buf->buffer += n;
         }
+
+        r->response = buf->next;
+    }
+
+    if (conn->events & EV_WRITE_EVENT) {
+        conn->dead_events = EV_WRITE_EVENT;                
+        conn->write_event_handler = NULL;
+    }
+
+    r->finish = 1;
+
+    if (r->start_time != 0) {
+        stats_record_latency(r->protocol->type, 
+                             time_monotonic_nsecs() - r->start_time);
+    }
+
+    /* no more requests are served on this connection while draining */
+    if (conn->server->draining || conn->server->close_on_reply) {
+        tcp_request_release(conn, r);
+        conn->request = NULL;
+
+        if (conn->zc_waiting != NULL) {
+            conn->zc_close = 1;
+        } else {
+            conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+            conn->close = 1;
+        }
+
+        return TCP_SRV_OK;
+    }
+
+    next = NULL;
+
+    if (r->protocol->next != NULL && !conn->close) {
+        next = tcp_request_pipeline(conn, r);
+    }
+
+    tcp_request_release(conn, r);
+    conn->request = next;
+
+    if (conn->close) {
+        return TCP_SRV_OK;
+    }
+
+    /* the reading was stopped until the response is sent */
+    if (!(conn->events & EV_READ_EVENT)) {
+        if (add_event(conn->server->event_driver, conn, EV_READ_EVENT,
+                      tcp_server_recv) == EVENT_ERROR)
+        {
+            log_error(conn->logger, 0,
+                      "add the read event of connection %d failed.",
+                      conn->conn_fd);
+
+            conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+            conn->close = 1;
+            return TCP_SRV_OK;
+        }
+    }
+
+    conn->dead_events &= ~EV_READ_EVENT;
+
+    /* called by the write event, not in the loop of "tcp_server_parse" */
+    if (next != NULL && !conn->receiving) {
+        tcp_server_parse(conn);
     }
 
     return TCP_SRV_OK;
 }
 
+/**
+ * The bytes after the request are the next ones, they are in the last
+ * buffer and are copied into the first buffer of a new request, which is
+ * as large as any buffer of a request.
+ */
+static tcp_request_t *tcp_request_pipeline(tcp_connection_t *conn,
+        tcp_request_t *r)
+{
+    size_t         n;
+    buffer_t      *b;
+    tcp_request_t *next;
+
+    n = r->last_buffer->last - r->protocol->next;
+
+    next = tcp_request_init(conn);
+    if (next == NULL) {
+        log_error(conn->logger, 0,
+                  "Pipelined request from client(addr:%s, port:%d) "
+                  "init failed.", conn->client_addr.data, conn->client_port);
+
+        conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+        conn->close = 1;
+        return NULL;
+    }
+
+    b = next->last_buffer;
+
+    memcpy(b->last, r->protocol->next, n);
+    next->unparsed = n;
+
+    return next;
+}
+
+/**
+ * A buffer of a zerocopy response is pinned by the kernel, not copied, so
+ * it must not be freed before the send is reported done.
+ */
+static ssize_t tcp_server_write(tcp_connection_t *conn, tcp_request_t *r,
+        buffer_t *buf)
+{
+    ssize_t n;
+    size_t  size;
+
+    size = buf->last - buf->buffer;
+
+    if (r->zerocopy && conn->zerocopy && size >= ZEROCOPY_BUFFER_MIN) {
+        n = send(conn->conn_fd, buf->buffer, size, MSG_ZEROCOPY);
+
+        if (n != -1) {
+            r->zc_last = ++conn->zc_sent;
+            stats_inc(STAT_ZEROCOPY_SENDS);
+            return n;
+        }
+
+        /* out of the locked memory for the pages, copy it this time */
+        if (errno != ENOBUFS) {
+            return n;
+        }
+    }
+
+    return write(conn->conn_fd, (char *) buf->buffer, size);
+}
+
+/* the pool of a zerocopy response waits for "tcp_server_zerocopy_done" */
+static void tcp_request_release(tcp_connection_t *conn, tcp_request_t *r)
+{
+    if (r->zc_last <= conn->zc_done) {
+        mem_pool_destroy(r->pool);
+        return;
+    }
+
+    r->zc_next = NULL;
+
+    if (conn->zc_waiting == NULL) {
+        conn->zc_waiting = r;
+    } else {
+        conn->zc_last_waiting->zc_next = r;
+    }
+
+    conn->zc_last_waiting = r;
+}
+
+/**
+ * The error handler of a connection with SO_ZEROCOPY. The notifications
+ * tell ranges of the MSG_ZEROCOPY sends which are done, a TCP socket
+ * reports them in order. If the kernel had to copy the data anyway, e.g.
+ * on loopback, the connection stops using MSG_ZEROCOPY.
+ */
+int tcp_server_zerocopy_done(tcp_connection_t *conn)
+{
+    int        err;
+    socklen_t  len;
+
+    tcp_server_zerocopy_read(conn);
+
+    if (conn->zc_close && conn->zc_waiting == NULL) {
+        conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+        conn->close = 1;
+        return TCP_SRV_OK;
+    }
+
+    /* not a notification but an error of the socket */
+    len = sizeof(int);
+
+    if (getsockopt(conn->conn_fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+        && err != 0)
+    {
+        log_error(conn->logger, err,
+                  "Connection(%s, %d) is error, will close it.",
+                  conn->client_addr.data, conn->client_port);
+
+        conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+        conn->close = 1;
+    }
+
+    return TCP_SRV_OK;
+}
+
+/* read the notifications and destroy the pools of the sends done */
+static void tcp_server_zerocopy_read(tcp_connection_t *conn)
+{
+    ssize_t                    n;
+    struct msghdr              msg;
+    struct cmsghdr            *cm;
+    tcp_request_t             *r;
+    struct sock_extended_err  *ee;
+    u_char                     control[128];
+
+    for ( ;; ) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(conn->conn_fd, &msg, MSG_ERRQUEUE);
+        if (n == -1) {
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6
+                     && cm->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+
+            ee = (struct sock_extended_err *) CMSG_DATA(cm);
+
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            conn->zc_done += ee->ee_data - ee->ee_info + 1;
+
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                stats_add(STAT_ZEROCOPY_COPIED, ee->ee_data - ee->ee_info + 1);
+
+                if (conn->zerocopy) {
+                    log_debug(conn->logger, 0, "MSG_ZEROCOPY of connection(%d)"
+                              " is copied, turn it off.", conn->conn_fd);
+                    conn->zerocopy = 0;
+                }
+            }
+        }
+    }
+
+    if (errno != EAGAIN) {
+        log_error(conn->logger, errno, "read the error queue of "
+                  "connection(%d) failed.", conn->conn_fd);
+    }
+
+    while ((r = conn->zc_waiting) != NULL && r->zc_last <= conn->zc_done) {
+        conn->zc_waiting = r->zc_next;
+        mem_pool_destroy(r->pool);
+    }
+}
+
+/**
+ * The kernel may still send from the pages of a connection's MSG_ZEROCOPY
+ * sends after it's done with, e.g. the client has gone, so its fd is kept
+ * open to read their notifications. The connection is out of the event
+ * driver and the notifications are read by the timer of "net".
+ */
+static void tcp_server_zerocopy_park(tcp_server_t *server,
+        tcp_connection_t *c)
+{
+    if (c->request != NULL && c->request->pool != NULL) {
+        mem_pool_destroy(c->request->pool);
+    }
+
+    c->request = NULL;
+    c->zc_close = 1;
+    c->zc_deadline = time_current_msecs + ZEROCOPY_LINGER;
+
+    c->next = server->zc_parked;
+    server->zc_parked = c;
+
+    log_debug(c->logger, 0, "connection(%d) is parked until its "
+              "MSG_ZEROCOPY sends are done.", c->conn_fd);
+}
+
+/**
+ * Close the parked connections whose sends are done, or which waited for
+ * ZEROCOPY_LINGER msecs, by a reset which drops what is not sent before
+ * the pools go. return the connections still parked.
+ */
+uint_t tcp_server_zerocopy_reap(tcp_server_t *server)
+{
+    uint_t             n;
+    tcp_connection_t  *c, **prev;
+
+    n = 0;
+    prev = &server->zc_parked;
+
+    while ((c = *prev) != NULL) {
+        tcp_server_zerocopy_read(c);
+
+        if (c->zc_waiting != NULL
+            && (int) (c->zc_deadline - time_current_msecs) > 0)
+        {
+            prev = (tcp_connection_t **) &c->next;
+            n++;
+            continue;
+        }
+
+        *prev = c->next;
+
+        if (c->zc_waiting != NULL) {
+            log_warn(c->logger, 0, "MSG_ZEROCOPY sends of connection(%d) "
+                     "are not done after %d msecs, reset it.", c->conn_fd,
+                     ZEROCOPY_LINGER);
+            (void) set_linger_reset(c->conn_fd);
+        }
+
+        close(c->conn_fd);
+        tcp_free_connection(server, c);
+    }
+
+    return n;
+}
+
+/**
+ * Stop accepting new connections and close the idle ones, the connections
+ * which are in the middle of a request are closed once it's replied.
+ */
+void tcp_server_shutdown(tcp_server_t *server)
+{
+    uint_t            i;
+    tcp_connection_t *conn;
+
+    server->draining = 1;
+
+    if (server->listen_conn != NULL) {
+        tcp_close_connection(server, server->listen_conn);
+        server->listen_conn = NULL;
+    }
+
+    for (i = 0; i < server->connections; i++) {
+        conn = server->conns + i;
+
+        if (conn->conn_fd != -1 && !tcp_connection_busy(conn)) {
+            tcp_close_connection(server, conn);
+        }
+    }
+}
+
+uint_t tcp_server_busy_connections(tcp_server_t *server)
+{
+    uint_t            i, n;
+    tcp_connection_t *conn;
+
+    for (i = 0, n = 0; i < server->connections; i++) {
+        conn = server->conns + i;
+
+        if (conn->conn_fd != -1 && tcp_connection_busy(conn)) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * The sends of MSG_ZEROCOPY which are not done are dropped by a reset,
+ * then their pools can go. The parked connections are in "conns" too.
+ */
+void tcp_server_close_connections(tcp_server_t *server)
+{
+    uint_t            i;
+    tcp_connection_t *conn;
+
+    server->zc_parked = NULL;
+
+    for (i = 0; i < server->connections; i++) {
+        conn = server->conns + i;
+
+        if (conn->conn_fd == -1) {
+            continue;
+        }
+
+        if (conn->zc_waiting != NULL
+            || (conn->request != NULL
+                && conn->request->zc_last > conn->zc_done))
+        {
+            (void) set_linger_reset(conn->conn_fd);
+        }
+
+        if (conn->events != EV_NONE_EVENT) {
+            del_event(server->event_driver, conn, conn->events);
+        }
+
+        close(conn->conn_fd);
+        tcp_free_connection(server, conn);
+    }
+}
+
 int connection_pool_init(tcp_server_t *server)
 {
     int               i;
@@ -279,9 +890,11 @@ int connection_pool_init(tcp_server_t *server)
     for (next = NULL, i = server->connections - 1; i >= 0; i--) {
         conn = conn_pool + i;
         conn->next = next;
+        conn->conn_fd = -1;
         next = conn; 
     }
 
+    server->conns = conn_pool;
     server->connection_pool = conn_pool;
 
     return TCP_SRV_OK;
@@ -294,7 +907,7 @@ tcp_connection_t *tcp_get_connection(tcp_server_t *server, int fd)
 
     conn_pool = server->connection_pool;
 
-    if (conn_pool == NULL) {
+    if (conn_pool == NULL || server->conn_used >= server->conn_limit) {
         return NULL;
     }
 
@@ -309,6 +922,7 @@ tcp_connection_t *tcp_get_connection(tcp_server_t *server, int fd)
     conn = conn_pool;
     conn_pool = conn->next;
     server->connection_pool = conn_pool;
+    server->conn_used++;
 
     memset(conn, 0, sizeof(tcp_connection_t));
 
@@ -330,8 +944,19 @@ void tcp_free_connection(tcp_server_t *server, tcp_connection_t *c)
         mem_pool_destroy(r->pool);
     }
 
+    /* the sends are done, or dropped by "set_linger_reset" */
+    while ((r = c->zc_waiting) != NULL) {
+        c->zc_waiting = r->zc_next;
+        mem_pool_destroy(r->pool);
+    }
+
     c->next = server->connection_pool;
     server->connection_pool = c;
+    server->conn_used--;
+
+    if (!c->is_listen) {
+        stats_dec(STAT_CONNECTIONS);
+    }
 
     c->conn_fd = -1;
     c->logger = NULL;
@@ -340,6 +965,31 @@ void tcp_free_connection(tcp_server_t *server, tcp_connection_t *c)
     c->pool = NULL;
 }
 
+/**
+ * close a connection, it's parked instead while the kernel may send from
+ * the buffers of its requests, see "tcp_server_zerocopy_park".
+ */
+void tcp_close_connection(tcp_server_t *server, tcp_connection_t *c)
+{
+    if (c->events != EV_NONE_EVENT) {
+        del_event(server->event_driver, c, c->events);
+    }
+
+    /* the response being sent may have MSG_ZEROCOPY sends too */
+    if (c->request != NULL && c->request->zc_last > c->zc_done) {
+        tcp_request_release(c, c->request);
+        c->request = NULL;
+    }
+
+    if (c->zc_waiting != NULL) {
+        tcp_server_zerocopy_park(server, c);
+        return;
+    }
+
+    close(c->conn_fd);
+    tcp_free_connection(server, c);
+}
+
 tcp_request_t *tcp_request_init(tcp_connection_t *conn)
 {
     uint_t           req_buffer_size;
@@ -347,6 +997,7 @@ tcp_request_t *tcp_request_init(tcp_connection_t *conn)
     buffer_t        *b, *b1;
     mem_pool_t      *pool;
     tcp_request_t   *r;
+    request_init_fp  init;
 
     req_buffer_size = conn->server->request_buf_size;
     
@@ -379,6 +1030,7 @@ tcp_request_t *tcp_request_init(tcp_connection_t *conn)
     b->end = b->buffer + req_buffer_size;
     b->last = b->buffer;
     b->next = NULL;
+    b->in_file = 0;
 
     r->buffers = b;
     r->last_buffer = b;
@@ -394,6 +1046,7 @@ tcp_request_t *tcp_request_init(tcp_connection_t *conn)
     b1->end = b1->buffer + req_buffer_size;
     b1->last = b1->buffer;
     b1->next = NULL;
+    b1->in_file = 0;
 
     r->response = b1;
     r->last_rep_buf = b1;
@@ -402,11 +1055,23 @@ tcp_request_t *tcp_request_init(tcp_connection_t *conn)
     r->done = 0;
     r->finish = 0;
     r->error = 0;
+    r->start_time = 0;
+    r->unparsed = 0;
+    r->ingest = NULL;
+    r->ingest_tried = 0;
+    r->zerocopy = -1;
+    r->zc_last = 0;
+    r->zc_next = NULL;
 
     r->pool = pool;
     r->logger = conn->logger;
 
-    if (protocol_init(r) == PROTOCOL_ERROR) {
+    init = conn->server->protocol_init;
+    if (init == NULL) {
+        init = protocol_init;
+    }
+
+    if (init(r) == PROTOCOL_ERROR) {
         return NULL;
     }
 
@@ -423,6 +1088,22 @@ int tcp_request_process(tcp_request_t *r, int ret)
     buf = r->last_buffer;
 
     if (ret == PROTOCOL_OK) {
+        if (!r->ingest_tried && r->protocol->type == PUT_T
+            && r->protocol->data_len != 0)
+        {
+            r->ingest_tried = 1;
+
+            switch (queue_ingest_start(r)) {
+            case QUEUE_OK:
+                return TCP_SRV_OK;
+            case QUEUE_ERROR:
+                r->error = -1;
+                r->conn->dead_events = EV_READ_EVENT | EV_WRITE_EVENT;
+                r->conn->close = 1;
+                goto response;
+            }
+        }
+
         if (buf->last != buf->end) {
             return TCP_SRV_OK;
         }
@@ -439,6 +1120,7 @@ int tcp_request_process(tcp_request_t *r, int ret)
         new_buf->last = new_buf->buffer;
         new_buf->end = new_buf->buffer + BUFFER_MIN_SIZE;
         new_buf->next = NULL;
+        new_buf->in_file = 0;
 
         buf->next = new_buf;
 
@@ -448,9 +1130,11 @@ int tcp_request_process(tcp_request_t *r, int ret)
     } else if (ret == PROTOCOL_DONE) {
         r->done = 1;
 
-        /**
-         * TODO 激发对应的队列线程去持久化
-         */
+        stats_inc(STAT_REQUESTS + r->protocol->type);
+
+        if (queue_request_process(r) != QUEUE_OK) {
+            r->error = -1;
+        }
 #ifdef DEBUG
         u_char old;
 
@@ -483,6 +1167,8 @@ int tcp_request_process(tcp_request_t *r, int ret)
 
     } else {
         r->error = ret;
+
+        stats_inc(STAT_PARSE_ERRORS + (ret > 0 ? ret : 0));
         
         if (r->error != -1) {
             log_error(r->logger, 0, "Request is error(%s)",
@@ -506,42 +1192,344 @@ int tcp_request_finish(tcp_request_t *r)
 
     conn = r->conn;
 
-    tcp_respone_generate(r);
+    if (conn->server->respone_generate != NULL) {
+        conn->server->respone_generate(r);
+    } else {
+        tcp_respone_generate(r);
+    }
    
+    /* the request is released once its response has been sent */
     tcp_server_send(conn);
 
-    if (r->finish) {
-        mem_pool_destroy(r->pool);
-        conn->request = NULL;
-    }
-
     return TCP_SRV_OK;
 }
 
 void tcp_respone_generate(tcp_request_t *r)
 {
-    buffer_t *buf;
-
-    buf = r->response;
-
     switch (r->protocol->type) {
     case PUT_T:
         if (r->error) {
-            sprintf((char *) buf->last, "error\r\n");
-            buf->last += 7;
+            tcp_response_printf(r, "error\r\n");
         } else {
-            sprintf((char *) buf->last, "ok\r\n");
-            buf->last += 4;
+            tcp_response_printf(r, "ok\r\n");
         }
+
+        break;
     case GET_T:
+        if (r->error) {
+            tcp_response_printf(r, "error\r\n");
+        } else {
+            tcp_response_printf(r, "end\r\n");
+        }
+
         break;
     case QUEUE_T:
+    case COMMIT_T:
+    case ACK_T:
+        if (r->error) {
+            tcp_response_printf(r, "error\r\n");
+        } else {
+            tcp_response_printf(r, "ok\r\n");
+        }
+
         break;
     case LIST_T:
+        tcp_respone_list(r);
+        break;
+    case STATS_T:
+        tcp_respone_stats(r);
         break;
     }
 }
 
+/**
+ * one "stat <name> <value>" line for each counter, ends with "end".
+ */
+static void tcp_respone_stats(tcp_request_t *r)
+{
+    uint_t       i;
+    uint64_t     counters[STAT_MAX];
+    histogram_t  h;
+
+    stats_merge(counters);
+
+    tcp_response_printf(r, "stat uptime %lu\r\n", (u_long) stats_uptime());
+
+    for (i = 0; i < STAT_MAX; i++) {
+        tcp_response_printf(r, "stat %s %llu\r\n", stats_names[i], 
+                            (unsigned long long) counters[i]);
+    }
+
+    for (i = 0; i < PROTOCOL_TYPE_NUM; i++) {
+        stats_merge_latency(i, &h);
+
+        if (h.total == 0) {
+            continue;
+        }
+
+        tcp_response_printf(r, 
+                "stat latency_%s_count %llu\r\n"
+                "stat latency_%s_mean %llu\r\n"
+                "stat latency_%s_p50 %llu\r\n"
+                "stat latency_%s_p99 %llu\r\n"
+                "stat latency_%s_p999 %llu\r\n"
+                "stat latency_%s_max %llu\r\n",
+                protocol_type_names[i], (unsigned long long) h.total,
+                protocol_type_names[i],
+                (unsigned long long) histogram_mean(&h),
+                protocol_type_names[i],
+                (unsigned long long) histogram_percentile(&h, 50),
+                protocol_type_names[i],
+                (unsigned long long) histogram_percentile(&h, 99),
+                protocol_type_names[i],
+                (unsigned long long) histogram_percentile(&h, 99.9),
+                protocol_type_names[i], (unsigned long long) h.max);
+    }
+
+    tcp_respone_queue_stats(r);
+
+#ifdef LOOP_STATS
+    tcp_respone_loop_stats(r);
+#endif
+
+#ifdef POOL_STATS
+    tcp_respone_pool_stats(r);
+#endif
+
+    tcp_response_printf(r, "end\r\n");
+}
+
+static void tcp_respone_queue_stats(tcp_request_t *r)
+{
+    uint_t            i, n;
+    queue_snapshot_t *snaps, *sn;
+
+    snaps = queue_snapshot(&n);
+
+    for (i = 0; i < n; i++) {
+        sn = &snaps[i];
+
+        tcp_response_printf(r, 
+                "stat queue_%s_depth %llu\r\n"
+                "stat queue_%s_bytes %llu\r\n"
+                "stat queue_%s_dropped %llu\r\n"
+                "stat queue_%s_rejected %llu\r\n"
+                "stat queue_%s_expired %llu\r\n"
+                "stat queue_%s_delayed %llu\r\n"
+                "stat queue_%s_inflight %llu\r\n"
+                "stat queue_%s_redelivered %llu\r\n",
+                sn->name, (unsigned long long) sn->depth,
+                sn->name, (unsigned long long) sn->bytes,
+                sn->name, (unsigned long long) sn->dropped,
+                sn->name, (unsigned long long) sn->rejected,
+                sn->name, (unsigned long long) sn->expired,
+                sn->name, (unsigned long long) sn->delayed,
+                sn->name, (unsigned long long) sn->inflight,
+                sn->name, (unsigned long long) sn->redelivered);
+    }
+
+    free(snaps);
+}
+
+/**
+ * one "queue <name> <depth> <bytes> <age_ms> <lag>" line for each queue,
+ * ends with "end". "age_ms" is of the oldest message, "lag" is the
+ * messages not consumed yet.
+ */
+static void tcp_respone_list(tcp_request_t *r)
+{
+    uint_t            i, n;
+    queue_snapshot_t *snaps, *sn;
+
+    snaps = queue_snapshot(&n);
+
+    for (i = 0; i < n; i++) {
+        sn = &snaps[i];
+
+        tcp_response_printf(r, "queue %s %llu %llu %llu %llu\r\n", sn->name,
+                            (unsigned long long) sn->depth,
+                            (unsigned long long) sn->bytes,
+                            (unsigned long long) sn->age,
+                            (unsigned long long) sn->lag);
+    }
+
+    free(snaps);
+
+    tcp_response_printf(r, "end\r\n");
+}
+
+#ifdef LOOP_STATS
+
+static void tcp_respone_loop_stats(tcp_request_t *r)
+{
+    loop_stats_t ls;
+
+    stats_merge_loop(&ls);
+
+    tcp_response_printf(r, 
+            "stat loop_iterations %llu\r\n"
+            "stat loop_events %llu\r\n"
+            "stat loop_events_max %llu\r\n"
+            "stat loop_blocked_nsecs %llu\r\n"
+            "stat loop_busy_nsecs %llu\r\n"
+            "stat loop_slowest_handler %s\r\n"
+            "stat loop_slowest_handler_nsecs %llu\r\n"
+            "stat loop_lag_p50 %llu\r\n"
+            "stat loop_lag_p99 %llu\r\n"
+            "stat loop_lag_p999 %llu\r\n"
+            "stat loop_lag_max %llu\r\n",
+            (unsigned long long) ls.iterations,
+            (unsigned long long) ls.events,
+            (unsigned long long) ls.max_events,
+            (unsigned long long) ls.blocked,
+            (unsigned long long) ls.busy,
+            event_handler_name(ls.last_slowest_handler),
+            (unsigned long long) ls.last_slowest,
+            (unsigned long long) histogram_percentile(&ls.lag, 50),
+            (unsigned long long) histogram_percentile(&ls.lag, 99),
+            (unsigned long long) histogram_percentile(&ls.lag, 99.9),
+            (unsigned long long) ls.lag.max);
+}
+
+#endif
+
+#ifdef POOL_STATS
+
+/* the live pools, summed by name */
+static void tcp_respone_pool_stats(tcp_request_t *r)
+{
+    int              i, n;
+    mem_pool_usage_t usage[MEM_POOL_NAMES_MAX];
+
+    n = mem_pool_usage(usage, MEM_POOL_NAMES_MAX);
+
+    for (i = 0; i < n; i++) {
+        tcp_response_printf(r, 
+                "stat pool_%s_pools %u\r\n"
+                "stat pool_%s_bytes %lu\r\n"
+                "stat pool_%s_requested %lu\r\n"
+                "stat pool_%s_wasted %lu\r\n"
+                "stat pool_%s_large %u\r\n"
+                "stat pool_%s_large_bytes %lu\r\n"
+                "stat pool_%s_chunks %u\r\n"
+                "stat pool_%s_high_water %lu\r\n",
+                usage[i].name, usage[i].pools,
+                usage[i].name, (u_long) usage[i].total,
+                usage[i].name, (u_long) usage[i].requested,
+                usage[i].name, (u_long) usage[i].wasted,
+                usage[i].name, usage[i].large,
+                usage[i].name, (u_long) usage[i].large_bytes,
+                usage[i].name, usage[i].chunks,
+                usage[i].name, (u_long) usage[i].high_water);
+    }
+}
+
+#endif
+
+/**
+ * return a response buffer which has "size" bytes free at least, a new one
+ * is chained if the last one is full.
+ */
+buffer_t *tcp_response_buffer(tcp_request_t *r, size_t size)
+{
+    u_char   *p;
+    buffer_t *buf;
+
+    buf = r->last_rep_buf;
+
+    if ((size_t) (buf->end - buf->last) >= size) {
+        return buf;
+    }
+
+    if (size < BUFFER_MIN_SIZE) {
+        size = BUFFER_MIN_SIZE;
+    }
+
+    p = pmalloc(r->pool, size + sizeof(buffer_t));
+    if (p == NULL) {
+        log_error(r->logger, 0, "alloc response buffer failed.");
+        return NULL;
+    }
+
+    buf = (buffer_t *) p;
+
+    buf->buffer = p + sizeof(buffer_t);
+    buf->last = buf->buffer;
+    buf->end = buf->buffer + size;
+    buf->next = NULL;
+    buf->in_file = 0;
+
+    r->last_rep_buf->next = buf;
+    r->last_rep_buf = buf;
+
+    if (r->response == NULL) {
+        r->response = buf;
+    }
+
+    return buf;
+}
+
+/**
+ * chain "len" bytes of "fd" from "pos" to the response, the next printf
+ * goes to a new buffer.
+ */
+buffer_t *tcp_response_file(tcp_request_t *r, int fd, off_t pos, size_t len)
+{
+    buffer_t *buf;
+
+    buf = pcalloc(r->pool, sizeof(buffer_t));
+    if (buf == NULL) {
+        log_error(r->logger, 0, "alloc response buffer failed.");
+        return NULL;
+    }
+
+    buf->in_file = 1;
+    buf->fd = fd;
+    buf->file_pos = pos;
+    buf->file_last = pos + len;
+
+    r->last_rep_buf->next = buf;
+    r->last_rep_buf = buf;
+
+    if (r->response == NULL) {
+        r->response = buf;
+    }
+
+    return buf;
+}
+
+int tcp_response_printf(tcp_request_t *r, const char *fmt, ...)
+{
+    int       n;
+    va_list   args;
+    buffer_t *buf;
+
+    buf = r->last_rep_buf;
+
+    va_start(args, fmt);
+    n = vsnprintf((char *) buf->last, buf->end - buf->last, fmt, args);
+    va_end(args);
+
+    if (n < 0) {
+        return TCP_SRV_ERROR;
+    }
+
+    if (n >= buf->end - buf->last) {
+        buf = tcp_response_buffer(r, n + 1);
+        if (buf == NULL) {
+            return TCP_SRV_ERROR;
+        }
+
+        va_start(args, fmt);
+        vsnprintf((char *) buf->last, buf->end - buf->last, fmt, args);
+        va_end(args);
+    }
+
+    buf->last += n;
+
+    return n;
+}
+
 /**
  * error: return errno
  * success: return 0 
@@ -577,3 +1565,38 @@ int set_nodelay(int fd)
     return 0;
 }
 
+/**
+ * error: return errno
+ * success: return 0 
+ */
+int set_zerocopy(int fd)
+{
+    int zerocopy = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &zerocopy, sizeof(int)) == -1)
+    {
+        return errno;
+    }
+
+    return 0;
+}
+
+/**
+ * close() resets the connection and drops the data not sent.
+ * error: return errno
+ * success: return 0 
+ */
+int set_linger_reset(int fd)
+{
+    struct linger l;
+
+    l.l_onoff = 1;
+    l.l_linger = 0;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l)) == -1) {
+        return errno;
+    }
+
+    return 0;
+}
+
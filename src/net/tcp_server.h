@@ -15,14 +15,32 @@
 #define BUFFER_MIN_SIZE 1024
 #define BUFFER_MAX_SIZE 1024 * 1204 * 10
 
+/* smaller buffers of a zerocopy response are written as usual */
+#define ZEROCOPY_BUFFER_MIN 4096
+#define ZEROCOPY_LINGER     3000    /* msecs a closed connection waits */
+#define ZEROCOPY_REAP_TICK  10      /* msecs its notifications are read in */
+
 typedef struct sockaddr_in xpe_sockaddr_in;
 typedef struct sockaddr xpe_sockaddr;
 
+typedef int (*request_init_fp) (tcp_request_t *r);
+typedef void (*respone_generate_fp) (tcp_request_t *r);
+
+/**
+ * A buffer of a response may be a range of a file, "file_pos" is moved
+ * forward by "sendfile" as it's sent. The file must be kept open until the
+ * pool of the request is destroyed, see "mem_pool_cleanup_add".
+ */
 typedef struct {
     u_char *buffer;
     u_char *end;
     u_char *last;
     void   *next;
+
+    int     in_file;
+    int     fd;
+    off_t   file_pos;
+    off_t   file_last;
 } buffer_t;
 
 struct tcp_request_s {
@@ -41,6 +59,24 @@ struct tcp_request_s {
     int                  finish;
     int                  error;
 
+    uint64_t             start_time;    /* nsecs, first byte read */
+
+    /* bytes at the end of the last buffer not parsed yet */
+    size_t               unparsed;
+
+    /* the payload of a large PUT is spliced into the queue's file */
+    queue_ingest_t      *ingest;
+    int                  ingest_tried;
+
+    /**
+     * zerocopy: -1 not decided, 0 or 1 for the response.
+     * zc_last: the MSG_ZEROCOPY sends of the connection after the last one
+     *     of this request, the buffers are in use until as many are done.
+     */
+    int                  zerocopy;
+    uint64_t             zc_last;
+    tcp_request_t       *zc_next;
+
     mem_pool_t          *pool;
     logger_t            *logger;    
 };
@@ -57,6 +93,7 @@ struct tcp_connection_s {
     
     event_handler_fp     read_event_handler;
     event_handler_fp     write_event_handler;
+    event_handler_fp     error_event_handler;
 
     tcp_server_t        *server;
     tcp_request_t       *request;
@@ -66,6 +103,24 @@ struct tcp_connection_s {
 
     void                *queue;
 
+    /* in "tcp_server_parse", which parses the pipelined requests */
+    int                  receiving;
+
+    /**
+     * The requests which are sent with MSG_ZEROCOPY wait in "zc_waiting"
+     * until the kernel reports their sends done on the error queue.
+     * zc_close: close the connection once no request waits.
+     * zc_deadline: a parked connection is reset after it, see
+     *     "tcp_server_zerocopy_park".
+     */
+    int                  zerocopy;
+    uint64_t             zc_sent;
+    uint64_t             zc_done;
+    tcp_request_t       *zc_waiting;
+    tcp_request_t       *zc_last_waiting;
+    int                  zc_close;
+    uint_t               zc_deadline;
+
     mem_pool_t          *pool;
     logger_t            *logger;
 };
@@ -73,37 +128,78 @@ struct tcp_connection_s {
 struct tcp_server_s {
     uint_t               port;
     uint_t               connections;
+    uint_t               conn_limit;    /* <= connections, can be reloaded */
+    uint_t               conn_used;
 
     int                  sock_fd;
+    tcp_connection_t    *listen_conn;
+    tcp_connection_t    *conns;
     tcp_connection_t    *connection_pool;
     xpe_sockaddr_in      sa;
     net_event_driver_t  *event_driver;
 
     int                  nodelay;
     uint_t               request_buf_size;
+    size_t               zerocopy_min;  /* response bytes, 0 is never */
+    int                  draining;
+
+    /* closed, out of the event driver, their MSG_ZEROCOPY sends not done */
+    tcp_connection_t    *zc_parked;
+
+    /**
+     * protocol_init: set the parser of a new request, "protocol_init"
+     *     of protocol.c if it's NULL.
+     * respone_generate: "tcp_respone_generate" if it's NULL.
+     * close_on_reply: serve one request on a connection, e.g. http.
+     */
+    request_init_fp      protocol_init;
+    respone_generate_fp  respone_generate;
+    int                  close_on_reply;
 
     mem_pool_t          *pool;
     logger_t            *logger;
 };
 
 
+/**
+ * a connection is busy once it has read part of a request, or while the
+ * buffers of a reply may still be sent by the kernel.
+ */
+#define tcp_connection_busy(c)                                              \
+    (((c)->request != NULL                                                  \
+      && (c)->request->buffers->last != (c)->request->buffers->buffer)      \
+     || (c)->zc_waiting != NULL)
+
+
 int tcp_server_init(tcp_server_t *server);
 
+int tcp_server_inherit_socket(tcp_server_t *server);
 int tcp_server_create_socket(tcp_server_t *server);
 int tcp_server_listen(tcp_server_t *server, int s_fd);
 int tcp_server_accept(tcp_connection_t *conn);
 int tcp_server_recv(tcp_connection_t *conn);
 int tcp_server_send(tcp_connection_t *conn);
+int tcp_server_zerocopy_done(tcp_connection_t *conn);
+uint_t tcp_server_zerocopy_reap(tcp_server_t *server);
+void tcp_server_shutdown(tcp_server_t *server);
+uint_t tcp_server_busy_connections(tcp_server_t *server);
+void tcp_server_close_connections(tcp_server_t *server);
 
 int connection_pool_init(tcp_server_t *server);
 tcp_connection_t *tcp_get_connection(tcp_server_t *server, int fd);
 void tcp_free_connection(tcp_server_t *server, tcp_connection_t *c);
+void tcp_close_connection(tcp_server_t *server, tcp_connection_t *c);
 
 tcp_request_t *tcp_request_init(tcp_connection_t *conn);
 int tcp_request_process(tcp_request_t *r, int ret);
 int tcp_request_finish(tcp_request_t *r);
 void tcp_respone_generate(tcp_request_t *r);
+buffer_t *tcp_response_buffer(tcp_request_t *r, size_t size);
+buffer_t *tcp_response_file(tcp_request_t *r, int fd, off_t pos, size_t len);
+int tcp_response_printf(tcp_request_t *r, const char *fmt, ...);
 
 int set_nonblock(int fd);
 int set_nodelay(int fd);
+int set_zerocopy(int fd);
+int set_linger_reset(int fd);
 #endif  /* __TCP_SERVER_H__ */
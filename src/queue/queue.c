@@ -0,0 +1,2602 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+#define QUEUE_MSG_HEAD_LEN  64      /* "msg <id> <len>\r\n" and "\r\n" */
+
+static void *create_queue_mod_conf(mem_pool_t *pool);
+static int init_queue_mod(system_module_t *mod);
+static int process_queue_mod(system_module_t *mod);
+static int finish_queue_mod(system_module_t *mod);
+static int reload_queue_mod(system_module_t *mod, system_module_t *new_mod);
+
+static int cmd_queue_set(dynamic_array_t *args, void *mod_conf);
+static int cmd_queue_dir_set(dynamic_array_t *args, void *mod_conf);
+static int cmd_queue_sync_interval_set(dynamic_array_t *args, 
+        void *mod_conf);
+
+static void queue_destroy(queue_t *q);
+static void queue_reap(void);
+static int queue_dir_lock(logger_t *logger);
+static void queue_dir_unlock(void);
+static void queue_trash_clean(logger_t *logger);
+static int queue_manifest_load(logger_t *logger);
+static void queue_manifest_store(logger_t *logger);
+static void queue_manifest_add(queue_t *q, logger_t *logger);
+static int queue_dir_remove(u_char *path, logger_t *logger);
+static uint32_t queue_hash(string_t *name);
+static queue_slot_t *queue_registry_find(string_t *name, uint32_t hash);
+static int queue_registry_insert(queue_t *q);
+static void queue_registry_remove(queue_slot_t *slot);
+static int queue_number(string_t *value, size_t *n);
+static queue_t *queue_request_lookup(tcp_request_t *r);
+static int queue_request_put(tcp_request_t *r);
+static int queue_request_get(tcp_request_t *r);
+static int queue_request_queue(tcp_request_t *r);
+static int queue_request_conf(tcp_request_t *r, queue_conf_t *qc);
+static int queue_request_commit(tcp_request_t *r);
+static int queue_request_ack(tcp_request_t *r);
+static int queue_request_expire(tcp_request_t *r, queue_t *q,
+        uint64_t *expire);
+static int queue_request_deliver_at(tcp_request_t *r, uint64_t *at);
+static int queue_response_msg(tcp_request_t *r, queue_t *q,
+        queue_msg_t *msg);
+static int queue_ingest_checksum(queue_ingest_t *in);
+static void queue_ingest_cleanup(void *data);
+static void queue_request_release(void *data);
+
+
+typedef struct {
+    dynamic_array_t *queues;    /* element is 'queue_conf_t' */
+    string_t         dir;
+    uint_t           sync_interval;
+} xpipe_queue_mod_conf_t;
+
+static conf_command_t commands[] = {
+    { 0, xstring("queue"), cmd_queue_set },
+    { 0, xstring("dir"), cmd_queue_dir_set },
+    { 0, xstring("sync_interval"), cmd_queue_sync_interval_set },
+    conf_command_null
+};
+
+system_module_t sys_queue_module = {
+    xstring("queue"),
+    commands,
+    create_queue_mod_conf,
+    init_queue_mod,
+    process_queue_mod,
+    finish_queue_mod,
+    reload_queue_mod,
+    sys_mod_padding
+};
+
+queue_engine_t *queue_engines[] = {
+    &queue_memory_engine,
+    &queue_log_engine,
+    NULL
+};
+
+/* the files of a queue are in "<queue_data_dir>/<name>/" */
+string_t queue_data_dir = string_null;
+
+/* the data dir is used by one process, see "queue_dir_lock" */
+static int queue_dir_lock_fd = -1;
+
+static uint_t queue_sync_interval = QUEUE_SYNC_INTERVAL;
+static uint_t queue_sync_next;
+
+/**
+ * Queues are looked up by the "net" module in an open addressing table of
+ * 1 << "bits" slots, and are in the list of "queue_registry" for the
+ * syncs and "queue_snapshot", e.g. of "admin" in its own thread. A slot is
+ * the hash of the name spread by a fibonacci hash, collisions probe the
+ * next slots and a removed queue shifts the ones after it back, like the
+ * leases. "queue_dead" are the queues released and not destroyed yet.
+ */
+static queue_slot_t    *queue_registry_slots;
+static uint_t           queue_registry_bits;
+static uint_t           queue_registry_n;
+static queue_t         *queue_registry;
+static queue_t         *queue_dead;
+static uint64_t         queue_trash_seq;
+static pthread_mutex_t  queue_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the manifest is written by "net" for QUEUE and by "queue" on reload */
+static pthread_mutex_t  queue_manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define queue_registry_slot(hash, bits)                                     \
+    ((uint_t) (((uint32_t) (hash) * 2654435769U) >> (32 - (bits))))
+
+
+static void *create_queue_mod_conf(mem_pool_t *pool)
+{
+    xpipe_queue_mod_conf_t *cf;
+
+    cf = pcalloc(pool, sizeof(xpipe_queue_mod_conf_t));
+    if (cf == NULL) {
+        log_error(pool->logger, 0, "create \"queue\" module config error.");
+        return NULL;
+    }
+
+    cf->queues = dynamic_array_create(pool, 4, sizeof(queue_conf_t));
+    if (cf->queues == NULL) {
+        log_error(pool->logger, 0, "create \"queue\" module config error.");
+        return NULL;
+    }
+
+    cf->sync_interval = QUEUE_SYNC_INTERVAL;
+
+    return cf;
+}
+
+/**
+ * Create the queues declared by "queue" commands. The module only runs on
+ * its timer to sync the queues on disk, "thread on;" keeps the fsyncs out
+ * of the thread of "net".
+ */
+static int init_queue_mod(system_module_t *mod)
+{
+    uint_t                  i;
+    u_char                 *dir;
+    size_t                  len;
+    queue_conf_t           *qc;
+    xpipe_queue_mod_conf_t *cf;
+
+    cf = (xpipe_queue_mod_conf_t *) mod->mod_conf;
+
+    if (cf != NULL && cf->dir.len != 0) {
+        len = cf->dir.len;
+        dir = pcalloc(mod->pool, strlen(xpipe_install_dir_path) + len + 2);
+        if (dir == NULL) {
+            return MOD_ERROR;
+        }
+
+        if (is_full_file_name((&cf->dir))) {
+            memcpy(dir, cf->dir.data, len);
+        } else {
+            make_full_file_name(dir, cf->dir.data, len);
+        }
+    } else {
+        len = sizeof(QUEUE_DEFAULT_DIR) - 1;
+        dir = pcalloc(mod->pool, strlen(xpipe_install_dir_path) + len + 2);
+        if (dir == NULL) {
+            return MOD_ERROR;
+        }
+
+        make_full_file_name(dir, (u_char *) QUEUE_DEFAULT_DIR, len);
+    }
+
+    queue_data_dir.data = dir;
+    queue_data_dir.len = x_strlen(dir);
+
+    if (queue_dir_lock(mod->logger) == QUEUE_ERROR) {
+        return MOD_ERROR;
+    }
+
+    queue_trash_clean(mod->logger);
+
+    /* queues may be created by "QUEUE" without the "queue" block */
+    if (cf != NULL) {
+        queue_sync_interval = cf->sync_interval;
+    }
+
+    queue_sync_next = time_current_msecs + queue_sync_interval;
+    mod->timer = queue_sync_next;
+
+    if (cf == NULL) {
+        return queue_manifest_load(mod->logger) == QUEUE_OK ? MOD_OK
+                                                            : MOD_ERROR;
+    }
+
+    for (i = 0; i < cf->queues->nelts; i++) {
+        qc = dynamic_array_get_ix(cf->queues, i);
+
+        if (queue_create(qc, mod->logger) == NULL) {
+            return MOD_ERROR;
+        }
+    }
+
+    if (queue_manifest_load(mod->logger) == QUEUE_ERROR) {
+        return MOD_ERROR;
+    }
+
+    return MOD_OK;
+}
+
+/**
+ * The timer syncs the queues every "sync_interval" msecs, and promotes the
+ * delayed messages every QUEUE_DELAY_TICK msecs while there are any. A
+ * message delayed while there are none is promoted by the next sync at
+ * the latest.
+ */
+static int process_queue_mod(system_module_t *mod)
+{
+    uint_t delayed;
+
+    queue_reap();
+
+    delayed = queue_promote_all();
+
+    if ((int) (queue_sync_next - time_current_msecs) <= 0) {
+        queue_sync_all();
+        queue_sync_next = time_current_msecs + queue_sync_interval;
+    }
+
+    mod->timer = queue_sync_next;
+
+    if (delayed != 0
+        && (int) (queue_sync_next - time_current_msecs) > QUEUE_DELAY_TICK)
+    {
+        mod->timer = time_current_msecs + QUEUE_DELAY_TICK;
+    }
+
+    return MOD_OK;
+}
+
+/**
+ * "net" is finished before, no request uses the queues. The engines flush
+ * what is left in their "done_handler".
+ */
+static int finish_queue_mod(system_module_t *mod)
+{
+    queue_destroy_all();
+
+    /* the new process of an upgrade waits for it */
+    queue_dir_unlock();
+
+    return MOD_OK;
+}
+
+/**
+ * "sync_interval" is a single word read by the timer. A queue of the
+ * "queue" block which exists takes the settings "queue_configure" can
+ * change, a new one is created. A queue removed from the block is kept
+ * until it's deleted by "QUEUE". "dir" can't be changed.
+ */
+static int reload_queue_mod(system_module_t *mod, system_module_t *new_mod)
+{
+    int                     ret;
+    uint_t                  i;
+    queue_t                *q;
+    queue_conf_t           *qc;
+    xpipe_queue_mod_conf_t *cf, *ncf;
+
+    cf = (xpipe_queue_mod_conf_t *) mod->mod_conf;
+    ncf = (xpipe_queue_mod_conf_t *) new_mod->mod_conf;
+
+    if (ncf == NULL) {
+        return MOD_OK;
+    }
+
+    if (cf != NULL
+        && (ncf->dir.len != cf->dir.len
+            || (cf->dir.len != 0
+                && x_strncmp(ncf->dir.data, cf->dir.data, cf->dir.len) != 0)))
+    {
+        log_warn(mod->logger, 0, "\"dir\" can't be reloaded, keep \"%s\".",
+                 queue_data_dir.data);
+    }
+
+    queue_sync_interval = ncf->sync_interval;
+
+    ret = MOD_OK;
+
+    for (i = 0; i < ncf->queues->nelts; i++) {
+        qc = dynamic_array_get_ix(ncf->queues, i);
+
+        q = queue_acquire(&qc->name);
+
+        if (q == NULL) {
+            if (queue_create(qc, mod->logger) == NULL) {
+                ret = MOD_ERROR;
+            }
+
+            continue;
+        }
+
+        if (queue_configure(q, qc) == QUEUE_ERROR) {
+            ret = MOD_ERROR;
+        }
+
+        queue_release(q);
+    }
+
+    /* the queues of the manifest may be configured by the block */
+    queue_manifest_store(mod->logger);
+
+    log_info(mod->logger, 0, "\"queue\" module reloaded, sync interval: %d",
+             queue_sync_interval);
+
+    return ret;
+}
+
+void queue_conf_init(queue_conf_t *qc)
+{
+    qc->name.data = NULL;
+    qc->name.len = 0;
+    qc->engine = &queue_memory_engine;
+    qc->slots = QUEUE_DEFAULT_SLOTS;
+    qc->bytes = QUEUE_DEFAULT_BYTES;
+    qc->full = QUEUE_FULL_REJECT;
+    qc->segment_bytes = QUEUE_DEFAULT_SEGMENT;
+    qc->sendfile_min = QUEUE_SENDFILE_MIN;
+    qc->splice_min = QUEUE_SPLICE_MIN;
+    qc->visibility_ms = 0;
+    qc->ttl_ms = 0;
+    qc->priority = 0;
+    qc->level_engine = NULL;
+}
+
+/**
+ * engine=memory|log, slots=<messages>, bytes=<payload bytes>,
+ * full=reject|drop_oldest, segment_bytes=<size of a log segment>,
+ * sendfile_min=<the smallest payload sent from the file, 0 is never>,
+ * splice_min=<the smallest payload spliced to the file, 0 is never>,
+ * visibility_ms=<msecs a message of GET is leased for, 0 is removed>,
+ * ttl_ms=<msecs a message is kept for if PUT has no "ttl_ms", 0 is ever>,
+ * priority=on|off
+ */
+int queue_conf_set(queue_conf_t *qc, string_t *key, string_t *value)
+{
+    size_t           n;
+    queue_engine_t **engine;
+
+#define queue_key_is(k, s)                                                  \
+    ((k)->len == sizeof(s) - 1 && x_strncmp((k)->data, s, (k)->len) == 0)
+
+    if (queue_key_is(key, "engine")) {
+        for (engine = queue_engines; *engine != NULL; engine++) {
+            if (value->len == (*engine)->name.len
+                && x_strncmp(value->data, (*engine)->name.data, value->len)
+                   == 0)
+            {
+                qc->engine = *engine;
+                return QUEUE_OK;
+            }
+        }
+
+        return QUEUE_ERROR;
+    }
+
+    if (queue_key_is(key, "slots")) {
+        if (queue_number(value, &n) == QUEUE_ERROR || n == 0
+            || n > (uint_t) -1)
+        {
+            return QUEUE_ERROR;
+        }
+
+        qc->slots = n;
+        return QUEUE_OK;
+    }
+
+    if (queue_key_is(key, "bytes")) {
+        if (queue_number(value, &n) == QUEUE_ERROR || n == 0) {
+            return QUEUE_ERROR;
+        }
+
+        qc->bytes = n;
+        return QUEUE_OK;
+    }
+
+    if (queue_key_is(key, "segment_bytes")) {
+        if (queue_number(value, &n) == QUEUE_ERROR || n < 4096) {
+            return QUEUE_ERROR;
+        }
+
+        qc->segment_bytes = n;
+        return QUEUE_OK;
+    }
+
+    if (queue_key_is(key, "sendfile_min")) {
+        if (queue_number(value, &n) == QUEUE_ERROR) {
+            return QUEUE_ERROR;
+        }
+
+        qc->sendfile_min = n;
+        return QUEUE_OK;
+    }
+
+    if (queue_key_is(key, "splice_min")) {
+        if (queue_number(value, &n) == QUEUE_ERROR) {
+            return QUEUE_ERROR;
+        }
+
+        qc->splice_min = n;
+        return QUEUE_OK;
+    }
+
+    if (queue_key_is(key, "visibility_ms")) {
+        if (queue_number(value, &n) == QUEUE_ERROR || n > (uint_t) -1) {
+            return QUEUE_ERROR;
+        }
+
+        qc->visibility_ms = n;
+        return QUEUE_OK;
+    }
+
+    if (queue_key_is(key, "ttl_ms")) {
+        if (queue_number(value, &n) == QUEUE_ERROR || n > (uint_t) -1) {
+            return QUEUE_ERROR;
+        }
+
+        qc->ttl_ms = n;
+        return QUEUE_OK;
+    }
+
+    if (queue_key_is(key, "priority")) {
+        if (queue_key_is(value, "on")) {
+            qc->priority = 1;
+            return QUEUE_OK;
+        }
+
+        if (queue_key_is(value, "off")) {
+            qc->priority = 0;
+            return QUEUE_OK;
+        }
+
+        return QUEUE_ERROR;
+    }
+
+    if (queue_key_is(key, "full")) {
+        if (queue_key_is(value, "reject")) {
+            qc->full = QUEUE_FULL_REJECT;
+            return QUEUE_OK;
+        }
+
+        if (queue_key_is(value, "drop_oldest")) {
+            qc->full = QUEUE_FULL_DROP_OLDEST;
+            return QUEUE_OK;
+        }
+
+        return QUEUE_ERROR;
+    }
+
+#undef queue_key_is
+
+    return QUEUE_ERROR;
+}
+
+static int queue_number(string_t *value, size_t *n)
+{
+    size_t  i, v;
+
+    if (value->len == 0 || value->len > 18) {
+        return QUEUE_ERROR;
+    }
+
+    for (i = 0, v = 0; i < value->len; i++) {
+        if (!is_digit(value->data[i])) {
+            return QUEUE_ERROR;
+        }
+
+        v = v * 10 + (value->data[i] - '0');
+    }
+
+    *n = v;
+
+    return QUEUE_OK;
+}
+
+/**
+ * return NULL if the name is invalid or taken, the queue is ready for
+ * PUT and GET once it's returned.
+ */
+queue_t *queue_create(queue_conf_t *qc, logger_t *logger)
+{
+    int            ret;
+    size_t         i;
+    uint32_t       hash;
+    queue_t       *q;
+    mem_pool_t    *pool;
+    queue_slot_t  *slot;
+
+    if (qc->name.len == 0 || qc->name.len > QUEUE_NAME_MAX) {
+        log_error(logger, 0, "the name of queue is empty or too long.");
+        return NULL;
+    }
+
+    for (i = 0; i < qc->name.len; i++) {
+        if (!is_letter(qc->name.data[i]) && !is_digit(qc->name.data[i])
+            && qc->name.data[i] != '_')
+        {
+            log_error(logger, 0, "queue \"%.*s\" has an invalid name.",
+                      (int) qc->name.len, qc->name.data);
+            return NULL;
+        }
+    }
+
+    /* the levels are "<name>/<priority>" */
+    if (qc->priority
+        && (qc->name.len > QUEUE_NAME_MAX - 2 || qc->visibility_ms != 0))
+    {
+        log_error(logger, 0, "queue \"%.*s\" with priority has a name "
+                  "longer than %d or has \"visibility_ms\".",
+                  (int) qc->name.len, qc->name.data, QUEUE_NAME_MAX - 2);
+        return NULL;
+    }
+
+    hash = queue_hash(&qc->name);
+
+    pthread_mutex_lock(&queue_registry_lock);
+    slot = queue_registry_find(&qc->name, hash);
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    if (slot != NULL) {
+        log_error(logger, 0, "queue \"%.*s\" exists.",
+                  (int) qc->name.len, qc->name.data);
+        return NULL;
+    }
+
+    pool = mem_pool_create((u_char *) "queue", QUEUE_POOL_SIZE, logger);
+    if (pool == NULL) {
+        log_error(logger, 0, "create queue's memory pool failed.");
+        return NULL;
+    }
+
+    q = pcalloc(pool, sizeof(queue_t));
+    if (q == NULL) {
+        mem_pool_destroy(pool);
+        return NULL;
+    }
+
+    memcpy(q->name, qc->name.data, qc->name.len);
+    q->name[qc->name.len] = '\0';
+    q->hash = hash;
+
+    q->conf = *qc;
+    q->conf.name.data = q->name;
+
+    if (qc->priority) {
+        q->conf.level_engine = qc->engine;
+        q->conf.engine = &queue_priority_engine;
+    }
+
+    q->next_id = 1;
+    q->pool = pool;
+    q->logger = logger;
+
+    pthread_mutex_init(&q->lock, NULL);
+
+    if (q->conf.engine->init_handler(q) == QUEUE_ERROR) {
+        log_error(logger, 0, "init the %s engine of queue \"%s\" failed.",
+                  q->conf.engine->name.data, q->name);
+        pthread_mutex_destroy(&q->lock);
+        mem_pool_destroy(pool);
+        return NULL;
+    }
+
+    if (q->conf.visibility_ms != 0 && queue_lease_init(q) == QUEUE_ERROR) {
+        log_error(logger, 0, "init the leases of queue \"%s\" failed.",
+                  q->name);
+        queue_destroy(q);
+        return NULL;
+    }
+
+    if (queue_delay_init(q) == QUEUE_ERROR) {
+        queue_destroy(q);
+        return NULL;
+    }
+
+    /* the groups of a queue which is not kept start over with it */
+    if (queue_stored(q) && queue_group_load(q) == QUEUE_ERROR) {
+        queue_destroy(q);
+        return NULL;
+    }
+
+    /* the levels have their own */
+    if (!q->conf.priority && queue_catalog_init(q) == QUEUE_ERROR) {
+        queue_destroy(q);
+        return NULL;
+    }
+
+    /* the name may be taken while the engine is being set up */
+    pthread_mutex_lock(&queue_registry_lock);
+
+    if (queue_registry_find(&qc->name, hash) != NULL) {
+        ret = QUEUE_DECLINED;
+
+    } else {
+        ret = queue_registry_insert(q);
+    }
+
+    if (ret == QUEUE_OK) {
+        q->refs = 1;
+        q->next = queue_registry;
+
+        if (queue_registry != NULL) {
+            queue_registry->prev = q;
+        }
+
+        queue_registry = q;
+    }
+
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    if (ret != QUEUE_OK) {
+        log_error(logger, 0, "queue \"%s\" %s.", q->name,
+                  ret == QUEUE_DECLINED ? "exists" : "is not registered");
+        queue_destroy(q);
+        return NULL;
+    }
+
+    log_info(logger, 0, "queue \"%s\" is created, engine: %s, depth: %llu",
+             q->name, q->conf.engine->name.data,
+             (unsigned long long) q->depth);
+
+    return q;
+}
+
+/**
+ * Called by the "queue" module, a queue is destroyed with nothing using it.
+ * What a deleted queue keeps is not stored, its directory is removed.
+ */
+static void queue_destroy(queue_t *q)
+{
+    if (!q->deleted) {
+        queue_group_sync(q);
+    }
+
+    queue_lease_done(q);
+    q->conf.engine->done_handler(q);
+
+    /* the mark of the promoted messages is stored after the engine */
+    if (!q->deleted) {
+        queue_delay_sync(q);
+    }
+
+    queue_delay_done(q);
+
+    if (q->trash != NULL) {
+        queue_dir_remove(q->trash, q->logger);
+    }
+
+    pthread_mutex_destroy(&q->lock);
+    mem_pool_destroy(q->pool);
+}
+
+/* the queues released since the last time */
+static void queue_reap(void)
+{
+    queue_t *q, *dead;
+
+    pthread_mutex_lock(&queue_registry_lock);
+
+    dead = queue_dead;
+    queue_dead = NULL;
+
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    for (q = dead; q != NULL; q = dead) {
+        dead = q->dead;
+
+        log_info(q->logger, 0, "queue \"%s\" is destroyed.", q->name);
+
+        queue_destroy(q);
+    }
+}
+
+/* NULL if it's not found, or else it's released by "queue_release" */
+queue_t *queue_acquire(string_t *name)
+{
+    queue_t      *q;
+    uint32_t      hash;
+    queue_slot_t *slot;
+
+    hash = queue_hash(name);
+    q = NULL;
+
+    pthread_mutex_lock(&queue_registry_lock);
+
+    slot = queue_registry_find(name, hash);
+
+    if (slot != NULL) {
+        q = slot->q;
+        q->refs++;
+    }
+
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    return q;
+}
+
+/**
+ * The last reference of a deleted queue takes it from the list, it's not
+ * destroyed here but by the "queue" module, whose walks may be on it.
+ */
+void queue_release(queue_t *q)
+{
+    pthread_mutex_lock(&queue_registry_lock);
+
+    if (--q->refs == 0) {
+        if (q->prev != NULL) {
+            q->prev->next = q->next;
+        } else {
+            queue_registry = q->next;
+        }
+
+        if (q->next != NULL) {
+            q->next->prev = q->prev;
+        }
+
+        q->dead = queue_dead;
+        queue_dead = q;
+    }
+
+    pthread_mutex_unlock(&queue_registry_lock);
+}
+
+/**
+ * The messages, groups and files of the queue are gone, a PUT or GET which
+ * has it already is done with nothing. The directory is moved aside at
+ * once, so a queue of the same name may be created before it's removed.
+ */
+int queue_delete(string_t *name, logger_t *logger)
+{
+    int           ret;
+    size_t        len, tlen;
+    u_char       *dir, *trash;
+    queue_t      *q;
+    queue_slot_t *slot;
+
+    pthread_mutex_lock(&queue_registry_lock);
+
+    slot = queue_registry_find(name, queue_hash(name));
+
+    if (slot == NULL) {
+        pthread_mutex_unlock(&queue_registry_lock);
+        log_error(logger, 0, "Queue \"%.*s\" not found.",
+                  (int) name->len, name->data);
+        return QUEUE_ERROR;
+    }
+
+    q = slot->q;
+    ret = QUEUE_OK;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (queue_stored(q)) {
+        len = queue_data_dir.len + 1 + x_strlen(q->name) + 1;
+
+        tlen = len + sizeof(".18446744073709551615");
+
+        dir = malloc(len);
+        trash = pmalloc(q->pool, tlen);
+
+        if (dir == NULL || trash == NULL) {
+            ret = QUEUE_ERROR;
+
+        } else {
+            snprintf((char *) dir, len, "%s/%s", queue_data_dir.data,
+                     q->name);
+            snprintf((char *) trash, tlen, "%s/.%s.%llu",
+                     queue_data_dir.data, q->name,
+                     (unsigned long long) ++queue_trash_seq);
+
+            if (rename((char *) dir, (char *) trash) == -1) {
+                if (errno != ENOENT) {
+                    log_error(logger, errno, "rename \"%s\" to \"%s\" "
+                              "failed.", dir, trash);
+                    ret = QUEUE_ERROR;
+                }
+
+            } else {
+                q->trash = trash;
+            }
+        }
+
+        free(dir);
+    }
+
+    if (ret == QUEUE_OK) {
+        q->deleted = 1;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (ret == QUEUE_OK) {
+        /* a queue of the name created next reads no groups of this one */
+        if (q->groups_stored) {
+            queue_group_remove(q);
+        }
+
+        queue_registry_remove(slot);
+    }
+
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    if (ret == QUEUE_ERROR) {
+        return QUEUE_ERROR;
+    }
+
+    log_info(logger, 0, "queue \"%s\" is deleted, depth: %llu", q->name,
+             (unsigned long long) q->depth);
+
+    queue_release(q);
+
+    return QUEUE_OK;
+}
+
+/**
+ * The settings which the engine has set up with can't be changed:
+ * "engine", "slots", "bytes", "priority", and "visibility_ms" from or to 0.
+ * The others apply to the next messages.
+ */
+int queue_configure(queue_t *q, queue_conf_t *qc)
+{
+    queue_engine_t *engine;
+
+    engine = q->conf.priority ? q->conf.level_engine : q->conf.engine;
+
+    if (qc->engine != engine || qc->slots != q->conf.slots
+        || qc->bytes != q->conf.bytes || qc->priority != q->conf.priority
+        || (qc->visibility_ms == 0) != (q->conf.visibility_ms == 0))
+    {
+        log_error(q->logger, 0, "a setting of queue \"%s\" which can't be "
+                  "changed is changed.", q->name);
+        return QUEUE_ERROR;
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    q->conf.full = qc->full;
+    q->conf.segment_bytes = qc->segment_bytes;
+    q->conf.sendfile_min = qc->sendfile_min;
+    q->conf.splice_min = qc->splice_min;
+    q->conf.visibility_ms = qc->visibility_ms;
+    q->conf.ttl_ms = qc->ttl_ms;
+
+    if (q->conf.priority) {
+        queue_priority_configure(q);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    log_info(q->logger, 0, "queue \"%s\" is configured.", q->name);
+
+    return QUEUE_OK;
+}
+
+/* "net" is finished, nothing is acquired */
+void queue_destroy_all(void)
+{
+    queue_t *q, *next;
+
+    queue_reap();
+
+    pthread_mutex_lock(&queue_registry_lock);
+
+    q = queue_registry;
+    queue_registry = NULL;
+
+    free(queue_registry_slots);
+    queue_registry_slots = NULL;
+    queue_registry_bits = 0;
+    queue_registry_n = 0;
+
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    for ( /* void */ ; q != NULL; q = next) {
+        next = q->next;
+        queue_destroy(q);
+    }
+
+    queue_group_store_close();
+}
+
+/**
+ * The fsyncs are not done with the registry locked, or they would stall
+ * every lookup. Only the "queue" module destroys queues and it's the only
+ * walker of the list unlocked, a queue taken from the list keeps "next" so
+ * a walk which is on it goes on. A deleted queue is skipped.
+ */
+void queue_sync_all(void)
+{
+    queue_t *q;
+
+    pthread_mutex_lock(&queue_registry_lock);
+    q = queue_registry;
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    for ( /* void */ ; q != NULL; q = q->next) {
+        if (q->deleted) {
+            continue;
+        }
+
+        if (q->conf.engine->sync_handler != NULL) {
+            q->conf.engine->sync_handler(q);
+        }
+
+        queue_group_sync(q);
+        queue_delay_sync(q);
+        queue_sweep(q);
+
+        /* the gauge of leases is right without GETs */
+        if (q->leases != NULL) {
+            pthread_mutex_lock(&q->lock);
+            queue_lease_expire(q);
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+}
+
+/* the number of messages still delayed */
+uint_t queue_promote_all(void)
+{
+    uint_t   n;
+    queue_t *q;
+
+    pthread_mutex_lock(&queue_registry_lock);
+    q = queue_registry;
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    for (n = 0; q != NULL; q = q->next) {
+        if (!q->deleted) {
+            n += queue_delay_promote(q);
+        }
+    }
+
+    return n;
+}
+
+/* "<queue_data_dir>/<queue>", the directory of the segments */
+int queue_dir_open(queue_t *q)
+{
+    int     fd;
+    size_t  len;
+    u_char *dir;
+
+    len = queue_data_dir.len + 1 + x_strlen(q->name) + 1;
+
+    dir = malloc(len);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    snprintf((char *) dir, len, "%s/%s", queue_data_dir.data, q->name);
+
+    fd = open((char *) dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        log_error(q->logger, errno, "open \"%s\" failed.", dir);
+    }
+
+    free(dir);
+
+    return fd;
+}
+
+/**
+ * Only one process writes the files of the data dir. The new process of
+ * an upgrade by SIGUSR2 waits here until the old one has drained and
+ * flushed its queues, or fails after QUEUE_LOCK_WAIT msecs. The lock is
+ * released by "queue_dir_unlock" or the exit of the process.
+ */
+static int queue_dir_lock(logger_t *logger)
+{
+    int     fd;
+    uint_t  waited;
+    size_t  len;
+    u_char *path;
+
+    if (mkdir((char *) queue_data_dir.data, 0755) == -1 && errno != EEXIST) {
+        log_error(logger, errno, "create \"%s\" failed.", queue_data_dir.data);
+        return QUEUE_ERROR;
+    }
+
+    len = queue_data_dir.len + sizeof("/" QUEUE_LOCK_FILE);
+
+    path = malloc(len);
+    if (path == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    snprintf((char *) path, len, "%s/%s", queue_data_dir.data,
+             QUEUE_LOCK_FILE);
+
+    fd = open((char *) path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_error(logger, errno, "open \"%s\" failed.", path);
+        free(path);
+        return QUEUE_ERROR;
+    }
+
+    for (waited = 0; flock(fd, LOCK_EX | LOCK_NB) == -1; waited += 100) {
+        if (errno != EWOULDBLOCK && errno != EINTR) {
+            log_error(logger, errno, "lock \"%s\" failed.", path);
+            goto failed;
+        }
+
+        if (waited >= QUEUE_LOCK_WAIT) {
+            log_error(logger, 0, "\"%s\" is still locked, the data dir is "
+                      "used by another process.", path);
+            goto failed;
+        }
+
+        if (waited == 0) {
+            log_warn(logger, 0, "\"%s\" is locked, wait for the old "
+                     "process to exit.", path);
+        }
+
+        usleep(100 * 1000);
+    }
+
+    free(path);
+    queue_dir_lock_fd = fd;
+
+    return QUEUE_OK;
+
+failed:
+    close(fd);
+    free(path);
+
+    return QUEUE_ERROR;
+}
+
+static void queue_dir_unlock(void)
+{
+    if (queue_dir_lock_fd != -1) {
+        close(queue_dir_lock_fd);
+        queue_dir_lock_fd = -1;
+    }
+}
+
+/**
+ * The queues created or configured by QUEUE are in "<dir>/queues.manifest"
+ * with their settings, one by line like a "queue" command. They are
+ * created again at start after the "queue" block, a queue of the block
+ * takes the settings of the manifest which "queue_configure" can change.
+ */
+static int queue_manifest_load(logger_t *logger)
+{
+    int           ret;
+    char          line[QUEUE_MANIFEST_LINE], *tok, *eq, *last;
+    FILE         *f;
+    size_t        len;
+    u_char       *path;
+    queue_t      *q;
+    string_t      key, value;
+    queue_conf_t  qc;
+
+    len = queue_data_dir.len + sizeof("/" QUEUE_MANIFEST_FILE);
+
+    path = malloc(len);
+    if (path == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    snprintf((char *) path, len, "%s/%s", queue_data_dir.data,
+             QUEUE_MANIFEST_FILE);
+
+    f = fopen((char *) path, "r");
+    if (f == NULL) {
+        ret = errno == ENOENT ? QUEUE_OK : QUEUE_ERROR;
+
+        if (ret == QUEUE_ERROR) {
+            log_error(logger, errno, "open \"%s\" failed.", path);
+        }
+
+        free(path);
+        return ret;
+    }
+
+    ret = QUEUE_OK;
+
+    while (ret == QUEUE_OK && fgets(line, sizeof(line), f) != NULL) {
+        tok = strtok_r(line, " \n", &last);
+        if (tok == NULL) {
+            continue;
+        }
+
+        queue_conf_init(&qc);
+        qc.name.data = (u_char *) tok;
+        qc.name.len = x_strlen(tok);
+
+        while ((tok = strtok_r(NULL, " \n", &last)) != NULL) {
+            eq = strchr(tok, '=');
+
+            key.data = (u_char *) tok;
+            key.len = eq != NULL ? (size_t) (eq - tok) : 0;
+            value.data = (u_char *) eq + 1;
+            value.len = eq != NULL ? x_strlen(eq + 1) : 0;
+
+            if (eq == NULL || queue_conf_set(&qc, &key, &value) == QUEUE_ERROR)
+            {
+                log_error(logger, 0, "\"%s\" of queue \"%.*s\" in \"%s\" is "
+                          "invalid.", tok, (int) qc.name.len, qc.name.data,
+                          path);
+                ret = QUEUE_ERROR;
+                break;
+            }
+        }
+
+        if (ret == QUEUE_ERROR) {
+            break;
+        }
+
+        q = queue_acquire(&qc.name);
+
+        if (q == NULL) {
+            q = queue_create(&qc, logger);
+            if (q == NULL) {
+                ret = QUEUE_ERROR;
+                break;
+            }
+
+            q->manifest = 1;
+            continue;
+        }
+
+        /* the block sets up the engine */
+        qc.engine = q->conf.priority ? q->conf.level_engine : q->conf.engine;
+        qc.slots = q->conf.slots;
+        qc.bytes = q->conf.bytes;
+        qc.priority = q->conf.priority;
+
+        if ((qc.visibility_ms == 0) != (q->conf.visibility_ms == 0)) {
+            qc.visibility_ms = q->conf.visibility_ms;
+        }
+
+        ret = queue_configure(q, &qc);
+        q->manifest = 1;
+
+        queue_release(q);
+    }
+
+    fclose(f);
+    free(path);
+
+    return ret;
+}
+
+/**
+ * The manifest is written whole and renamed, it's removed if no queue is
+ * in it. A queue is written with the settings it has at the time.
+ */
+static void queue_manifest_store(logger_t *logger)
+{
+    int              dir_fd, fd;
+    uint_t           n;
+    size_t           len;
+    ssize_t          written;
+    u_char          *buf, *p;
+    queue_t         *q;
+    queue_engine_t  *engine;
+
+    pthread_mutex_lock(&queue_manifest_lock);
+    pthread_mutex_lock(&queue_registry_lock);
+
+    buf = malloc((queue_registry_n + 1) * QUEUE_MANIFEST_LINE);
+    if (buf == NULL) {
+        pthread_mutex_unlock(&queue_registry_lock);
+        pthread_mutex_unlock(&queue_manifest_lock);
+        log_error(logger, 0, "malloc the manifest of queues failed.");
+        return;
+    }
+
+    for (q = queue_registry, p = buf, n = 0;
+         q != NULL && n < queue_registry_n;
+         q = q->next)
+    {
+        if (q->deleted) {
+            continue;
+        }
+
+        n++;
+
+        pthread_mutex_lock(&q->lock);
+
+        if (!q->manifest) {
+            pthread_mutex_unlock(&q->lock);
+            continue;
+        }
+
+        engine = q->conf.priority ? q->conf.level_engine : q->conf.engine;
+
+        p += sprintf((char *) p, "%s engine=%.*s slots=%lu bytes=%lu "
+                     "full=%s segment_bytes=%lu sendfile_min=%lu "
+                     "splice_min=%lu visibility_ms=%lu ttl_ms=%lu "
+                     "priority=%s\n", q->name,
+                     (int) engine->name.len, engine->name.data,
+                     (u_long) q->conf.slots, (u_long) q->conf.bytes,
+                     q->conf.full == QUEUE_FULL_DROP_OLDEST
+                         ? "drop_oldest" : "reject",
+                     (u_long) q->conf.segment_bytes,
+                     (u_long) q->conf.sendfile_min,
+                     (u_long) q->conf.splice_min,
+                     (u_long) q->conf.visibility_ms,
+                     (u_long) q->conf.ttl_ms,
+                     q->conf.priority ? "on" : "off");
+
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    len = p - buf;
+
+    dir_fd = open((char *) queue_data_dir.data, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        goto failed;
+    }
+
+    if (len == 0) {
+        if (unlinkat(dir_fd, QUEUE_MANIFEST_FILE, 0) == -1 && errno != ENOENT)
+        {
+            goto failed;
+        }
+
+        goto done;
+    }
+
+    fd = openat(dir_fd, QUEUE_MANIFEST_FILE ".new",
+                O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        goto failed;
+    }
+
+    for (p = buf; len > 0; p += written, len -= written) {
+        written = write(fd, p, len);
+        if (written == -1) {
+            close(fd);
+            goto failed;
+        }
+    }
+
+    if (fdatasync(fd) == -1) {
+        close(fd);
+        goto failed;
+    }
+
+    close(fd);
+
+    if (renameat(dir_fd, QUEUE_MANIFEST_FILE ".new", dir_fd,
+                 QUEUE_MANIFEST_FILE) == -1
+        || fsync(dir_fd) == -1)
+    {
+        goto failed;
+    }
+
+done:
+
+    close(dir_fd);
+    free(buf);
+
+    pthread_mutex_unlock(&queue_manifest_lock);
+
+    return;
+
+failed:
+
+    log_error(logger, errno, "store the manifest of queues failed.");
+
+    if (dir_fd != -1) {
+        close(dir_fd);
+    }
+
+    free(buf);
+
+    pthread_mutex_unlock(&queue_manifest_lock);
+}
+
+/* "q" is created or configured by QUEUE */
+static void queue_manifest_add(queue_t *q, logger_t *logger)
+{
+    pthread_mutex_lock(&q->lock);
+    q->manifest = 1;
+    pthread_mutex_unlock(&q->lock);
+
+    queue_manifest_store(logger);
+}
+
+/**
+ * The directories of the queues deleted before a crash or exit are
+ * removed, "." is the first byte of them and never of a queue's.
+ */
+static void queue_trash_clean(logger_t *logger)
+{
+    DIR           *d;
+    size_t         len;
+    u_char        *path;
+    struct dirent *e;
+
+    queue_trash_seq = time_current_epoch_msecs;
+
+    d = opendir((char *) queue_data_dir.data);
+    if (d == NULL) {
+        return;
+    }
+
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.' || x_strcmp(e->d_name, ".") == 0
+            || x_strcmp(e->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        len = queue_data_dir.len + 1 + x_strlen(e->d_name) + 1;
+
+        path = malloc(len);
+        if (path == NULL) {
+            break;
+        }
+
+        snprintf((char *) path, len, "%s/%s", queue_data_dir.data,
+                 e->d_name);
+
+        queue_dir_remove(path, logger);
+        free(path);
+    }
+
+    closedir(d);
+}
+
+/* "path" and what is in it, the directories of a queue are not deep */
+static int queue_dir_remove(u_char *path, logger_t *logger)
+{
+    int            ret;
+    DIR           *d;
+    size_t         len;
+    u_char        *sub;
+    struct stat    st;
+    struct dirent *e;
+
+    if (lstat((char *) path, &st) == -1) {
+        return errno == ENOENT ? QUEUE_OK : QUEUE_ERROR;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink((char *) path) == -1) {
+            log_error(logger, errno, "remove \"%s\" failed.", path);
+            return QUEUE_ERROR;
+        }
+
+        return QUEUE_OK;
+    }
+
+    d = opendir((char *) path);
+    if (d == NULL) {
+        log_error(logger, errno, "open \"%s\" failed.", path);
+        return QUEUE_ERROR;
+    }
+
+    ret = QUEUE_OK;
+
+    while ((e = readdir(d)) != NULL) {
+        if (x_strcmp(e->d_name, ".") == 0 || x_strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+
+        len = x_strlen(path) + 1 + x_strlen(e->d_name) + 1;
+
+        sub = malloc(len);
+        if (sub == NULL) {
+            ret = QUEUE_ERROR;
+            break;
+        }
+
+        snprintf((char *) sub, len, "%s/%s", path, e->d_name);
+
+        if (queue_dir_remove(sub, logger) == QUEUE_ERROR) {
+            ret = QUEUE_ERROR;
+        }
+
+        free(sub);
+    }
+
+    closedir(d);
+
+    if (ret == QUEUE_OK && rmdir((char *) path) == -1) {
+        log_error(logger, errno, "remove \"%s\" failed.", path);
+        ret = QUEUE_ERROR;
+    }
+
+    return ret;
+}
+
+/* FNV-1a of the name */
+static uint32_t queue_hash(string_t *name)
+{
+    size_t    i;
+    uint32_t  h;
+
+    h = 2166136261U;
+
+    for (i = 0; i < name->len; i++) {
+        h ^= name->data[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* called with the registry locked */
+static queue_slot_t *queue_registry_find(string_t *name, uint32_t hash)
+{
+    uint_t        i, mask;
+    size_t        n;
+    queue_slot_t *slot;
+
+    if (queue_registry_slots == NULL) {
+        return NULL;
+    }
+
+    mask = (1 << queue_registry_bits) - 1;
+    n = name->len < QUEUE_REGISTRY_KEY ? name->len : QUEUE_REGISTRY_KEY;
+
+    for (i = queue_registry_slot(hash, queue_registry_bits);
+         queue_registry_slots[i].q != NULL; i = (i + 1) & mask)
+    {
+        slot = &queue_registry_slots[i];
+
+        if (slot->hash != hash || slot->len != name->len
+            || memcmp(slot->key, name->data, n) != 0)
+        {
+            continue;
+        }
+
+        if (name->len <= QUEUE_REGISTRY_KEY
+            || memcmp(slot->q->name + n, name->data + n, name->len - n) == 0)
+        {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Called with the registry locked, the table is doubled when it's 3/4
+ * full. The slots keep the hashes so they are moved without the names.
+ */
+static int queue_registry_insert(queue_t *q)
+{
+    uint_t        i, j, mask, size, bits;
+    size_t        len;
+    queue_slot_t *slots, *old;
+
+    size = queue_registry_slots != NULL ? 1U << queue_registry_bits : 0;
+
+    if ((queue_registry_n + 1) * 4 > size * 3) {
+        bits = size != 0 ? queue_registry_bits + 1 : QUEUE_REGISTRY_BITS;
+
+        if (bits > 30
+            || posix_memalign((void **) &slots, 64,
+                              (1U << bits) * sizeof(queue_slot_t)) != 0)
+        {
+            return QUEUE_ERROR;
+        }
+
+        memset(slots, 0, (1U << bits) * sizeof(queue_slot_t));
+
+        old = queue_registry_slots;
+        mask = (1U << bits) - 1;
+
+        for (i = 0; i < size; i++) {
+            if (old[i].q == NULL) {
+                continue;
+            }
+
+            for (j = queue_registry_slot(old[i].hash, bits); slots[j].q != NULL;
+                 j = (j + 1) & mask)
+            {
+                /* void */
+            }
+
+            slots[j] = old[i];
+        }
+
+        free(old);
+
+        queue_registry_slots = slots;
+        queue_registry_bits = bits;
+    }
+
+    mask = (1U << queue_registry_bits) - 1;
+
+    for (i = queue_registry_slot(q->hash, queue_registry_bits);
+         queue_registry_slots[i].q != NULL; i = (i + 1) & mask)
+    {
+        /* void */
+    }
+
+    len = x_strlen(q->name);
+
+    queue_registry_slots[i].hash = q->hash;
+    queue_registry_slots[i].len = (u_char) len;
+    memcpy(queue_registry_slots[i].key, q->name,
+           len < QUEUE_REGISTRY_KEY ? len : QUEUE_REGISTRY_KEY);
+    queue_registry_slots[i].q = q;
+
+    queue_registry_n++;
+
+    return QUEUE_OK;
+}
+
+/* called with the registry locked, the slots after it are shifted back */
+static void queue_registry_remove(queue_slot_t *slot)
+{
+    uint_t  i, j, home, mask;
+
+    mask = (1U << queue_registry_bits) - 1;
+
+    i = slot - queue_registry_slots;
+    memset(&queue_registry_slots[i], 0, sizeof(queue_slot_t));
+    queue_registry_n--;
+
+    for (j = (i + 1) & mask; queue_registry_slots[j].q != NULL;
+         j = (j + 1) & mask)
+    {
+        home = queue_registry_slot(queue_registry_slots[j].hash,
+                                   queue_registry_bits);
+
+        /* the queue stays if its home is in (i, j] cyclically */
+        if (((j - home) & mask) < ((j - i) & mask)) {
+            continue;
+        }
+
+        queue_registry_slots[i] = queue_registry_slots[j];
+        memset(&queue_registry_slots[j], 0, sizeof(queue_slot_t));
+        i = j;
+    }
+}
+
+/**
+ * The counters of the queues are copied with the registry locked, and are
+ * formatted by the caller after it's unlocked, so a lookup only waits for
+ * the copy. The array is freed by the caller, NULL if there is no queue or
+ * it can't be allocated.
+ */
+queue_snapshot_t *queue_snapshot(uint_t *n)
+{
+    uint_t            i;
+    queue_t          *q;
+    queue_snapshot_t *snaps, *sn;
+
+    *n = 0;
+
+    pthread_mutex_lock(&queue_registry_lock);
+
+    if (queue_registry_n == 0) {
+        pthread_mutex_unlock(&queue_registry_lock);
+        return NULL;
+    }
+
+    snaps = malloc(queue_registry_n * sizeof(queue_snapshot_t));
+    if (snaps == NULL) {
+        pthread_mutex_unlock(&queue_registry_lock);
+        return NULL;
+    }
+
+    for (q = queue_registry, i = 0;
+         q != NULL && i < queue_registry_n;
+         q = q->next)
+    {
+        if (q->deleted) {
+            continue;
+        }
+
+        sn = &snaps[i++];
+
+        memcpy(sn->name, q->name, sizeof(q->name));
+        sn->depth = q->depth;
+        sn->bytes = q->bytes;
+        sn->dropped = q->dropped;
+        sn->rejected = q->rejected;
+        sn->expired = q->expired;
+        sn->delayed = q->delayed;
+        sn->inflight = q->inflight;
+        sn->redelivered = q->redelivered;
+        sn->age = queue_catalog_age(q);
+        sn->lag = queue_catalog_lag(q);
+    }
+
+    pthread_mutex_unlock(&queue_registry_lock);
+
+    *n = i;
+
+    return snaps;
+}
+
+int queue_put(queue_t *q, queue_msg_t *msg)
+{
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->deleted) {
+        pthread_mutex_unlock(&q->lock);
+        return QUEUE_ERROR;
+    }
+
+    msg->id = q->next_id;
+
+    ret = q->conf.engine->put_handler(q, msg);
+
+    if (ret == QUEUE_OK) {
+        q->next_id++;
+        q->depth++;
+        q->bytes += msg->len;
+    } else if (ret == QUEUE_FULL) {
+        q->rejected++;
+    }
+
+    queue_catalog_update(q);
+
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+/**
+ * Called by the timer of the "queue" module, the expired messages from the
+ * oldest one are removed. The lock is taken for QUEUE_SWEEP_BATCH messages
+ * at most so PUT and GET wait little, and a call stops at QUEUE_SWEEP_MAX
+ * so the loop it runs in goes on, the rest is left to the next call. An
+ * expired message after one which is not is skipped by GET until it's the
+ * oldest.
+ */
+void queue_sweep(queue_t *q)
+{
+    uint_t       n, total;
+    uint64_t     now;
+    queue_msg_t  msg;
+
+    now = time_current_epoch_msecs;
+
+    for (total = 0; total < QUEUE_SWEEP_MAX; total += n) {
+        pthread_mutex_lock(&q->lock);
+
+        for (n = 0; n < QUEUE_SWEEP_BATCH; n++) {
+            if (q->conf.engine->peek_handler(q, &msg) != QUEUE_OK
+                || !queue_msg_expired(&msg, now))
+            {
+                break;
+            }
+
+            q->conf.engine->pop_handler(q);
+            q->depth--;
+            q->bytes -= msg.len;
+            q->expired++;
+        }
+
+        queue_catalog_update(q);
+
+        pthread_mutex_unlock(&q->lock);
+
+        if (n < QUEUE_SWEEP_BATCH) {
+            break;
+        }
+    }
+}
+
+/**
+ * Called with the queue locked. Remove the oldest messages which every
+ * group has committed and which are acked, a message which is leased keeps
+ * the ones after it.
+ */
+void queue_trim(queue_t *q)
+{
+    uint64_t       min;
+    queue_msg_t    msg;
+    queue_group_t *g;
+
+    if (q->groups == NULL && q->leases == NULL) {
+        return;
+    }
+
+    min = (uint64_t) -1;
+
+    for (g = q->groups; g != NULL; g = g->next) {
+        if (g->committed < min) {
+            min = g->committed;
+        }
+    }
+
+    q->committed = min;
+
+    if (q->leases != NULL && q->leases->cursor.id < min) {
+        min = q->leases->cursor.id;
+    }
+
+    while (q->conf.engine->peek_handler(q, &msg) == QUEUE_OK
+           && msg.id < min)
+    {
+        if (q->leases != NULL && queue_lease_held(q, msg.id)) {
+            break;
+        }
+
+        q->conf.engine->pop_handler(q);
+        q->depth--;
+        q->bytes -= msg.len;
+    }
+
+    queue_catalog_update(q);
+}
+
+/* gather the payload of a PUT which may be split in request buffers */
+u_char *queue_msg_copy(queue_msg_t *msg, u_char *dst)
+{
+    size_t    n, left;
+    u_char   *p;
+    buffer_t *buf;
+
+    left = msg->len;
+    p = msg->data;
+
+    /* a payload which is not in the request is in one piece */
+    if (msg->buf == NULL) {
+        return x_memcpy_n(dst, p, left);
+    }
+
+    for (buf = msg->buf; left > 0 && buf != NULL; buf = buf->next) {
+        if (p == NULL) {
+            p = buf->buffer;
+        }
+
+        n = buf->last - p;
+        if (n > left) {
+            n = left;
+        }
+
+        dst = x_memcpy_n(dst, p, n);
+        left -= n;
+        p = NULL;
+    }
+
+    return dst;
+}
+
+/**
+ * The hook of "tcp_request_process" for a parsed request, the messages of
+ * GET are put in the response here.
+ */
+int queue_request_process(tcp_request_t *r)
+{
+    switch (r->protocol->type) {
+    case PUT_T:
+        return queue_request_put(r);
+    case GET_T:
+        return queue_request_get(r);
+    case QUEUE_T:
+        return queue_request_queue(r);
+    case COMMIT_T:
+        return queue_request_commit(r);
+    case ACK_T:
+        return queue_request_ack(r);
+    }
+
+    return QUEUE_OK;
+}
+
+/* the queue is released with the request */
+static queue_t *queue_request_lookup(tcp_request_t *r)
+{
+    queue_t            *q;
+    string_t            name;
+    mem_pool_cleanup_t *c;
+
+    if (protocol_header(r->protocol, "queue", &name) == PROTOCOL_ERROR) {
+        log_error(r->logger, 0, "Request has no \"queue\" header.");
+        return NULL;
+    }
+
+    c = mem_pool_cleanup_add(r->pool, 0);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    q = queue_acquire(&name);
+    if (q == NULL) {
+        log_error(r->logger, 0, "Queue \"%.*s\" not found.",
+                  (int) name.len, name.data);
+        return NULL;
+    }
+
+    c->data = q;
+    c->handler = queue_request_release;
+
+    return q;
+}
+
+static void queue_request_release(void *data)
+{
+    queue_release(data);
+}
+
+static int queue_request_put(tcp_request_t *r)
+{
+    size_t       n;
+    uint64_t     at;
+    queue_t     *q;
+    string_t     value;
+    protocol_t  *pro;
+    queue_msg_t  msg;
+
+    q = queue_request_lookup(r);
+    if (q == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    /* spliced and committed already */
+    if (r->ingest != NULL) {
+        return r->ingest->done == 1 ? QUEUE_OK : QUEUE_ERROR;
+    }
+
+    if (queue_request_expire(r, q, &msg.expire) == QUEUE_ERROR
+        || queue_request_deliver_at(r, &at) == QUEUE_ERROR)
+    {
+        return QUEUE_ERROR;
+    }
+
+    pro = r->protocol;
+
+    msg.priority = 0;
+
+    /* a queue without "priority" takes any */
+    if (protocol_header(pro, "priority", &value) == PROTOCOL_OK) {
+        if (queue_number(&value, &n) == QUEUE_ERROR
+            || n >= QUEUE_PRIORITY_LEVELS)
+        {
+            log_error(r->logger, 0, "Request has an invalid \"priority\".");
+            return QUEUE_ERROR;
+        }
+
+        msg.priority = n;
+    }
+
+    msg.len = pro->data_len;
+    msg.data = pro->data_start;
+    msg.buf = pro->data_start_buf;
+
+    if (at > time_current_epoch_msecs) {
+        return queue_delay_put(q, &msg, at);
+    }
+
+    return queue_put(q, &msg);
+}
+
+/**
+ * "deliver_at=<msecs of the epoch>" or "delay_ms=<msecs>", 0 if the PUT
+ * has neither of them.
+ */
+static int queue_request_deliver_at(tcp_request_t *r, uint64_t *at)
+{
+    size_t    n;
+    string_t  value;
+
+    *at = 0;
+
+    if (protocol_header(r->protocol, "deliver_at", &value) == PROTOCOL_OK) {
+        if (queue_number(&value, &n) == QUEUE_ERROR) {
+            log_error(r->logger, 0, "Request has an invalid \"deliver_at\".");
+            return QUEUE_ERROR;
+        }
+
+        *at = n;
+        return QUEUE_OK;
+    }
+
+    if (protocol_header(r->protocol, "delay_ms", &value) == PROTOCOL_OK) {
+        if (queue_number(&value, &n) == QUEUE_ERROR || n > (uint_t) -1) {
+            log_error(r->logger, 0, "Request has an invalid \"delay_ms\".");
+            return QUEUE_ERROR;
+        }
+
+        *at = n == 0 ? 0 : time_current_epoch_msecs + n;
+    }
+
+    return QUEUE_OK;
+}
+
+/* "ttl_ms=<msecs>" of PUT or the "ttl_ms" of the queue, 0 never expires */
+static int queue_request_expire(tcp_request_t *r, queue_t *q,
+        uint64_t *expire)
+{
+    size_t    ttl;
+    string_t  value;
+
+    ttl = q->conf.ttl_ms;
+
+    if (protocol_header(r->protocol, "ttl_ms", &value) == PROTOCOL_OK
+        && (queue_number(&value, &ttl) == QUEUE_ERROR || ttl > (uint_t) -1))
+    {
+        log_error(r->logger, 0, "Request has an invalid \"ttl_ms\".");
+        return QUEUE_ERROR;
+    }
+
+    *expire = ttl == 0 ? 0 : time_current_epoch_msecs + ttl;
+
+    return QUEUE_OK;
+}
+
+/**
+ * Called once the length of a PUT is parsed. A payload of "splice_min"
+ * bytes at least is not gathered in the request buffers, the bytes read
+ * with the headers are written to a file of the engine and the rest is
+ * spliced there by "tcp_server_splice". return QUEUE_DECLINED if the PUT
+ * goes on as usual.
+ */
+int queue_ingest_start(tcp_request_t *r)
+{
+    size_t              n, left;
+    u_char             *p;
+    ssize_t             written;
+    queue_t            *q;
+    buffer_t           *buf;
+    string_t            name, value;
+    protocol_t         *pro;
+    queue_ingest_t     *in;
+    mem_pool_cleanup_t *c;
+
+    pro = r->protocol;
+
+    /* a queue not found is reported when the PUT is parsed */
+    if (protocol_header(pro, "queue", &name) == PROTOCOL_ERROR
+        || protocol_header(pro, "deliver_at", &value) == PROTOCOL_OK
+        || protocol_header(pro, "delay_ms", &value) == PROTOCOL_OK)
+    {
+        return QUEUE_DECLINED;
+    }
+
+    c = mem_pool_cleanup_add(r->pool, sizeof(queue_ingest_t));
+    if (c == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    in = c->data;
+    memset(in, 0, sizeof(queue_ingest_t));
+
+    q = queue_acquire(&name);
+    if (q == NULL) {
+        return QUEUE_DECLINED;
+    }
+
+    /* a bad "ttl_ms" is reported by the PUT */
+    if (q->conf.engine->ingest_handler == NULL
+        || q->conf.splice_min == 0 || pro->data_len < q->conf.splice_min
+        || queue_request_expire(r, q, &in->expire) == QUEUE_ERROR)
+    {
+        queue_release(q);
+        return QUEUE_DECLINED;
+    }
+
+    in->q = q;
+    in->len = pro->data_len;
+    in->left = pro->tmp_data_len;
+    in->fd = -1;
+    in->pipe[0] = -1;
+    in->pipe[1] = -1;
+
+    c->handler = queue_ingest_cleanup;
+
+    if (pipe2(in->pipe, O_NONBLOCK) == -1) {
+        log_error(r->logger, errno, "create the pipe of a PUT failed.");
+        return QUEUE_ERROR;
+    }
+
+    if (q->conf.engine->ingest_handler(q, in) == QUEUE_ERROR) {
+        return QUEUE_ERROR;
+    }
+
+    /* the bytes read with the headers */
+    left = in->len - in->left;
+    p = pro->data_start;
+
+    for (buf = pro->data_start_buf; left > 0 && buf != NULL; buf = buf->next)
+    {
+        if (p == NULL) {
+            p = buf->buffer;
+        }
+
+        n = buf->last - p;
+        if (n > left) {
+            n = left;
+        }
+
+        for ( /* void */ ; n > 0; n -= written, p += written) {
+            written = pwrite(in->fd, p, n, in->offset);
+            if (written <= 0) {
+                log_error(r->logger, errno, "write the payload to queue "
+                          "\"%s\" failed.", q->name);
+                return QUEUE_ERROR;
+            }
+
+            in->offset += written;
+            left -= written;
+        }
+
+        p = NULL;
+    }
+
+    r->ingest = in;
+
+    log_debug(r->logger, 0, "splice a PUT of %lu bytes to queue \"%s\"",
+              (u_long) in->len, q->name);
+
+    return QUEUE_OK;
+}
+
+/* "ok" is 0 if the payload is not read fully */
+void queue_ingest_finish(tcp_request_t *r, int ok)
+{
+    queue_t        *q;
+    queue_ingest_t *in;
+
+    in = r->ingest;
+    q = in->q;
+
+    if (!ok || queue_ingest_checksum(in) == QUEUE_ERROR) {
+        in->done = -1;
+        q->conf.engine->ingest_end_handler(q, in, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->deleted) {
+        pthread_mutex_unlock(&q->lock);
+        in->done = -1;
+        q->conf.engine->ingest_end_handler(q, in, 0);
+        return;
+    }
+
+    in->id = q->next_id;
+
+    if (q->conf.engine->ingest_end_handler(q, in, 1) == QUEUE_OK) {
+        q->next_id++;
+        q->depth++;
+        q->bytes += in->len;
+        in->done = 1;
+    } else {
+        in->done = -1;
+    }
+
+    queue_catalog_update(q);
+
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * The payload is read back from the page cache before the queue is locked,
+ * it ends at "offset" of "fd".
+ */
+static int queue_ingest_checksum(queue_ingest_t *in)
+{
+    size_t    n, left;
+    off_t     off;
+    ssize_t   nread;
+    u_char    buf[QUEUE_CHECKSUM_CHUNK];
+
+    in->crc = 0;
+    off = in->offset - in->len;
+
+    for (left = in->len; left > 0; left -= nread, off += nread) {
+        n = left < sizeof(buf) ? left : sizeof(buf);
+
+        nread = pread(in->fd, buf, n, off);
+        if (nread <= 0) {
+            log_error(in->q->logger, errno, "read the payload of a PUT to "
+                      "queue \"%s\" failed.", in->q->name);
+            return QUEUE_ERROR;
+        }
+
+        in->crc = crc32c(in->crc, buf, nread);
+    }
+
+    return QUEUE_OK;
+}
+
+/* the PUT is gone before its payload is read fully */
+static void queue_ingest_cleanup(void *data)
+{
+    queue_ingest_t *in;
+
+    in = data;
+
+    if (in->done == 0 && in->fd != -1) {
+        in->q->conf.engine->ingest_end_handler(in->q, in, 0);
+    }
+
+    if (in->pipe[0] != -1) {
+        close(in->pipe[0]);
+        close(in->pipe[1]);
+    }
+
+    queue_release(in->q);
+}
+
+/**
+ * "count=<n>" asks for at most n messages, 1 if it's not set. With
+ * "group=<name>" the messages are read from the cursor of the group and
+ * are kept until COMMIT. A queue with "visibility_ms" leases them until
+ * ACK, "visibility_ms=<msecs>" of the GET overrides it for these ones. Or
+ * else they are removed.
+ */
+static int queue_request_get(tcp_request_t *r)
+{
+    int            ret;
+    size_t         i, skipped, count, visibility;
+    uint64_t       now;
+    queue_t       *q;
+    string_t       value, group;
+    queue_msg_t    msg;
+    queue_group_t *g;
+
+    q = queue_request_lookup(r);
+    if (q == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    count = 1;
+
+    if (protocol_header(r->protocol, "count", &value) == PROTOCOL_OK
+        && (queue_number(&value, &count) == QUEUE_ERROR || count == 0))
+    {
+        log_error(r->logger, 0, "Request has an invalid \"count\".");
+        return QUEUE_ERROR;
+    }
+
+    if (count > QUEUE_GET_MAX) {
+        count = QUEUE_GET_MAX;
+    }
+
+    visibility = q->conf.visibility_ms;
+
+    if (protocol_header(r->protocol, "visibility_ms", &value) == PROTOCOL_OK
+        && (q->leases == NULL
+            || queue_number(&value, &visibility) == QUEUE_ERROR
+            || visibility == 0 || visibility > (uint_t) -1))
+    {
+        log_error(r->logger, 0, "Request has an invalid \"visibility_ms\".");
+        return QUEUE_ERROR;
+    }
+
+    ret = QUEUE_OK;
+    g = NULL;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (protocol_header(r->protocol, "group", &group) == PROTOCOL_OK) {
+        /* the ids of the "priority" engine are not in order */
+        if (q->conf.engine->read_handler != NULL) {
+            g = queue_group_get(q, &group);
+        }
+
+        if (g == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            log_error(r->logger, 0, "Group \"%.*s\" is invalid.",
+                      (int) group.len, group.data);
+            return QUEUE_ERROR;
+        }
+
+    } else if (q->leases != NULL) {
+        queue_lease_expire(q);
+    }
+
+    now = time_current_epoch_msecs;
+    skipped = 0;
+
+    for (i = 0; i < count; /* void */ ) {
+        if (g != NULL) {
+            ret = q->conf.engine->read_handler(q, &g->cursor, &msg);
+        } else if (q->leases != NULL) {
+            ret = queue_lease_next(q, &msg, visibility);
+        } else {
+            ret = q->conf.engine->peek_handler(q, &msg);
+        }
+
+        if (ret == QUEUE_EMPTY) {
+            ret = QUEUE_OK;
+            break;
+        }
+
+        if (ret == QUEUE_ERROR) {
+            break;
+        }
+
+        /**
+         * skipped, the sweeper removes it unless it's removed here. The
+         * lock is held for QUEUE_SWEEP_BATCH of them at most like in
+         * "queue_sweep", the GET returns what it has and the rest is left
+         * to the sweeper.
+         */
+        if (queue_msg_expired(&msg, now)) {
+            if (++skipped > QUEUE_SWEEP_BATCH) {
+                break;
+            }
+
+            if (g != NULL) {
+                g->cursor.id = msg.id + 1;
+                continue;
+            }
+
+            q->conf.engine->pop_handler(q);
+            q->depth--;
+            q->bytes -= msg.len;
+            q->expired++;
+            continue;
+        }
+
+        ret = queue_response_msg(r, q, &msg);
+        if (ret == QUEUE_ERROR) {
+            break;
+        }
+
+        i++;
+
+        if (g != NULL) {
+            g->cursor.id = msg.id + 1;
+            continue;
+        }
+
+        if (q->leases != NULL) {
+            continue;
+        }
+
+        q->conf.engine->pop_handler(q);
+        q->depth--;
+        q->bytes -= msg.len;
+    }
+
+    queue_catalog_update(q);
+
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+/**
+ * A payload of "sendfile_min" bytes at least is not copied if it's in a
+ * file, the response refers to the range of the file.
+ */
+static int queue_response_msg(tcp_request_t *r, queue_t *q,
+        queue_msg_t *msg)
+{
+    buffer_t *buf;
+
+    if (msg->fd != -1 && q->conf.sendfile_min != 0
+        && msg->len >= q->conf.sendfile_min)
+    {
+        if (tcp_response_printf(r, "msg %llu %lu\r\n",
+                                (unsigned long long) msg->id,
+                                (u_long) msg->len) == TCP_SRV_ERROR
+            || q->conf.engine->hold_handler(q, r->pool) == QUEUE_ERROR
+            || tcp_response_file(r, msg->fd, msg->offset, msg->len) == NULL
+            || tcp_response_printf(r, "\r\n") == TCP_SRV_ERROR)
+        {
+            return QUEUE_ERROR;
+        }
+
+        return QUEUE_OK;
+    }
+
+    buf = tcp_response_buffer(r, msg->len + QUEUE_MSG_HEAD_LEN);
+    if (buf == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    buf->last += sprintf((char *) buf->last, "msg %llu %lu\r\n",
+                         (unsigned long long) msg->id, (u_long) msg->len);
+    buf->last = x_memcpy_n(buf->last, msg->data, msg->len);
+    *buf->last++ = CR;
+    *buf->last++ = LF;
+
+    return QUEUE_OK;
+}
+
+/* "queue=<name>;group=<name>;id=<id>", the group is done up to "id" */
+static int queue_request_commit(tcp_request_t *r)
+{
+    size_t         id;
+    queue_t       *q;
+    string_t       group, value;
+    queue_group_t *g;
+
+    q = queue_request_lookup(r);
+    if (q == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    if (protocol_header(r->protocol, "group", &group) == PROTOCOL_ERROR
+        || protocol_header(r->protocol, "id", &value) == PROTOCOL_ERROR
+        || queue_number(&value, &id) == QUEUE_ERROR)
+    {
+        log_error(r->logger, 0, "COMMIT needs \"group\" and \"id\".");
+        return QUEUE_ERROR;
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    g = NULL;
+
+    if (q->conf.engine->read_handler != NULL) {
+        g = queue_group_get(q, &group);
+    }
+
+    if (g != NULL) {
+        queue_group_commit(q, g, id);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (g == NULL) {
+        log_error(r->logger, 0, "Group \"%.*s\" is invalid.",
+                  (int) group.len, group.data);
+        return QUEUE_ERROR;
+    }
+
+    return QUEUE_OK;
+}
+
+/**
+ * "queue=<name>;id=<id>[;id=<id>...]", the leases of the ids are done. It
+ * fails if an id is not leased, e.g. it's expired and given again, the
+ * other ids are acked still.
+ */
+static int queue_request_ack(tcp_request_t *r)
+{
+    int       ret;
+    size_t    id, n;
+    u_char   *p;
+    queue_t  *q;
+    string_t  key, value;
+
+    q = queue_request_lookup(r);
+    if (q == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    if (q->leases == NULL) {
+        log_error(r->logger, 0, "Queue \"%s\" has no \"visibility_ms\".",
+                  q->name);
+        return QUEUE_ERROR;
+    }
+
+    ret = QUEUE_OK;
+    n = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    for (p = NULL; (p = protocol_header_next(r->protocol, p, &key, &value))
+                   != NULL; )
+    {
+        if (key.len != 2 || x_strncmp(key.data, "id", 2) != 0) {
+            continue;
+        }
+
+        n++;
+
+        if (queue_number(&value, &id) == QUEUE_ERROR
+            || queue_lease_ack(q, id) == QUEUE_ERROR)
+        {
+            ret = QUEUE_ERROR;
+        }
+    }
+
+    queue_trim(q);
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (n == 0) {
+        log_error(r->logger, 0, "ACK needs \"id\".");
+        return QUEUE_ERROR;
+    }
+
+    return ret;
+}
+
+/**
+ * "queue=<name>" and "op=create", the default, with the settings of
+ * "queue_conf_set". "op=configure" with the settings to change of a queue,
+ * see "queue_configure". "op=delete" removes a queue with its messages,
+ * a queue of the "queue" block is created again after a restart.
+ */
+static int queue_request_queue(tcp_request_t *r)
+{
+    queue_t      *q;
+    string_t      op, name;
+    queue_conf_t  qc;
+
+    if (protocol_header(r->protocol, "op", &op) == PROTOCOL_ERROR) {
+        op.data = (u_char *) "create";
+        op.len = sizeof("create") - 1;
+    }
+
+    if (op.len == 6 && x_strncmp(op.data, "create", 6) == 0) {
+        queue_conf_init(&qc);
+
+        if (queue_request_conf(r, &qc) == QUEUE_ERROR) {
+            return QUEUE_ERROR;
+        }
+
+        q = queue_create(&qc, r->logger);
+        if (q == NULL) {
+            return QUEUE_ERROR;
+        }
+
+        queue_manifest_add(q, r->logger);
+
+        return QUEUE_OK;
+    }
+
+    if (op.len == 9 && x_strncmp(op.data, "configure", 9) == 0) {
+        q = queue_request_lookup(r);
+        if (q == NULL) {
+            return QUEUE_ERROR;
+        }
+
+        qc = q->conf;
+
+        if (qc.priority) {
+            qc.engine = qc.level_engine;
+        }
+
+        if (queue_request_conf(r, &qc) == QUEUE_ERROR
+            || queue_configure(q, &qc) == QUEUE_ERROR)
+        {
+            return QUEUE_ERROR;
+        }
+
+        queue_manifest_add(q, r->logger);
+
+        return QUEUE_OK;
+    }
+
+    if (op.len == 6 && x_strncmp(op.data, "delete", 6) == 0) {
+        if (protocol_header(r->protocol, "queue", &name) == PROTOCOL_ERROR) {
+            log_error(r->logger, 0, "Request has no \"queue\" header.");
+            return QUEUE_ERROR;
+        }
+
+        if (queue_delete(&name, r->logger) == QUEUE_ERROR) {
+            return QUEUE_ERROR;
+        }
+
+        queue_manifest_store(r->logger);
+
+        return QUEUE_OK;
+    }
+
+    log_error(r->logger, 0, "QUEUE has an invalid \"op\" \"%.*s\".",
+              (int) op.len, op.data);
+
+    return QUEUE_ERROR;
+}
+
+/* the headers of QUEUE but "op" are set to "qc" */
+static int queue_request_conf(tcp_request_t *r, queue_conf_t *qc)
+{
+    u_char    *p;
+    string_t   key, value;
+
+    for (p = NULL; (p = protocol_header_next(r->protocol, p, &key, &value))
+                   != NULL; )
+    {
+        if (key.len == 2 && x_strncmp(key.data, "op", 2) == 0) {
+            continue;
+        }
+
+        if (key.len == 5 && x_strncmp(key.data, "queue", 5) == 0) {
+            qc->name = value;
+            continue;
+        }
+
+        if (queue_conf_set(qc, &key, &value) == QUEUE_ERROR) {
+            log_error(r->logger, 0, "Queue setting \"%.*s=%.*s\" is invalid.",
+                      (int) key.len, key.data, (int) value.len, value.data);
+            return QUEUE_ERROR;
+        }
+    }
+
+    return QUEUE_OK;
+}
+
+/**
+ * queue <name> [engine=memory|log] [slots=n] [bytes=n] [full=drop_oldest]
+ *     [segment_bytes=n] [sendfile_min=n] [splice_min=n] [visibility_ms=n]
+ *     [ttl_ms=n] [priority=on];
+ */
+static int cmd_queue_set(dynamic_array_t *args, void *mod_conf)
+{
+    uint_t                  i;
+    u_char                 *eq;
+    string_t               *arg, key, value;
+    queue_conf_t           *qc;
+    xpipe_queue_mod_conf_t *cf;
+
+    cf = (xpipe_queue_mod_conf_t *) mod_conf;
+
+    if (args->nelts < 2) {
+        log_error(args->pool->logger, 0, "the args of \"queue\" is error.");
+        return CONF_ERROR;
+    }
+
+    qc = dynamic_array_push(cf->queues);
+    if (qc == NULL) {
+        return CONF_ERROR;
+    }
+
+    queue_conf_init(qc);
+
+    qc->name = *((string_t *) dynamic_array_get_ix(args, 1));
+
+    for (i = 2; i < args->nelts; i++) {
+        arg = dynamic_array_get_ix(args, i);
+
+        eq = (u_char *) strchr((char *) arg->data, '=');
+        if (eq == NULL) {
+            log_error(args->pool->logger, 0,
+                      "\"%s\" of queue \"%s\" is not \"key=value\".",
+                      arg->data, qc->name.data);
+            return CONF_ERROR;
+        }
+
+        key.data = arg->data;
+        key.len = eq - arg->data;
+        value.data = eq + 1;
+        value.len = arg->len - key.len - 1;
+
+        if (queue_conf_set(qc, &key, &value) == QUEUE_ERROR) {
+            log_error(args->pool->logger, 0,
+                      "\"%s\" of queue \"%s\" is invalid.",
+                      arg->data, qc->name.data);
+            return CONF_ERROR;
+        }
+    }
+
+    return CONF_OK;
+}
+
+static int cmd_queue_dir_set(dynamic_array_t *args, void *mod_conf)
+{
+    string_t               *arg;
+    xpipe_queue_mod_conf_t *cf;
+
+    cf = (xpipe_queue_mod_conf_t *) mod_conf;
+
+    if (args->nelts != 2) {
+        log_error(args->pool->logger, 0, "the args of \"dir\" is error.");
+        return CONF_ERROR;
+    }
+
+    arg = dynamic_array_get_ix(args, 1);
+    if (arg == NULL) {
+        return CONF_ERROR;
+    }
+
+    cf->dir = *arg;
+
+    return CONF_OK;
+}
+
+static int cmd_queue_sync_interval_set(dynamic_array_t *args, 
+        void *mod_conf)
+{
+    string_t               *arg;
+    xpipe_queue_mod_conf_t *cf;
+
+    cf = (xpipe_queue_mod_conf_t *) mod_conf;
+
+    if (args->nelts != 2) {
+        log_error(args->pool->logger, 0,
+                  "the args of \"sync_interval\" is error.");
+        return CONF_ERROR;
+    }
+
+    arg = dynamic_array_get_ix(args, 1);
+    if (arg == NULL) {
+        return CONF_ERROR;
+    }
+
+    if (!is_positive_integer(arg) || x_atoi(arg->data) == 0) {
+        log_error(args->pool->logger, 0,
+                  "\"%s\" is not a positive integer.", arg->data);
+        return CONF_ERROR;
+    }
+
+    cf->sync_interval = x_atoi(arg->data);
+
+    return CONF_OK;
+}
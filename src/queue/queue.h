@@ -0,0 +1,407 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include "config.h"
+#include "system.h"
+
+#define QUEUE_OK      0
+#define QUEUE_ERROR  -1
+#define QUEUE_FULL   -2
+#define QUEUE_EMPTY  -3
+#define QUEUE_DECLINED  -4
+
+#define QUEUE_NAME_MAX      64
+#define QUEUE_POOL_SIZE     2048
+#define QUEUE_GET_MAX       128     /* messages of a GET */
+
+#define QUEUE_FULL_REJECT       0
+#define QUEUE_FULL_DROP_OLDEST  1
+
+#define QUEUE_DEFAULT_SLOTS     4096
+#define QUEUE_DEFAULT_BYTES     (4 * 1024 * 1024)
+#define QUEUE_DEFAULT_SEGMENT   (64 * 1024 * 1024)
+#define QUEUE_DEFAULT_DIR       "data"
+#define QUEUE_LOCK_FILE         "xpipe.lock"    /* in the data dir */
+#define QUEUE_MANIFEST_FILE     "queues.manifest"
+#define QUEUE_MANIFEST_LINE     512     /* bytes of a queue in the manifest */
+#define QUEUE_LOCK_WAIT         60000   /* msecs the old process is waited */
+#define QUEUE_SYNC_INTERVAL     100     /* msecs */
+#define QUEUE_SENDFILE_MIN      16384
+#define QUEUE_SPLICE_MIN        (1024 * 1024)
+#define QUEUE_CHECKSUM_CHUNK    16384   /* bytes of a spliced payload read */
+#define QUEUE_GROUPS_MAX        256     /* consumer groups of a queue */
+#define QUEUE_LEASE_TICK        10      /* msecs of the timer wheel */
+#define QUEUE_LEASE_CHUNK       1024    /* leases allocated at a time */
+#define QUEUE_SWEEP_BATCH       256     /* expired messages a lock removes */
+#define QUEUE_SWEEP_MAX         4096    /* expired messages a sync removes */
+#define QUEUE_DELAY_TICK        10      /* msecs delayed messages are due in */
+#define QUEUE_PROMOTE_BATCH     256     /* delayed messages a lock promotes */
+#define QUEUE_PROMOTE_MAX       4096    /* delayed messages a tick promotes */
+#define QUEUE_PRIORITY_LEVELS   8       /* "priority" of PUT is 0 to 7 */
+#define QUEUE_CATALOG_MARKS     32      /* put times kept for LIST */
+#define QUEUE_CATALOG_INTERVAL  10      /* msecs between put times at least */
+#define QUEUE_REGISTRY_BITS     10      /* 1024 slots of the registry first */
+#define QUEUE_REGISTRY_KEY      19      /* bytes of a name in its slot */
+
+#define queue_msg_expired(msg, now)                                         \
+    ((msg)->expire != 0 && (msg)->expire <= (now))
+
+
+/**
+ * PUT: "buf" is the request buffer where the payload starts at "data", it
+ *     may go on in the next buffers, see "queue_msg_copy".
+ * GET: "data" points into the engine, it is valid until the queue is
+ *     unlocked. The payload is at "offset" of "fd" too if the engine keeps
+ *     it in a file, or "fd" is -1.
+ * "expire" is in "time_current_epoch_msecs", 0 if the message never expires.
+ * "priority" is used by the "priority" engine only.
+ */
+typedef struct {
+    uint64_t     id;
+    uint64_t     expire;
+    uint_t       priority;
+    size_t       len;
+    u_char      *data;
+    buffer_t    *buf;
+    int          fd;
+    off_t        offset;
+} queue_msg_t;
+
+/**
+ * Where a consumer group reads next. "hint_base" and "hint_off" are the
+ * engine's, to find message "id" without a search.
+ */
+typedef struct {
+    uint64_t     id;
+    uint64_t     hint_base;
+    size_t       hint_off;
+} queue_cursor_t;
+
+typedef struct queue_group_s queue_group_t;
+
+/**
+ * A consumer group reads a queue without removing the messages. "cursor"
+ * is the next message to give and is not kept, a group goes on from
+ * "committed" after a restart. The messages are removed once every group
+ * has committed them.
+ */
+struct queue_group_s {
+    u_char           name[QUEUE_NAME_MAX + 1];
+    queue_cursor_t   cursor;
+    uint64_t         committed;     /* the first id not committed */
+    uint64_t         synced;        /* "committed" in the store */
+    queue_group_t   *next;
+};
+
+typedef struct queue_lease_s queue_lease_t;
+
+/**
+ * A message given by a GET of a queue with "visibility_ms". The node is in
+ * the timer wheel until the lease expires, then in "ready" until the
+ * message is given again.
+ */
+struct queue_lease_s {
+    timer_node_t     node;
+    uint64_t         id;
+    int              ready;
+};
+
+/**
+ * The leases of a queue, "table" finds a lease by id with open addressing.
+ * "cursor" is the first message never given.
+ */
+typedef struct {
+    queue_lease_t  **table;
+    uint_t           bits;
+    uint_t           n;
+    timer_node_t     ready;
+    queue_lease_t   *free;
+    void            *chunks;
+    queue_cursor_t   cursor;
+    timer_wheel_t    wheel;
+} queue_leases_t;
+
+/**
+ * A message of PUT with "deliver_at" or "delay_ms", it's put in the engine
+ * at "at" (time_current_epoch_msecs). "seq" keeps the order of PUTs for
+ * the same "at".
+ */
+typedef struct {
+    uint64_t         at;
+    uint64_t         seq;
+    uint64_t         expire;
+    uint_t           priority;
+    size_t           len;
+    u_char          *data;
+} queue_delayed_t;
+
+/**
+ * The delayed messages of a queue in a binary heap by "at", apart from the
+ * messages of the engine. "fd" is the file they are kept in if the engine
+ * is on disk, or -1.
+ */
+typedef struct {
+    queue_delayed_t **heap;
+    uint_t            n;
+    uint_t            size;
+    uint64_t          seq;
+    int               fd;
+    int               dirty;
+    off_t             file_size;
+    off_t             live;         /* bytes of "file_size" in the heap */
+    uint64_t          mark_at;      /* the last promoted */
+    uint64_t          mark_seq;
+} queue_delay_t;
+
+typedef int (*queue_init_fp) (queue_t *q);
+typedef void (*queue_done_fp) (queue_t *q);
+typedef int (*queue_put_fp) (queue_t *q, queue_msg_t *msg);
+typedef int (*queue_peek_fp) (queue_t *q, queue_msg_t *msg);
+typedef int (*queue_read_fp) (queue_t *q, queue_cursor_t *c,
+        queue_msg_t *msg);
+typedef void (*queue_pop_fp) (queue_t *q);
+typedef void (*queue_sync_fp) (queue_t *q);
+typedef int (*queue_hold_fp) (queue_t *q, mem_pool_t *pool);
+typedef int (*queue_ingest_fp) (queue_t *q, queue_ingest_t *in);
+typedef int (*queue_ingest_end_fp) (queue_t *q, queue_ingest_t *in,
+        int commit);
+
+/**
+ * A PUT whose payload is spliced from the socket to "offset" of "fd". The
+ * file is the engine's and is not seen by GET until the message is
+ * committed, "name" and "ctx" are for the engine too.
+ */
+struct queue_ingest_s {
+    queue_t     *q;
+    uint64_t     id;
+    uint64_t     expire;
+    size_t       len;
+    size_t       left;      /* bytes still in the socket */
+    int          fd;
+    off_t        offset;
+    int          pipe[2];
+    int          done;      /* 1 committed, -1 failed */
+    uint32_t     crc;       /* CRC-32C of the payload */
+    u_char       name[32];
+};
+
+/**
+ * The storage of a queue. The handlers are called with the queue locked,
+ * "peek" gives the oldest message and "pop" removes it. "read" gives the
+ * message at the cursor, or the oldest after it if it's removed, for
+ * consumer groups. "sync" is called unlocked by the timer of the "queue"
+ * module to flush what is written, NULL if the engine keeps nothing on
+ * disk. "hold" keeps the "fd" of the message peeked or read open until
+ * "pool" is destroyed, for the GETs which send the payload by "sendfile",
+ * NULL if the engine gives no "fd".
+ * "ingest" opens a file for a large PUT, "ingest_end" appends it as the
+ * next message with the queue locked or removes it, NULL if the engine
+ * can't take a payload written by others.
+ */
+typedef struct {
+    string_t             name;
+    queue_init_fp        init_handler;
+    queue_done_fp        done_handler;
+    queue_put_fp         put_handler;
+    queue_peek_fp        peek_handler;
+    queue_pop_fp         pop_handler;
+    queue_read_fp        read_handler;
+    queue_sync_fp        sync_handler;
+    queue_hold_fp        hold_handler;
+    queue_ingest_fp      ingest_handler;
+    queue_ingest_end_fp  ingest_end_handler;
+} queue_engine_t;
+
+/* message "id" and the ones after it are put at "at" or later */
+typedef struct {
+    uint64_t         id;
+    uint64_t         at;
+} queue_mark_t;
+
+/**
+ * The put times of a queue for the age of its oldest message in LIST, in
+ * a ring of marks. A mark is taken by the first update at least
+ * "interval" msecs after the last one, every other mark is dropped and
+ * "interval" is doubled when the ring is full, so the age is as precise
+ * as the few last marks cover. "next_id" is the first id not marked yet.
+ */
+typedef struct {
+    queue_mark_t     marks[QUEUE_CATALOG_MARKS];
+    uint_t           head;
+    uint_t           n;
+    uint_t           interval;
+    uint64_t         next_id;
+} queue_catalog_t;
+
+/* the settings of "QUEUE" headers and "queue" commands */
+typedef struct {
+    string_t         name;
+    queue_engine_t  *engine;
+    uint_t           slots;
+    size_t           bytes;
+    int              full;
+    size_t           segment_bytes;
+    size_t           sendfile_min;
+    size_t           splice_min;
+    uint_t           visibility_ms;
+    uint_t           ttl_ms;
+    int              priority;
+    queue_engine_t  *level_engine;  /* of the levels if "priority" is on */
+} queue_conf_t;
+
+struct queue_s {
+    u_char           name[QUEUE_NAME_MAX + 1];
+    uint32_t         hash;
+    queue_conf_t     conf;
+    void            *engine_ctx;
+    pthread_mutex_t  lock;
+
+    uint64_t         next_id;
+    uint64_t         depth;
+    uint64_t         bytes;
+    uint64_t         dropped;
+    uint64_t         rejected;
+    uint64_t         expired;
+    uint64_t         delayed;
+    uint64_t         inflight;
+    uint64_t         redelivered;
+
+    /* what LIST tells, updated by the changes of the queue */
+    queue_catalog_t *catalog;
+    uint64_t         oldest;        /* time_current_epoch_msecs, 0 empty */
+    uint64_t         committed;     /* the least "committed" of the groups */
+
+    /* the committed ids are stored if the engine keeps the messages */
+    queue_group_t   *groups;
+    uint_t           ngroups;
+    int              groups_stored;
+
+    /* GET leases the messages instead of removing them */
+    queue_leases_t  *leases;
+
+    /* PUTs which are not due yet */
+    queue_delay_t   *delay;
+
+    /* created or configured by QUEUE, it's kept in the manifest */
+    int              manifest;
+
+    /**
+     * A reference is held by the registry and by each request of the
+     * queue, the queue is destroyed by the "queue" module once they are
+     * all released. A deleted queue is not in the registry and is not
+     * written, its directory is moved to "trash".
+     */
+    uint_t           refs;
+    int              deleted;
+    u_char          *trash;
+
+    queue_t         *next;
+    queue_t         *prev;
+    queue_t         *dead;      /* released, to be destroyed */
+
+    mem_pool_t      *pool;
+    logger_t        *logger;
+};
+
+/**
+ * A slot of the registry in 32 bytes, two of a cache line. The hash and
+ * the length and first bytes of the name are in the slot, so a probe only
+ * reads the queue for a name longer than QUEUE_REGISTRY_KEY which matches.
+ */
+typedef struct {
+    uint32_t         hash;
+    u_char           len;
+    u_char           key[QUEUE_REGISTRY_KEY];
+    queue_t         *q;
+} queue_slot_t;
+
+/* the counters of a queue at the time of "queue_snapshot" */
+typedef struct {
+    u_char           name[QUEUE_NAME_MAX + 1];
+    uint64_t         depth;
+    uint64_t         bytes;
+    uint64_t         dropped;
+    uint64_t         rejected;
+    uint64_t         expired;
+    uint64_t         delayed;
+    uint64_t         inflight;
+    uint64_t         redelivered;
+    uint64_t         age;           /* msecs of the oldest message */
+    uint64_t         lag;
+} queue_snapshot_t;
+
+extern queue_engine_t *queue_engines[];
+extern queue_engine_t queue_memory_engine;
+extern queue_engine_t queue_log_engine;
+extern queue_engine_t queue_priority_engine;
+extern string_t queue_data_dir;
+
+/* the messages are kept on disk */
+#define queue_stored(q)                                                     \
+    (((q)->conf.priority ? (q)->conf.level_engine : (q)->conf.engine)        \
+     ->sync_handler != NULL)
+
+/* called by an engine for a message it drops to make room */
+#define queue_dropped(q, len)                                               \
+    do {                                                                    \
+        (q)->depth--;                                                       \
+        (q)->bytes -= (len);                                                \
+        (q)->dropped++;                                                     \
+    } while (0)
+
+
+void queue_conf_init(queue_conf_t *qc);
+int queue_conf_set(queue_conf_t *qc, string_t *key, string_t *value);
+
+queue_t *queue_create(queue_conf_t *qc, logger_t *logger);
+int queue_configure(queue_t *q, queue_conf_t *qc);
+int queue_delete(string_t *name, logger_t *logger);
+queue_t *queue_acquire(string_t *name);
+void queue_release(queue_t *q);
+void queue_destroy_all(void);
+void queue_sync_all(void);
+queue_snapshot_t *queue_snapshot(uint_t *n);
+
+int queue_put(queue_t *q, queue_msg_t *msg);
+void queue_trim(queue_t *q);
+void queue_sweep(queue_t *q);
+uint_t queue_promote_all(void);
+int queue_dir_open(queue_t *q);
+u_char *queue_msg_copy(queue_msg_t *msg, u_char *dst);
+
+int queue_request_process(tcp_request_t *r);
+int queue_ingest_start(tcp_request_t *r);
+void queue_ingest_finish(tcp_request_t *r, int ok);
+
+queue_group_t *queue_group_get(queue_t *q, string_t *name);
+void queue_group_commit(queue_t *q, queue_group_t *g, uint64_t id);
+int queue_group_load(queue_t *q);
+void queue_group_sync(queue_t *q);
+void queue_group_remove(queue_t *q);
+void queue_group_store_close(void);
+
+int queue_lease_init(queue_t *q);
+void queue_lease_done(queue_t *q);
+int queue_lease_next(queue_t *q, queue_msg_t *msg, uint_t visibility);
+int queue_lease_ack(queue_t *q, uint64_t id);
+int queue_lease_held(queue_t *q, uint64_t id);
+void queue_lease_expire(queue_t *q);
+
+int queue_delay_init(queue_t *q);
+void queue_delay_done(queue_t *q);
+int queue_delay_put(queue_t *q, queue_msg_t *msg, uint64_t at);
+uint_t queue_delay_promote(queue_t *q);
+void queue_delay_sync(queue_t *q);
+
+int queue_catalog_init(queue_t *q);
+void queue_catalog_update(queue_t *q);
+uint64_t queue_catalog_age(queue_t *q);
+uint64_t queue_catalog_lag(queue_t *q);
+
+void queue_priority_configure(queue_t *q);
+
+#endif /* __QUEUE_H__ */
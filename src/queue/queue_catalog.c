@@ -0,0 +1,144 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * The catalog of LIST: the depth, bytes, age of the oldest message and lag
+ * of each queue are in the queue and are kept up by the changes of it, so
+ * LIST reads a few counters of every queue and never the engine.
+ *
+ * The messages of a queue are removed from the oldest one, the oldest is
+ * "next_id - depth" and it's put at the time of the last mark before it.
+ * The "priority" engine keeps a catalog for each level instead, "oldest"
+ * of the queue is the oldest of the levels. A message loaded from disk is
+ * put when the queue is created.
+ */
+
+#define queue_catalog_mark(c, i)                                            \
+    (&(c)->marks[((c)->head + (i)) & (QUEUE_CATALOG_MARKS - 1)])
+
+static void queue_catalog_thin(queue_catalog_t *c);
+
+
+int queue_catalog_init(queue_t *q)
+{
+    queue_catalog_t *c;
+
+    c = pcalloc(q->pool, sizeof(queue_catalog_t));
+    if (c == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    c->interval = QUEUE_CATALOG_INTERVAL;
+    c->next_id = q->next_id - q->depth;
+
+    q->catalog = c;
+
+    queue_catalog_update(q);
+
+    return QUEUE_OK;
+}
+
+/**
+ * Called with the queue locked after the messages are put or removed, the
+ * messages put since the last call are marked now.
+ */
+void queue_catalog_update(queue_t *q)
+{
+    uint64_t         now, oldest;
+    queue_mark_t    *m;
+    queue_catalog_t *c;
+
+    c = q->catalog;
+
+    if (c == NULL) {
+        return;
+    }
+
+    if (q->depth == 0) {
+        c->n = 0;
+        c->interval = QUEUE_CATALOG_INTERVAL;
+        c->next_id = q->next_id;
+        q->oldest = 0;
+        return;
+    }
+
+    if (c->next_id != q->next_id) {
+        now = time_current_epoch_msecs;
+
+        if (c->n == 0
+            || now - queue_catalog_mark(c, c->n - 1)->at >= c->interval)
+        {
+            if (c->n == QUEUE_CATALOG_MARKS) {
+                queue_catalog_thin(c);
+            }
+
+            m = queue_catalog_mark(c, c->n);
+            m->id = c->next_id;
+            m->at = now;
+            c->n++;
+        }
+
+        c->next_id = q->next_id;
+    }
+
+    oldest = q->next_id - q->depth;
+
+    while (c->n > 1 && queue_catalog_mark(c, 1)->id <= oldest) {
+        c->head = (c->head + 1) & (QUEUE_CATALOG_MARKS - 1);
+        c->n--;
+    }
+
+    q->oldest = queue_catalog_mark(c, 0)->at;
+}
+
+/* msecs the oldest message has been in the queue, read unlocked */
+uint64_t queue_catalog_age(queue_t *q)
+{
+    uint64_t  now, oldest;
+
+    now = time_current_epoch_msecs;
+    oldest = q->oldest;
+
+    if (q->depth == 0 || oldest == 0 || oldest >= now) {
+        return 0;
+    }
+
+    return now - oldest;
+}
+
+/**
+ * The messages not consumed yet, read unlocked: not committed by the
+ * slowest group, or not given or leased by GET.
+ */
+uint64_t queue_catalog_lag(queue_t *q)
+{
+    uint64_t  lag, depth, inflight;
+
+    depth = q->depth;
+
+    if (q->groups != NULL) {
+        lag = q->next_id - q->committed;
+        return lag < depth ? lag : depth;
+    }
+
+    inflight = q->inflight;
+
+    return depth > inflight ? depth - inflight : 0;
+}
+
+/* the first mark stays, it's the time of the oldest message */
+static void queue_catalog_thin(queue_catalog_t *c)
+{
+    uint_t  i;
+
+    for (i = 1; i < c->n / 2; i++) {
+        *queue_catalog_mark(c, i) = *queue_catalog_mark(c, i * 2);
+    }
+
+    c->n /= 2;
+    c->interval *= 2;
+}
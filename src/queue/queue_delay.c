@@ -0,0 +1,605 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * Delayed messages. A PUT which is not due yet is kept in a heap of the
+ * queue and not in the engine, so PUT and GET of the other messages don't
+ * see it. The timer of the "queue" module promotes the due ones to the
+ * engine every QUEUE_DELAY_TICK msecs while there are any, a message is
+ * given an id when it's promoted.
+ *
+ * If the engine is on disk the messages are appended to "delayed" by the
+ * segments of the queue too. The file starts with the last message which
+ * is promoted, it's written after the engine is synced, the records up to
+ * it are skipped when the file is loaded. The file is truncated when the
+ * heap is empty, and written again from the heap when most of it is
+ * promoted.
+ */
+
+#define QUEUE_DELAY_HEAP            1024
+#define QUEUE_DELAY_COMPACT_MIN     (1024 * 1024)
+
+typedef struct {
+    uint64_t   at;
+    uint64_t   seq;
+} queue_delay_mark_t;
+
+typedef struct {
+    uint64_t   at;
+    uint64_t   seq;
+    uint64_t   expire;
+    uint32_t   len;
+    uint32_t   priority;
+} queue_delay_record_t;
+
+#define queue_delayed_before(a, b)                                          \
+    ((a)->at < (b)->at || ((a)->at == (b)->at && (a)->seq < (b)->seq))
+
+#define queue_delayed_size(d)  (sizeof(queue_delay_record_t) + (d)->len)
+
+static int queue_delay_load(queue_t *q);
+static queue_delayed_t *queue_delayed_alloc(size_t len);
+static int queue_delay_push(queue_delay_t *dl, queue_delayed_t *d);
+static void queue_delay_pop(queue_delay_t *dl);
+static int queue_delay_append(queue_t *q, queue_delayed_t *d);
+static int queue_delay_rewrite(queue_t *q, int dir_fd);
+
+
+int queue_delay_init(queue_t *q)
+{
+    queue_delay_t *dl;
+
+    dl = pcalloc(q->pool, sizeof(queue_delay_t));
+    if (dl == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    dl->fd = -1;
+    q->delay = dl;
+
+    if (queue_stored(q) && queue_delay_load(q) == QUEUE_ERROR) {
+        log_error(q->logger, 0, "load the delayed messages of queue \"%s\" "
+                  "failed.", q->name);
+        return QUEUE_ERROR;
+    }
+
+    return QUEUE_OK;
+}
+
+void queue_delay_done(queue_t *q)
+{
+    uint_t         i;
+    queue_delay_t *dl;
+
+    dl = q->delay;
+
+    if (dl == NULL) {
+        return;
+    }
+
+    for (i = 0; i < dl->n; i++) {
+        free(dl->heap[i]);
+    }
+
+    free(dl->heap);
+
+    if (dl->fd != -1) {
+        close(dl->fd);
+    }
+
+    q->delay = NULL;
+}
+
+/* the payload is copied, "at" is later than now */
+int queue_delay_put(queue_t *q, queue_msg_t *msg, uint64_t at)
+{
+    queue_delay_t   *dl;
+    queue_delayed_t *d;
+
+    dl = q->delay;
+
+    d = queue_delayed_alloc(msg->len);
+    if (d == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    d->at = at;
+    d->expire = msg->expire;
+    d->priority = msg->priority;
+    queue_msg_copy(msg, d->data);
+
+    pthread_mutex_lock(&q->lock);
+
+    d->seq = dl->seq;
+
+    /* the directory of a deleted queue may be a new one's */
+    if (q->deleted
+        || (queue_stored(q) && queue_delay_append(q, d) == QUEUE_ERROR)
+        || queue_delay_push(dl, d) == QUEUE_ERROR)
+    {
+        pthread_mutex_unlock(&q->lock);
+        free(d);
+        return QUEUE_ERROR;
+    }
+
+    dl->seq++;
+    q->delayed = dl->n;
+
+    pthread_mutex_unlock(&q->lock);
+
+    return QUEUE_OK;
+}
+
+/**
+ * Called by the timer of the "queue" module. The due messages are put in
+ * the engine QUEUE_PROMOTE_BATCH at a time with the queue locked, up to
+ * QUEUE_PROMOTE_MAX. A queue which is full and rejects keeps them for the
+ * next tick. Return the number of messages still delayed.
+ */
+uint_t queue_delay_promote(queue_t *q)
+{
+    int              ret;
+    uint_t           n, total, left;
+    uint64_t         now;
+    queue_msg_t      msg;
+    queue_delay_t   *dl;
+    queue_delayed_t *d;
+
+    dl = q->delay;
+
+    if (dl == NULL) {
+        return 0;
+    }
+
+    now = time_current_epoch_msecs;
+    ret = QUEUE_OK;
+
+    for (total = 0; total < QUEUE_PROMOTE_MAX; total += n) {
+        pthread_mutex_lock(&q->lock);
+
+        for (n = 0; n < QUEUE_PROMOTE_BATCH && dl->n > 0; n++) {
+            d = dl->heap[0];
+
+            if (d->at > now) {
+                break;
+            }
+
+            if (queue_msg_expired(d, now)) {
+                q->expired++;
+
+            } else {
+                msg.id = q->next_id;
+                msg.expire = d->expire;
+                msg.priority = d->priority;
+                msg.len = d->len;
+                msg.data = d->data;
+                msg.buf = NULL;
+                msg.fd = -1;
+
+                ret = q->conf.engine->put_handler(q, &msg);
+
+                if (ret == QUEUE_FULL) {
+                    break;
+                }
+
+                if (ret == QUEUE_OK) {
+                    q->next_id++;
+                    q->depth++;
+                    q->bytes += msg.len;
+
+                } else {
+                    log_error(q->logger, 0, "promote a delayed message of "
+                              "queue \"%s\" failed, it's dropped.", q->name);
+                }
+            }
+
+            dl->mark_at = d->at;
+            dl->mark_seq = d->seq;
+            dl->dirty = 1;
+
+            if (dl->fd != -1) {
+                dl->live -= queue_delayed_size(d);
+            }
+
+            queue_delay_pop(dl);
+            free(d);
+        }
+
+        left = dl->n;
+        q->delayed = left;
+
+        queue_catalog_update(q);
+
+        pthread_mutex_unlock(&q->lock);
+
+        if (n < QUEUE_PROMOTE_BATCH || ret == QUEUE_FULL) {
+            break;
+        }
+    }
+
+    return left;
+}
+
+/**
+ * Called by the "queue" module after the engine is synced, so the mark
+ * never gets ahead of the messages it promoted. The file is truncated or
+ * written again with the queue locked, the appends are synced unlocked.
+ */
+void queue_delay_sync(queue_t *q)
+{
+    int                 fd, dir_fd;
+    queue_delay_t      *dl;
+    queue_delay_mark_t  mark;
+
+    dl = q->delay;
+
+    if (dl == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    if (dl->fd == -1 || !dl->dirty) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    dl->dirty = 0;
+
+    if (dl->n == 0) {
+        if (ftruncate(dl->fd, sizeof(queue_delay_mark_t)) == 0) {
+            dl->file_size = sizeof(queue_delay_mark_t);
+        }
+
+    } else if (dl->file_size > QUEUE_DELAY_COMPACT_MIN
+               && dl->file_size - dl->live > dl->live)
+    {
+        dir_fd = queue_dir_open(q);
+
+        if (dir_fd != -1) {
+            queue_delay_rewrite(q, dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    mark.at = dl->mark_at;
+    mark.seq = dl->mark_seq;
+
+    if (pwrite(dl->fd, &mark, sizeof(mark), 0) != sizeof(mark)) {
+        log_error(q->logger, errno, "write the delayed messages of queue "
+                  "\"%s\" failed.", q->name);
+        dl->dirty = 1;
+    }
+
+    fd = dl->fd;
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (fdatasync(fd) == -1) {
+        log_error(q->logger, errno, "sync the delayed messages of queue "
+                  "\"%s\" failed.", q->name);
+    }
+}
+
+/* the records after the mark, a torn one at the end is cut off */
+static int queue_delay_load(queue_t *q)
+{
+    int                    fd, dir_fd;
+    off_t                  off;
+    FILE                  *f;
+    queue_delay_t         *dl;
+    queue_delayed_t       *d, mark_d;
+    queue_delay_mark_t     mark;
+    queue_delay_record_t   rec;
+
+    dl = q->delay;
+
+    dir_fd = queue_dir_open(q);
+    if (dir_fd == -1) {
+        return QUEUE_ERROR;
+    }
+
+    /* "delayed.new" is left by a crash before it's renamed */
+    unlinkat(dir_fd, "delayed.new", 0);
+
+    fd = openat(dir_fd, "delayed", O_RDWR);
+    close(dir_fd);
+
+    if (fd == -1) {
+        return errno == ENOENT ? QUEUE_OK : QUEUE_ERROR;
+    }
+
+    dl->fd = fd;
+
+    f = fdopen(dup(fd), "r");
+    if (f == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    if (fread(&mark, sizeof(mark), 1, f) != 1) {
+        mark.at = 0;
+        mark.seq = 0;
+    }
+
+    dl->mark_at = mark.at;
+    dl->mark_seq = mark.seq;
+    dl->seq = mark.seq + 1;
+
+    mark_d.at = mark.at;
+    mark_d.seq = mark.seq;
+
+    off = sizeof(mark);
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        d = queue_delayed_alloc(rec.len);
+        if (d == NULL) {
+            fclose(f);
+            return QUEUE_ERROR;
+        }
+
+        if (rec.len != 0 && fread(d->data, rec.len, 1, f) != 1) {
+            free(d);
+            break;
+        }
+
+        off += sizeof(rec) + rec.len;
+
+        d->at = rec.at;
+        d->seq = rec.seq;
+        d->expire = rec.expire;
+        d->priority = rec.priority < QUEUE_PRIORITY_LEVELS ? rec.priority : 0;
+
+        if (d->seq >= dl->seq) {
+            dl->seq = d->seq + 1;
+        }
+
+        if (!queue_delayed_before(&mark_d, d)) {
+            free(d);
+            continue;
+        }
+
+        if (queue_delay_push(dl, d) == QUEUE_ERROR) {
+            free(d);
+            fclose(f);
+            return QUEUE_ERROR;
+        }
+
+        dl->live += queue_delayed_size(d);
+    }
+
+    fclose(f);
+
+    if (ftruncate(fd, off) == -1) {
+        return QUEUE_ERROR;
+    }
+
+    dl->file_size = off;
+    q->delayed = dl->n;
+
+    log_info(q->logger, 0, "queue \"%s\" has %u delayed messages",
+             q->name, dl->n);
+
+    return QUEUE_OK;
+}
+
+static queue_delayed_t *queue_delayed_alloc(size_t len)
+{
+    queue_delayed_t *d;
+
+    d = malloc(sizeof(queue_delayed_t) + len);
+    if (d == NULL) {
+        return NULL;
+    }
+
+    d->len = len;
+    d->data = (u_char *) (d + 1);
+
+    return d;
+}
+
+static int queue_delay_push(queue_delay_t *dl, queue_delayed_t *d)
+{
+    uint_t            i, parent, size;
+    queue_delayed_t **heap;
+
+    if (dl->n == dl->size) {
+        size = dl->size ? dl->size * 2 : QUEUE_DELAY_HEAP;
+
+        heap = realloc(dl->heap, size * sizeof(queue_delayed_t *));
+        if (heap == NULL) {
+            return QUEUE_ERROR;
+        }
+
+        dl->heap = heap;
+        dl->size = size;
+    }
+
+    for (i = dl->n++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+
+        if (!queue_delayed_before(d, dl->heap[parent])) {
+            break;
+        }
+
+        dl->heap[i] = dl->heap[parent];
+    }
+
+    dl->heap[i] = d;
+
+    return QUEUE_OK;
+}
+
+/* remove the first one */
+static void queue_delay_pop(queue_delay_t *dl)
+{
+    uint_t            i, child;
+    queue_delayed_t  *last;
+
+    last = dl->heap[--dl->n];
+
+    for (i = 0; (child = 2 * i + 1) < dl->n; i = child) {
+        if (child + 1 < dl->n
+            && queue_delayed_before(dl->heap[child + 1], dl->heap[child]))
+        {
+            child++;
+        }
+
+        if (!queue_delayed_before(dl->heap[child], last)) {
+            break;
+        }
+
+        dl->heap[i] = dl->heap[child];
+    }
+
+    dl->heap[i] = last;
+}
+
+/* called with the queue locked, the file is created by the first one */
+static int queue_delay_append(queue_t *q, queue_delayed_t *d)
+{
+    int                   dir_fd;
+    struct iovec          iov[2];
+    queue_delay_t        *dl;
+    queue_delay_mark_t    mark;
+    queue_delay_record_t  rec;
+
+    dl = q->delay;
+
+    if (dl->fd == -1) {
+        dir_fd = queue_dir_open(q);
+        if (dir_fd == -1) {
+            return QUEUE_ERROR;
+        }
+
+        dl->fd = openat(dir_fd, "delayed", O_RDWR | O_CREAT, 0644);
+
+        if (dl->fd == -1 || fsync(dir_fd) == -1) {
+            log_error(q->logger, errno, "create the delayed messages of "
+                      "queue \"%s\" failed.", q->name);
+            close(dir_fd);
+            return QUEUE_ERROR;
+        }
+
+        close(dir_fd);
+
+        mark.at = dl->mark_at;
+        mark.seq = dl->mark_seq;
+
+        if (pwrite(dl->fd, &mark, sizeof(mark), 0) != sizeof(mark)) {
+            goto failed;
+        }
+
+        dl->file_size = sizeof(mark);
+    }
+
+    rec.at = d->at;
+    rec.seq = d->seq;
+    rec.expire = d->expire;
+    rec.len = d->len;
+    rec.priority = d->priority;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = d->data;
+    iov[1].iov_len = d->len;
+
+    if (pwritev(dl->fd, iov, 2, dl->file_size)
+        != (ssize_t) queue_delayed_size(d))
+    {
+        goto failed;
+    }
+
+    dl->file_size += queue_delayed_size(d);
+    dl->live += queue_delayed_size(d);
+    dl->dirty = 1;
+
+    return QUEUE_OK;
+
+failed:
+
+    log_error(q->logger, errno, "write the delayed messages of queue "
+              "\"%s\" failed.", q->name);
+
+    return QUEUE_ERROR;
+}
+
+/**
+ * Called with the queue locked, the heap is written to "delayed.new" which
+ * is synced and renamed to "delayed" before it becomes "fd", so no append
+ * goes to a file which a crash would leave as "delayed.new". The old file
+ * is kept on an error.
+ */
+static int queue_delay_rewrite(queue_t *q, int dir_fd)
+{
+    int                   fd;
+    uint_t                i;
+    FILE                 *f;
+    queue_delay_t        *dl;
+    queue_delayed_t      *d;
+    queue_delay_mark_t    mark;
+    queue_delay_record_t  rec;
+
+    dl = q->delay;
+
+    fd = openat(dir_fd, "delayed.new", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        goto failed;
+    }
+
+    f = fdopen(dup(fd), "w");
+    if (f == NULL) {
+        close(fd);
+        goto failed;
+    }
+
+    mark.at = dl->mark_at;
+    mark.seq = dl->mark_seq;
+
+    fwrite(&mark, sizeof(mark), 1, f);
+
+    for (i = 0; i < dl->n; i++) {
+        d = dl->heap[i];
+
+        rec.at = d->at;
+        rec.seq = d->seq;
+        rec.expire = d->expire;
+        rec.len = d->len;
+        rec.priority = d->priority;
+
+        fwrite(&rec, sizeof(rec), 1, f);
+        fwrite(d->data, 1, d->len, f);
+    }
+
+    if (fclose(f) != 0
+        || fdatasync(fd) == -1
+        || renameat(dir_fd, "delayed.new", dir_fd, "delayed") == -1)
+    {
+        close(fd);
+        unlinkat(dir_fd, "delayed.new", 0);
+        goto failed;
+    }
+
+    /* the rename is in the page cache, the old file is gone anyway */
+    if (fsync(dir_fd) == -1) {
+        log_error(q->logger, errno, "sync the directory of queue \"%s\" "
+                  "failed.", q->name);
+    }
+
+    close(dl->fd);
+
+    dl->fd = fd;
+    dl->file_size = sizeof(mark) + dl->live;
+
+    return QUEUE_OK;
+
+failed:
+
+    log_error(q->logger, errno, "compact the delayed messages of queue "
+              "\"%s\" failed.", q->name);
+
+    return QUEUE_ERROR;
+}
@@ -0,0 +1,545 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+#ifdef HAVE_LEVELDB
+#include "leveldb/c.h"
+#endif
+
+/**
+ * Consumer groups. COMMIT only moves "committed" in memory, the timer of
+ * the "queue" module stores the groups which are moved since the last time
+ * in one synchronous write for each queue, however many COMMITs there are.
+ *
+ * The committed ids are stored in LevelDB if xpipe is configured with
+ * "--with-leveldb", one database in "<queue_data_dir>/groups" with keys
+ * "<queue>:<group>". Or else they are in "<queue_data_dir>/<queue>/groups"
+ * by the segments of the queue, a "<group> <id>" line for each group, the
+ * file is written aside and renamed.
+ */
+
+#define QUEUE_GROUP_LINE_LEN  (QUEUE_NAME_MAX + 24)
+
+static int queue_group_store_load(queue_t *q);
+static int queue_group_store_write(queue_t *q, queue_group_t **groups,
+        uint64_t *ids, uint_t n, uint_t dirty);
+
+
+/* called with the queue locked, NULL if the name is invalid */
+queue_group_t *queue_group_get(queue_t *q, string_t *name)
+{
+    size_t         i;
+    queue_group_t *g;
+
+    if (name->len == 0 || name->len > QUEUE_NAME_MAX) {
+        return NULL;
+    }
+
+    for (i = 0; i < name->len; i++) {
+        if (!is_letter(name->data[i]) && !is_digit(name->data[i])
+            && name->data[i] != '_')
+        {
+            return NULL;
+        }
+    }
+
+    for (g = q->groups; g != NULL; g = g->next) {
+        if (x_strncmp(g->name, name->data, name->len) == 0
+            && g->name[name->len] == '\0')
+        {
+            return g;
+        }
+    }
+
+    if (q->ngroups == QUEUE_GROUPS_MAX) {
+        log_error(q->logger, 0, "queue \"%s\" has %d groups already.",
+                  q->name, QUEUE_GROUPS_MAX);
+        return NULL;
+    }
+
+    /* the pool of the queue is not freed until the queue is destroyed */
+    g = pcalloc(q->pool, sizeof(queue_group_t));
+    if (g == NULL) {
+        return NULL;
+    }
+
+    memcpy(g->name, name->data, name->len);
+    g->name[name->len] = '\0';
+
+    /* reads from the oldest message */
+    g->next = q->groups;
+    q->groups = g;
+    q->ngroups++;
+    q->committed = 0;
+
+    return g;
+}
+
+/**
+ * Called with the queue locked. The messages up to "id" are done with by
+ * the group, an id which is not given to the group yet is cut to the last
+ * one given.
+ */
+void queue_group_commit(queue_t *q, queue_group_t *g, uint64_t id)
+{
+    id++;
+
+    if (id > g->cursor.id) {
+        id = g->cursor.id;
+    }
+
+    if (id <= g->committed) {
+        return;
+    }
+
+    g->committed = id;
+
+    queue_trim(q);
+}
+
+/* called when the queue is created, the groups read from "committed" */
+int queue_group_load(queue_t *q)
+{
+    q->groups_stored = 1;
+
+    if (queue_group_store_load(q) == QUEUE_ERROR) {
+        log_error(q->logger, 0, "load the groups of queue \"%s\" failed.",
+                  q->name);
+        return QUEUE_ERROR;
+    }
+
+    /* the queue is not shared yet, "committed" is set for LIST */
+    queue_trim(q);
+
+    return QUEUE_OK;
+}
+
+/**
+ * Called by the "queue" module only. The store is written with the queue
+ * unlocked, the groups are only prepended and are freed with the queue, so
+ * the list taken under the lock stays valid.
+ */
+void queue_group_sync(queue_t *q)
+{
+    uint_t          i, n, dirty;
+    uint64_t       *ids;
+    queue_group_t  *g, **groups;
+
+    if (!q->groups_stored) {
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    /* "queue_group_remove" is done with it */
+    if (q->deleted) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    for (dirty = 0, g = q->groups; g != NULL; g = g->next) {
+        if (g->committed != g->synced) {
+            dirty++;
+        }
+    }
+
+    if (dirty == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    n = q->ngroups;
+
+    groups = malloc(n * (sizeof(queue_group_t *) + sizeof(uint64_t)));
+    if (groups == NULL) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    ids = (uint64_t *) (groups + n);
+
+    for (i = 0, g = q->groups; g != NULL; g = g->next, i++) {
+        groups[i] = g;
+        ids[i] = g->committed;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (queue_group_store_write(q, groups, ids, n, dirty) == QUEUE_OK) {
+        pthread_mutex_lock(&q->lock);
+
+        for (i = 0; i < n; i++) {
+            groups[i]->synced = ids[i];
+        }
+
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    free(groups);
+}
+
+
+#ifdef HAVE_LEVELDB
+
+static leveldb_t       *queue_group_db;
+static pthread_mutex_t  queue_group_db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static leveldb_t *queue_group_db_open(queue_t *q)
+{
+    char              *err;
+    size_t             len;
+    u_char            *path;
+    leveldb_t         *db;
+    leveldb_options_t *options;
+
+    pthread_mutex_lock(&queue_group_db_lock);
+
+    db = queue_group_db;
+
+    if (db != NULL) {
+        pthread_mutex_unlock(&queue_group_db_lock);
+        return db;
+    }
+
+    len = queue_data_dir.len + sizeof("/groups");
+
+    path = malloc(len);
+    if (path == NULL) {
+        pthread_mutex_unlock(&queue_group_db_lock);
+        return NULL;
+    }
+
+    snprintf((char *) path, len, "%s/groups", queue_data_dir.data);
+
+    options = leveldb_options_create();
+    leveldb_options_set_create_if_missing(options, 1);
+
+    err = NULL;
+    db = leveldb_open(options, (char *) path, &err);
+
+    if (err != NULL) {
+        log_error(q->logger, 0, "open \"%s\" failed: %s", path, err);
+        free(err);
+        db = NULL;
+    }
+
+    leveldb_options_destroy(options);
+    free(path);
+
+    queue_group_db = db;
+
+    pthread_mutex_unlock(&queue_group_db_lock);
+
+    return db;
+}
+
+static int queue_group_store_load(queue_t *q)
+{
+    char                    prefix[QUEUE_NAME_MAX + 2];
+    size_t                  klen, vlen, plen;
+    uint64_t                id;
+    string_t                name;
+    const char             *key, *value;
+    leveldb_t              *db;
+    queue_group_t          *g;
+    leveldb_iterator_t     *it;
+    leveldb_readoptions_t  *options;
+
+    db = queue_group_db_open(q);
+    if (db == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    plen = snprintf(prefix, sizeof(prefix), "%s:", q->name);
+
+    options = leveldb_readoptions_create();
+    it = leveldb_create_iterator(db, options);
+
+    for (leveldb_iter_seek(it, prefix, plen); leveldb_iter_valid(it);
+         leveldb_iter_next(it))
+    {
+        key = leveldb_iter_key(it, &klen);
+
+        if (klen <= plen || memcmp(key, prefix, plen) != 0) {
+            break;
+        }
+
+        value = leveldb_iter_value(it, &vlen);
+        if (vlen != sizeof(uint64_t)) {
+            continue;
+        }
+
+        memcpy(&id, value, sizeof(uint64_t));
+
+        name.data = (u_char *) key + plen;
+        name.len = klen - plen;
+
+        g = queue_group_get(q, &name);
+        if (g == NULL) {
+            continue;
+        }
+
+        g->cursor.id = id;
+        g->committed = id;
+        g->synced = id;
+    }
+
+    leveldb_iter_destroy(it);
+    leveldb_readoptions_destroy(options);
+
+    return QUEUE_OK;
+}
+
+/* the groups which are moved, in one batch */
+static int queue_group_store_write(queue_t *q, queue_group_t **groups,
+        uint64_t *ids, uint_t n, uint_t dirty)
+{
+    int                     ret;
+    char                   *err;
+    char                    key[2 * QUEUE_NAME_MAX + 2];
+    uint_t                  i;
+    size_t                  klen;
+    leveldb_t              *db;
+    leveldb_writebatch_t   *batch;
+    leveldb_writeoptions_t *options;
+
+    db = queue_group_db_open(q);
+    if (db == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    batch = leveldb_writebatch_create();
+
+    for (i = 0; i < n; i++) {
+        if (ids[i] == groups[i]->synced) {
+            continue;
+        }
+
+        klen = snprintf(key, sizeof(key), "%s:%s", q->name, groups[i]->name);
+        leveldb_writebatch_put(batch, key, klen, (char *) &ids[i],
+                               sizeof(uint64_t));
+    }
+
+    options = leveldb_writeoptions_create();
+    leveldb_writeoptions_set_sync(options, 1);
+
+    err = NULL;
+    leveldb_write(db, options, batch, &err);
+
+    ret = QUEUE_OK;
+
+    if (err != NULL) {
+        log_error(q->logger, 0, "store %u groups of queue \"%s\" failed: %s",
+                  dirty, q->name, err);
+        free(err);
+        ret = QUEUE_ERROR;
+    }
+
+    leveldb_writeoptions_destroy(options);
+    leveldb_writebatch_destroy(batch);
+
+    return ret;
+}
+
+/* the keys of a deleted queue, in one batch */
+void queue_group_remove(queue_t *q)
+{
+    char                   *err;
+    char                    prefix[QUEUE_NAME_MAX + 2];
+    size_t                  klen, plen;
+    const char             *key;
+    leveldb_t              *db;
+    leveldb_iterator_t     *it;
+    leveldb_writebatch_t   *batch;
+    leveldb_readoptions_t  *roptions;
+    leveldb_writeoptions_t *woptions;
+
+    db = queue_group_db_open(q);
+    if (db == NULL) {
+        return;
+    }
+
+    plen = snprintf(prefix, sizeof(prefix), "%s:", q->name);
+
+    batch = leveldb_writebatch_create();
+    roptions = leveldb_readoptions_create();
+    it = leveldb_create_iterator(db, roptions);
+
+    for (leveldb_iter_seek(it, prefix, plen); leveldb_iter_valid(it);
+         leveldb_iter_next(it))
+    {
+        key = leveldb_iter_key(it, &klen);
+
+        if (klen <= plen || memcmp(key, prefix, plen) != 0) {
+            break;
+        }
+
+        leveldb_writebatch_delete(batch, key, klen);
+    }
+
+    leveldb_iter_destroy(it);
+    leveldb_readoptions_destroy(roptions);
+
+    woptions = leveldb_writeoptions_create();
+    leveldb_writeoptions_set_sync(woptions, 1);
+
+    err = NULL;
+    leveldb_write(db, woptions, batch, &err);
+
+    if (err != NULL) {
+        log_error(q->logger, 0, "remove the groups of queue \"%s\" failed: "
+                  "%s", q->name, err);
+        free(err);
+    }
+
+    leveldb_writeoptions_destroy(woptions);
+    leveldb_writebatch_destroy(batch);
+}
+
+void queue_group_store_close(void)
+{
+    pthread_mutex_lock(&queue_group_db_lock);
+
+    if (queue_group_db != NULL) {
+        leveldb_close(queue_group_db);
+        queue_group_db = NULL;
+    }
+
+    pthread_mutex_unlock(&queue_group_db_lock);
+}
+
+#else
+
+static int queue_group_store_load(queue_t *q)
+{
+    int            dir_fd, fd;
+    char           line[QUEUE_GROUP_LINE_LEN];
+    char           name[QUEUE_NAME_MAX + 1];
+    FILE          *f;
+    uint64_t       id;
+    string_t       s;
+    queue_group_t *g;
+
+    dir_fd = queue_dir_open(q);
+    if (dir_fd == -1) {
+        return QUEUE_ERROR;
+    }
+
+    fd = openat(dir_fd, "groups", O_RDONLY);
+    close(dir_fd);
+
+    if (fd == -1) {
+        return errno == ENOENT ? QUEUE_OK : QUEUE_ERROR;
+    }
+
+    f = fdopen(fd, "r");
+    if (f == NULL) {
+        close(fd);
+        return QUEUE_ERROR;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%64s %" SCNu64, name, &id) != 2) {
+            continue;
+        }
+
+        s.data = (u_char *) name;
+        s.len = x_strlen(name);
+
+        g = queue_group_get(q, &s);
+        if (g == NULL) {
+            continue;
+        }
+
+        g->cursor.id = id;
+        g->committed = id;
+        g->synced = id;
+    }
+
+    fclose(f);
+
+    return QUEUE_OK;
+}
+
+/* the file has every group, it's written whole and renamed */
+static int queue_group_store_write(queue_t *q, queue_group_t **groups,
+        uint64_t *ids, uint_t n, uint_t dirty)
+{
+    int      dir_fd, fd;
+    uint_t   i;
+    size_t   len;
+    ssize_t  written;
+    u_char  *buf, *p;
+
+    buf = malloc(n * QUEUE_GROUP_LINE_LEN);
+    if (buf == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    for (i = 0, p = buf; i < n; i++) {
+        p += sprintf((char *) p, "%s %" PRIu64 "\n", groups[i]->name, ids[i]);
+    }
+
+    len = p - buf;
+
+    dir_fd = queue_dir_open(q);
+    if (dir_fd == -1) {
+        free(buf);
+        return QUEUE_ERROR;
+    }
+
+    fd = openat(dir_fd, "groups.new", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        goto failed;
+    }
+
+    for (p = buf; len > 0; p += written, len -= written) {
+        written = write(fd, p, len);
+        if (written == -1) {
+            close(fd);
+            goto failed;
+        }
+    }
+
+    if (fdatasync(fd) == -1) {
+        close(fd);
+        goto failed;
+    }
+
+    close(fd);
+
+    if (renameat(dir_fd, "groups.new", dir_fd, "groups") == -1
+        || fsync(dir_fd) == -1)
+    {
+        goto failed;
+    }
+
+    close(dir_fd);
+    free(buf);
+
+    return QUEUE_OK;
+
+failed:
+
+    log_error(q->logger, errno, "store %u groups of queue \"%s\" failed.",
+              dirty, q->name);
+
+    close(dir_fd);
+    free(buf);
+
+    return QUEUE_ERROR;
+}
+
+/* the file is in the directory of the queue, which is removed */
+void queue_group_remove(queue_t *q)
+{
+}
+
+void queue_group_store_close(void)
+{
+}
+
+#endif
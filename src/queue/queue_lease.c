@@ -0,0 +1,366 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * Leases of a queue with "visibility_ms". A GET gives the messages from
+ * the lease cursor and leases them, ACK ends a lease and the messages
+ * which are acked are removed by "queue_trim". A lease which is not acked
+ * in time is moved to "ready", the next GET gives the message again.
+ *
+ * The leases are found by id in an open addressing table, the slot is the
+ * fibonacci hash of the id and collisions probe the next slots, a removed
+ * lease shifts the ones after it back so no tombstones are left. The
+ * expiries are on a timer wheel driven by "time_current_msecs". Leases are
+ * not stored, the messages which are not acked are given again after a
+ * restart.
+ */
+
+#define QUEUE_LEASE_BITS        10
+#define QUEUE_LEASE_BITS_MAX    30
+
+#define queue_lease_hash(id, bits)                                          \
+    ((uint_t) (((id) * 11400714819323198485ULL) >> (64 - (bits))))
+
+#define queue_lease_of(n)   ((queue_lease_t *) (n))
+
+static queue_lease_t *queue_lease_alloc(queue_leases_t *ls);
+static int queue_lease_insert(queue_leases_t *ls, queue_lease_t *l);
+static queue_lease_t **queue_lease_find(queue_leases_t *ls, uint64_t id);
+static void queue_lease_remove(queue_leases_t *ls, queue_lease_t **slot);
+static void queue_lease_timeout(timer_node_t *node, void *data);
+
+
+int queue_lease_init(queue_t *q)
+{
+    queue_leases_t *ls;
+
+    ls = pcalloc(q->pool, sizeof(queue_leases_t));
+    if (ls == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    ls->bits = QUEUE_LEASE_BITS;
+
+    ls->table = calloc(1 << ls->bits, sizeof(queue_lease_t *));
+    if (ls->table == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    ls->ready.next = &ls->ready;
+    ls->ready.prev = &ls->ready;
+
+    timer_wheel_init(&ls->wheel, time_current_msecs, QUEUE_LEASE_TICK);
+
+    q->leases = ls;
+
+    return QUEUE_OK;
+}
+
+void queue_lease_done(queue_t *q)
+{
+    void           *chunk;
+    queue_leases_t *ls;
+
+    ls = q->leases;
+
+    if (ls == NULL) {
+        return;
+    }
+
+    while (ls->chunks != NULL) {
+        chunk = ls->chunks;
+        ls->chunks = *(void **) chunk;
+        free(chunk);
+    }
+
+    free(ls->table);
+    q->leases = NULL;
+}
+
+/**
+ * Called with the queue locked. The next message to give, an expired lease
+ * first, and lease it for "visibility" msecs. QUEUE_SWEEP_BATCH expired
+ * messages are skipped at most, then it's QUEUE_EMPTY for this time.
+ */
+int queue_lease_next(queue_t *q, queue_msg_t *msg, uint_t visibility)
+{
+    uint_t           skipped;
+    queue_lease_t   *l, **slot;
+    timer_node_t    *node;
+    queue_cursor_t   cursor;
+    queue_leases_t  *ls;
+
+    ls = q->leases;
+    skipped = 0;
+
+    while (ls->ready.next != &ls->ready) {
+        node = ls->ready.next;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->next = NULL;
+        node->prev = NULL;
+
+        l = queue_lease_of(node);
+        l->ready = 0;
+
+        cursor.id = l->id;
+        cursor.hint_base = 0;
+        cursor.hint_off = 0;
+
+        /* the message is dropped for a new one if the queue was full */
+        if (q->conf.engine->read_handler(q, &cursor, msg) == QUEUE_EMPTY
+            || msg->id != l->id
+            || queue_msg_expired(msg, time_current_epoch_msecs))
+        {
+            slot = queue_lease_find(ls, l->id);
+            queue_lease_remove(ls, slot);
+
+            if (++skipped == QUEUE_SWEEP_BATCH) {
+                return QUEUE_EMPTY;
+            }
+
+            continue;
+        }
+
+        timer_wheel_add(&ls->wheel, &l->node, visibility);
+        q->inflight = ls->wheel.count;
+        q->redelivered++;
+
+        return QUEUE_OK;
+    }
+
+    for ( ;; ) {
+        if (q->conf.engine->read_handler(q, &ls->cursor, msg) == QUEUE_EMPTY)
+        {
+            return QUEUE_EMPTY;
+        }
+
+        if (!queue_msg_expired(msg, time_current_epoch_msecs)) {
+            break;
+        }
+
+        ls->cursor.id = msg->id + 1;
+
+        if (++skipped == QUEUE_SWEEP_BATCH) {
+            return QUEUE_EMPTY;
+        }
+    }
+
+    l = queue_lease_alloc(ls);
+    if (l == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    l->id = msg->id;
+    l->ready = 0;
+
+    if (queue_lease_insert(ls, l) == QUEUE_ERROR) {
+        l->node.next = (timer_node_t *) ls->free;
+        ls->free = l;
+        return QUEUE_ERROR;
+    }
+
+    ls->cursor.id = msg->id + 1;
+
+    timer_wheel_add(&ls->wheel, &l->node, visibility);
+    q->inflight = ls->wheel.count;
+
+    return QUEUE_OK;
+}
+
+/* called with the queue locked, QUEUE_ERROR if "id" is not leased */
+int queue_lease_ack(queue_t *q, uint64_t id)
+{
+    queue_lease_t  *l, **slot;
+    queue_leases_t *ls;
+
+    ls = q->leases;
+
+    slot = queue_lease_find(ls, id);
+    if (slot == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    l = *slot;
+
+    if (l->ready) {
+        l->node.prev->next = l->node.next;
+        l->node.next->prev = l->node.prev;
+        l->node.next = NULL;
+        l->node.prev = NULL;
+
+    } else {
+        timer_wheel_del(&ls->wheel, &l->node);
+    }
+
+    queue_lease_remove(ls, slot);
+    q->inflight = ls->wheel.count;
+
+    return QUEUE_OK;
+}
+
+/* called with the queue locked, the message is given and not acked */
+int queue_lease_held(queue_t *q, uint64_t id)
+{
+    return queue_lease_find(q->leases, id) != NULL;
+}
+
+/* called with the queue locked, the expired leases are moved to "ready" */
+void queue_lease_expire(queue_t *q)
+{
+    queue_leases_t *ls;
+
+    ls = q->leases;
+
+    timer_wheel_advance(&ls->wheel, time_current_msecs, queue_lease_timeout,
+                        ls);
+    q->inflight = ls->wheel.count;
+}
+
+static void queue_lease_timeout(timer_node_t *node, void *data)
+{
+    queue_leases_t *ls;
+
+    ls = data;
+
+    /* the oldest expiry is given first */
+    node->next = &ls->ready;
+    node->prev = ls->ready.prev;
+    ls->ready.prev->next = node;
+    ls->ready.prev = node;
+
+    queue_lease_of(node)->ready = 1;
+}
+
+static queue_lease_t *queue_lease_alloc(queue_leases_t *ls)
+{
+    uint_t          i;
+    void          **chunk;
+    queue_lease_t  *l;
+
+    if (ls->free == NULL) {
+        chunk = malloc(sizeof(void *)
+                       + QUEUE_LEASE_CHUNK * sizeof(queue_lease_t));
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        *chunk = ls->chunks;
+        ls->chunks = chunk;
+
+        l = (queue_lease_t *) (chunk + 1);
+
+        for (i = 0; i < QUEUE_LEASE_CHUNK; i++) {
+            l[i].node.next = (timer_node_t *) ls->free;
+            ls->free = &l[i];
+        }
+    }
+
+    l = ls->free;
+    ls->free = (queue_lease_t *) l->node.next;
+
+    l->node.next = NULL;
+    l->node.prev = NULL;
+
+    return l;
+}
+
+/* the table is doubled when it's 3/4 full */
+static int queue_lease_insert(queue_leases_t *ls, queue_lease_t *l)
+{
+    uint_t          i, mask, size;
+    queue_lease_t **table, **old;
+
+    if ((ls->n + 1) * 4 > (1U << ls->bits) * 3) {
+        if (ls->bits == QUEUE_LEASE_BITS_MAX) {
+            return QUEUE_ERROR;
+        }
+
+        size = 1 << ls->bits;
+
+        table = calloc(size * 2, sizeof(queue_lease_t *));
+        if (table == NULL) {
+            return QUEUE_ERROR;
+        }
+
+        old = ls->table;
+        ls->table = table;
+        ls->bits++;
+        ls->n = 0;
+
+        for (i = 0; i < size; i++) {
+            if (old[i] != NULL) {
+                queue_lease_insert(ls, old[i]);
+            }
+        }
+
+        free(old);
+    }
+
+    mask = (1 << ls->bits) - 1;
+
+    for (i = queue_lease_hash(l->id, ls->bits); ls->table[i] != NULL;
+         i = (i + 1) & mask)
+    {
+        /* void */
+    }
+
+    ls->table[i] = l;
+    ls->n++;
+
+    return QUEUE_OK;
+}
+
+static queue_lease_t **queue_lease_find(queue_leases_t *ls, uint64_t id)
+{
+    uint_t  i, mask;
+
+    mask = (1 << ls->bits) - 1;
+
+    for (i = queue_lease_hash(id, ls->bits); ls->table[i] != NULL;
+         i = (i + 1) & mask)
+    {
+        if (ls->table[i]->id == id) {
+            return &ls->table[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Free the lease of "slot", the leases probed past it are moved back to
+ * the first free slot they may be found in.
+ */
+static void queue_lease_remove(queue_leases_t *ls, queue_lease_t **slot)
+{
+    uint_t          i, j, home, mask;
+    queue_lease_t  *l;
+
+    mask = (1 << ls->bits) - 1;
+
+    l = *slot;
+    l->node.next = (timer_node_t *) ls->free;
+    ls->free = l;
+
+    i = slot - ls->table;
+    ls->table[i] = NULL;
+    ls->n--;
+
+    for (j = (i + 1) & mask; ls->table[j] != NULL; j = (j + 1) & mask) {
+        home = queue_lease_hash(ls->table[j]->id, ls->bits);
+
+        /* the lease stays if its home is in (i, j] cyclically */
+        if (((j - home) & mask) < ((j - i) & mask)) {
+            continue;
+        }
+
+        ls->table[i] = ls->table[j];
+        ls->table[j] = NULL;
+        i = j;
+    }
+}
@@ -0,0 +1,1123 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * The "log" engine appends messages to segment files in
+ * "<queue_data_dir>/<name>/", a segment is named by the id of its first
+ * message:
+ *
+ *   <base>.log  records of "queue_log_record_t" and the payload, the file
+ *               is preallocated and mapped, records are written and read
+ *               through the map. A record keeps the CRC-32C of its
+ *               payload, the records of a segment are checked when it's
+ *               loaded and it ends at the first one which is torn.
+ *   <base>.idx  a sparse index, an entry for every QUEUE_LOG_INDEX_INTERVAL
+ *               bytes of records, to find a message by id on recovery.
+ *   head        the id of the next message to GET.
+ *   <n>.tmp     the payload of a large PUT being spliced, it's renamed to
+ *               a segment of its own once the payload is read fully.
+ *
+ * PUT and GET only touch the page cache, the timer of the "queue" module
+ * calls "queue_log_sync" which fsyncs what is written since the last call
+ * in one go, and removes the segments which have been read.
+ */
+
+#define QUEUE_LOG_INDEX_INTERVAL  4096
+#define QUEUE_LOG_SYNC_MAX        8         /* segments of a sync */
+
+static int queue_log_init(queue_t *q);
+static void queue_log_done(queue_t *q);
+static int queue_log_put(queue_t *q, queue_msg_t *msg);
+static int queue_log_peek(queue_t *q, queue_msg_t *msg);
+static void queue_log_pop(queue_t *q);
+static int queue_log_read(queue_t *q, queue_cursor_t *c, queue_msg_t *msg);
+static void queue_log_sync(queue_t *q);
+static int queue_log_hold(queue_t *q, mem_pool_t *pool);
+static void queue_log_release(void *data);
+static int queue_log_ingest(queue_t *q, queue_ingest_t *in);
+static int queue_log_ingest_end(queue_t *q, queue_ingest_t *in, int commit);
+
+
+/**
+ * "expire" is in seconds of the epoch so the records keep their size, a
+ * TTL is rounded up to a second by the "log" engine. 0 never expires.
+ * "crc" is the CRC-32C of the payload.
+ */
+typedef struct {
+    uint64_t   id;
+    uint32_t   len;
+    uint32_t   expire;
+    uint32_t   crc;
+    uint32_t   reserved;
+} queue_log_record_t;
+
+#define queue_log_expire_secs(msecs)                                        \
+    ((msecs) == 0 ? 0 : (uint32_t) (((msecs) + 999) / 1000))
+#define queue_log_expire_msecs(secs)  ((uint64_t) (secs) * 1000)
+
+typedef struct {
+    uint64_t   id;
+    uint64_t   offset;
+} queue_log_index_t;
+
+typedef struct queue_log_segment_s queue_log_segment_t;
+
+struct queue_log_segment_s {
+    uint64_t              base;
+    uint64_t              next_id;  /* id of the record at "last" */
+    int                   fd;
+    int                   idx_fd;
+    u_char               *map;
+    size_t                size;
+    size_t                last;     /* end of the records */
+    size_t                indexed;  /* offset of the last index entry */
+    off_t                 idx_size;
+    int                   dirty;
+    int                   refs;     /* responses which send from "fd" */
+    queue_log_segment_t  *next;
+};
+
+typedef struct {
+    queue_t              *q;
+    queue_log_segment_t  *seg;
+} queue_log_hold_t;
+
+/**
+ * GET reads "head" from "rd", PUT appends to "tail". The segments which
+ * have been read are moved to "retired", they are removed by the sync
+ * once no response sends from them.
+ */
+typedef struct {
+    u_char               *dir;
+    int                   dir_fd;
+    int                   head_fd;
+    int                   dir_dirty;
+
+    queue_log_segment_t  *head;
+    queue_log_segment_t  *tail;
+    queue_log_segment_t  *retired;
+    queue_log_segment_t  *last_read;    /* of the last peek or read */
+
+    size_t                rd;
+    uint64_t              rd_id;
+    uint64_t              synced_id;
+    uint_t                ingests;  /* names the ".tmp" files */
+} queue_log_t;
+
+queue_engine_t queue_log_engine = {
+    xstring("log"),
+    queue_log_init,
+    queue_log_done,
+    queue_log_put,
+    queue_log_peek,
+    queue_log_pop,
+    queue_log_read,
+    queue_log_sync,
+    queue_log_hold,
+    queue_log_ingest,
+    queue_log_ingest_end
+};
+
+static queue_log_segment_t *queue_log_segment_create(queue_t *q,
+        uint64_t base, size_t size);
+static queue_log_segment_t *queue_log_segment_load(queue_t *q,
+        uint64_t base);
+static void queue_log_segment_close(queue_log_segment_t *seg);
+static void queue_log_segment_unlink(queue_t *q, queue_log_segment_t *seg);
+static size_t queue_log_segment_find(queue_t *q, queue_log_segment_t *seg,
+        uint64_t id, uint64_t *found);
+static void queue_log_index_trim(queue_t *q, queue_log_segment_t *seg);
+static size_t queue_log_scan(queue_log_segment_t *seg, size_t off,
+        uint64_t *id, uint64_t stop, int verify);
+static int queue_log_load(queue_t *q);
+static int queue_log_base_cmp(const void *a, const void *b);
+
+
+static int queue_log_init(queue_t *q)
+{
+    size_t          len;
+    ssize_t         n;
+    uint64_t        id;
+    queue_log_t    *lq;
+
+    lq = pcalloc(q->pool, sizeof(queue_log_t));
+    if (lq == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    lq->dir_fd = -1;
+    lq->head_fd = -1;
+
+    len = queue_data_dir.len + 1 + x_strlen(q->name) + 1;
+
+    lq->dir = pmalloc(q->pool, len);
+    if (lq->dir == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    snprintf((char *) lq->dir, len, "%s/%s", queue_data_dir.data, q->name);
+
+    if ((mkdir((char *) queue_data_dir.data, 0755) == -1 && errno != EEXIST)
+        || (mkdir((char *) lq->dir, 0755) == -1 && errno != EEXIST))
+    {
+        log_error(q->logger, errno, "create directory \"%s\" failed.",
+                  lq->dir);
+        return QUEUE_ERROR;
+    }
+
+    lq->dir_fd = open((char *) lq->dir, O_RDONLY | O_DIRECTORY);
+    if (lq->dir_fd == -1) {
+        log_error(q->logger, errno, "open \"%s\" failed.", lq->dir);
+        return QUEUE_ERROR;
+    }
+
+    lq->head_fd = openat(lq->dir_fd, "head", O_RDWR | O_CREAT, 0644);
+    if (lq->head_fd == -1) {
+        log_error(q->logger, errno, "open the head of \"%s\" failed.",
+                  lq->dir);
+        goto failed;
+    }
+
+    n = pread(lq->head_fd, &id, sizeof(uint64_t), 0);
+    lq->rd_id = n == sizeof(uint64_t) ? id : 1;
+    lq->synced_id = lq->rd_id;
+
+    q->engine_ctx = lq;
+
+    if (queue_log_load(q) == QUEUE_ERROR) {
+        queue_log_done(q);
+        return QUEUE_ERROR;
+    }
+
+    return QUEUE_OK;
+
+failed:
+
+    close(lq->dir_fd);
+    return QUEUE_ERROR;
+}
+
+/**
+ * Load the segments in the directory, the ones before "rd_id" are
+ * removed, the depth and bytes of the queue are counted from the offsets.
+ */
+static int queue_log_load(queue_t *q)
+{
+    DIR                 *dir;
+    size_t               n, nalloc, i, bytes, n_len;
+    uint64_t            *bases, *p, base, id;
+    queue_log_t         *lq;
+    struct dirent       *de;
+    queue_log_segment_t *seg;
+
+    lq = q->engine_ctx;
+
+    dir = opendir((char *) lq->dir);
+    if (dir == NULL) {
+        log_error(q->logger, errno, "open \"%s\" failed.", lq->dir);
+        return QUEUE_ERROR;
+    }
+
+    bases = NULL;
+    n = 0;
+    nalloc = 0;
+
+    while ((de = readdir(dir)) != NULL) {
+        n_len = x_strlen(de->d_name);
+
+        /* a PUT which was being spliced */
+        if (n_len > 4 && x_strcmp(de->d_name + n_len - 4, ".tmp") == 0) {
+            unlinkat(lq->dir_fd, de->d_name, 0);
+            continue;
+        }
+
+        if (n_len != 24
+            || x_strcmp(de->d_name + 20, ".log") != 0
+            || sscanf(de->d_name, "%20" SCNu64, &base) != 1)
+        {
+            continue;
+        }
+
+        if (n == nalloc) {
+            nalloc = nalloc ? nalloc * 2 : 16;
+
+            p = realloc(bases, nalloc * sizeof(uint64_t));
+            if (p == NULL) {
+                free(bases);
+                closedir(dir);
+                return QUEUE_ERROR;
+            }
+
+            bases = p;
+        }
+
+        bases[n++] = base;
+    }
+
+    closedir(dir);
+
+    qsort(bases, n, sizeof(uint64_t), queue_log_base_cmp);
+
+    for (i = 0; i < n; i++) {
+        seg = queue_log_segment_load(q, bases[i]);
+        if (seg == NULL) {
+            free(bases);
+            return QUEUE_ERROR;
+        }
+
+        /* read to the end before "rd_id" */
+        if (seg->next_id <= lq->rd_id && i + 1 < n) {
+            queue_log_segment_unlink(q, seg);
+            queue_log_segment_close(seg);
+            continue;
+        }
+
+        if (lq->tail == NULL) {
+            lq->head = seg;
+        } else {
+            lq->tail->next = seg;
+        }
+
+        lq->tail = seg;
+    }
+
+    free(bases);
+
+    if (lq->head == NULL) {
+        q->next_id = lq->rd_id;
+        return QUEUE_OK;
+    }
+
+    /* the messages before the oldest segment are lost */
+    if (lq->rd_id < lq->head->base) {
+        lq->rd_id = lq->head->base;
+    }
+
+    lq->rd = queue_log_segment_find(q, lq->head, lq->rd_id, &id);
+    lq->rd_id = id;
+
+    q->next_id = lq->tail->next_id;
+    q->depth = q->next_id - lq->rd_id;
+
+    for (bytes = 0, seg = lq->head; seg != NULL; seg = seg->next) {
+        bytes += seg->last;
+    }
+
+    q->bytes = bytes - lq->rd - q->depth * sizeof(queue_log_record_t);
+
+    return QUEUE_OK;
+}
+
+static int queue_log_base_cmp(const void *a, const void *b)
+{
+    uint64_t x, y;
+
+    x = *(const uint64_t *) a;
+    y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* the pages of the segments are not synced, "queue_log_sync" does it */
+static void queue_log_done(queue_t *q)
+{
+    queue_log_t         *lq;
+    queue_log_segment_t *seg, *next;
+
+    lq = q->engine_ctx;
+    if (lq == NULL) {
+        return;
+    }
+
+    queue_log_sync(q);
+
+    for (seg = lq->head; seg != NULL; seg = next) {
+        next = seg->next;
+        queue_log_segment_close(seg);
+    }
+
+    /* no request is alive, "net" is finished before */
+    for (seg = lq->retired; seg != NULL; seg = next) {
+        next = seg->next;
+        queue_log_segment_unlink(q, seg);
+        queue_log_segment_close(seg);
+    }
+
+    if (lq->head_fd != -1) {
+        close(lq->head_fd);
+    }
+
+    if (lq->dir_fd != -1) {
+        close(lq->dir_fd);
+    }
+
+    q->engine_ctx = NULL;
+}
+
+static int queue_log_put(queue_t *q, queue_msg_t *msg)
+{
+    size_t               need, size;
+    u_char              *p;
+    queue_log_t         *lq;
+    queue_log_index_t    entry;
+    queue_log_record_t   rec;
+    queue_log_segment_t *seg;
+
+    lq = q->engine_ctx;
+    seg = lq->tail;
+
+    need = sizeof(queue_log_record_t) + msg->len;
+
+    if (seg == NULL || seg->last + need > seg->size) {
+        size = q->conf.segment_bytes;
+        if (size < need) {
+            size = (need + 4095) & ~((size_t) 4095);
+        }
+
+        seg = queue_log_segment_create(q, msg->id, size);
+        if (seg == NULL) {
+            return QUEUE_ERROR;
+        }
+
+        if (lq->tail == NULL) {
+            lq->head = seg;
+            lq->rd = 0;
+            lq->rd_id = msg->id;
+        } else {
+            lq->tail->next = seg;
+        }
+
+        lq->tail = seg;
+    }
+
+    /* an index entry which is lost only makes the recovery scan longer */
+    if (seg->last == 0 || seg->last - seg->indexed >= QUEUE_LOG_INDEX_INTERVAL)
+    {
+        entry.id = msg->id;
+        entry.offset = seg->last;
+
+        if (pwrite(seg->idx_fd, &entry, sizeof(entry), seg->idx_size)
+            == sizeof(entry))
+        {
+            seg->idx_size += sizeof(entry);
+        }
+
+        seg->indexed = seg->last;
+    }
+
+    rec.id = msg->id;
+    rec.len = msg->len;
+    rec.expire = queue_log_expire_secs(msg->expire);
+    rec.reserved = 0;
+
+    p = seg->map + seg->last;
+
+    queue_msg_copy(msg, p + sizeof(rec));
+    rec.crc = crc32c(0, p + sizeof(rec), msg->len);
+
+    memcpy(p, &rec, sizeof(rec));
+
+    seg->last += need;
+    seg->next_id = msg->id + 1;
+    seg->dirty = 1;
+
+    return QUEUE_OK;
+}
+
+static int queue_log_peek(queue_t *q, queue_msg_t *msg)
+{
+    queue_log_t         *lq;
+    queue_log_record_t   rec;
+    queue_log_segment_t *seg;
+
+    lq = q->engine_ctx;
+
+    for ( ;; ) {
+        seg = lq->head;
+
+        if (seg == NULL) {
+            return QUEUE_EMPTY;
+        }
+
+        if (lq->rd < seg->last) {
+            break;
+        }
+
+        if (seg == lq->tail) {
+            return QUEUE_EMPTY;
+        }
+
+        lq->head = seg->next;
+        lq->rd = 0;
+
+        seg->next = lq->retired;
+        lq->retired = seg;
+    }
+
+    memcpy(&rec, seg->map + lq->rd, sizeof(rec));
+
+    msg->id = rec.id;
+    msg->expire = queue_log_expire_msecs(rec.expire);
+    msg->len = rec.len;
+    msg->data = seg->map + lq->rd + sizeof(rec);
+    msg->buf = NULL;
+    msg->fd = seg->fd;
+    msg->offset = lq->rd + sizeof(rec);
+
+    lq->last_read = seg;
+
+    return QUEUE_OK;
+}
+
+/**
+ * The segment of the cursor is searched from "head", there are a few of
+ * them. The hint is the offset of the record after the last one read, so
+ * a group reading on needs no index search.
+ */
+static int queue_log_read(queue_t *q, queue_cursor_t *c, queue_msg_t *msg)
+{
+    size_t               off;
+    uint64_t             id;
+    queue_log_t         *lq;
+    queue_log_record_t   rec;
+    queue_log_segment_t *seg;
+
+    lq = q->engine_ctx;
+
+    if (c->id < lq->rd_id) {
+        c->id = lq->rd_id;
+    }
+
+    for (seg = lq->head; seg != NULL; seg = seg->next) {
+        if (c->id < seg->next_id) {
+            break;
+        }
+    }
+
+    if (seg == NULL) {
+        return QUEUE_EMPTY;
+    }
+
+    off = c->hint_off;
+    rec.id = 0;
+
+    if (c->hint_base == seg->base && off + sizeof(rec) <= seg->last) {
+        memcpy(&rec, seg->map + off, sizeof(rec));
+    }
+
+    if (rec.id != c->id) {
+        if (seg == lq->head && c->id == lq->rd_id) {
+            off = lq->rd;
+        } else {
+            off = queue_log_segment_find(q, seg, c->id, &id);
+            if (id != c->id) {
+                return QUEUE_EMPTY;
+            }
+        }
+    }
+
+    memcpy(&rec, seg->map + off, sizeof(rec));
+
+    msg->id = rec.id;
+    msg->expire = queue_log_expire_msecs(rec.expire);
+    msg->len = rec.len;
+    msg->data = seg->map + off + sizeof(rec);
+    msg->buf = NULL;
+    msg->fd = seg->fd;
+    msg->offset = off + sizeof(rec);
+
+    c->hint_base = seg->base;
+    c->hint_off = off + sizeof(rec) + rec.len;
+
+    lq->last_read = seg;
+
+    return QUEUE_OK;
+}
+
+/* pin the segment of the message peeked or read while "pool" is alive */
+static int queue_log_hold(queue_t *q, mem_pool_t *pool)
+{
+    queue_log_t         *lq;
+    queue_log_hold_t    *h;
+    mem_pool_cleanup_t  *c;
+
+    lq = q->engine_ctx;
+
+    c = mem_pool_cleanup_add(pool, sizeof(queue_log_hold_t));
+    if (c == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    h = c->data;
+    h->q = q;
+    h->seg = lq->last_read;
+
+    h->seg->refs++;
+
+    c->handler = queue_log_release;
+
+    return QUEUE_OK;
+}
+
+static void queue_log_release(void *data)
+{
+    queue_log_hold_t *h;
+
+    h = data;
+
+    pthread_mutex_lock(&h->q->lock);
+    h->seg->refs--;
+    pthread_mutex_unlock(&h->q->lock);
+}
+
+/**
+ * The payload is spliced to a file of its own so the PUTs which come in
+ * the meantime are appended to "tail" as usual. The record is written
+ * before the payload, its id is set on commit.
+ */
+static int queue_log_ingest(queue_t *q, queue_ingest_t *in)
+{
+    size_t       size;
+    queue_log_t *lq;
+
+    lq = q->engine_ctx;
+
+    if (in->len > (uint32_t) -1) {
+        log_error(q->logger, 0, "message(%lu bytes) is larger than "
+                  "queue \"%s\".", (u_long) in->len, q->name);
+        return QUEUE_ERROR;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    snprintf((char *) in->name, sizeof(in->name), "%u.tmp", lq->ingests++);
+    pthread_mutex_unlock(&q->lock);
+
+    in->fd = openat(lq->dir_fd, (char *) in->name,
+                    O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (in->fd == -1) {
+        log_error(q->logger, errno, "create \"%s/%s\" failed.",
+                  lq->dir, in->name);
+        return QUEUE_ERROR;
+    }
+
+    size = sizeof(queue_log_record_t) + in->len;
+
+    if (fallocate(in->fd, 0, 0, size) == -1) {
+        if (errno != EOPNOTSUPP || ftruncate(in->fd, size) == -1) {
+            log_error(q->logger, errno, "preallocate %lu bytes of \"%s/%s\" "
+                      "failed.", (u_long) size, lq->dir, in->name);
+            queue_log_ingest_end(q, in, 0);
+            return QUEUE_ERROR;
+        }
+    }
+
+    in->offset = sizeof(queue_log_record_t);
+
+    return QUEUE_OK;
+}
+
+/**
+ * Commit: the file becomes the segment of message "id" after "tail", the
+ * next PUT starts a new segment as it's full. Called with the queue locked.
+ */
+static int queue_log_ingest_end(queue_t *q, queue_ingest_t *in, int commit)
+{
+    char                 name[32];
+    queue_log_t         *lq;
+    queue_log_index_t    entry;
+    queue_log_record_t   rec;
+    queue_log_segment_t *seg;
+
+    lq = q->engine_ctx;
+
+    if (!commit) {
+        goto failed;
+    }
+
+    rec.id = in->id;
+    rec.len = in->len;
+    rec.expire = queue_log_expire_secs(in->expire);
+    rec.crc = in->crc;
+    rec.reserved = 0;
+
+    if (pwrite(in->fd, &rec, sizeof(rec), 0) != sizeof(rec)) {
+        log_error(q->logger, errno, "write \"%s/%s\" failed.",
+                  lq->dir, in->name);
+        goto failed;
+    }
+
+    seg = calloc(1, sizeof(queue_log_segment_t));
+    if (seg == NULL) {
+        goto failed;
+    }
+
+    seg->base = in->id;
+    seg->next_id = in->id + 1;
+    seg->size = sizeof(rec) + in->len;
+    seg->last = seg->size;
+    seg->fd = in->fd;
+    seg->idx_fd = -1;
+    seg->dirty = 1;
+
+    seg->map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        log_error(q->logger, errno, "map \"%s/%s\" failed.",
+                  lq->dir, in->name);
+        free(seg);
+        goto failed;
+    }
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".idx", seg->base);
+
+    seg->idx_fd = openat(lq->dir_fd, name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    entry.id = seg->base;
+    entry.offset = 0;
+
+    if (seg->idx_fd == -1
+        || pwrite(seg->idx_fd, &entry, sizeof(entry), 0) != sizeof(entry))
+    {
+        log_error(q->logger, errno, "create \"%s/%s\" failed.",
+                  lq->dir, name);
+        goto unmap;
+    }
+
+    seg->idx_size = sizeof(entry);
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".log", seg->base);
+
+    if (renameat(lq->dir_fd, (char *) in->name, lq->dir_fd, name) == -1) {
+        log_error(q->logger, errno, "rename \"%s/%s\" failed.",
+                  lq->dir, in->name);
+        goto unmap;
+    }
+
+    if (lq->tail == NULL) {
+        lq->head = seg;
+        lq->rd = 0;
+        lq->rd_id = seg->base;
+    } else {
+        lq->tail->next = seg;
+    }
+
+    lq->tail = seg;
+    lq->dir_dirty = 1;
+
+    return QUEUE_OK;
+
+unmap:
+
+    /* "fd" is still the one of "in" */
+    seg->fd = -1;
+    queue_log_segment_unlink(q, seg);
+    queue_log_segment_close(seg);
+
+failed:
+
+    close(in->fd);
+    in->fd = -1;
+    unlinkat(lq->dir_fd, (char *) in->name, 0);
+
+    return QUEUE_ERROR;
+}
+
+/* always after a "peek" which is not empty */
+static void queue_log_pop(queue_t *q)
+{
+    queue_log_t         *lq;
+    queue_log_record_t   rec;
+
+    lq = q->engine_ctx;
+
+    memcpy(&rec, lq->head->map + lq->rd, sizeof(rec));
+
+    lq->rd += sizeof(rec) + rec.len;
+    lq->rd_id = rec.id + 1;
+}
+
+/**
+ * Called by the "queue" module only, so no segment is closed by others
+ * while it's being synced. On linux "fdatasync" writes back the pages
+ * dirtied through the map.
+ */
+static void queue_log_sync(queue_t *q)
+{
+    int                   i, n, dir_dirty;
+    uint64_t              rd_id;
+    queue_log_t          *lq;
+    queue_log_segment_t  *seg, *next, *retired, **held;
+    queue_log_segment_t  *segs[QUEUE_LOG_SYNC_MAX];
+
+    lq = q->engine_ctx;
+
+    pthread_mutex_lock(&q->lock);
+
+    for (n = 0, seg = lq->head; seg != NULL && n < QUEUE_LOG_SYNC_MAX;
+         seg = seg->next)
+    {
+        if (seg->dirty) {
+            seg->dirty = 0;
+            segs[n++] = seg;
+        }
+    }
+
+    retired = NULL;
+    held = &lq->retired;
+
+    for (seg = lq->retired; seg != NULL; seg = next) {
+        next = seg->next;
+
+        if (seg->refs != 0) {
+            *held = seg;
+            held = &seg->next;
+            continue;
+        }
+
+        seg->next = retired;
+        retired = seg;
+    }
+
+    *held = NULL;
+
+    rd_id = lq->rd_id;
+
+    dir_dirty = lq->dir_dirty;
+    lq->dir_dirty = 0;
+
+    pthread_mutex_unlock(&q->lock);
+
+    for (i = 0; i < n; i++) {
+        if (fdatasync(segs[i]->fd) == -1) {
+            log_error(q->logger, errno, "sync segment %llu of queue \"%s\" "
+                      "failed.", (unsigned long long) segs[i]->base, q->name);
+        }
+    }
+
+    if (rd_id != lq->synced_id) {
+        if (pwrite(lq->head_fd, &rd_id, sizeof(uint64_t), 0)
+                != sizeof(uint64_t)
+            || fdatasync(lq->head_fd) == -1)
+        {
+            log_error(q->logger, errno, "sync the head of queue \"%s\" "
+                      "failed.", q->name);
+        } else {
+            lq->synced_id = rd_id;
+        }
+    }
+
+    for (seg = retired; seg != NULL; seg = next) {
+        next = seg->next;
+        queue_log_segment_unlink(q, seg);
+        queue_log_segment_close(seg);
+        dir_dirty = 1;
+    }
+
+    if (dir_dirty && fsync(lq->dir_fd) == -1) {
+        log_error(q->logger, errno, "sync \"%s\" failed.", lq->dir);
+    }
+}
+
+static queue_log_segment_t *queue_log_segment_create(queue_t *q,
+        uint64_t base, size_t size)
+{
+    char                 name[32];
+    queue_log_t         *lq;
+    queue_log_segment_t *seg;
+
+    lq = q->engine_ctx;
+
+    seg = calloc(1, sizeof(queue_log_segment_t));
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    seg->base = base;
+    seg->next_id = base;
+    seg->size = size;
+    seg->idx_fd = -1;
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".log", base);
+
+    seg->fd = openat(lq->dir_fd, name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (seg->fd == -1) {
+        log_error(q->logger, errno, "create \"%s/%s\" failed.", lq->dir, name);
+        free(seg);
+        return NULL;
+    }
+
+    /* reserve the blocks, the writes through the map never fail later */
+    if (fallocate(seg->fd, 0, 0, size) == -1) {
+        if (errno != EOPNOTSUPP || ftruncate(seg->fd, size) == -1) {
+            log_error(q->logger, errno, "preallocate %lu bytes of \"%s/%s\" "
+                      "failed.", (u_long) size, lq->dir, name);
+            goto failed;
+        }
+    }
+
+    seg->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        log_error(q->logger, errno, "map \"%s/%s\" failed.", lq->dir, name);
+        seg->map = NULL;
+        goto failed;
+    }
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".idx", base);
+
+    seg->idx_fd = openat(lq->dir_fd, name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (seg->idx_fd == -1) {
+        log_error(q->logger, errno, "create \"%s/%s\" failed.", lq->dir, name);
+        goto failed;
+    }
+
+    lq->dir_dirty = 1;
+
+    return seg;
+
+failed:
+
+    queue_log_segment_unlink(q, seg);
+    queue_log_segment_close(seg);
+    return NULL;
+}
+
+/**
+ * open a segment written before, its records are checked from the start as
+ * the pages of any of them may be lost, the index entries after the last
+ * good one are dropped.
+ */
+static queue_log_segment_t *queue_log_segment_load(queue_t *q,
+        uint64_t base)
+{
+    char                 name[32];
+    uint64_t             id;
+    struct stat          st;
+    queue_log_t         *lq;
+    queue_log_record_t   rec;
+    queue_log_segment_t *seg;
+
+    lq = q->engine_ctx;
+
+    seg = calloc(1, sizeof(queue_log_segment_t));
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    seg->base = base;
+    seg->idx_fd = -1;
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".log", base);
+
+    seg->fd = openat(lq->dir_fd, name, O_RDWR);
+    if (seg->fd == -1 || fstat(seg->fd, &st) == -1) {
+        log_error(q->logger, errno, "open \"%s/%s\" failed.", lq->dir, name);
+        goto failed;
+    }
+
+    seg->size = st.st_size;
+
+    if (seg->size != 0) {
+        seg->map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        seg->fd, 0);
+        if (seg->map == MAP_FAILED) {
+            log_error(q->logger, errno, "map \"%s/%s\" failed.",
+                      lq->dir, name);
+            seg->map = NULL;
+            goto failed;
+        }
+    }
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".idx", base);
+
+    seg->idx_fd = openat(lq->dir_fd, name, O_RDWR | O_CREAT, 0644);
+    if (seg->idx_fd == -1 || fstat(seg->idx_fd, &st) == -1) {
+        log_error(q->logger, errno, "open \"%s/%s\" failed.", lq->dir, name);
+        goto failed;
+    }
+
+    /* a torn entry at the end is overwritten by the next one */
+    seg->idx_size = st.st_size - st.st_size % sizeof(queue_log_index_t);
+
+    id = base;
+
+    seg->last = queue_log_scan(seg, 0, &id, (uint64_t) -1, 1);
+    seg->next_id = id;
+
+    /* the rest of a segment is zeroed by "fallocate" */
+    if (seg->last + sizeof(rec) <= seg->size) {
+        memcpy(&rec, seg->map + seg->last, sizeof(rec));
+
+        if (rec.id != 0) {
+            log_warn(q->logger, 0, "segment %llu of queue \"%s\" is cut at "
+                     "message %llu, the record is torn.",
+                     (unsigned long long) base, q->name,
+                     (unsigned long long) id);
+        }
+    }
+
+    queue_log_index_trim(q, seg);
+
+    return seg;
+
+failed:
+
+    queue_log_segment_close(seg);
+    return NULL;
+}
+
+static void queue_log_segment_close(queue_log_segment_t *seg)
+{
+    if (seg->map != NULL) {
+        munmap(seg->map, seg->size);
+    }
+
+    if (seg->fd != -1) {
+        close(seg->fd);
+    }
+
+    if (seg->idx_fd != -1) {
+        close(seg->idx_fd);
+    }
+
+    free(seg);
+}
+
+static void queue_log_segment_unlink(queue_t *q, queue_log_segment_t *seg)
+{
+    char         name[32];
+    queue_log_t *lq;
+
+    lq = q->engine_ctx;
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".log", seg->base);
+    unlinkat(lq->dir_fd, name, 0);
+
+    snprintf(name, sizeof(name), "%020" PRIu64 ".idx", seg->base);
+    unlinkat(lq->dir_fd, name, 0);
+}
+
+/**
+ * return the offset of message "id", or the end of the records if it's
+ * beyond. "found" is set to the id of the record at the offset. The last
+ * index entry before "id" is searched, the records after it are scanned.
+ */
+static size_t queue_log_segment_find(queue_t *q, queue_log_segment_t *seg,
+        uint64_t id, uint64_t *found)
+{
+    size_t             off, lo, hi, mid, n;
+    uint64_t           start;
+    queue_log_index_t  entry;
+
+    off = 0;
+    start = seg->base;
+
+    n = seg->idx_size / sizeof(queue_log_index_t);
+
+    for (lo = 0, hi = n; lo < hi; ) {
+        mid = lo + (hi - lo) / 2;
+
+        if (pread(seg->idx_fd, &entry, sizeof(entry),
+                  mid * sizeof(queue_log_index_t)) != sizeof(entry))
+        {
+            log_error(q->logger, errno, "read the index of segment %llu "
+                      "failed.", (unsigned long long) seg->base);
+            break;
+        }
+
+        if (entry.id > id || entry.offset >= seg->size) {
+            hi = mid;
+            continue;
+        }
+
+        off = entry.offset;
+        start = entry.id;
+        lo = mid + 1;
+    }
+
+    off = queue_log_scan(seg, off, &start, id, 0);
+    *found = start;
+
+    return off;
+}
+
+/**
+ * The entries are written before the records they point to are synced, the
+ * ones at or after "last" are removed from the file, so the records written
+ * there later are not found by them.
+ */
+static void queue_log_index_trim(queue_t *q, queue_log_segment_t *seg)
+{
+    off_t              size;
+    queue_log_index_t  entry;
+
+    seg->indexed = 0;
+
+    for (size = seg->idx_size; size > 0; size -= sizeof(entry)) {
+        if (pread(seg->idx_fd, &entry, sizeof(entry), size - sizeof(entry))
+            != sizeof(entry))
+        {
+            log_error(q->logger, errno, "read the index of segment %llu "
+                      "failed.", (unsigned long long) seg->base);
+            size = 0;
+            break;
+        }
+
+        if (entry.offset < seg->last && entry.id < seg->next_id) {
+            seg->indexed = entry.offset;
+            break;
+        }
+    }
+
+    if (size == seg->idx_size) {
+        return;
+    }
+
+    log_warn(q->logger, 0, "segment %llu of queue \"%s\" ends at message "
+             "%llu, %ld index entries after it are dropped.",
+             (unsigned long long) seg->base, q->name,
+             (unsigned long long) seg->next_id,
+             (long) ((seg->idx_size - size) / sizeof(entry)));
+
+    seg->idx_size = size;
+
+    if (ftruncate(seg->idx_fd, size) == -1) {
+        log_error(q->logger, errno, "truncate the index of segment %llu "
+                  "failed.", (unsigned long long) seg->base);
+    }
+}
+
+/**
+ * Step over the records from "off" until message "stop", "id" is the one
+ * expected at "off" and is increased. A record which is zeroed, torn or
+ * out of order ends the segment, and one whose payload doesn't match its
+ * CRC-32C if "verify" is set.
+ */
+static size_t queue_log_scan(queue_log_segment_t *seg, size_t off,
+        uint64_t *id, uint64_t stop, int verify)
+{
+    queue_log_record_t rec;
+
+    while (*id < stop && off + sizeof(rec) <= seg->size) {
+        memcpy(&rec, seg->map + off, sizeof(rec));
+
+        if (rec.id != *id || rec.len > seg->size - off - sizeof(rec)) {
+            break;
+        }
+
+        if (verify
+            && crc32c(0, seg->map + off + sizeof(rec), rec.len) != rec.crc)
+        {
+            break;
+        }
+
+        off += sizeof(rec) + rec.len;
+        (*id)++;
+    }
+
+    return off;
+}
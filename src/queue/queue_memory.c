@@ -0,0 +1,272 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * The "memory" engine keeps messages in a fixed ring of slots, payloads
+ * are laid one after another in an arena which is allocated when the queue
+ * is created. Nothing is written to disk, PUT and GET never call into the
+ * kernel, the messages are lost when xpipe exits.
+ */
+
+static int queue_memory_init(queue_t *q);
+static void queue_memory_done(queue_t *q);
+static int queue_memory_put(queue_t *q, queue_msg_t *msg);
+static int queue_memory_peek(queue_t *q, queue_msg_t *msg);
+static void queue_memory_pop(queue_t *q);
+static int queue_memory_read(queue_t *q, queue_cursor_t *c,
+        queue_msg_t *msg);
+static u_char *queue_memory_alloc(queue_t *q, size_t len);
+
+
+typedef struct {
+    uint64_t   id;
+    uint64_t   expire;
+    u_char    *data;
+    size_t     len;
+} queue_memory_slot_t;
+
+/**
+ * The payloads from the oldest one to "last" are in use, it wraps to
+ * "start" when a payload doesn't fit before "end". "last" never reaches
+ * the oldest one from behind, so they are equal only if the ring is empty.
+ */
+typedef struct {
+    queue_memory_slot_t *slots;
+    uint_t               nslots;
+    uint_t               head;      /* the oldest */
+    uint_t               n;
+
+    u_char              *start;
+    u_char              *end;
+    u_char              *last;
+} queue_memory_t;
+
+queue_engine_t queue_memory_engine = {
+    xstring("memory"),
+    queue_memory_init,
+    queue_memory_done,
+    queue_memory_put,
+    queue_memory_peek,
+    queue_memory_pop,
+    queue_memory_read,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+
+static int queue_memory_init(queue_t *q)
+{
+    queue_memory_t *mq;
+
+    mq = pcalloc(q->pool, sizeof(queue_memory_t));
+    if (mq == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    mq->nslots = q->conf.slots;
+
+    mq->slots = pmalloc(q->pool, sizeof(queue_memory_slot_t) * mq->nslots);
+    if (mq->slots == NULL) {
+        log_error(q->logger, 0, "alloc %u slots failed.", mq->nslots);
+        return QUEUE_ERROR;
+    }
+
+    mq->start = pmalloc(q->pool, q->conf.bytes);
+    if (mq->start == NULL) {
+        log_error(q->logger, 0, "alloc %lu bytes failed.",
+                  (u_long) q->conf.bytes);
+        return QUEUE_ERROR;
+    }
+
+    /* fault the pages in now rather than on the first PUTs */
+    memset(mq->start, 0, q->conf.bytes);
+    memset(mq->slots, 0, sizeof(queue_memory_slot_t) * mq->nslots);
+
+    mq->end = mq->start + q->conf.bytes;
+    mq->last = mq->start;
+
+    q->engine_ctx = mq;
+
+    return QUEUE_OK;
+}
+
+/* the slots and the arena are freed with the pool of the queue */
+static void queue_memory_done(queue_t *q)
+{
+    q->engine_ctx = NULL;
+}
+
+static int queue_memory_put(queue_t *q, queue_msg_t *msg)
+{
+    uint_t               i;
+    u_char              *p;
+    queue_memory_t      *mq;
+    queue_memory_slot_t *slot;
+
+    mq = q->engine_ctx;
+
+    if (msg->len > (size_t) (mq->end - mq->start)) {
+        log_error(q->logger, 0, "message(%lu bytes) is larger than "
+                  "queue \"%s\".", (u_long) msg->len, q->name);
+        return QUEUE_ERROR;
+    }
+
+    for ( ;; ) {
+        if (mq->n < mq->nslots) {
+            p = queue_memory_alloc(q, msg->len);
+            if (p != NULL) {
+                break;
+            }
+        }
+
+        if (q->conf.full == QUEUE_FULL_REJECT) {
+            return QUEUE_FULL;
+        }
+
+        slot = &mq->slots[mq->head];
+        queue_dropped(q, slot->len);
+        queue_memory_pop(q);
+    }
+
+    i = mq->head + mq->n;
+    if (i >= mq->nslots) {
+        i -= mq->nslots;
+    }
+
+    slot = &mq->slots[i];
+
+    slot->id = msg->id;
+    slot->expire = msg->expire;
+    slot->data = p;
+    slot->len = msg->len;
+
+    mq->last = queue_msg_copy(msg, p);
+    mq->n++;
+
+    return QUEUE_OK;
+}
+
+static int queue_memory_peek(queue_t *q, queue_msg_t *msg)
+{
+    queue_memory_t      *mq;
+    queue_memory_slot_t *slot;
+
+    mq = q->engine_ctx;
+
+    if (mq->n == 0) {
+        return QUEUE_EMPTY;
+    }
+
+    slot = &mq->slots[mq->head];
+
+    msg->id = slot->id;
+    msg->expire = slot->expire;
+    msg->data = slot->data;
+    msg->len = slot->len;
+    msg->buf = NULL;
+    msg->fd = -1;
+
+    return QUEUE_OK;
+}
+
+static void queue_memory_pop(queue_t *q)
+{
+    queue_memory_t *mq;
+
+    mq = q->engine_ctx;
+
+    if (mq->n == 0) {
+        return;
+    }
+
+    if (++mq->head == mq->nslots) {
+        mq->head = 0;
+    }
+
+    if (--mq->n == 0) {
+        mq->head = 0;
+        mq->last = mq->start;
+    }
+}
+
+/* the ids in the ring are one after another from the oldest */
+static int queue_memory_read(queue_t *q, queue_cursor_t *c,
+        queue_msg_t *msg)
+{
+    uint_t               i;
+    uint64_t             first;
+    queue_memory_t      *mq;
+    queue_memory_slot_t *slot;
+
+    mq = q->engine_ctx;
+
+    if (mq->n == 0) {
+        return QUEUE_EMPTY;
+    }
+
+    first = mq->slots[mq->head].id;
+
+    if (c->id < first) {
+        c->id = first;
+    }
+
+    if (c->id - first >= mq->n) {
+        return QUEUE_EMPTY;
+    }
+
+    i = mq->head + (uint_t) (c->id - first);
+    if (i >= mq->nslots) {
+        i -= mq->nslots;
+    }
+
+    slot = &mq->slots[i];
+
+    msg->id = slot->id;
+    msg->expire = slot->expire;
+    msg->data = slot->data;
+    msg->len = slot->len;
+    msg->buf = NULL;
+    msg->fd = -1;
+
+    return QUEUE_OK;
+}
+
+/* return NULL if "len" bytes can't be put without dropping the oldest */
+static u_char *queue_memory_alloc(queue_t *q, size_t len)
+{
+    u_char         *first;
+    queue_memory_t *mq;
+
+    mq = q->engine_ctx;
+
+    if (mq->n == 0) {
+        return mq->start;
+    }
+
+    first = mq->slots[mq->head].data;
+
+    if (mq->last > first) {
+        if (len <= (size_t) (mq->end - mq->last)) {
+            return mq->last;
+        }
+
+        /* the tail before "end" is skipped */
+        if (len < (size_t) (first - mq->start)) {
+            return mq->start;
+        }
+
+        return NULL;
+    }
+
+    if (len < (size_t) (first - mq->last)) {
+        return mq->last;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,348 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * The "priority" engine of a queue with "priority=on". A level of each
+ * priority keeps its messages in the engine the queue is configured with,
+ * in "<queue_data_dir>/<queue>/<priority>" if it's on disk. A bit of
+ * "ready" is set for a level which may have messages, the highest
+ * priority is the lowest bit so the level to give from is found by a
+ * "ctz". A bit is set by PUT and cleared by the peek which finds the level
+ * empty, so the messages removed by the engine, e.g. dropped or expired,
+ * need no bookkeeping.
+ *
+ * The id given is "(<id in the level> << 3) | <priority>", the ids of a
+ * queue are unique but not in order, consumer groups and leases are not
+ * supported. "slots", "bytes" and "full" are of each level.
+ *
+ * The levels are queues which are not registered, a level is locked
+ * within the queue as its engine may lock it by itself, e.g. "sync". A
+ * level keeps its depth and bytes for its catalog, "oldest" of the queue
+ * is the oldest of the levels.
+ */
+
+#define queue_priority_bit(p)  (1U << (QUEUE_PRIORITY_LEVELS - 1 - (p)))
+#define queue_priority_id(id, p)  (((id) << 3) | (p))
+
+static int queue_priority_init(queue_t *q);
+static void queue_priority_done(queue_t *q);
+static int queue_priority_put(queue_t *q, queue_msg_t *msg);
+static int queue_priority_peek(queue_t *q, queue_msg_t *msg);
+static void queue_priority_pop(queue_t *q);
+static void queue_priority_sync(queue_t *q);
+static int queue_priority_hold(queue_t *q, mem_pool_t *pool);
+static void queue_priority_oldest(queue_t *q);
+
+
+typedef struct {
+    queue_t     *levels[QUEUE_PRIORITY_LEVELS];
+    uint_t       ready;
+    uint_t       last;      /* the level of the last peek */
+    size_t       last_len;
+} queue_priority_t;
+
+queue_engine_t queue_priority_engine = {
+    xstring("priority"),
+    queue_priority_init,
+    queue_priority_done,
+    queue_priority_put,
+    queue_priority_peek,
+    queue_priority_pop,
+    NULL,
+    queue_priority_sync,
+    queue_priority_hold,
+    NULL,
+    NULL
+};
+
+
+static int queue_priority_init(queue_t *q)
+{
+    uint_t            p;
+    size_t            len;
+    u_char           *dir;
+    queue_t          *lv;
+    queue_engine_t   *engine;
+    queue_priority_t *pq;
+
+    pq = pcalloc(q->pool, sizeof(queue_priority_t));
+    if (pq == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    q->engine_ctx = pq;
+
+    engine = q->conf.level_engine;
+
+    /* the levels are in the directory of the queue */
+    if (engine->sync_handler != NULL) {
+        len = queue_data_dir.len + 1 + x_strlen(q->name) + 1;
+
+        dir = pmalloc(q->pool, len);
+        if (dir == NULL) {
+            return QUEUE_ERROR;
+        }
+
+        snprintf((char *) dir, len, "%s/%s", queue_data_dir.data, q->name);
+
+        if ((mkdir((char *) queue_data_dir.data, 0755) == -1
+             && errno != EEXIST)
+            || (mkdir((char *) dir, 0755) == -1 && errno != EEXIST))
+        {
+            log_error(q->logger, errno, "create directory \"%s\" failed.",
+                      dir);
+            return QUEUE_ERROR;
+        }
+    }
+
+    for (p = 0; p < QUEUE_PRIORITY_LEVELS; p++) {
+        lv = pcalloc(q->pool, sizeof(queue_t));
+        if (lv == NULL) {
+            return QUEUE_ERROR;
+        }
+
+        /* the name of a queue with priority is 2 bytes shorter */
+        len = x_strlen(q->name);
+        memcpy(lv->name, q->name, len);
+        lv->name[len] = '/';
+        lv->name[len + 1] = (u_char) ('0' + p);
+        lv->name[len + 2] = '\0';
+
+        lv->conf = q->conf;
+        lv->conf.name.data = lv->name;
+        lv->conf.name.len = len + 2;
+        lv->conf.engine = engine;
+        lv->conf.priority = 0;
+        lv->next_id = 1;
+        lv->pool = q->pool;
+        lv->logger = q->logger;
+
+        pthread_mutex_init(&lv->lock, NULL);
+
+        if (engine->init_handler(lv) == QUEUE_ERROR) {
+            log_error(q->logger, 0, "init level %u of queue \"%s\" failed.",
+                      p, q->name);
+            pthread_mutex_destroy(&lv->lock);
+            return QUEUE_ERROR;
+        }
+
+        pq->levels[p] = lv;
+
+        if (queue_catalog_init(lv) == QUEUE_ERROR) {
+            return QUEUE_ERROR;
+        }
+
+        q->depth += lv->depth;
+        q->bytes += lv->bytes;
+
+        if (lv->depth != 0) {
+            pq->ready |= queue_priority_bit(p);
+        }
+    }
+
+    queue_priority_oldest(q);
+
+    return QUEUE_OK;
+}
+
+static void queue_priority_done(queue_t *q)
+{
+    uint_t            p;
+    queue_t          *lv;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+
+    if (pq == NULL) {
+        return;
+    }
+
+    for (p = 0; p < QUEUE_PRIORITY_LEVELS; p++) {
+        lv = pq->levels[p];
+
+        if (lv != NULL) {
+            lv->conf.engine->done_handler(lv);
+            pthread_mutex_destroy(&lv->lock);
+        }
+    }
+
+    q->engine_ctx = NULL;
+}
+
+/* what the level drops to make room is dropped by the queue */
+static int queue_priority_put(queue_t *q, queue_msg_t *msg)
+{
+    int               ret;
+    size_t            bytes;
+    uint64_t          dropped;
+    queue_t          *lv;
+    queue_msg_t       m;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+    lv = pq->levels[msg->priority];
+
+    m = *msg;
+
+    pthread_mutex_lock(&lv->lock);
+
+    m.id = lv->next_id;
+    dropped = lv->dropped;
+    bytes = lv->bytes;
+
+    ret = lv->conf.engine->put_handler(lv, &m);
+
+    q->depth -= lv->dropped - dropped;
+    q->bytes -= bytes - lv->bytes;
+    q->dropped += lv->dropped - dropped;
+
+    if (ret == QUEUE_OK) {
+        lv->next_id++;
+        lv->depth++;
+        lv->bytes += m.len;
+        pq->ready |= queue_priority_bit(msg->priority);
+    }
+
+    queue_catalog_update(lv);
+
+    pthread_mutex_unlock(&lv->lock);
+
+    queue_priority_oldest(q);
+
+    return ret;
+}
+
+static int queue_priority_peek(queue_t *q, queue_msg_t *msg)
+{
+    int               ret;
+    uint_t            bit, p;
+    queue_t          *lv;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+
+    while (pq->ready != 0) {
+        bit = __builtin_ctz(pq->ready);
+        p = QUEUE_PRIORITY_LEVELS - 1 - bit;
+        lv = pq->levels[p];
+
+        pthread_mutex_lock(&lv->lock);
+        ret = lv->conf.engine->peek_handler(lv, msg);
+        pthread_mutex_unlock(&lv->lock);
+
+        if (ret == QUEUE_OK) {
+            pq->last = p;
+            pq->last_len = msg->len;
+            msg->id = queue_priority_id(msg->id, p);
+            msg->priority = p;
+            return QUEUE_OK;
+        }
+
+        pq->ready &= ~(1U << bit);
+    }
+
+    return QUEUE_EMPTY;
+}
+
+/* the message of the last peek */
+static void queue_priority_pop(queue_t *q)
+{
+    queue_t          *lv;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+    lv = pq->levels[pq->last];
+
+    pthread_mutex_lock(&lv->lock);
+
+    lv->conf.engine->pop_handler(lv);
+    lv->depth--;
+    lv->bytes -= pq->last_len;
+
+    queue_catalog_update(lv);
+
+    pthread_mutex_unlock(&lv->lock);
+
+    queue_priority_oldest(q);
+}
+
+static void queue_priority_sync(queue_t *q)
+{
+    uint_t            p;
+    queue_t          *lv;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+
+    for (p = 0; p < QUEUE_PRIORITY_LEVELS; p++) {
+        lv = pq->levels[p];
+
+        if (lv->conf.engine->sync_handler != NULL) {
+            lv->conf.engine->sync_handler(lv);
+        }
+    }
+}
+
+static int queue_priority_hold(queue_t *q, mem_pool_t *pool)
+{
+    int               ret;
+    queue_t          *lv;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+    lv = pq->levels[pq->last];
+
+    if (lv->conf.engine->hold_handler == NULL) {
+        return QUEUE_ERROR;
+    }
+
+    pthread_mutex_lock(&lv->lock);
+    ret = lv->conf.engine->hold_handler(lv, pool);
+    pthread_mutex_unlock(&lv->lock);
+
+    return ret;
+}
+
+/* called with the queue locked, the levels are read as LIST reads them */
+static void queue_priority_oldest(queue_t *q)
+{
+    uint_t            p;
+    uint64_t          oldest, at;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+    oldest = 0;
+
+    for (p = 0; p < QUEUE_PRIORITY_LEVELS; p++) {
+        at = pq->levels[p]->oldest;
+
+        if (at != 0 && (oldest == 0 || at < oldest)) {
+            oldest = at;
+        }
+    }
+
+    q->oldest = oldest;
+}
+
+/* called with the queue locked, the settings the levels read */
+void queue_priority_configure(queue_t *q)
+{
+    uint_t            p;
+    queue_t          *lv;
+    queue_priority_t *pq;
+
+    pq = q->engine_ctx;
+
+    for (p = 0; p < QUEUE_PRIORITY_LEVELS; p++) {
+        lv = pq->levels[p];
+
+        pthread_mutex_lock(&lv->lock);
+        lv->conf.full = q->conf.full;
+        lv->conf.segment_bytes = q->conf.segment_bytes;
+        pthread_mutex_unlock(&lv->lock);
+    }
+}
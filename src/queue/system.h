@@ -0,0 +1,4 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+#include "../system.h"
@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+__thread stats_slot_t *stats_local;
+
+static stats_slot_t stats_slots[STATS_THREADS_MAX];
+static stats_slot_t stats_slot_overflow;   /* never merged */
+static uint_t stats_slots_used;
+static time_t stats_start_time;
+
+/* the order must be the same as the enum in stats.h */
+const char *stats_names[] = {
+    "accepts",
+    "connections",
+    "bytes_in",
+    "bytes_out",
+    "pool_bytes",
+    "zerocopy_sends",
+    "zerocopy_copied",
+
+    "requests_unknow",
+    "requests_put",
+    "requests_get",
+    "requests_queue",
+    "requests_list",
+    "requests_stats",
+    "requests_metrics",
+    "requests_commit",
+    "requests_ack",
+
+    "parse_errors_internal",
+    "parse_errors_type_invalid",
+    "parse_errors_only_cr",
+    "parse_errors_type_not_found",
+    "parse_errors_headers_invalid",
+    "parse_errors_data_len_invalid",
+    "parse_errors_needless_data"
+};
+
+/**
+ * give the calling thread a slot of its own. The threads beyond
+ * STATS_THREADS_MAX are refused with an error, they count in a slot which
+ * is never merged instead of adding to a slot of another thread.
+ */
+void stats_init(void)
+{
+    stats_start_time = time_current_seconds;
+
+    (void) stats_slot();
+}
+
+stats_slot_t *stats_register(void)
+{
+    uint_t i;
+
+    i = __sync_fetch_and_add(&stats_slots_used, 1);
+    if (i >= STATS_THREADS_MAX) {
+        log_stderr(0, "more than %d threads, the stats of this one are "
+                   "dropped.", STATS_THREADS_MAX);
+        stats_local = &stats_slot_overflow;
+        return stats_local;
+    }
+
+    stats_local = &stats_slots[i];
+
+    return stats_local;
+}
+
+void stats_merge(uint64_t *counters)
+{
+    uint_t i, k, n;
+
+    n = stats_slots_used < STATS_THREADS_MAX ? 
+        stats_slots_used : STATS_THREADS_MAX;
+
+    memset(counters, 0, sizeof(uint64_t) * STAT_MAX);
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < STAT_MAX; k++) {
+            counters[k] += stats_slots[i].counters[k];
+        }
+    }
+}
+
+void stats_merge_latency(int type, histogram_t *h)
+{
+    uint_t i, n;
+
+    n = stats_slots_used < STATS_THREADS_MAX ? 
+        stats_slots_used : STATS_THREADS_MAX;
+
+    memset(h, 0, sizeof(histogram_t));
+
+    for (i = 0; i < n; i++) {
+        histogram_merge(h, &stats_slots[i].latency[type]);
+    }
+}
+
+void stats_log_latency(logger_t *logger)
+{
+    int          type;
+    histogram_t  h;
+
+    for (type = 0; type < PROTOCOL_TYPE_NUM; type++) {
+        stats_merge_latency(type, &h);
+
+        if (h.total == 0) {
+            continue;
+        }
+
+        log_info(logger, 0, "latency of %s(nsecs): count %llu, mean %llu, "
+                 "p50 %llu, p99 %llu, p999 %llu, max %llu",
+                 protocol_type_names[type],
+                 (unsigned long long) h.total,
+                 (unsigned long long) histogram_mean(&h),
+                 (unsigned long long) histogram_percentile(&h, 50),
+                 (unsigned long long) histogram_percentile(&h, 99),
+                 (unsigned long long) histogram_percentile(&h, 99.9),
+                 (unsigned long long) h.max);
+    }
+}
+
+#ifdef LOOP_STATS
+
+/* the slowest handler is the one of all threads */
+void stats_merge_loop(loop_stats_t *ls)
+{
+    uint_t        i, n;
+    loop_stats_t *src;
+
+    n = stats_slots_used < STATS_THREADS_MAX ? 
+        stats_slots_used : STATS_THREADS_MAX;
+
+    memset(ls, 0, sizeof(loop_stats_t));
+
+    for (i = 0; i < n; i++) {
+        src = &stats_slots[i].loop;
+
+        ls->iterations += src->iterations;
+        ls->events += src->events;
+        ls->blocked += src->blocked;
+        ls->busy += src->busy;
+
+        if (src->max_events > ls->max_events) {
+            ls->max_events = src->max_events;
+        }
+
+        if (src->last_slowest > ls->last_slowest) {
+            ls->last_slowest = src->last_slowest;
+            ls->last_slowest_handler = src->last_slowest_handler;
+        }
+
+        histogram_merge(&ls->lag, &src->lag);
+    }
+}
+
+#endif
+
+time_t stats_uptime(void)
+{
+    return time_current_seconds - stats_start_time;
+}
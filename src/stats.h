@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "config.h"
+#include "system.h"
+
+#define CACHE_LINE_SIZE     64
+#define STATS_THREADS_MAX   16
+
+/**
+ * STAT_REQUESTS and STAT_PARSE_ERRORS are the first of a group, indexed by
+ * the type of request and the error code of "protocol_parse".
+ */
+enum {
+    STAT_ACCEPTS = 0,
+    STAT_CONNECTIONS,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_POOL_BYTES,
+    STAT_ZEROCOPY_SENDS,
+    STAT_ZEROCOPY_COPIED,
+    STAT_REQUESTS,
+    STAT_PARSE_ERRORS = STAT_REQUESTS + PROTOCOL_TYPE_NUM,
+    STAT_MAX = STAT_PARSE_ERRORS + PROTOCOL_ERR_NUM
+};
+
+#ifdef LOOP_STATS
+
+#define LOOP_STATS_INTERVAL  1000000000ULL   /* nsecs */
+
+/**
+ * Instrumentation of "process_events", built with "--with-loop-stats".
+ * blocked: nsecs in the poll or out of the loops of the thread (waiting
+ *     in the module scheduler, running the modules without a loop).
+ * busy: nsecs in the event handlers.
+ * slowest: the slowest handler of the current interval, "last_slowest"
+ *     is the one of the last whole interval.
+ * lag: busy nsecs of each round, an event which becomes ready in the
+ *     round waits that long for the next poll.
+ */
+typedef struct {
+    uint64_t          iterations;
+    uint64_t          events;
+    uint64_t          max_events;
+    uint64_t          blocked;
+    uint64_t          busy;
+    uint64_t          loop_end;
+    uint64_t          interval_start;
+    uint64_t          slowest;
+    event_handler_fp  slowest_handler;
+    uint64_t          last_slowest;
+    event_handler_fp  last_slowest_handler;
+    histogram_t       lag;
+} loop_stats_t;
+
+#endif
+
+/**
+ * Every thread updates its own slot without any lock or atomic, a slot
+ * takes whole cache lines so threads never share one. Readers sum all
+ * slots, gauges (e.g. STAT_CONNECTIONS) are increased in one thread and
+ * may be decreased in another, the sum wraps back to the right value.
+ */
+typedef struct {
+    uint64_t    counters[STAT_MAX];
+
+    /* nsecs from the first byte read to the last byte of reply sent */
+    histogram_t latency[PROTOCOL_TYPE_NUM];
+
+#ifdef LOOP_STATS
+    loop_stats_t loop;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_slot_t;
+
+extern __thread stats_slot_t *stats_local;
+extern const char *stats_names[];
+
+void stats_init(void);
+stats_slot_t *stats_register(void);
+void stats_merge(uint64_t *counters);
+void stats_merge_latency(int type, histogram_t *h);
+void stats_log_latency(logger_t *logger);
+time_t stats_uptime(void);
+
+#ifdef LOOP_STATS
+void stats_merge_loop(loop_stats_t *ls);
+#endif
+
+#define stats_slot()  (stats_local ? stats_local : stats_register())
+
+#define stats_add(id, n)  (stats_slot()->counters[id] += (uint64_t) (n))
+#define stats_sub(id, n)  (stats_slot()->counters[id] -= (uint64_t) (n))
+#define stats_inc(id)     stats_add(id, 1)
+#define stats_dec(id)     stats_sub(id, 1)
+
+#define stats_record_latency(type, nsecs)                                   \
+    histogram_record(&stats_slot()->latency[type], nsecs)
+
+#endif /* __STATS_H__ */
@@ -5,6 +5,10 @@
 #ifndef __HEADERS_H__
 #define __HEADERS_H__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #define XPE_OK      0
 #define XPE_ERROR   -1
 
@@ -27,10 +31,20 @@ typedef struct protocol_s           protocol_t;
 typedef struct tcp_connection_s     tcp_connection_t;
 typedef struct tcp_server_s         tcp_server_t;
 typedef struct system_module_s      system_module_t;
+typedef struct queue_s              queue_t;
+typedef struct queue_ingest_s       queue_ingest_t;
+
+#define XPIPE_LISTEN_FD_ENV "XPIPE_LISTEN_FD"
+#define XPIPE_LISTEN_FD_MAX 8
 
 typedef struct {
-    int          stop;
+    volatile int stop;
+    volatile int upgrade;
+    volatile int reload;
     int          sys_mod_num;
+    int          listen_fds[XPIPE_LISTEN_FD_MAX];  /* inherited on upgrade */
+    int          listen_n;
+    char       **argv;
     mem_pool_t  *conf_pool;
     conf_file_t *conf;
     logger_t    *main_logger;
@@ -60,6 +74,19 @@ typedef int (*event_handler_fp) (tcp_connection_t *conn);
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <dirent.h>
+#include <inttypes.h>
 
 #include "xstring.h"
 #include "mem_pool.h"
@@ -68,12 +95,19 @@ typedef int (*event_handler_fp) (tcp_connection_t *conn);
 #include "times.h"
 #include "logger.h"
 #include "conf_file.h"
+#include "channel.h"
 #include "mod_manager.h"
 
 #include "net/protocol.h"
+#include "crc32c.h"
+#include "histogram.h"
+#include "timer_wheel.h"
+#include "stats.h"
 #include "net/tcp_server.h"
+#include "queue/queue.h"
 #include "net/net_event.h"
 #include "net/net_epoll.h"
+#include "net/network.h"
 
 
 #endif /* __HEADERS_H__ */
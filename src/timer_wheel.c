@@ -0,0 +1,186 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#include "config.h"
+#include "system.h"
+
+#define timer_list_init(h)   ((h)->next = (h)->prev = (h))
+#define timer_list_empty(h)  ((h)->next == (h))
+
+static void timer_wheel_insert(timer_wheel_t *tw, timer_node_t *node);
+static uint_t timer_wheel_cascade(timer_wheel_t *tw, uint_t level);
+
+
+void timer_wheel_init(timer_wheel_t *tw, uint_t now_msecs, uint_t tick_msecs)
+{
+    uint_t i, j;
+
+    tw->ticks = 0;
+    tw->msecs = 0;
+    tw->last_msecs = now_msecs;
+    tw->tick_msecs = tick_msecs ? tick_msecs : 1;
+    tw->count = 0;
+
+    for (i = 0; i < TIMER_WHEEL_SIZE0; i++) {
+        timer_list_init(&tw->slots0[i]);
+    }
+
+    for (i = 0; i < TIMER_WHEEL_LEVELS - 1; i++) {
+        for (j = 0; j < TIMER_WHEEL_SIZE; j++) {
+            timer_list_init(&tw->slots[i][j]);
+        }
+    }
+}
+
+/* the timer is due "msecs" later, at the tick after it rounded up */
+void timer_wheel_add(timer_wheel_t *tw, timer_node_t *node, uint64_t msecs)
+{
+    uint64_t ticks;
+
+    ticks = (tw->msecs + msecs + tw->tick_msecs - 1) / tw->tick_msecs;
+
+    if (ticks < tw->ticks) {
+        ticks = tw->ticks;
+    }
+
+    if (ticks - tw->ticks > TIMER_WHEEL_MAX) {
+        ticks = tw->ticks + TIMER_WHEEL_MAX;
+    }
+
+    node->expire = ticks;
+
+    timer_wheel_insert(tw, node);
+    tw->count++;
+}
+
+void timer_wheel_del(timer_wheel_t *tw, timer_node_t *node)
+{
+    if (node->next == NULL) {
+        return;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+
+    tw->count--;
+}
+
+static void timer_wheel_insert(timer_wheel_t *tw, timer_node_t *node)
+{
+    uint_t        level, shift;
+    uint64_t      delta;
+    timer_node_t *head;
+
+    delta = node->expire - tw->ticks;
+
+    if (delta < TIMER_WHEEL_SIZE0) {
+        head = &tw->slots0[node->expire & (TIMER_WHEEL_SIZE0 - 1)];
+    } else {
+        for (level = 0, shift = TIMER_WHEEL_BITS0 + TIMER_WHEEL_BITS;
+             level < TIMER_WHEEL_LEVELS - 2 && delta >= (1ULL << shift);
+             level++, shift += TIMER_WHEEL_BITS)
+        {
+            /* void */
+        }
+
+        shift -= TIMER_WHEEL_BITS;
+        head = &tw->slots[level][(node->expire >> shift)
+                                 & (TIMER_WHEEL_SIZE - 1)];
+    }
+
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+/* spread a slot of "level" to the levels below, return the index of it */
+static uint_t timer_wheel_cascade(timer_wheel_t *tw, uint_t level)
+{
+    uint_t        index;
+    timer_node_t  list, *node, *next;
+
+    index = (tw->ticks >> (TIMER_WHEEL_BITS0 + level * TIMER_WHEEL_BITS))
+            & (TIMER_WHEEL_SIZE - 1);
+
+    if (timer_list_empty(&tw->slots[level][index])) {
+        return index;
+    }
+
+    list.next = tw->slots[level][index].next;
+    list.prev = tw->slots[level][index].prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+
+    timer_list_init(&tw->slots[level][index]);
+
+    for (node = list.next; node != &list; node = next) {
+        next = node->next;
+        timer_wheel_insert(tw, node);
+    }
+
+    return index;
+}
+
+/**
+ * Call "fn" for every timer which is due by "now_msecs", a timer is
+ * removed before "fn" is called and may be added again by it.
+ */
+void timer_wheel_advance(timer_wheel_t *tw, uint_t now_msecs,
+        timer_wheel_fp fn, void *data)
+{
+    uint_t        level, index;
+    uint64_t      now;
+    timer_node_t  list, *node;
+
+    tw->msecs += (uint_t) (now_msecs - tw->last_msecs);
+    tw->last_msecs = now_msecs;
+
+    now = tw->msecs / tw->tick_msecs;
+
+    /* nothing is due, the idle ticks are skipped */
+    if (tw->count == 0) {
+        tw->ticks = now + 1;
+        return;
+    }
+
+    while (tw->ticks <= now) {
+        index = tw->ticks & (TIMER_WHEEL_SIZE0 - 1);
+
+        for (level = 0; index == 0 && level < TIMER_WHEEL_LEVELS - 1;
+             level++)
+        {
+            index = timer_wheel_cascade(tw, level);
+        }
+
+        index = tw->ticks & (TIMER_WHEEL_SIZE0 - 1);
+
+        /* the timers added by "fn" are due at the next tick at least */
+        tw->ticks++;
+
+        if (!timer_list_empty(&tw->slots0[index])) {
+            list.next = tw->slots0[index].next;
+            list.prev = tw->slots0[index].prev;
+            list.next->prev = &list;
+            list.prev->next = &list;
+
+            timer_list_init(&tw->slots0[index]);
+
+            while (list.next != &list) {
+                node = list.next;
+
+                node->prev->next = node->next;
+                node->next->prev = node->prev;
+                node->next = NULL;
+                node->prev = NULL;
+
+                tw->count--;
+
+                fn(node, data);
+            }
+        }
+    }
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include "config.h"
+#include "system.h"
+
+/**
+ * A hierarchical timing wheel: level 0 has a slot for every tick of the
+ * next 2^TIMER_WHEEL_BITS0 ticks, a slot of an upper level covers a whole
+ * round of the level below and is spread to it when that comes round.
+ * Adding and removing a timer is O(1), advancing the wheel only visits the
+ * slots passed, not the timers which are not due. Timers beyond the last
+ * level are due at its end.
+ */
+#define TIMER_WHEEL_BITS0   8
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_WHEEL_SIZE0   (1 << TIMER_WHEEL_BITS0)
+#define TIMER_WHEEL_SIZE    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MAX     \
+    ((1ULL << (TIMER_WHEEL_BITS0 + (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_BITS)) \
+     - 1)
+
+typedef struct timer_node_s timer_node_t;
+
+/* embedded in the object of a timer, "next" is NULL if it's not added */
+struct timer_node_s {
+    timer_node_t   *next;
+    timer_node_t   *prev;
+    uint64_t        expire;     /* ticks */
+};
+
+typedef void (*timer_wheel_fp) (timer_node_t *node, void *data);
+
+/**
+ * The time of the wheel is its own, the msecs given to "advance" may wrap,
+ * e.g. "time_current_msecs", only the difference of two calls is used.
+ */
+typedef struct {
+    uint64_t        ticks;      /* the next tick to expire */
+    uint64_t        msecs;
+    uint_t          last_msecs;
+    uint_t          tick_msecs;
+    uint_t          count;
+    timer_node_t    slots0[TIMER_WHEEL_SIZE0];
+    timer_node_t    slots[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_SIZE];
+} timer_wheel_t;
+
+
+void timer_wheel_init(timer_wheel_t *tw, uint_t now_msecs, uint_t tick_msecs);
+void timer_wheel_add(timer_wheel_t *tw, timer_node_t *node, uint64_t msecs);
+void timer_wheel_del(timer_wheel_t *tw, timer_node_t *node);
+void timer_wheel_advance(timer_wheel_t *tw, uint_t now_msecs,
+        timer_wheel_fp fn, void *data);
+
+#endif /* __TIMER_WHEEL_H__ */
@@ -7,43 +7,74 @@
 
 volatile uint_t time_current_msecs;
 volatile time_t time_current_seconds;
+volatile uint64_t time_current_epoch_msecs;
 
-volatile string_t cache_log_time; 
+/**
+ * The loop of every thread updates the clock, the time which is taken
+ * later may be stored first, so it's stored under "timer_lock" and is
+ * only moved back by a step of the system clock. The log time is of each
+ * thread and is formatted when the second of it is changed.
+ */
+static pthread_mutex_t  timer_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static u_char log_time[21];
+static __thread u_char  log_time[TIMER_LOG_TIME_LEN + 1];
+static __thread time_t  log_time_secs = -1;
 
 void timer_init()
 {
-    memset(log_time, 0, 21);
-
-    cache_log_time.data = log_time;
-    cache_log_time.len = 20;
-
     timer_update();
 }
 
 void timer_update(void)
 {
     time_t          secs;
-    uint_t          msecs;
-    struct tm       tm, *tmp;
+    uint64_t        now;
     struct timeval  tv;
 
     gettimeofday(&tv, NULL);
 
     secs = tv.tv_sec;
-    msecs = tv.tv_usec / 1000;
+    now = (uint64_t) secs * 1000 + tv.tv_usec / 1000;
+
+    pthread_mutex_lock(&timer_lock);
+
+    /* a thread which is behind by less than a second is a late one */
+    if (now > time_current_epoch_msecs
+        || time_current_epoch_msecs - now >= 1000)
+    {
+        time_current_seconds = secs;
+        time_current_msecs = (uint_t) now;
+        time_current_epoch_msecs = now;
+    }
+
+    pthread_mutex_unlock(&timer_lock);
+}
 
-    time_current_seconds = secs;
-    time_current_msecs = (uint_t) secs * 1000 + msecs;
+/* "yyyy-mm-dd/hh:mm:ss " of the clock, for the thread which logs */
+u_char *timer_log_time(void)
+{
+    time_t     secs;
+    struct tm  tm;
+
+    secs = time_current_seconds;
+
+    if (secs != log_time_secs) {
+        localtime_r(&secs, &tm);
+
+        strftime((char *) log_time, sizeof(log_time), "%Y-%m-%d/%H:%M:%S ",
+                 &tm);
 
-    tmp = localtime(&secs);
-    tm = *tmp;
+        log_time_secs = secs;
+    }
+
+    return log_time;
+}
+
+uint64_t time_monotonic_nsecs(void)
+{
+    struct timespec ts;
 
-    tm.tm_mon++;
-    tm.tm_year += 1900;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    sprintf((char *) log_time, "%4d-%02d-%02d/%02d:%02d:%02d ",
-            tm.tm_year, tm.tm_mon, tm.tm_mday,
-            tm.tm_hour, tm.tm_min, tm.tm_sec);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
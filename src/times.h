@@ -8,11 +8,15 @@
 #include "config.h"
 #include "system.h"
 
-extern volatile string_t cache_log_time; 
+#define TIMER_LOG_TIME_LEN  20
+
 extern volatile uint_t time_current_msecs;
 extern volatile time_t time_current_seconds;
+extern volatile uint64_t time_current_epoch_msecs;     /* doesn't wrap */
 
 void timer_init();
 void timer_update(void);
+u_char *timer_log_time(void);
+uint64_t time_monotonic_nsecs(void);
 
 #endif /* __TIMES_H__ */
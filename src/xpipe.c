@@ -9,12 +9,19 @@
 static void sig_backtrace_handler(int sig, siginfo_t *info, void *context);
 #else
 static void sig_term_handler(int signo);
+static void sig_upgrade_handler(int signo);
+static void sig_reload_handler(int signo);
 #endif
+static void sig_child_handler(int signo);
 static int setup_signals();
 static int create_default_logger(xpipe_resource_t *resource);
 static int system_modules_init(xpipe_resource_t *resource);
 static void system_modules_working(xpipe_resource_t *resource);
 static int process_daemon(int daemon, file_t *pid_file, logger_t *logger);
+static int process_upgrade(xpipe_resource_t *resource);
+#ifndef UNIT_TEST
+static void close_inherited_sockets(xpipe_resource_t *resource);
+#endif
 
 static void *create_main_loc_conf(mem_pool_t *pool);
 static int init_main_mod(system_module_t *mod);
@@ -22,6 +29,7 @@ static int init_main_mod(system_module_t *mod);
 static int cmd_daemon_set(dynamic_array_t *args, void *mod_conf);
 static int cmd_pid_set(dynamic_array_t *args, void *mod_conf);
 static int cmd_log_set(dynamic_array_t *args, void *mod_conf);
+static int cmd_thread_set(dynamic_array_t *args, void *mod_conf);
 
 
 typedef struct {
@@ -34,6 +42,7 @@ static conf_command_t commands[] = {
     { 0, xstring("daemon"), cmd_daemon_set },
     { 0, xstring("pid"), cmd_pid_set },
     { 1, xstring("log"), cmd_log_set },
+    { 1, xstring("thread"), cmd_thread_set },
     conf_command_null
 };
 
@@ -44,11 +53,15 @@ system_module_t sys_main_module = {
     init_main_mod,
     NULL,
     NULL,
+    NULL,
     sys_mod_padding
 };
 
 xpipe_resource_t xpipe_resource;
 
+/* signals are only delivered while the main loop waits on this mask */
+static sigset_t sig_wait_mask;
+
 
 static void *create_main_loc_conf(mem_pool_t *pool)
 {
@@ -214,6 +227,34 @@ static int cmd_log_set(dynamic_array_t *args, void *mod_conf)
     return CONF_OK;
 }
 
+static int cmd_thread_set(dynamic_array_t *args, void *mod_conf)
+{
+    string_t        *arg;
+    system_module_t *mod;
+
+    mod = (system_module_t *) mod_conf; 
+
+    if (args->nelts != 2) {
+        log_error(args->pool->logger, 0, "the args of \"thread\" is error.");
+        return CONF_ERROR;
+    }
+
+    arg = dynamic_array_get_ix(args, 1);
+    if (arg == NULL) {
+        return CONF_ERROR;
+    }
+
+    if (is_sys_main_mod(&mod->mod_name)) {
+        log_error(args->pool->logger, 0, 
+                  "\"main\" module can't work in its own thread.");
+        return CONF_ERROR;
+    }
+
+    mod->thread = x_strcmp(arg->data, "off") == 0 ? 0 : 1;
+
+    return CONF_OK;
+}
+
 #ifndef UNIT_TEST
 int main(int argc, char **args) 
 {
@@ -224,6 +265,7 @@ int main(int argc, char **args)
     xpipe_main_mod_conf_t   *cf;
 
     timer_init();
+    stats_init();
 
     sys_mod_num = 0;
     for (i = 0; ; i++) {
@@ -247,6 +289,10 @@ int main(int argc, char **args)
 
     /* build some resource */
     xpipe_resource.stop = 0;
+    xpipe_resource.upgrade = 0;
+    xpipe_resource.reload = 0;
+    xpipe_resource.listen_n = 0;
+    xpipe_resource.argv = args;
     xpipe_resource.conf = &conf;
     xpipe_resource.log_stdout = &log_stdout;
     xpipe_resource.main_logger = sys_main_module.logger;
@@ -268,6 +314,8 @@ int main(int argc, char **args)
         return XPE_ERROR;
     }
 
+    close_inherited_sockets(&xpipe_resource);
+
     cf = (xpipe_main_mod_conf_t *) sys_main_module.mod_conf;
     if (process_daemon(cf->daemon, &cf->pid_file, xpipe_resource.default_logger)
             == XPE_ERROR)
@@ -275,8 +323,35 @@ int main(int argc, char **args)
         return XPE_ERROR;
     }
 
+    /* threads don't survive "fork", start them after daemonizing */
+    if (sys_modules_start_threads(&xpipe_resource) == MOD_ERROR) {
+        sys_modules_stop_threads(&xpipe_resource);
+        return XPE_ERROR;
+    }
+
     /* process modules */
     system_modules_working(&xpipe_resource);
+
+    sys_modules_stop_threads(&xpipe_resource);
+
+    /* drain the requests in flight and flush modules */
+    if (sys_modules_finish(&xpipe_resource) == MOD_ERROR) {
+        log_error(xpipe_resource.default_logger, 0,
+                  "finish system modules failed.");
+    }
+
+    stats_log_latency(xpipe_resource.default_logger);
+
+#ifdef POOL_STATS
+    mem_pool_log_usage(xpipe_resource.default_logger);
+#endif
+
+    if (cf->pid_file.fd != FL_INVALID_FD) {
+        file_close(cf->pid_file.fd);
+        file_delete(cf->pid_file.name.data);
+    }
+
+    log_info(xpipe_resource.default_logger, 0, "xpipe exits.");
     
     return 0;
 }
@@ -320,20 +395,56 @@ static void sig_term_handler(int signo)
     xpipe_resource.stop = 1;
 }
 
+static void sig_upgrade_handler(int signo)
+{
+    log_warn(xpipe_resource.default_logger, 0, 
+             "Receive \"SIGUSR2\" signal, process will upgrade.");
+    xpipe_resource.upgrade = 1;
+}
+
+static void sig_reload_handler(int signo)
+{
+    log_warn(xpipe_resource.default_logger, 0, 
+             "Receive \"SIGHUP\" signal, config will be reloaded.");
+    xpipe_resource.reload = 1;
+}
+
 #endif
 
+/**
+ * The new binary of an upgrade is a child of the old process, and its
+ * first process exits when it daemonizes, reap it even while draining.
+ */
+static void sig_child_handler(int signo)
+{
+    int  err;
+
+    err = errno;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        /* void */
+    }
+
+    errno = err;
+}
+
 static int setup_signals() 
 {
+    sigset_t         set;
     struct sigaction act;
 
-    signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
 
+    sigemptyset(&set);
+    sigprocmask(SIG_BLOCK, NULL, &sig_wait_mask);
+
     sigemptyset(&act.sa_mask);
     act.sa_flags = SA_NODEFER | SA_ONSTACK | SA_RESETHAND;
 
 #ifdef USE_BACKTRACE
 
+    signal(SIGHUP, SIG_IGN);
+
     act.sa_flags |= SA_SIGINFO;
 
 #ifdef SA_RESTART
@@ -368,8 +479,44 @@ static int setup_signals()
     if (sigaction(SIGTERM, &act, NULL) == -1) {
         return XPE_ERROR;
     }
+
+    act.sa_flags &= ~SA_RESETHAND;
+    act.sa_handler = sig_upgrade_handler;
+
+    if (sigaction(SIGUSR2, &act, NULL) == -1) {
+        return XPE_ERROR;
+    }
+
+    act.sa_handler = sig_reload_handler;
+
+    if (sigaction(SIGHUP, &act, NULL) == -1) {
+        return XPE_ERROR;
+    }
+
+    /**
+     * block them and let "ppoll" unblock them, so a signal can't slip in
+     * between the check of "stop" and the wait of the main loop.
+     */
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGHUP);
+    sigdelset(&sig_wait_mask, SIGTERM);
+    sigdelset(&sig_wait_mask, SIGUSR2);
+    sigdelset(&sig_wait_mask, SIGHUP);
 #endif
 
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    act.sa_handler = sig_child_handler;
+
+    if (sigaction(SIGCHLD, &act, NULL) == -1) {
+        return XPE_ERROR;
+    }
+
+    if (sigprocmask(SIG_BLOCK, &set, NULL) == -1) {
+        return XPE_ERROR;
+    }
+
     return XPE_OK;
 }
 
@@ -436,25 +583,53 @@ static int system_modules_init(xpipe_resource_t *resource)
 
 static void system_modules_working(xpipe_resource_t *resource)
 {
-    int              i;
-    system_module_t *mod;
+    uint_t           i, n;
+    system_module_t *mod, *mods[MOD_MAX_NUM];
+
+    /* the modules which have their own threads are not run here */
+    for (i = 0, n = 0; ; i++) {
+        mod = *(sys_modules + i);
+        if (mod == NULL) {
+            break;
+        }
+
+        if (!mod->thread) {
+            mods[n++] = mod;
+        }
+    }
 
     while (!resource->stop) {
-        for (i = 0; ; i++) {
-            mod = *(sys_modules + i);
-            if (mod == NULL) {
+        if (sys_modules_wait(mods, n, &sig_wait_mask) == MOD_ERROR) {
+            log_error(resource->default_logger, errno,
+                      "wait for system modules failed.");
+            continue;
+        }
+
+        if (resource->reload) {
+            resource->reload = 0;
+            sys_modules_reload(resource);
+        }
+
+        if (resource->upgrade) {
+            resource->upgrade = 0;
+
+            /* the new binary owns the listening socket, drain and exit */
+            if (process_upgrade(resource) == XPE_OK) {
+                resource->stop = 1;
                 break;
             }
+        }
 
-            if (mod->process_mod != NULL 
-                    && mod->process_mod(mod) == MOD_ERROR) 
+        for (i = 0; i < n; i++) {
+            mod = mods[i];
+
+            if ((mod->ready || mod->inbox)
+                && sys_module_process(mod) == MOD_ERROR)
             {
                 log_error(resource->default_logger, 0,
                           "process module \"%s\" failed.", mod->mod_name.data);
             }
         }
-
-        timer_update();
     }
 }
 
@@ -500,3 +675,189 @@ static int process_daemon(int daemon, file_t *pid_file, logger_t *logger)
 
     return XPE_OK;
 }
+
+/**
+ * Exec the binary of "argv[0]" in a child process and pass the listening
+ * sockets to it by XPIPE_LISTEN_FD ("fd;fd;..."). A CLOEXEC pipe tells
+ * whether the exec succeeded: it's closed by a successful exec, or carries
+ * the errno.
+ */
+static int process_upgrade(xpipe_resource_t *resource)
+{
+    int                    i, fd, max_fd, err, pfd[2];
+    pid_t                  pid;
+    size_t                 len, nenv;
+    ssize_t                n;
+    u_char                 old_name[1024], buffer[128], *p;
+    char                 **envp;
+    string_t               pid_name;
+    xpipe_main_mod_conf_t *cf;
+
+    cf = (xpipe_main_mod_conf_t *) sys_main_module.mod_conf;
+    pid_name = cf->pid_file.name;
+
+    if (resource->listen_n == 0) {
+        log_error(resource->default_logger, 0,
+                  "no listening socket to pass to the new binary.");
+        return XPE_ERROR;
+    }
+
+    /**
+     * the environment of the new binary is made here, only async-signal-safe
+     * calls are made by the child of a threaded process.
+     */
+    p = buffer + sprintf((char *) buffer, "%s=", XPIPE_LISTEN_FD_ENV);
+    len = p - buffer;
+
+    for (i = 0; i < resource->listen_n; i++) {
+        p += sprintf((char *) p, "%d;", resource->listen_fds[i]);
+    }
+
+    for (nenv = 0; environ[nenv] != NULL; nenv++) { /* void */ }
+
+    envp = malloc((nenv + 2) * sizeof(char *));
+    if (envp == NULL) {
+        log_error(resource->default_logger, errno, "alloc the environment "
+                  "of the new binary failed.");
+        return XPE_ERROR;
+    }
+
+    for (nenv = 0, i = 0; environ[i] != NULL; i++) {
+        if (x_strncmp(environ[i], buffer, len) != 0) {
+            envp[nenv++] = environ[i];
+        }
+    }
+
+    envp[nenv++] = (char *) buffer;
+    envp[nenv] = NULL;
+
+    if (pipe2(pfd, O_CLOEXEC) == -1) {
+        log_error(resource->default_logger, errno, "create pipe failed.");
+        free(envp);
+        return XPE_ERROR;
+    }
+
+    /* the new process writes its own pid file */
+    if (cf->pid_file.fd != FL_INVALID_FD) {
+        snprintf((char *) old_name, sizeof(old_name), "%s.oldbin",
+                 cf->pid_file.name.data);
+
+        cf->pid_file.name.len = x_strlen(old_name);
+        cf->pid_file.name.data = pmalloc(resource->conf_pool,
+                                         cf->pid_file.name.len + 1);
+
+        if (cf->pid_file.name.data == NULL
+            || rename((char *) pid_name.data, (char *) old_name) == -1)
+        {
+            log_error(resource->default_logger, errno,
+                      "rename \"%s\" failed.", pid_name.data);
+            cf->pid_file.name = pid_name;
+        } else {
+            x_strcpy(cf->pid_file.name.data, old_name);
+        }
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        log_error(resource->default_logger, errno, "fork failed.");
+        free(envp);
+        close(pfd[0]);
+        close(pfd[1]);
+        goto failed;
+    }
+
+    if (pid == 0) {
+        /* nothing but the listening sockets are inherited by the new binary */
+        max_fd = getdtablesize();
+        for (fd = STDERR_FILENO + 1; fd < max_fd; fd++) {
+            for (i = 0; i < resource->listen_n; i++) {
+                if (fd == resource->listen_fds[i]) {
+                    break;
+                }
+            }
+
+            if (i == resource->listen_n && fd != pfd[1]) {
+                close(fd);
+            }
+        }
+
+        sigprocmask(SIG_SETMASK, &sig_wait_mask, NULL);
+
+        execve(resource->argv[0], resource->argv, envp);
+
+        err = errno;
+        (void) write(pfd[1], &err, sizeof(int));
+        _exit(1);
+    }
+
+    free(envp);
+    close(pfd[1]);
+
+    do {
+        n = read(pfd[0], &err, sizeof(int));
+    } while (n == -1 && errno == EINTR);
+
+    close(pfd[0]);
+
+    if (n == sizeof(int)) {
+        log_error(resource->default_logger, err, "exec \"%s\" failed.",
+                  resource->argv[0]);
+        waitpid(pid, NULL, 0);
+        goto failed;
+    }
+
+    log_info(resource->default_logger, 0,
+             "new binary is running(pid:%d), old process begins to drain.",
+             pid);
+
+    return XPE_OK;
+
+failed:
+    if (cf->pid_file.name.data != pid_name.data) {
+        rename((char *) cf->pid_file.name.data, (char *) pid_name.data);
+        cf->pid_file.name = pid_name;
+    }
+
+    return XPE_ERROR;
+}
+
+#ifndef UNIT_TEST
+/**
+ * close the sockets passed by the old process which no server has taken,
+ * e.g. its port has been changed in the config.
+ */
+static void close_inherited_sockets(xpipe_resource_t *resource)
+{
+    int   i, fd;
+    char *env, *p;
+
+    env = getenv(XPIPE_LISTEN_FD_ENV);
+    if (env == NULL) {
+        return;
+    }
+
+    for (p = env; p != NULL && *p != '\0'; p = strchr(p, ';')) {
+        if (*p == ';') {
+            p++;
+            continue;
+        }
+
+        fd = atoi(p);
+
+        for (i = 0; i < resource->listen_n; i++) {
+            if (resource->listen_fds[i] == fd) {
+                break;
+            }
+        }
+
+        if (i == resource->listen_n) {
+            log_warn(resource->default_logger, 0,
+                     "close inherited socket(%d) which isn't used.", fd);
+            close(fd);
+        }
+    }
+
+    unsetenv(XPIPE_LISTEN_FD_ENV);
+}
+#endif
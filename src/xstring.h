@@ -28,7 +28,7 @@ typedef struct {
 #define is_digit(c)  (c >= '0' && c <= '9')
 #define is_blank(c)  (c == CR || c == LF || c == '\t' || c == ' ')
 
-#define x_memcpy_n(dst, src, n) ((u_char *)memcpy(dst, src, n) + n)
+#define x_memcpy_n(dst, src, n) ((u_char *)memcpy(dst, src, n) + (n))
 
 #define x_strcpy(s1, s2)  strcpy((char *) (s1), (char *) (s2))
 #define x_strcmp(s1, s2)  strcmp((const char *) (s1), (const char *) (s2))
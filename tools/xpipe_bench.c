@@ -0,0 +1,638 @@
+/**
+ * Copyright (c) Xiaowei Wu
+ */
+
+/**
+ * xpipe-bench: load generator speaking the native protocol.
+ *
+ * Every thread owns a part of the connections and an epoll fd. A connection
+ * keeps up to "depth" requests in flight. With a rate (-r) the requests
+ * are sent on a fixed schedule and the latency is measured from the time
+ * a request should have been sent, so a stalled server is not hidden by
+ * the requests it kept us from sending (coordinated omission). Without a
+ * rate, the next request is sent as soon as a reply comes back.
+ */
+
+#include "../src/config.h"
+#include "../src/system.h"
+
+#include <getopt.h>
+
+#define BENCH_DEPTH_MAX     64
+#define BENCH_READ_SIZE     (64 * 1024)
+#define BENCH_EVENTS        256
+
+#define bench_error(fmt, ...)                                               \
+    fprintf(stderr, "xpipe-bench: " fmt "\n", ##__VA_ARGS__)
+
+
+typedef struct {
+    char       *host;
+    int         port;
+    uint_t      threads;
+    uint_t      conns;
+    uint_t      duration;   /* seconds */
+    uint_t      rate;       /* requests per second of all, 0 closed loop */
+    uint_t      size;       /* bytes of PUT data */
+    uint_t      depth;      /* requests in flight on a connection */
+    uint_t      put_ratio;  /* percent of PUT, the others are GET */
+    char       *queue;
+} bench_conf_t;
+
+typedef struct {
+    int         fd;
+    int         writing;
+
+    /* start times of the requests in flight, a ring */
+    uint64_t    intended[BENCH_DEPTH_MAX];
+    uint64_t    sent[BENCH_DEPTH_MAX];
+    uint_t      head;
+    uint_t      inflight;
+
+    uint64_t    next_send;  /* nsecs, rate mode only */
+    uint64_t    interval;
+
+    u_char     *wbuf;
+    size_t      wpos;
+    size_t      wlen;
+    size_t      wsize;
+
+    u_char      rbuf[BENCH_READ_SIZE];
+    size_t      rlen;
+    size_t      skip;       /* bytes of message data to skip */
+} bench_conn_t;
+
+typedef struct {
+    pthread_t       tid;
+    uint_t          index;
+    uint_t          nconns;
+    bench_conn_t   *conns;
+    int             epfd;
+    uint_t          seed;
+
+    u_char         *put_req;
+    size_t          put_len;
+    u_char         *get_req;
+    size_t          get_len;
+
+    uint64_t        requests;
+    uint64_t        errors;
+    uint64_t        bytes_out;
+    uint64_t        bytes_in;
+    histogram_t     corrected;
+    histogram_t     uncorrected;
+} bench_thread_t;
+
+
+static bench_conf_t  conf;
+static uint64_t      bench_deadline;
+
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr,
+            "usage: xpipe-bench [options]\n"
+            "    -H host      server address (127.0.0.1)\n"
+            "    -p port      server port (8080)\n"
+            "    -t threads   threads (1)\n"
+            "    -c conns     connections of all threads (1)\n"
+            "    -d seconds   duration (10)\n"
+            "    -r rate      requests per second, 0 is closed loop (0)\n"
+            "    -s bytes     size of PUT data (64)\n"
+            "    -P depth     requests in flight on a connection (1)\n"
+            "    -w percent   percent of PUT, the others are GET (100)\n"
+            "    -q queue     queue name (bench)\n");
+}
+
+static int bench_connect(void)
+{
+    int                 fd, nodelay;
+    struct sockaddr_in  sa;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        bench_error("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(conf.port);
+
+    if (inet_pton(AF_INET, conf.host, &sa.sin_addr) != 1) {
+        bench_error("invalid address \"%s\"", conf.host);
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1) {
+        bench_error("connect %s:%d: %s", conf.host, conf.port,
+                    strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+static int bench_build_requests(bench_thread_t *t)
+{
+    int  n;
+    char header[256];
+
+    n = snprintf(header, sizeof(header), "PUT\r\nqueue=%s\r\n%u\r\n",
+                 conf.queue, conf.size);
+
+    t->put_len = n + conf.size;
+    t->put_req = malloc(t->put_len);
+    if (t->put_req == NULL) {
+        return -1;
+    }
+
+    memcpy(t->put_req, header, n);
+    memset(t->put_req + n, 'x', conf.size);
+
+    n = snprintf(header, sizeof(header), "GET\r\nqueue=%s\r\n", conf.queue);
+
+    t->get_len = n;
+    t->get_req = (u_char *) strdup(header);
+    if (t->get_req == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void bench_watch(bench_thread_t *t, bench_conn_t *c, int writing)
+{
+    struct epoll_event ee;
+
+    if (c->writing == writing) {
+        return;
+    }
+
+    ee.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    ee.data.ptr = c;
+
+    epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ee);
+
+    c->writing = writing;
+}
+
+static int bench_flush(bench_thread_t *t, bench_conn_t *c)
+{
+    ssize_t n;
+
+    while (c->wpos < c->wlen) {
+        n = write(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos);
+
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                bench_watch(t, c, 1);
+                return 0;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            bench_error("write: %s", strerror(errno));
+            return -1;
+        }
+
+        t->bytes_out += n;
+        c->wpos += n;
+    }
+
+    c->wpos = 0;
+    c->wlen = 0;
+
+    bench_watch(t, c, 0);
+
+    return 0;
+}
+
+/* queue the requests which are due, then write them out */
+static int bench_send(bench_thread_t *t, bench_conn_t *c, uint64_t now)
+{
+    uint_t   i;
+    size_t   len;
+    u_char  *req;
+    uint64_t intended;
+
+    while (c->inflight < conf.depth) {
+        if (conf.rate && c->next_send > now) {
+            break;
+        }
+
+        if ((uint_t) (rand_r(&t->seed) % 100) < conf.put_ratio) {
+            req = t->put_req;
+            len = t->put_len;
+        } else {
+            req = t->get_req;
+            len = t->get_len;
+        }
+
+        if (c->wlen + len > c->wsize) {
+            break;
+        }
+
+        if (conf.rate) {
+            intended = c->next_send;
+            c->next_send += c->interval;
+        } else {
+            intended = now;
+        }
+
+        memcpy(c->wbuf + c->wlen, req, len);
+        c->wlen += len;
+
+        i = (c->head + c->inflight) % BENCH_DEPTH_MAX;
+        c->intended[i] = intended;
+        c->sent[i] = now;
+        c->inflight++;
+    }
+
+    if (c->wlen == 0) {
+        return 0;
+    }
+
+    return bench_flush(t, c);
+}
+
+static void bench_reply(bench_thread_t *t, bench_conn_t *c, int error)
+{
+    uint64_t now;
+
+    if (c->inflight == 0) {
+        t->errors++;
+        return;
+    }
+
+    now = bench_now();
+
+    if (now < bench_deadline) {
+        histogram_record(&t->corrected, now - c->intended[c->head]);
+        histogram_record(&t->uncorrected, now - c->sent[c->head]);
+
+        t->requests++;
+        if (error) {
+            t->errors++;
+        }
+    }
+
+    c->head = (c->head + 1) % BENCH_DEPTH_MAX;
+    c->inflight--;
+}
+
+/**
+ * A reply is "ok", "error" or "end" after any "msg <id> <len>" (followed
+ * by <len> bytes of data and CRLF) and "stat" lines.
+ */
+static int bench_recv(bench_thread_t *t, bench_conn_t *c)
+{
+    ssize_t  n;
+    size_t   len, pos;
+    u_char  *p, *line, *lf;
+
+    for (;;) {
+        n = read(c->fd, c->rbuf + c->rlen, BENCH_READ_SIZE - c->rlen);
+
+        if (n == 0) {
+            bench_error("server closed the connection");
+            return -1;
+        }
+
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            bench_error("read: %s", strerror(errno));
+            return -1;
+        }
+
+        t->bytes_in += n;
+        c->rlen += n;
+        pos = 0;
+
+        while (pos < c->rlen) {
+            p = c->rbuf + pos;
+            len = c->rlen - pos;
+
+            if (c->skip) {
+                n = len < c->skip ? len : c->skip;
+                c->skip -= n;
+                pos += n;
+                continue;
+            }
+
+            lf = memchr(p, '\n', len);
+            if (lf == NULL) {
+                break;
+            }
+
+            line = p;
+            pos += lf - p + 1;
+
+            if (strncmp((char *) line, "msg ", 4) == 0) {
+                p = (u_char *) strchr((char *) line + 4, ' ');
+                c->skip = (p && p < lf) ? strtoul((char *) p, NULL, 10) + 2
+                                        : 0;
+                continue;
+            }
+
+            if (strncmp((char *) line, "stat ", 5) == 0) {
+                continue;
+            }
+
+            bench_reply(t, c, strncmp((char *) line, "error", 5) == 0);
+        }
+
+        if (pos == 0 && c->rlen == BENCH_READ_SIZE) {
+            bench_error("line of reply is too long");
+            return -1;
+        }
+
+        memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+        c->rlen -= pos;
+    }
+}
+
+static void *bench_thread_cycle(void *arg)
+{
+    int                 i, n, timeout;
+    uint_t              k;
+    uint64_t            now, next;
+    bench_conn_t       *c;
+    bench_thread_t     *t;
+    struct epoll_event  ee, events[BENCH_EVENTS];
+
+    t = (bench_thread_t *) arg;
+
+    now = bench_now();
+
+    for (k = 0; k < t->nconns; k++) {
+        c = t->conns + k;
+
+        ee.events = EPOLLIN;
+        ee.data.ptr = c;
+
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ee) == -1) {
+            bench_error("epoll_ctl: %s", strerror(errno));
+            return NULL;
+        }
+
+        /* spread the first requests of the connections over an interval */
+        if (conf.rate) {
+            c->interval = 1000000000ULL * conf.conns / conf.rate;
+            c->next_send = now + c->interval * (t->index * t->nconns + k)
+                                 / conf.conns;
+        }
+
+        if (bench_send(t, c, now) == -1) {
+            return NULL;
+        }
+    }
+
+    while ((now = bench_now()) < bench_deadline) {
+        timeout = (bench_deadline - now) / 1000000 + 1;
+
+        if (conf.rate) {
+            for (k = 0; k < t->nconns; k++) {
+                c = t->conns + k;
+
+                if (c->inflight == conf.depth) {
+                    continue;
+                }
+
+                next = c->next_send > now ? c->next_send - now : 0;
+                if ((int) (next / 1000000) < timeout) {
+                    timeout = next / 1000000;
+                }
+            }
+        }
+
+        n = epoll_wait(t->epfd, events, BENCH_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) {
+            bench_error("epoll_wait: %s", strerror(errno));
+            return NULL;
+        }
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if ((events[i].events & EPOLLOUT) && bench_flush(t, c) == -1) {
+                return NULL;
+            }
+
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                && bench_recv(t, c) == -1)
+            {
+                return NULL;
+            }
+        }
+
+        now = bench_now();
+
+        for (k = 0; k < t->nconns; k++) {
+            c = t->conns + k;
+
+            if (!c->writing && bench_send(t, c, now) == -1) {
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_report(bench_thread_t *threads, double seconds)
+{
+    uint_t          i;
+    uint64_t        requests, errors, bytes_out, bytes_in;
+    histogram_t    *corrected, *uncorrected;
+
+    corrected = calloc(1, sizeof(histogram_t));
+    uncorrected = calloc(1, sizeof(histogram_t));
+    if (corrected == NULL || uncorrected == NULL) {
+        return;
+    }
+
+    requests = errors = bytes_out = bytes_in = 0;
+
+    for (i = 0; i < conf.threads; i++) {
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        bytes_out += threads[i].bytes_out;
+        bytes_in += threads[i].bytes_in;
+
+        histogram_merge(corrected, &threads[i].corrected);
+        histogram_merge(uncorrected, &threads[i].uncorrected);
+    }
+
+    printf("%u threads, %u connections, depth %u, %s, %u bytes, "
+           "%u%% PUT\n",
+           conf.threads, conf.conns, conf.depth,
+           conf.rate ? "open loop" : "closed loop", conf.size,
+           conf.put_ratio);
+
+    printf("  requests    %llu in %.2fs, %llu errors\n",
+           (unsigned long long) requests, seconds,
+           (unsigned long long) errors);
+
+    printf("  throughput  %.1f req/s, out %.2f MB/s, in %.2f MB/s\n",
+           requests / seconds, bytes_out / seconds / 1048576,
+           bytes_in / seconds / 1048576);
+
+    printf("  latency(us) %-12s %10s %10s %10s %10s %10s %10s\n",
+           "", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+#define bench_print_latency(name, h)                                        \
+    printf("              %-12s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",\
+           name, histogram_mean(h) / 1e3,                                   \
+           histogram_percentile(h, 50) / 1e3,                               \
+           histogram_percentile(h, 90) / 1e3,                               \
+           histogram_percentile(h, 99) / 1e3,                               \
+           histogram_percentile(h, 99.9) / 1e3, (h)->max / 1e3)
+
+    /* both are the same without a schedule */
+    if (conf.rate) {
+        bench_print_latency("corrected", corrected);
+        bench_print_latency("uncorrected", uncorrected);
+    } else {
+        bench_print_latency("", uncorrected);
+    }
+
+    free(corrected);
+    free(uncorrected);
+}
+
+int main(int argc, char **argv)
+{
+    int             opt;
+    uint_t          i, k, n;
+    uint64_t        start;
+    bench_conn_t   *c;
+    bench_thread_t *threads, *t;
+
+    conf.host = "127.0.0.1";
+    conf.port = 8080;
+    conf.threads = 1;
+    conf.conns = 1;
+    conf.duration = 10;
+    conf.rate = 0;
+    conf.size = 64;
+    conf.depth = 1;
+    conf.put_ratio = 100;
+    conf.queue = "bench";
+
+    while ((opt = getopt(argc, argv, "H:p:t:c:d:r:s:P:w:q:h")) != -1) {
+        switch (opt) {
+        case 'H': conf.host = optarg; break;
+        case 'p': conf.port = atoi(optarg); break;
+        case 't': conf.threads = atoi(optarg); break;
+        case 'c': conf.conns = atoi(optarg); break;
+        case 'd': conf.duration = atoi(optarg); break;
+        case 'r': conf.rate = atoi(optarg); break;
+        case 's': conf.size = atoi(optarg); break;
+        case 'P': conf.depth = atoi(optarg); break;
+        case 'w': conf.put_ratio = atoi(optarg); break;
+        case 'q': conf.queue = optarg; break;
+        default:
+            bench_usage();
+            return 1;
+        }
+    }
+
+    if (conf.threads == 0 || conf.conns < conf.threads || conf.size == 0
+        || conf.depth == 0 || conf.depth > BENCH_DEPTH_MAX
+        || conf.put_ratio > 100 || conf.duration == 0)
+    {
+        bench_error("invalid options, connections must be no less than "
+                    "threads, depth is 1 to %d", BENCH_DEPTH_MAX);
+        bench_usage();
+        return 1;
+    }
+
+    threads = calloc(conf.threads, sizeof(bench_thread_t));
+    if (threads == NULL) {
+        return 1;
+    }
+
+    for (i = 0, k = 0; i < conf.threads; i++) {
+        t = threads + i;
+
+        /* the first threads take the remainder */
+        n = conf.conns / conf.threads + (i < conf.conns % conf.threads);
+
+        t->index = i;
+        t->nconns = n;
+        t->seed = i + 1;
+        t->conns = calloc(n, sizeof(bench_conn_t));
+        t->epfd = epoll_create(BENCH_EVENTS);
+
+        if (t->conns == NULL || t->epfd == -1
+            || bench_build_requests(t) == -1)
+        {
+            bench_error("init thread %u failed", i);
+            return 1;
+        }
+
+        for (k = 0; k < n; k++) {
+            c = t->conns + k;
+
+            c->fd = bench_connect();
+            if (c->fd == -1) {
+                return 1;
+            }
+
+            c->wsize = conf.depth * (t->put_len > t->get_len ? t->put_len
+                                                             : t->get_len);
+            c->wbuf = malloc(c->wsize);
+            if (c->wbuf == NULL) {
+                return 1;
+            }
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    start = bench_now();
+    bench_deadline = start + (uint64_t) conf.duration * 1000000000;
+
+    for (i = 0; i < conf.threads; i++) {
+        if (pthread_create(&threads[i].tid, NULL, bench_thread_cycle,
+                           threads + i) != 0)
+        {
+            bench_error("create thread %u failed", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < conf.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+
+    bench_report(threads, conf.duration);
+
+    return 0;
+}